@@ -0,0 +1,420 @@
+#include "Decoder.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+/* Operand flags of an opcode. The low bits describe the opcode, the high nibble the kind of
+ * immediate that follows the ModRM byte (and its SIB and displacement). */
+#define OPERAND_MODRM			0x01
+#define OPERAND_INVALID			0x02
+#define OPERAND_RELATIVE		0x04
+
+#define OPERAND_IMM_MASK		0xF0
+#define OPERAND_IMM_NONE		0x00
+#define OPERAND_IMM_8			0x10
+#define OPERAND_IMM_16			0x20
+#define OPERAND_IMM_Z			0x30	/* 16 or 32 bits, by operand size. */
+#define OPERAND_IMM_V			0x40	/* 16, 32 or 64 bits, by operand size (MOV r, imm). */
+#define OPERAND_IMM_16_8		0x50	/* ENTER */
+#define OPERAND_IMM_MOFFS		0x60	/* 64 or 32 bits, by address size. */
+#define OPERAND_IMM_GROUP3		0x70	/* F6/F7, only TEST (reg 0 and 1) has an immediate. */
+
+/* Shorthands for the opcode tables. */
+#define NO	OPERAND_IMM_NONE
+#define XX	OPERAND_INVALID
+#define MR	OPERAND_MODRM
+#define I1	OPERAND_IMM_8
+#define I2	OPERAND_IMM_16
+#define IZ	OPERAND_IMM_Z
+#define IV	OPERAND_IMM_V
+#define MI	(OPERAND_MODRM | OPERAND_IMM_8)
+#define MZ	(OPERAND_MODRM | OPERAND_IMM_Z)
+#define J1	(OPERAND_RELATIVE | OPERAND_IMM_8)
+#define JZ	(OPERAND_RELATIVE | OPERAND_IMM_Z)
+#define EN	OPERAND_IMM_16_8
+#define MO	OPERAND_IMM_MOFFS
+#define G3	(OPERAND_MODRM | OPERAND_IMM_GROUP3)
+
+/* The decoder reads from a zero padded copy, so no opcode lookahead can pass the end of the input. */
+#define DECODER_BUFFER_SIZE		32
+
+/******************** Module Variables ********************/
+
+/* One byte opcodes in 64-bit mode. Prefixes, REX, 0F and the C4, C5 and 62 VEX/EVEX
+ * prefixes are consumed before the table is used. */
+static const UINT8 oneByteOperands[256] =
+{
+	/* 00 */ MR, MR, MR, MR, I1, IZ, XX, XX, MR, MR, MR, MR, I1, IZ, XX, NO,
+	/* 10 */ MR, MR, MR, MR, I1, IZ, XX, XX, MR, MR, MR, MR, I1, IZ, XX, XX,
+	/* 20 */ MR, MR, MR, MR, I1, IZ, NO, XX, MR, MR, MR, MR, I1, IZ, NO, XX,
+	/* 30 */ MR, MR, MR, MR, I1, IZ, NO, XX, MR, MR, MR, MR, I1, IZ, NO, XX,
+	/* 40 */ NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO,
+	/* 50 */ NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO,
+	/* 60 */ XX, XX, NO, MR, NO, NO, NO, NO, IZ, MZ, I1, MI, NO, NO, NO, NO,
+	/* 70 */ J1, J1, J1, J1, J1, J1, J1, J1, J1, J1, J1, J1, J1, J1, J1, J1,
+	/* 80 */ MI, MZ, XX, MI, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* 90 */ NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, XX, NO, NO, NO, NO, NO,
+	/* A0 */ MO, MO, MO, MO, NO, NO, NO, NO, I1, IZ, NO, NO, NO, NO, NO, NO,
+	/* B0 */ I1, I1, I1, I1, I1, I1, I1, I1, IV, IV, IV, IV, IV, IV, IV, IV,
+	/* C0 */ MI, MI, I2, NO, NO, NO, MI, MZ, EN, NO, I2, NO, NO, I1, XX, NO,
+	/* D0 */ MR, MR, MR, MR, XX, XX, XX, NO, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* E0 */ J1, J1, J1, J1, I1, I1, I1, I1, JZ, JZ, XX, J1, NO, NO, NO, NO,
+	/* F0 */ NO, NO, NO, NO, NO, NO, G3, G3, NO, NO, NO, NO, NO, NO, MR, MR
+};
+
+/* 0F opcodes, 0F 38 opcodes all take a ModRM byte and 0F 3A opcodes a ModRM byte and imm8. */
+static const UINT8 twoByteOperands[256] =
+{
+	/* 00 */ MR, MR, MR, MR, XX, NO, NO, NO, NO, NO, XX, NO, XX, MR, NO, MI,
+	/* 10 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* 20 */ MR, MR, MR, MR, XX, XX, XX, XX, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* 30 */ NO, NO, NO, NO, NO, NO, XX, NO, NO, XX, NO, XX, XX, XX, XX, XX,
+	/* 40 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* 50 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* 60 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* 70 */ MI, MI, MI, MI, MR, MR, MR, NO, MR, MR, XX, XX, MR, MR, MR, MR,
+	/* 80 */ JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ,
+	/* 90 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* A0 */ NO, NO, NO, MR, MI, MR, XX, XX, NO, NO, NO, MR, MI, MR, MR, MR,
+	/* B0 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MI, MR, MR, MR, MR, MR,
+	/* C0 */ MR, MR, MI, MR, MI, MI, MI, MR, NO, NO, NO, NO, NO, NO, NO, NO,
+	/* D0 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* E0 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR,
+	/* F0 */ MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR, MR
+};
+
+#undef NO
+#undef XX
+#undef MR
+#undef I1
+#undef I2
+#undef IZ
+#undef IV
+#undef MI
+#undef MZ
+#undef J1
+#undef JZ
+#undef EN
+#undef MO
+#undef G3
+
+/******************** Module Prototypes ********************/
+static UINT8 getOperandFlags(PINSTRUCTION_LAYOUT layout);
+static ULONG getImmediateSize(UINT8 operandFlags, PINSTRUCTION_LAYOUT layout, BOOLEAN operandSize16, BOOLEAN addressSize32);
+static BOOLEAN isLegacyPrefix(UINT8 value);
+
+/******************** Public Code ********************/
+
+NTSTATUS Decoder_decode(const UINT8* code, ULONG availableSize, PINSTRUCTION_LAYOUT layout)
+{
+	/* Decodes the length and operand layout of one 64-bit mode instruction, never reading
+	 * more than availableSize bytes of code. Nothing is allocated and no kernel routine is
+	 * called, so this is safe in VMX root and builds as plain C for user mode tests. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	ULONG limit = min(availableSize, DECODER_MAX_INSTRUCTION_LENGTH);
+	ULONG offset = 0;
+
+	BOOLEAN operandSize16 = FALSE;
+	BOOLEAN addressSize32 = FALSE;
+	BOOLEAN simdPrefix = FALSE;
+
+	UINT8 bytes[DECODER_BUFFER_SIZE] = { 0 };
+	RtlCopyMemory(bytes, code, limit);
+	RtlZeroMemory(layout, sizeof(INSTRUCTION_LAYOUT));
+
+	/* Legacy prefixes, a REX prefix is ignored unless the opcode follows it directly. */
+	while (offset < limit)
+	{
+		if (TRUE == isLegacyPrefix(bytes[offset]))
+		{
+			operandSize16 |= (0x66 == bytes[offset]);
+			addressSize32 |= (0x67 == bytes[offset]);
+			simdPrefix |= (0x66 == bytes[offset]) || (0xF0 == bytes[offset]) || (0xF2 == bytes[offset]) || (0xF3 == bytes[offset]);
+
+			layout->rex = 0;
+			layout->prefixLength = offset + 1;
+		}
+		else if (0x40 == (bytes[offset] & 0xF0))
+		{
+			layout->rex = bytes[offset];
+		}
+		else
+		{
+			break;
+		}
+
+		offset++;
+	}
+
+	switch (bytes[offset])
+	{
+	case 0xC5:
+		/* Two byte VEX, always the 0F map. */
+		layout->opcodeMap = OPCODE_MAP_0F;
+		layout->vexEncoded = TRUE;
+		offset += 2;
+		break;
+
+	case 0xC4:
+		/* Three byte VEX, map select in the low bits of the second byte. */
+		layout->opcodeMap = bytes[offset + 1] & 0x1F;
+		layout->vexEncoded = TRUE;
+		offset += 3;
+		break;
+
+	case 0x62:
+		/* EVEX, map select in the low bits of the second byte. */
+		layout->opcodeMap = bytes[offset + 1] & 0x07;
+		layout->vexEncoded = TRUE;
+		offset += 4;
+		break;
+
+	case 0x0F:
+		if (0x38 == bytes[offset + 1])
+		{
+			layout->opcodeMap = OPCODE_MAP_0F38;
+			offset += 2;
+		}
+		else if (0x3A == bytes[offset + 1])
+		{
+			layout->opcodeMap = OPCODE_MAP_0F3A;
+			offset += 2;
+		}
+		else
+		{
+			layout->opcodeMap = OPCODE_MAP_0F;
+			offset += 1;
+		}
+		break;
+
+	default:
+		layout->opcodeMap = OPCODE_MAP_ONE_BYTE;
+		break;
+	}
+
+	/* VEX and EVEX raise #UD after a REX, 66, F0, F2 or F3 prefix. */
+	if ((TRUE == layout->vexEncoded) && ((0 != layout->rex) || (TRUE == simdPrefix)))
+	{
+		status = STATUS_ILLEGAL_INSTRUCTION;
+	}
+
+	layout->opcodeOffset = offset;
+	layout->opcode = bytes[offset];
+	offset++;
+
+	UINT8 operandFlags = getOperandFlags(layout);
+
+	if (0 != (operandFlags & OPERAND_INVALID))
+	{
+		status = STATUS_ILLEGAL_INSTRUCTION;
+	}
+
+	if (0 != (operandFlags & OPERAND_MODRM))
+	{
+		layout->hasModRM = TRUE;
+		layout->modRM = bytes[offset];
+		offset++;
+
+		UINT8 mod = layout->modRM >> 6;
+		UINT8 rm = layout->modRM & 0x07;
+
+		/* MOV to/from control and debug registers ignore the mod field, they are always registers. */
+		BOOLEAN registerOnly = (FALSE == layout->vexEncoded) && (OPCODE_MAP_0F == layout->opcodeMap) &&
+							   (layout->opcode >= 0x20) && (layout->opcode <= 0x23);
+
+		if ((3 != mod) && (FALSE == registerOnly))
+		{
+			if (4 == rm)
+			{
+				/* SIB, base 101 with mod 00 has a disp32 and no base. */
+				if ((0 == mod) && (5 == (bytes[offset] & 0x07)))
+				{
+					layout->displacementSize = sizeof(LONG);
+				}
+				offset++;
+			}
+
+			if ((0 == mod) && (5 == rm))
+			{
+				/* Mod 00 with R/M 101 is [RIP + disp32] in 64-bit mode. */
+				layout->ripRelative = TRUE;
+				layout->displacementSize = sizeof(LONG);
+			}
+			else if (1 == mod)
+			{
+				layout->displacementSize = sizeof(CHAR);
+			}
+			else if (2 == mod)
+			{
+				layout->displacementSize = sizeof(LONG);
+			}
+		}
+
+		layout->displacementOffset = offset;
+		offset += layout->displacementSize;
+	}
+
+	layout->immediateOffset = offset;
+	layout->immediateSize = getImmediateSize(operandFlags, layout, operandSize16, addressSize32);
+	layout->relative = (0 != (operandFlags & OPERAND_RELATIVE));
+	offset += layout->immediateSize;
+
+	layout->length = offset;
+
+	if (offset > limit)
+	{
+		/* Truncated by availableSize, or longer than any valid instruction. */
+		status = STATUS_ILLEGAL_INSTRUCTION;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static UINT8 getOperandFlags(PINSTRUCTION_LAYOUT layout)
+{
+	UINT8 result;
+
+	if (FALSE == layout->vexEncoded)
+	{
+		switch (layout->opcodeMap)
+		{
+		case OPCODE_MAP_ONE_BYTE:
+			result = oneByteOperands[layout->opcode];
+			break;
+
+		case OPCODE_MAP_0F:
+			result = twoByteOperands[layout->opcode];
+			break;
+
+		case OPCODE_MAP_0F38:
+			result = OPERAND_MODRM;
+			break;
+
+		default:
+			result = OPERAND_MODRM | OPERAND_IMM_8;
+			break;
+		}
+	}
+	else
+	{
+		switch (layout->opcodeMap)
+		{
+		case OPCODE_MAP_0F:
+			/* Only VZEROUPPER/VZEROALL have no ModRM, the imm8 forms match the legacy map. */
+			result = (0x77 == layout->opcode) ? OPERAND_IMM_NONE : OPERAND_MODRM;
+			if (OPERAND_IMM_8 == (twoByteOperands[layout->opcode] & OPERAND_IMM_MASK))
+			{
+				result |= OPERAND_IMM_8;
+			}
+			break;
+
+		case OPCODE_MAP_0F38:
+		case 5:
+		case 6:
+			/* EVEX maps 5 and 6 hold the AVX512-FP16 instructions. */
+			result = OPERAND_MODRM;
+			break;
+
+		case OPCODE_MAP_0F3A:
+			result = OPERAND_MODRM | OPERAND_IMM_8;
+			break;
+
+		default:
+			result = OPERAND_INVALID;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static ULONG getImmediateSize(UINT8 operandFlags, PINSTRUCTION_LAYOUT layout, BOOLEAN operandSize16, BOOLEAN addressSize32)
+{
+	/* REX.W takes precedence over the 66 operand size prefix. Near branches always
+	 * take a 32-bit displacement in 64-bit mode, whatever the operand size. */
+	ULONG result;
+
+	BOOLEAN wide = (0 != (layout->rex & 0x08));
+	BOOLEAN narrow = (TRUE == operandSize16) && (FALSE == wide) && (0 == (operandFlags & OPERAND_RELATIVE));
+
+	switch (operandFlags & OPERAND_IMM_MASK)
+	{
+	case OPERAND_IMM_8:
+		result = 1;
+		break;
+
+	case OPERAND_IMM_16:
+		result = 2;
+		break;
+
+	case OPERAND_IMM_Z:
+		result = (TRUE == narrow) ? 2 : 4;
+		break;
+
+	case OPERAND_IMM_V:
+		result = (TRUE == wide) ? 8 : ((TRUE == narrow) ? 2 : 4);
+		break;
+
+	case OPERAND_IMM_16_8:
+		result = 3;
+		break;
+
+	case OPERAND_IMM_MOFFS:
+		result = (TRUE == addressSize32) ? 4 : 8;
+		break;
+
+	case OPERAND_IMM_GROUP3:
+		/* TEST r/m, imm is reg 0 (and its alias reg 1), F6 takes an imm8 and F7 an immz. */
+		if (((layout->modRM >> 3) & 0x07) <= 1)
+		{
+			result = (0xF6 == layout->opcode) ? 1 : ((TRUE == narrow) ? 2 : 4);
+		}
+		else
+		{
+			result = 0;
+		}
+		break;
+
+	default:
+		result = 0;
+		break;
+	}
+
+	return result;
+}
+
+static BOOLEAN isLegacyPrefix(UINT8 value)
+{
+	BOOLEAN result;
+
+	switch (value)
+	{
+	case 0x26:
+	case 0x2E:
+	case 0x36:
+	case 0x3E:
+	case 0x64:
+	case 0x65:
+	case 0x66:
+	case 0x67:
+	case 0xF0:
+	case 0xF2:
+	case 0xF3:
+		result = TRUE;
+		break;
+
+	default:
+		result = FALSE;
+		break;
+	}
+
+	return result;
+}
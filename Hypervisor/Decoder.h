@@ -0,0 +1,54 @@
+#pragma once
+#include "Platform_Common.h"
+
+/******************** Public Defines ********************/
+
+/* Architectural limit, longer encodings raise #GP. */
+#define DECODER_MAX_INSTRUCTION_LENGTH 15
+
+/* Opcode maps, numbered as in the map select field of VEX/EVEX prefixes. */
+#define OPCODE_MAP_ONE_BYTE		0
+#define OPCODE_MAP_0F			1
+#define OPCODE_MAP_0F38			2
+#define OPCODE_MAP_0F3A			3
+
+/******************** Public Typedefs ********************/
+
+/* Position of the parts of a decoded instruction, relative to its first byte. */
+typedef struct _INSTRUCTION_LAYOUT
+{
+	ULONG length;
+
+	/* Bytes up to the last legacy prefix, and the REX prefix following them (0 if none). */
+	ULONG prefixLength;
+	UINT8 rex;
+
+	/* Opcode map (OPCODE_MAP_*), whether it was selected by a VEX/EVEX prefix,
+	 * and the final opcode byte. */
+	ULONG opcodeMap;
+	BOOLEAN vexEncoded;
+	UINT8 opcode;
+	ULONG opcodeOffset;
+
+	/* ModRM byte if there is one, and whether it addresses memory relative to RIP. */
+	BOOLEAN hasModRM;
+	UINT8 modRM;
+	BOOLEAN ripRelative;
+
+	/* Memory displacement and immediate operands, a size of 0 if there are none. */
+	ULONG displacementOffset;
+	ULONG displacementSize;
+	ULONG immediateOffset;
+	ULONG immediateSize;
+
+	/* The immediate is a branch displacement, relative to the end of the instruction. */
+	BOOLEAN relative;
+} INSTRUCTION_LAYOUT, *PINSTRUCTION_LAYOUT;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS Decoder_decode(const UINT8* code, ULONG availableSize, PINSTRUCTION_LAYOUT layout);
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <intrin.h>
 #include "EPT.h"
 #include "Intrinsics.h"
+#include "PageTable.h"
 #include "Debug.h"
 
 /******************** External API ********************/
@@ -9,15 +10,39 @@
 
 /******************** Module Typedefs ********************/
 
+/* State used while run-length encoding the layout. */
+typedef struct _LAYOUT_BUILDER
+{
+	EPT_LAYOUT_RECORD current;
+	BOOLEAN hasCurrent;
+	fnEPTLayoutCallback callback;
+	PVOID userParameter;
+	NTSTATUS status;
+} LAYOUT_BUILDER, *PLAYOUT_BUILDER;
+
 
 /******************** Module Constants ********************/
 
 
 /******************** Module Variables ********************/
 
+/* Splits and handlers allocated by the guest ahead of time and mapped in the host tables,
+ * VMX root takes from these as it cannot allocate. Shared by every processor. */
+static LIST_ENTRY freeSplits = { &freeSplits, &freeSplits };
+static LIST_ENTRY freeHandlers = { &freeHandlers, &freeHandlers };
+static ULONG freeSplitCount = 0;
+static ULONG freeHandlerCount = 0;
+static volatile LONG reserveLock = 0;
 
 /******************** Module Prototypes ********************/
 static UINT32 adjustEffectiveMemoryType(const PMTRR_RANGE mtrrTable, UINT64 pageAddress, UINT32 desiredType);
+static BOOLEAN dispatchViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation);
+static void appendLayoutRun(PLAYOUT_BUILDER builder, const PEPT_LAYOUT_RECORD candidate);
+static UINT64 layoutPageSize(UINT8 pageSize);
+static PLIST_ENTRY takeReserved(PLIST_ENTRY freeList, PULONG freeCount);
+static void returnReserved(PLIST_ENTRY freeList, PULONG freeCount, PLIST_ENTRY listEntry);
+static void lockReserve(void);
+static void unlockReserve(void);
 
 /******************** Public Code ********************/
 
@@ -67,6 +92,9 @@ void EPT_initialise(PEPT_CONFIG eptConfig, const PMTRR_RANGE mtrrTable)
 	tempLargePML2E.ExecuteAccess = 1;
 	tempLargePML2E.LargePage = 1;
 
+	/* Violations are never converted to a #VE, every one causes a VM exit. */
+	tempLargePML2E.SuppressVe = 1;
+
 	/* Store the temporarily create LARGE_PDE to each of the entries in the page directory table. */
 	__stosq((UINT64*)eptConfig->PML2, tempLargePML2E.Flags, EPT_PML3E_COUNT * EPT_PML2E_COUNT);
 
@@ -91,73 +119,82 @@ void EPT_initialise(PEPT_CONFIG eptConfig, const PMTRR_RANGE mtrrTable)
 	}
 }
 
-BOOLEAN EPT_handleViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext)
+NTSTATUS EPT_reserve(ULONG splitCount, ULONG handlerCount)
 {
-	/* Result indicates handled successfully. */
-	BOOLEAN result = FALSE;
-
-	/* Get the physical address of the page that caused the violation. */
-	PHYSICAL_ADDRESS violationGuestPA;
-	__vmx_vmread(VMCS_GUEST_PHYSICAL_ADDRESS, (SIZE_T*)&violationGuestPA.QuadPart);
+	/* Called from the guest at PASSIVE_LEVEL before an edit that splits pages or adds handlers
+	 * on every processor. The reserve is topped up so each processor can take the amounts given,
+	 * if edits run at the same time it can still run out, failing with STATUS_NO_MEMORY. */
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
 
-	/* Search the list of EPT handlers and determine which one to call. */
-	for (PLIST_ENTRY currentEntry = eptConfig->handlerList.Flink;
-		currentEntry != &eptConfig->handlerList;
-		currentEntry = currentEntry->Flink)
+	while ((NT_SUCCESS(status)) && (freeSplitCount < (splitCount * processorCount)))
 	{
-		/* Use the CONTAINING_RECORD macro to get the actual record 
-		 * the linked list is holding. */
-		PEPT_HANDLER eptHandler = CONTAINING_RECORD(currentEntry, EPT_HANDLER, listEntry);
+		PEPT_DYNAMIC_SPLIT newSplit = (PEPT_DYNAMIC_SPLIT)ExAllocatePool(NonPagedPoolNx, sizeof(EPT_DYNAMIC_SPLIT));
 
-		/* Check to see if the physical address associated with the handler matches. */
-		if ((violationGuestPA.QuadPart >= eptHandler->physRange.start.QuadPart) &&
-			(violationGuestPA.QuadPart <= eptHandler->physRange.end.QuadPart))
+		if (NULL != newSplit)
 		{
-			result = eptHandler->callback(eptConfig, guestContext, eptHandler->userParameter);
-			break;
+			status = PageTable_mapHost(newSplit, sizeof(EPT_DYNAMIC_SPLIT));
+
+			if (NT_SUCCESS(status))
+			{
+				newSplit->physicalPML1 = MmGetPhysicalAddress(&newSplit->PML1[0]).QuadPart;
+				KIRQL oldIrql;
+				KeRaiseIrql(HIGH_LEVEL, &oldIrql);
+				returnReserved(&freeSplits, &freeSplitCount, &newSplit->listEntry);
+				KeLowerIrql(oldIrql);
+			}
+			else
+			{
+				ExFreePool(newSplit);
+			}
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
 		}
 	}
 
-	if (FALSE == result)
+	while ((NT_SUCCESS(status)) && (freeHandlerCount < (handlerCount * processorCount)))
 	{
-		/*** DEBUG ***/
-
-		/* Print the information regarding where the violation took place. */
-		PVOID virtPA = MmGetVirtualForPhysical(violationGuestPA);
-
-		DEBUG_PRINT("Unhandled EPT violation: PhysAlign %p\tPhysReal %p\tVirtReal %p\n", 
-			PAGE_ALIGN(violationGuestPA.QuadPart),
-			(PVOID)violationGuestPA.QuadPart,
-			virtPA);
-
-		/* Print the guest RIP. */
-		SIZE_T guestRIP;
-		__vmx_vmread(VMCS_GUEST_RIP, &guestRIP);
-		DEBUG_PRINT("\tGuest RIP: %p\n\n", (PVOID)guestRIP);
-
-		/* Print the violation qualification information. */
-		VMX_EXIT_QUALIFICATION_EPT_VIOLATION qualification;
-		__vmx_vmread(VMCS_EXIT_QUALIFICATION, &qualification.Flags);
-
-		DEBUG_PRINT("\tQualification.ReadAccess: 0x%I64X\n", qualification.ReadAccess);
-		DEBUG_PRINT("\tQualification.WriteAccess: 0x%I64X\n", qualification.WriteAccess);
-		DEBUG_PRINT("\tQualification.ExecuteAccess: 0x%I64X\n", qualification.ExecuteAccess);
-		DEBUG_PRINT("\tQualification.EptReadable: 0x%I64X\n", qualification.EptReadable);
-		DEBUG_PRINT("\tQualification.EptWriteable: 0x%I64X\n", qualification.EptWriteable);
-		DEBUG_PRINT("\tQualification.EptExecutable: 0x%I64X\n", qualification.EptExecutable);
-		DEBUG_PRINT("\tQualification.EptExecutableForUserMode: 0x%I64X\n", qualification.EptExecutableForUserMode);
-		DEBUG_PRINT("\tQualification.ValidGuestLinearAddress: 0x%I64X\n", qualification.ValidGuestLinearAddress);
-		DEBUG_PRINT("\tQualification.CausedByTranslation: 0x%I64X\n", qualification.CausedByTranslation);
-		DEBUG_PRINT("\tQualification.UserModeLinearAddress: 0x%I64X\n", qualification.UserModeLinearAddress);
-		DEBUG_PRINT("\tQualification.ReadableWritablePage: 0x%I64X\n", qualification.ReadableWritablePage);
-		DEBUG_PRINT("\tQualification.ExecuteDisablePage: 0x%I64X\n", qualification.ExecuteDisablePage);
-		DEBUG_PRINT("\tQualification.NmiUnblocking: 0x%I64X\n", qualification.NmiUnblocking);
-		DEBUG_PRINT("\tQualification.Reserved1: 0x%I64X\n", qualification.Reserved1);
-
-		DbgBreakPoint();
+		PEPT_HANDLER newHandler = (PEPT_HANDLER)ExAllocatePool(NonPagedPoolNx, sizeof(EPT_HANDLER));
+
+		if (NULL != newHandler)
+		{
+			status = PageTable_mapHost(newHandler, sizeof(EPT_HANDLER));
+
+			if (NT_SUCCESS(status))
+			{
+				KIRQL oldIrql;
+				KeRaiseIrql(HIGH_LEVEL, &oldIrql);
+				returnReserved(&freeHandlers, &freeHandlerCount, &newHandler->listEntry);
+				KeLowerIrql(oldIrql);
+			}
+			else
+			{
+				ExFreePool(newHandler);
+			}
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
 	}
 
-	return result;
+	return status;
+}
+
+BOOLEAN EPT_handleViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext)
+{
+	/* Build the violation information from the VMCS. */
+	EPT_VIOLATION violation = { 0 };
+	__vmx_vmread(VMCS_GUEST_PHYSICAL_ADDRESS, (SIZE_T*)&violation.guestPA.QuadPart);
+	__vmx_vmread(VMCS_EXIT_GUEST_LINEAR_ADDRESS, &violation.guestLA);
+	__vmx_vmread(VMCS_EXIT_QUALIFICATION, &violation.qualification.Flags);
+	__vmx_vmread(VMCS_GUEST_CR3, &violation.guestCR3.Flags);
+
+	/* A violation no handler claims is retried by the guest. The kernel (and its debugger)
+	 * cannot be called from VMX root, so nothing is reported. */
+	return dispatchViolation(eptConfig, guestContext, &violation);
 }
 
 NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalRange, fnEPTHandlerCallback callback, PVOID userParameter)
@@ -166,10 +203,12 @@ NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalR
 
 	if (NULL != callback)
 	{
-		/* Allocate a new handler structure that will be used for traversal later. */
-		PEPT_HANDLER newHandler = (PEPT_HANDLER)ExAllocatePool(NonPagedPoolNx, sizeof(EPT_HANDLER));
-		if (NULL != newHandler)
+		/* Take a handler structure from the reserve, this may be called from VMX root. */
+		PLIST_ENTRY reservedEntry = takeReserved(&freeHandlers, &freeHandlerCount);
+		if (NULL != reservedEntry)
 		{
+			PEPT_HANDLER newHandler = CONTAINING_RECORD(reservedEntry, EPT_HANDLER, listEntry);
+
 			newHandler->physRange = physicalRange;
 			newHandler->callback = callback;
 			newHandler->userParameter = userParameter;
@@ -191,6 +230,29 @@ NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalR
 	return status;
 }
 
+NTSTATUS EPT_removeViolationHandler(PEPT_CONFIG eptConfig, fnEPTHandlerCallback callback, PVOID userParameter)
+{
+	NTSTATUS status = STATUS_NOT_FOUND;
+
+	/* Search for the handler registered with both the callback and parameter. */
+	for (PLIST_ENTRY currentEntry = eptConfig->handlerList.Flink;
+		currentEntry != &eptConfig->handlerList;
+		currentEntry = currentEntry->Flink)
+	{
+		PEPT_HANDLER eptHandler = CONTAINING_RECORD(currentEntry, EPT_HANDLER, listEntry);
+
+		if ((callback == eptHandler->callback) && (userParameter == eptHandler->userParameter))
+		{
+			RemoveEntryList(currentEntry);
+			returnReserved(&freeHandlers, &freeHandlerCount, currentEntry);
+			status = STATUS_SUCCESS;
+			break;
+		}
+	}
+
+	return status;
+}
+
 NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress)
 {
 	NTSTATUS status;
@@ -204,10 +266,12 @@ NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddr
 		* then we don't have to split it as it is already done. */
 		if (FALSE != targetPML2E->LargePage)
 		{
-			PEPT_DYNAMIC_SPLIT newSplit = (PEPT_DYNAMIC_SPLIT)ExAllocatePool(NonPagedPoolNx, sizeof(EPT_DYNAMIC_SPLIT));
+			/* Take a split from the reserve, this may be called from VMX root. */
+			PLIST_ENTRY reservedEntry = takeReserved(&freeSplits, &freeSplitCount);
 
-			if (NULL != newSplit)
+			if (NULL != reservedEntry)
 			{
+				PEPT_DYNAMIC_SPLIT newSplit = CONTAINING_RECORD(reservedEntry, EPT_DYNAMIC_SPLIT, listEntry);
 				newSplit->pml2Entry = targetPML2E;
 
 				/* Make a template for RWX. */
@@ -241,7 +305,7 @@ NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddr
 				tempPML2.ReadAccess = 1;
 				tempPML2.WriteAccess = 1;
 				tempPML2.ExecuteAccess = 1;
-				tempPML2.PageFrameNumber = MmGetPhysicalAddress(&newSplit->PML1[0]).QuadPart / PAGE_SIZE;
+				tempPML2.PageFrameNumber = newSplit->physicalPML1 / PAGE_SIZE;
 
 				/* Replace the old entry with the new split pointer. */
 				targetPML2E->Flags = tempPML2.Flags;
@@ -317,17 +381,22 @@ PEPT_PML1_ENTRY EPT_getPML1EFromAddress(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS
 			/* We have determined it is not the lowest level, so cast the entry to a pointer to the level 1 table. */
 			PEPT_PML2_POINTER pointerPML2 = (PEPT_PML2_POINTER)entryPML2;
 
-			/* Convert the physical address to a virtual address. */
-			PHYSICAL_ADDRESS physicalPML1;
-			physicalPML1.QuadPart = pointerPML2->PageFrameNumber * PAGE_SIZE;
-
-			PEPT_PML1_ENTRY entryPML1 = (PEPT_PML1_ENTRY)MmGetVirtualForPhysical(physicalPML1);
+			/* Find the split the table belongs to, the kernel cannot be asked from VMX root. */
+			UINT64 physicalPML1 = pointerPML2->PageFrameNumber * PAGE_SIZE;
 
-			if (NULL != entryPML1)
+			for (PLIST_ENTRY currentEntry = eptConfig->dynamicSplitList.Flink;
+				currentEntry != &eptConfig->dynamicSplitList;
+				currentEntry = currentEntry->Flink)
 			{
-				UINT64 indexPML1 = ADDRMASK_EPT_PML1_INDEX(unsignedAddr);
+				PEPT_DYNAMIC_SPLIT split = CONTAINING_RECORD(currentEntry, EPT_DYNAMIC_SPLIT, listEntry);
 
-				result = &entryPML1[indexPML1];
+				if (physicalPML1 == split->physicalPML1)
+				{
+					UINT64 indexPML1 = ADDRMASK_EPT_PML1_INDEX(unsignedAddr);
+
+					result = &split->PML1[indexPML1];
+					break;
+				}
 			}
 		}
 	}
@@ -344,8 +413,106 @@ void EPT_invalidateAndFlush(PEPT_CONFIG eptConfig)
 	__invept(InveptSingleContext, &eptDescriptor);
 }
 
+NTSTATUS EPT_exportLayout(PEPT_CONFIG eptConfig, fnEPTLayoutCallback callback, PVOID userParameter)
+{
+	/* Walks the whole identity map and reports it as runs of equal entries, a box that has
+	 * never been split produces a handful of records instead of 2MB+ of tables. */
+	LAYOUT_BUILDER builder = { 0 };
+	builder.callback = callback;
+	builder.userParameter = userParameter;
+	builder.status = STATUS_SUCCESS;
+
+	for (UINT32 indexPML3 = 0; (indexPML3 < EPT_PML3E_COUNT) && NT_SUCCESS(builder.status); indexPML3++)
+	{
+		for (UINT32 indexPML2 = 0; (indexPML2 < EPT_PML2E_COUNT) && NT_SUCCESS(builder.status); indexPML2++)
+		{
+			PEPT_PML2_2MB entryPML2 = &eptConfig->PML2[indexPML3][indexPML2];
+			UINT64 regionPA = ((UINT64)indexPML3 * EPT_PML2E_COUNT + indexPML2) * SIZE_2MB;
+
+			EPT_LAYOUT_RECORD candidate = { 0 };
+			candidate.guestPA = regionPA;
+			candidate.pageCount = 1;
+
+			if (FALSE != entryPML2->LargePage)
+			{
+				candidate.hostPA = entryPML2->PageFrameNumber * SIZE_2MB;
+				candidate.pageSize = EPT_LAYOUT_PAGE_2MB;
+				candidate.permissions = (UINT8)(entryPML2->Flags & (EPT_LAYOUT_READ | EPT_LAYOUT_WRITE | EPT_LAYOUT_EXECUTE));
+				candidate.memoryType = (UINT8)entryPML2->MemoryType;
+				candidate.flags = (entryPML2->SuppressVe ? EPT_LAYOUT_FLAG_SUPPRESS_VE : 0) |
+								  (entryPML2->IgnorePat ? EPT_LAYOUT_FLAG_IGNORE_PAT : 0);
+
+				appendLayoutRun(&builder, &candidate);
+			}
+			else
+			{
+				/* Mark the region as split, then describe its 4KB entries. */
+				candidate.hostPA = regionPA;
+				candidate.pageSize = EPT_LAYOUT_SPLIT_2MB;
+				appendLayoutRun(&builder, &candidate);
+
+				PHYSICAL_ADDRESS regionAddress;
+				regionAddress.QuadPart = (LONGLONG)regionPA;
+
+				PEPT_PML1_ENTRY tablePML1 = EPT_getPML1EFromAddress(eptConfig, regionAddress);
+				if (NULL != tablePML1)
+				{
+					for (UINT32 indexPML1 = 0; (indexPML1 < EPT_PML1E_COUNT) && NT_SUCCESS(builder.status); indexPML1++)
+					{
+						PEPT_PML1_ENTRY entryPML1 = &tablePML1[indexPML1];
+
+						candidate.guestPA = regionPA + ((UINT64)indexPML1 * PAGE_SIZE);
+						candidate.hostPA = entryPML1->PageFrameNumber * PAGE_SIZE;
+						candidate.pageSize = EPT_LAYOUT_PAGE_4KB;
+						candidate.permissions = (UINT8)(entryPML1->Flags & (EPT_LAYOUT_READ | EPT_LAYOUT_WRITE | EPT_LAYOUT_EXECUTE));
+						candidate.memoryType = (UINT8)entryPML1->MemoryType;
+						candidate.flags = (entryPML1->SuppressVe ? EPT_LAYOUT_FLAG_SUPPRESS_VE : 0) |
+										  (entryPML1->IgnorePat ? EPT_LAYOUT_FLAG_IGNORE_PAT : 0);
+
+						appendLayoutRun(&builder, &candidate);
+					}
+				}
+			}
+		}
+	}
+
+	/* Emit the final run. */
+	if ((NT_SUCCESS(builder.status)) && (TRUE == builder.hasCurrent))
+	{
+		builder.status = builder.callback(&builder.current, builder.userParameter);
+	}
+
+	return builder.status;
+}
+
 /******************** Module Code ********************/
 
+static BOOLEAN dispatchViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation)
+{
+	/* Result indicates handled successfully. */
+	BOOLEAN result = FALSE;
+
+	/* Search the list of EPT handlers and determine which one to call. */
+	for (PLIST_ENTRY currentEntry = eptConfig->handlerList.Flink;
+		currentEntry != &eptConfig->handlerList;
+		currentEntry = currentEntry->Flink)
+	{
+		/* Use the CONTAINING_RECORD macro to get the actual record 
+		 * the linked list is holding. */
+		PEPT_HANDLER eptHandler = CONTAINING_RECORD(currentEntry, EPT_HANDLER, listEntry);
+
+		/* Check to see if the physical address associated with the handler matches. */
+		if ((violation->guestPA.QuadPart >= eptHandler->physRange.start.QuadPart) &&
+			(violation->guestPA.QuadPart <= eptHandler->physRange.end.QuadPart))
+		{
+			result = eptHandler->callback(eptConfig, guestContext, violation, eptHandler->userParameter);
+			break;
+		}
+	}
+
+	return result;
+}
+
 static UINT32 adjustEffectiveMemoryType(const PMTRR_RANGE mtrrTable, UINT64 pageAddress, UINT32 desiredType)
 {
 	for (UINT32 i = 0; i < IA32_MTRR_VARIABLE_COUNT; i++)
@@ -365,3 +532,84 @@ static UINT32 adjustEffectiveMemoryType(const PMTRR_RANGE mtrrTable, UINT64 page
 
 	return desiredType;
 }
+
+static void appendLayoutRun(PLAYOUT_BUILDER builder, const PEPT_LAYOUT_RECORD candidate)
+{
+	if (NT_SUCCESS(builder->status))
+	{
+		PEPT_LAYOUT_RECORD current = &builder->current;
+		UINT64 runLength = (UINT64)current->pageCount * layoutPageSize(current->pageSize);
+
+		/* Extend the current run if the candidate directly follows it, in both the
+		 * guest and host address space, with identical attributes. */
+		if ((TRUE == builder->hasCurrent) &&
+			(current->pageSize == candidate->pageSize) &&
+			(current->permissions == candidate->permissions) &&
+			(current->memoryType == candidate->memoryType) &&
+			(current->flags == candidate->flags) &&
+			(current->guestPA + runLength == candidate->guestPA) &&
+			(current->hostPA + runLength == candidate->hostPA))
+		{
+			current->pageCount++;
+		}
+		else
+		{
+			if (TRUE == builder->hasCurrent)
+			{
+				builder->status = builder->callback(current, builder->userParameter);
+			}
+
+			*current = *candidate;
+			builder->hasCurrent = TRUE;
+		}
+	}
+}
+
+static UINT64 layoutPageSize(UINT8 pageSize)
+{
+	return (EPT_LAYOUT_PAGE_4KB == pageSize) ? PAGE_SIZE : SIZE_2MB;
+}
+
+static PLIST_ENTRY takeReserved(PLIST_ENTRY freeList, PULONG freeCount)
+{
+	/* Returns an entry of the reserve, or NULL when it is empty. */
+	PLIST_ENTRY result = NULL;
+
+	lockReserve();
+
+	if (FALSE == IsListEmpty(freeList))
+	{
+		result = RemoveHeadList(freeList);
+		(*freeCount)--;
+	}
+
+	unlockReserve();
+
+	return result;
+}
+
+static void returnReserved(PLIST_ENTRY freeList, PULONG freeCount, PLIST_ENTRY listEntry)
+{
+	lockReserve();
+
+	InsertHeadList(freeList, listEntry);
+	(*freeCount)++;
+
+	unlockReserve();
+}
+
+static void lockReserve(void)
+{
+	/* Taken from VMX root and from the guest, which is at HIGH_LEVEL (or IPI_LEVEL during
+	 * launch) so it cannot be interrupted by a VMSync broadcast while holding the lock.
+	 * Processors in VMX root cannot wait on kernel objects, so spin. */
+	while (0 != InterlockedCompareExchange(&reserveLock, 1, 0))
+	{
+		_mm_pause();
+	}
+}
+
+static void unlockReserve(void)
+{
+	InterlockedExchange(&reserveLock, 0);
+}
@@ -2,6 +2,7 @@
 #include <wdm.h>
 #include "ia32.h"
 #include "MTRR.h"
+#include "EPTLayout_Common.h"
 
 /******************** Public Defines ********************/
 
@@ -51,6 +52,9 @@ typedef struct _EPT_DYNAMIC_SPLIT
 	/* A pointer to the 2MB entry in the page table which this split was created for. */
 	PEPT_PML2_2MB pml2Entry;
 
+	/* Physical address of PML1, found when the split is reserved by the guest. */
+	UINT64 physicalPML1;
+
 	/* List entry for the dynamic split, will be used to keep track of all split entries. */
 	LIST_ENTRY listEntry;
 
@@ -72,7 +76,8 @@ typedef struct _EPT_CONFIG
 	LIST_ENTRY handlerList;
 
 	/* List of all dynamically split pages (from 2MB to 4KB). This will be used for
-	 * when they need to be freed during uninitialisation. 
+	 * when they need to be freed during uninitialisation, and to find the PML1 table
+	 * of a split entry without the kernel's help.
 	 * TODO: Actually implement uninit. */
 	LIST_ENTRY dynamicSplitList;
 
@@ -80,8 +85,27 @@ typedef struct _EPT_CONFIG
 	EPT_POINTER eptPointer;
 } EPT_CONFIG, *PEPT_CONFIG;
 
+/* Describes a single EPT violation, read from the VMCS on the VM exit. */
+typedef struct _EPT_VIOLATION
+{
+	/* Guest physical address that caused the violation. */
+	PHYSICAL_ADDRESS guestPA;
+
+	/* Guest linear address, only valid if the qualification says so. */
+	UINT64 guestLA;
+
+	/* Qualification describing the attempted access and the EPT permissions. */
+	VMX_EXIT_QUALIFICATION_EPT_VIOLATION qualification;
+
+	/* Page table base of the guest at the time of the violation. */
+	CR3 guestCR3;
+} EPT_VIOLATION, *PEPT_VIOLATION;
+
 /* Callback function for the EPT violation handler. */
-typedef BOOLEAN(*fnEPTHandlerCallback)(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PVOID userBuffer);
+typedef BOOLEAN(*fnEPTHandlerCallback)(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation, PVOID userBuffer);
+
+/* Callback receiving each run of the exported EPT layout. */
+typedef NTSTATUS(*fnEPTLayoutCallback)(const PEPT_LAYOUT_RECORD record, PVOID userParameter);
 
 /* Structure that holds the information of each handler that
 * are used for parsing violations. */
@@ -108,9 +132,12 @@ typedef struct _EPT_HANDLER
 /******************** Public Prototypes ********************/
 
 void EPT_initialise(PEPT_CONFIG eptTable, const PMTRR_RANGE mtrrTable);
+NTSTATUS EPT_reserve(ULONG splitCount, ULONG handlerCount);
 BOOLEAN EPT_handleViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext);
 NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalRange, fnEPTHandlerCallback callback, PVOID userParameter);
+NTSTATUS EPT_removeViolationHandler(PEPT_CONFIG eptConfig, fnEPTHandlerCallback callback, PVOID userParameter);
 NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress);
 PEPT_PML2_2MB EPT_getPML2EFromAddress(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress);
 PEPT_PML1_ENTRY EPT_getPML1EFromAddress(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress);
-void EPT_invalidateAndFlush(PEPT_CONFIG eptConfig);
\ No newline at end of file
+void EPT_invalidateAndFlush(PEPT_CONFIG eptConfig);
+NTSTATUS EPT_exportLayout(PEPT_CONFIG eptConfig, fnEPTLayoutCallback callback, PVOID userParameter);
\ No newline at end of file
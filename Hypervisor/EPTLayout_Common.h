@@ -0,0 +1,65 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Shared between the hypervisor and offline tools, only fixed width types are used.
+ * Windows builds are expected to have included the Windows/WDK headers beforehand. */
+#ifndef _WIN32
+#include <stdint.h>
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#endif
+
+/******************** Public Defines ********************/
+
+#define EPT_LAYOUT_MAGIC			0x4C545045	/* 'EPTL' */
+#define EPT_LAYOUT_VERSION			1
+
+/* Granularity of a run. A split record marks 2MB regions that are mapped by 4KB
+ * entries, the 4KB runs describing the region follow it. */
+#define EPT_LAYOUT_PAGE_2MB			0
+#define EPT_LAYOUT_PAGE_4KB			1
+#define EPT_LAYOUT_SPLIT_2MB		2
+
+/* Permission bits of a run, the same as the EPT entry bits. */
+#define EPT_LAYOUT_READ				0x1
+#define EPT_LAYOUT_WRITE			0x2
+#define EPT_LAYOUT_EXECUTE			0x4
+
+/* Flags of a run. */
+#define EPT_LAYOUT_FLAG_SUPPRESS_VE	0x1
+#define EPT_LAYOUT_FLAG_IGNORE_PAT	0x2
+
+/******************** Public Typedefs ********************/
+
+/* Start of the exported layout, followed by recordCount records. */
+typedef struct _EPT_LAYOUT_HEADER
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT32 processorIndex;
+	UINT32 recordCount;
+	UINT64 eptPointer;
+} EPT_LAYOUT_HEADER, *PEPT_LAYOUT_HEADER;
+
+/* A run of pageCount consecutive entries of the same size, permissions, memory type and flags.
+ * Runs where hostPA == guestPA are identity mapped, otherwise the run is remapped (shadowed). */
+typedef struct _EPT_LAYOUT_RECORD
+{
+	UINT64 guestPA;
+	UINT64 hostPA;
+	UINT32 pageCount;
+	UINT8 pageSize;
+	UINT8 permissions;
+	UINT8 memoryType;
+	UINT8 flags;
+} EPT_LAYOUT_RECORD, *PEPT_LAYOUT_RECORD;
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,660 @@
+#include "ExportIndex.h"
+#include "ProcessDefines.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Export of a module keyed by the hash of its name. Names are not kept, a 64 bit hash is
+ * unique within a module in practice and names that do collide are marked ambiguous. */
+typedef struct _EXPORT_ENTRY
+{
+	UINT64 nameHash;
+	UINT32 rva;
+	UINT32 flags;
+} EXPORT_ENTRY, *PEXPORT_ENTRY;
+
+/* Exports of one build of a module, an open addressed table of a power of two size. */
+typedef struct _EXPORT_MODULE
+{
+	CHAR name[EXPORT_INDEX_MAX_NAME];
+	UINT64 nameHash;
+
+	/* Identify the build, a user module is shared by every process that maps the same build. */
+	UINT32 timeDateStamp;
+	UINT32 sizeOfImage;
+
+	/* Base of a kernel module, NULL for a user module as each process can map it elsewhere. */
+	PUINT8 kernelBase;
+
+	PEXPORT_ENTRY exports;
+	ULONG exportMask;
+} EXPORT_MODULE, *PEXPORT_MODULE;
+
+/******************** Module Constants ********************/
+
+/* The name hashes to more than one export of the module. */
+#define EXPORT_FLAG_AMBIGUOUS 0x1
+
+/* Upper bound of the loaded user modules walked in a process. */
+#define MAX_USER_MODULES 4096
+
+/******************** Module Variables ********************/
+
+/* Protects the index, it is only used at PASSIVE_LEVEL (load notifications, installs). */
+static FAST_MUTEX indexLock;
+static BOOLEAN indexReady = FALSE;
+
+static EXPORT_MODULE indexModules[EXPORT_INDEX_MAX_MODULES] = { 0 };
+static ULONG indexModuleCount = 0;
+
+/******************** Module Prototypes ********************/
+static void indexKernelModules(void);
+static PEXPORT_MODULE indexImage(PUINT8 imageBase, PCSTR moduleName, BOOLEAN kernelImage);
+static NTSTATUS buildExports(PUINT8 imageBase, PIMAGE_NT_HEADERS64 ntHeaders, BOOLEAN kernelImage, PEXPORT_MODULE module);
+static PIMAGE_NT_HEADERS64 getNtHeaders(PUINT8 imageBase, BOOLEAN kernelImage);
+static BOOLEAN isRangeReadable(PUINT8 address, SIZE_T size, BOOLEAN kernelImage);
+static PEXPORT_MODULE findModule(UINT64 nameHash, BOOLEAN kernelImage, UINT32 timeDateStamp, UINT32 sizeOfImage);
+static NTSTATUS lookupExport(PEXPORT_MODULE module, PCSTR exportName, PUINT32 rva);
+static UINT64 hashName(PCSTR name, SIZE_T maximumLength, BOOLEAN ignoreCase);
+static BOOLEAN copyModuleName(PCSTR fileName, SIZE_T length, PCHAR moduleName);
+static PUINT8 findUserModule(PEPROCESS process, PCSTR moduleName);
+static void loadImageNotify(PUNICODE_STRING fullImageName, HANDLE processId, PIMAGE_INFO imageInfo);
+
+/******************** Public Code ********************/
+
+NTSTATUS ExportIndex_init(void)
+{
+	/* Called at PASSIVE_LEVEL. The loaded kernel modules are indexed once here, modules
+	 * loaded later (kernel or user) are added as they load. User modules that were already
+	 * loaded are indexed the first time an export is resolved from them. */
+	NTSTATUS status;
+
+	ExInitializeFastMutex(&indexLock);
+
+	status = PsSetLoadImageNotifyRoutine(loadImageNotify);
+	if (NT_SUCCESS(status))
+	{
+		indexKernelModules();
+		indexReady = TRUE;
+	}
+
+	return status;
+}
+
+void ExportIndex_uninit(void)
+{
+	/* Called at PASSIVE_LEVEL when the hypervisor fails to start, does nothing if the index
+	 * was never built. Once the notification is removed no load can add to the index. */
+	if (TRUE == indexReady)
+	{
+		PsRemoveLoadImageNotifyRoutine(loadImageNotify);
+
+		ExAcquireFastMutex(&indexLock);
+
+		indexReady = FALSE;
+
+		for (ULONG i = 0; i < indexModuleCount; i++)
+		{
+			if (NULL != indexModules[i].exports)
+			{
+				ExFreePool(indexModules[i].exports);
+			}
+		}
+
+		RtlZeroMemory(indexModules, sizeof(indexModules));
+		indexModuleCount = 0;
+
+		ExReleaseFastMutex(&indexLock);
+	}
+}
+
+NTSTATUS ExportIndex_resolveKernel(PCSTR moduleName, PCSTR exportName, PVOID* address)
+{
+	/* Called at PASSIVE_LEVEL, module names are not case sensitive and export names are. */
+	NTSTATUS status;
+
+	if ((NULL != moduleName) && (NULL != exportName) && (NULL != address))
+	{
+		if (TRUE == indexReady)
+		{
+			ExAcquireFastMutex(&indexLock);
+
+			PEXPORT_MODULE module = findModule(hashName(moduleName, EXPORT_INDEX_MAX_NAME, TRUE), TRUE, 0, 0);
+			if (NULL != module)
+			{
+				UINT32 rva;
+				status = lookupExport(module, exportName, &rva);
+
+				if (NT_SUCCESS(status))
+				{
+					/* Drivers are not reported when they unload, check the module is still there. */
+					PVOID imageBase = NULL;
+					RtlPcToFileHeader(module->kernelBase + rva, &imageBase);
+
+					if (module->kernelBase == imageBase)
+					{
+						*address = module->kernelBase + rva;
+					}
+					else
+					{
+						status = STATUS_NOT_FOUND;
+					}
+				}
+			}
+			else
+			{
+				status = STATUS_NOT_FOUND;
+			}
+
+			ExReleaseFastMutex(&indexLock);
+		}
+		else
+		{
+			status = STATUS_DEVICE_NOT_READY;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS ExportIndex_resolveUser(PEPROCESS process, PCSTR moduleName, PCSTR exportName, PVOID* address)
+{
+	/* Called at PASSIVE_LEVEL, resolves the export of a module loaded in the process. Only the
+	 * loaded module list is walked, the exports of a build are parsed once for every process. */
+	NTSTATUS status;
+
+	if ((NULL != process) && (NULL != moduleName) && (NULL != exportName) && (NULL != address))
+	{
+		if (TRUE == indexReady)
+		{
+			CHAR lowerName[EXPORT_INDEX_MAX_NAME];
+
+			if (TRUE == copyModuleName(moduleName, strlen(moduleName), lowerName))
+			{
+				KAPC_STATE apcState;
+				KeStackAttachProcess(process, &apcState);
+
+				ExAcquireFastMutex(&indexLock);
+
+				PUINT8 imageBase = findUserModule(process, lowerName);
+				PEXPORT_MODULE module = (NULL != imageBase) ? indexImage(imageBase, lowerName, FALSE) : NULL;
+
+				if (NULL != module)
+				{
+					UINT32 rva;
+					status = lookupExport(module, exportName, &rva);
+
+					if (NT_SUCCESS(status))
+					{
+						*address = imageBase + rva;
+					}
+				}
+				else
+				{
+					status = STATUS_NOT_FOUND;
+				}
+
+				ExReleaseFastMutex(&indexLock);
+
+				KeUnstackDetachProcess(&apcState);
+			}
+			else
+			{
+				status = STATUS_NAME_TOO_LONG;
+			}
+		}
+		else
+		{
+			status = STATUS_DEVICE_NOT_READY;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static void indexKernelModules(void)
+{
+	/* Called at PASSIVE_LEVEL, modules that cannot be parsed are skipped. */
+	ULONG bufferSize = 0;
+	ZwQuerySystemInformation(SystemModuleInformation, NULL, 0, &bufferSize);
+
+	/* Leave room for drivers loading in between the two queries. */
+	bufferSize += PAGE_SIZE;
+
+	PRTL_PROCESS_MODULES loadedModules = (PRTL_PROCESS_MODULES)ExAllocatePool(PagedPool, bufferSize);
+	if (NULL != loadedModules)
+	{
+		if (NT_SUCCESS(ZwQuerySystemInformation(SystemModuleInformation, loadedModules, bufferSize, &bufferSize)))
+		{
+			ExAcquireFastMutex(&indexLock);
+
+			for (ULONG i = 0; i < loadedModules->NumberOfModules; i++)
+			{
+				PRTL_PROCESS_MODULE_INFORMATION loadedModule = &loadedModules->Modules[i];
+				PCSTR fileName = (PCSTR)&loadedModule->FullPathName[loadedModule->OffsetToFileName];
+
+				SIZE_T nameLength = 0;
+				while (((loadedModule->OffsetToFileName + nameLength) < sizeof(loadedModule->FullPathName)) && ('\0' != fileName[nameLength]))
+				{
+					nameLength++;
+				}
+
+				CHAR moduleName[EXPORT_INDEX_MAX_NAME];
+				if (TRUE == copyModuleName(fileName, nameLength, moduleName))
+				{
+					indexImage((PUINT8)loadedModule->ImageBase, moduleName, TRUE);
+				}
+			}
+
+			ExReleaseFastMutex(&indexLock);
+		}
+
+		ExFreePool(loadedModules);
+	}
+}
+
+static PEXPORT_MODULE indexImage(PUINT8 imageBase, PCSTR moduleName, BOOLEAN kernelImage)
+{
+	/* Called with the index lock held (attached to the process for a user image). Returns
+	 * the index of the image, parsing it if this build has not been seen before. */
+	PEXPORT_MODULE result = NULL;
+
+	/* The image can be unmapped under us, or (in the kernel) not be resident at all. */
+	__try
+	{
+		PIMAGE_NT_HEADERS64 ntHeaders = getNtHeaders(imageBase, kernelImage);
+		if (NULL != ntHeaders)
+		{
+			UINT64 nameHash = hashName(moduleName, EXPORT_INDEX_MAX_NAME, TRUE);
+			UINT32 timeDateStamp = ntHeaders->FileHeader.TimeDateStamp;
+			UINT32 sizeOfImage = ntHeaders->OptionalHeader.SizeOfImage;
+
+			/* A kernel module has a single loaded build, a new one replaces it. */
+			PEXPORT_MODULE module = findModule(nameHash, kernelImage, timeDateStamp, sizeOfImage);
+
+			if ((NULL != module) && (timeDateStamp == module->timeDateStamp) && (sizeOfImage == module->sizeOfImage))
+			{
+				module->kernelBase = (TRUE == kernelImage) ? imageBase : NULL;
+				result = module;
+			}
+			else
+			{
+				/* The old build is replaced in place, even one that failed to parse,
+				 * as findModule would keep returning it ahead of a new slot. */
+				if (NULL != module)
+				{
+					if (NULL != module->exports)
+					{
+						ExFreePool(module->exports);
+					}
+				}
+				else if (indexModuleCount < EXPORT_INDEX_MAX_MODULES)
+				{
+					module = &indexModules[indexModuleCount++];
+				}
+
+				if (NULL != module)
+				{
+					RtlZeroMemory(module, sizeof(EXPORT_MODULE));
+					RtlCopyMemory(module->name, moduleName, strlen(moduleName));
+					module->nameHash = nameHash;
+					module->timeDateStamp = timeDateStamp;
+					module->sizeOfImage = sizeOfImage;
+					module->kernelBase = (TRUE == kernelImage) ? imageBase : NULL;
+
+					/* A module that fails to parse stays with no exports, rather than being parsed again. */
+					buildExports(imageBase, ntHeaders, kernelImage, module);
+					result = module;
+				}
+			}
+		}
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		result = NULL;
+	}
+
+	return result;
+}
+
+static NTSTATUS buildExports(PUINT8 imageBase, PIMAGE_NT_HEADERS64 ntHeaders, BOOLEAN kernelImage, PEXPORT_MODULE module)
+{
+	/* Every table and name referenced by the export directory lies within its data directory,
+	 * so that range is all that is checked and read. Forwarded exports are not indexed, they
+	 * are not code within the module. */
+	NTSTATUS status;
+
+	IMAGE_DATA_DIRECTORY exportData = ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+	UINT64 exportEnd = (UINT64)exportData.VirtualAddress + exportData.Size;
+
+	if ((IMAGE_DIRECTORY_ENTRY_EXPORT < ntHeaders->OptionalHeader.NumberOfRvaAndSizes) &&
+		(sizeof(IMAGE_EXPORT_DIRECTORY) <= exportData.Size) && (exportEnd <= module->sizeOfImage) &&
+		(TRUE == isRangeReadable(imageBase + exportData.VirtualAddress, exportData.Size, kernelImage)))
+	{
+		PIMAGE_EXPORT_DIRECTORY exportDirectory = (PIMAGE_EXPORT_DIRECTORY)(imageBase + exportData.VirtualAddress);
+
+		ULONG nameCount = exportDirectory->NumberOfNames;
+		ULONG functionCount = exportDirectory->NumberOfFunctions;
+
+		/* Check the tables before using them. */
+		BOOLEAN tablesValid = ((exportDirectory->AddressOfNames >= exportData.VirtualAddress) &&
+							   (((UINT64)exportDirectory->AddressOfNames + (nameCount * sizeof(UINT32))) <= exportEnd) &&
+							   (exportDirectory->AddressOfNameOrdinals >= exportData.VirtualAddress) &&
+							   (((UINT64)exportDirectory->AddressOfNameOrdinals + (nameCount * sizeof(UINT16))) <= exportEnd) &&
+							   (exportDirectory->AddressOfFunctions >= exportData.VirtualAddress) &&
+							   (((UINT64)exportDirectory->AddressOfFunctions + (functionCount * sizeof(UINT32))) <= exportEnd));
+
+		/* Keep the table at most half full. */
+		ULONG tableSize = 16;
+		while ((TRUE == tablesValid) && (tableSize < (nameCount * 2)))
+		{
+			tableSize *= 2;
+		}
+
+		if (FALSE == tablesValid)
+		{
+			status = STATUS_INVALID_IMAGE_FORMAT;
+		}
+		else if (NULL != (module->exports = (PEXPORT_ENTRY)ExAllocatePool(PagedPool, tableSize * sizeof(EXPORT_ENTRY))))
+		{
+			RtlZeroMemory(module->exports, tableSize * sizeof(EXPORT_ENTRY));
+			module->exportMask = tableSize - 1;
+
+			PUINT32 names = (PUINT32)(imageBase + exportDirectory->AddressOfNames);
+			PUINT16 ordinals = (PUINT16)(imageBase + exportDirectory->AddressOfNameOrdinals);
+			PUINT32 functions = (PUINT32)(imageBase + exportDirectory->AddressOfFunctions);
+
+			for (ULONG i = 0; i < nameCount; i++)
+			{
+				UINT32 nameRVA = names[i];
+				UINT16 ordinal = ordinals[i];
+
+				if ((nameRVA >= exportData.VirtualAddress) && (nameRVA < exportEnd) && (ordinal < functionCount))
+				{
+					UINT32 functionRVA = functions[ordinal];
+					BOOLEAN forwarded = ((functionRVA >= exportData.VirtualAddress) && (functionRVA < exportEnd));
+
+					if ((FALSE == forwarded) && (0 != functionRVA) && (functionRVA < module->sizeOfImage))
+					{
+						/* The name cannot run past the export data. */
+						UINT64 nameHash = hashName((PCSTR)(imageBase + nameRVA), (SIZE_T)(exportEnd - nameRVA), FALSE);
+						ULONG slot = (ULONG)nameHash & module->exportMask;
+
+						while ((0 != module->exports[slot].nameHash) && (nameHash != module->exports[slot].nameHash))
+						{
+							slot = (slot + 1) & module->exportMask;
+						}
+
+						if (0 == module->exports[slot].nameHash)
+						{
+							module->exports[slot].nameHash = nameHash;
+							module->exports[slot].rva = functionRVA;
+						}
+						else if (functionRVA != module->exports[slot].rva)
+						{
+							module->exports[slot].flags |= EXPORT_FLAG_AMBIGUOUS;
+						}
+					}
+				}
+			}
+
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+	else
+	{
+		/* No exports, or none that can be read. */
+		status = STATUS_NOT_FOUND;
+	}
+
+	return status;
+}
+
+static PIMAGE_NT_HEADERS64 getNtHeaders(PUINT8 imageBase, BOOLEAN kernelImage)
+{
+	/* Returns the headers of a 64 bit image, which must be within its first page. */
+	PIMAGE_NT_HEADERS64 result = NULL;
+
+	if ((TRUE == isRangeReadable(imageBase, PAGE_SIZE, kernelImage)) &&
+		(IMAGE_DOS_SIGNATURE == ((PIMAGE_DOS_HEADER)imageBase)->e_magic))
+	{
+		LONG headerOffset = ((PIMAGE_DOS_HEADER)imageBase)->e_lfanew;
+
+		if ((0 < headerOffset) && ((headerOffset + sizeof(IMAGE_NT_HEADERS64)) <= PAGE_SIZE))
+		{
+			PIMAGE_NT_HEADERS64 ntHeaders = (PIMAGE_NT_HEADERS64)(imageBase + headerOffset);
+
+			if ((IMAGE_NT_SIGNATURE == ntHeaders->Signature) &&
+				(IMAGE_NT_OPTIONAL_HDR64_MAGIC == ntHeaders->OptionalHeader.Magic))
+			{
+				result = ntHeaders;
+			}
+		}
+	}
+
+	return result;
+}
+
+static BOOLEAN isRangeReadable(PUINT8 address, SIZE_T size, BOOLEAN kernelImage)
+{
+	/* Faults on user addresses are caught by the caller, kernel addresses must be resident
+	 * as touching one that is not cannot be recovered from (session images, for example). */
+	BOOLEAN result = TRUE;
+
+	if (TRUE == kernelImage)
+	{
+		for (PUINT8 page = (PUINT8)PAGE_ALIGN(address); (TRUE == result) && (page < (address + size)); page += PAGE_SIZE)
+		{
+			result = MmIsAddressValid(page);
+		}
+	}
+	else
+	{
+		ProbeForRead(address, size, sizeof(UINT8));
+	}
+
+	return result;
+}
+
+static PEXPORT_MODULE findModule(UINT64 nameHash, BOOLEAN kernelImage, UINT32 timeDateStamp, UINT32 sizeOfImage)
+{
+	/* Kernel modules are found by name, user modules by name and build. */
+	PEXPORT_MODULE result = NULL;
+
+	for (ULONG i = 0; i < indexModuleCount; i++)
+	{
+		PEXPORT_MODULE module = &indexModules[i];
+
+		if ((nameHash == module->nameHash) && (kernelImage == (NULL != module->kernelBase)) &&
+			((TRUE == kernelImage) || ((timeDateStamp == module->timeDateStamp) && (sizeOfImage == module->sizeOfImage))))
+		{
+			result = module;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static NTSTATUS lookupExport(PEXPORT_MODULE module, PCSTR exportName, PUINT32 rva)
+{
+	NTSTATUS status = STATUS_NOT_FOUND;
+
+	if (NULL != module->exports)
+	{
+		UINT64 nameHash = hashName(exportName, MAXSIZE_T, FALSE);
+		ULONG slot = (ULONG)nameHash & module->exportMask;
+
+		while (0 != module->exports[slot].nameHash)
+		{
+			if (nameHash == module->exports[slot].nameHash)
+			{
+				if (0 == (module->exports[slot].flags & EXPORT_FLAG_AMBIGUOUS))
+				{
+					*rva = module->exports[slot].rva;
+					status = STATUS_SUCCESS;
+				}
+				else
+				{
+					status = STATUS_OBJECT_NAME_COLLISION;
+				}
+
+				break;
+			}
+
+			slot = (slot + 1) & module->exportMask;
+		}
+	}
+
+	return status;
+}
+
+static UINT64 hashName(PCSTR name, SIZE_T maximumLength, BOOLEAN ignoreCase)
+{
+	/* FNV-1a, 0 is kept free to mark empty slots. */
+	UINT64 result = 0xCBF29CE484222325ULL;
+
+	for (SIZE_T i = 0; (i < maximumLength) && ('\0' != name[i]); i++)
+	{
+		CHAR current = name[i];
+
+		if ((TRUE == ignoreCase) && (current >= 'A') && (current <= 'Z'))
+		{
+			current += 'a' - 'A';
+		}
+
+		result = (result ^ (UINT8)current) * 0x100000001B3ULL;
+	}
+
+	return (0 != result) ? result : 1;
+}
+
+static BOOLEAN copyModuleName(PCSTR fileName, SIZE_T length, PCHAR moduleName)
+{
+	/* Copies the name in lower case, FALSE if it is too long to be indexed. */
+	BOOLEAN result = FALSE;
+
+	if (length < EXPORT_INDEX_MAX_NAME)
+	{
+		for (SIZE_T i = 0; i < length; i++)
+		{
+			CHAR current = fileName[i];
+			moduleName[i] = ((current >= 'A') && (current <= 'Z')) ? (current + ('a' - 'A')) : current;
+		}
+
+		moduleName[length] = '\0';
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static PUINT8 findUserModule(PEPROCESS process, PCSTR moduleName)
+{
+	/* Called attached to the process, returns the base of the loaded (64 bit) module. The
+	 * list is owned by the process, so every read of it is guarded. */
+	PUINT8 result = NULL;
+
+	__try
+	{
+		PPEB peb = PsGetProcessPeb(process);
+		ProbeForRead(peb, sizeof(PEB), sizeof(UINT8));
+
+		PPEB_LDR_DATA loaderData = peb->Ldr;
+		ProbeForRead(loaderData, sizeof(PEB_LDR_DATA), sizeof(UINT8));
+
+		PLIST_ENTRY listHead = &loaderData->InLoadOrderModuleList;
+		PLIST_ENTRY current = listHead->Flink;
+
+		for (ULONG i = 0; (i < MAX_USER_MODULES) && (current != listHead) && (NULL == result); i++)
+		{
+			PLDR_DATA_TABLE_ENTRY loaderEntry = CONTAINING_RECORD(current, LDR_DATA_TABLE_ENTRY, InLoadOrderLinks);
+			ProbeForRead(loaderEntry, sizeof(LDR_DATA_TABLE_ENTRY), sizeof(UINT8));
+
+			UNICODE_STRING baseName = loaderEntry->BaseDllName;
+			ProbeForRead(baseName.Buffer, baseName.Length, sizeof(UINT8));
+
+			/* Module names are ASCII, compare without regard to case. */
+			SIZE_T nameLength = baseName.Length / sizeof(WCHAR);
+			BOOLEAN matches = (nameLength == strlen(moduleName));
+
+			for (SIZE_T j = 0; (TRUE == matches) && (j < nameLength); j++)
+			{
+				WCHAR character = baseName.Buffer[j];
+				if ((character >= L'A') && (character <= L'Z'))
+				{
+					character += L'a' - L'A';
+				}
+
+				matches = (character == (WCHAR)moduleName[j]);
+			}
+
+			if (TRUE == matches)
+			{
+				result = (PUINT8)loaderEntry->DllBase;
+			}
+
+			current = loaderEntry->InLoadOrderLinks.Flink;
+		}
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		result = NULL;
+	}
+
+	return result;
+}
+
+static void loadImageNotify(PUNICODE_STRING fullImageName, HANDLE processId, PIMAGE_INFO imageInfo)
+{
+	/* Called at PASSIVE_LEVEL when an image is mapped, in the context of the process it is
+	 * mapped into. Drivers are mapped with a process ID of 0. */
+	if ((TRUE == indexReady) && (NULL != fullImageName) && (NULL != fullImageName->Buffer))
+	{
+		/* Take the file name from the end of the path, as ASCII. */
+		SIZE_T pathLength = fullImageName->Length / sizeof(WCHAR);
+		SIZE_T nameStart = pathLength;
+
+		while ((0 != nameStart) && (L'\\' != fullImageName->Buffer[nameStart - 1]))
+		{
+			nameStart--;
+		}
+
+		CHAR fileName[EXPORT_INDEX_MAX_NAME];
+		SIZE_T nameLength = pathLength - nameStart;
+		BOOLEAN isASCII = (nameLength < EXPORT_INDEX_MAX_NAME);
+
+		for (SIZE_T i = 0; (TRUE == isASCII) && (i < nameLength); i++)
+		{
+			WCHAR character = fullImageName->Buffer[nameStart + i];
+			isASCII = (character < 0x80);
+			fileName[i] = (CHAR)character;
+		}
+
+		CHAR moduleName[EXPORT_INDEX_MAX_NAME];
+		if ((TRUE == isASCII) && (TRUE == copyModuleName(fileName, nameLength, moduleName)))
+		{
+			ExAcquireFastMutex(&indexLock);
+
+			indexImage((PUINT8)imageInfo->ImageBase, moduleName, (BOOLEAN)(NULL == processId));
+
+			ExReleaseFastMutex(&indexLock);
+		}
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <ntifs.h>
+
+/******************** Public Defines ********************/
+
+/* Modules that can be indexed, kernel modules and distinct user modules combined. */
+#define EXPORT_INDEX_MAX_MODULES 512
+
+/* Longest module file name that is indexed, including the terminator. */
+#define EXPORT_INDEX_MAX_NAME 64
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS ExportIndex_init(void);
+void ExportIndex_uninit(void);
+NTSTATUS ExportIndex_resolveKernel(PCSTR moduleName, PCSTR exportName, PVOID* address);
+NTSTATUS ExportIndex_resolveUser(PEPROCESS process, PCSTR moduleName, PCSTR exportName, PVOID* address);
\ No newline at end of file
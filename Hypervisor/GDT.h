@@ -83,6 +83,24 @@ typedef union _KGDTENTRY64
 	};
 } KGDTENTRY64, *PKGDTENTRY64;
 
+typedef union _KIDTENTRY64
+{
+	struct
+	{
+		UINT16 OffsetLow;
+		UINT16 Selector;
+		UINT16 IstIndex : 3;
+		UINT16 Reserved0 : 5;
+		UINT16 Type : 5;
+		UINT16 Dpl : 2;
+		UINT16 Present : 1;
+		UINT16 OffsetMiddle;
+		UINT32 OffsetHigh;
+		UINT32 Reserved1;
+	};
+	UINT64 Alignment;
+} KIDTENTRY64, *PKIDTENTRY64;
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
@@ -1,3 +1,4 @@
+#include <intrin.h>
 #include "GuestShim.h"
 #include "Debug.h"
 
@@ -40,12 +41,20 @@ typedef enum
 /* Calculates the index of PML4. */
 #define ADDRMASK_PML4_INDEX(_VAR_) (((SIZE_T)_VAR_ & 0xFF8000000000ULL) >> 39)
 
+/* Sizes a translation can be cached at, looked up smallest first. */
+#define TRANSLATION_SIZE_COUNT 3
+
 /******************** Module Variables ********************/
 
+static const UINT64 TRANSLATION_SIZES[TRANSLATION_SIZE_COUNT] = { PAGE_SIZE, SIZE_2MB, SIZE_1GB };
+
 
 /******************** Module Prototypes ********************/
 static HOST_PHYS_ADDRESS getHostPAFromGuestVA(PMM_CONTEXT mmContext, CR3 guestCR3, PVOID guestVA);
 static PT_ENTRY_64 getGuestPTEFromVA(PMM_CONTEXT mmContext, CR3 guestCR3, PVOID guestVA, PT_LEVEL* level);
+static PMM_TRANSLATION lookupTranslation(PMM_CONTEXT mmContext, UINT64 directoryBase, SIZE_T guestVA);
+static void insertTranslation(PMM_CONTEXT mmContext, UINT64 directoryBase, SIZE_T guestVA, UINT64 pageSize, UINT64 pageBase);
+static PMM_TRANSLATION getTranslationSet(PMM_CONTEXT mmContext, SIZE_T guestVA, UINT64 pageSize);
 
 /******************** Public Code ********************/
 HOST_PHYS_ADDRESS GuestShim_GuestUVAToHPA(PMM_CONTEXT mmContext, CR3 userCR3, GUEST_VIRTUAL_ADDRESS guestAddress)
@@ -57,89 +66,145 @@ HOST_PHYS_ADDRESS GuestShim_GuestUVAToHPA(PMM_CONTEXT mmContext, CR3 userCR3, GU
 	return getHostPAFromGuestVA(mmContext, userCR3, (PVOID)guestAddress);
 }
 
+void GuestShim_flushTranslations(PMM_CONTEXT mmContext)
+{
+	/* Drops every cached translation of this logical processor. Called from VMX root,
+	 * where the kernel's memset is not mapped, so the sets are cleared inline. */
+	__stosb((PUCHAR)mmContext->tlb.sets, 0, sizeof(mmContext->tlb.sets));
+	mmContext->tlb.flushes++;
+}
+
+void GuestShim_flushTranslation(PMM_CONTEXT mmContext, GUEST_VIRTUAL_ADDRESS guestAddress)
+{
+	/* Drops the cached translations of the page containing the address, of any page table
+	 * base and any page size, as an INVLPG would. Called from VMX root on an INVLPG exit. */
+	for (ULONG size = 0; size < TRANSLATION_SIZE_COUNT; size++)
+	{
+		PMM_TRANSLATION set = getTranslationSet(mmContext, guestAddress, TRANSLATION_SIZES[size]);
+
+		for (ULONG way = 0; way < MEMMANAGE_TLB_WAYS; way++)
+		{
+			if ((TRANSLATION_SIZES[size] == set[way].pageSize) &&
+				(set[way].virtualPage == (guestAddress & ~(TRANSLATION_SIZES[size] - 1))))
+			{
+				set[way].pageSize = 0;
+				mmContext->tlb.invalidations++;
+			}
+		}
+	}
+}
+
 /******************** Module Code ********************/
 
 static HOST_PHYS_ADDRESS getHostPAFromGuestVA(PMM_CONTEXT mmContext, CR3 guestCR3, PVOID guestVA)
 {
 	HOST_PHYS_ADDRESS result = 0;
+	UINT64 directoryBase = guestCR3.AddressOfPageDirectory * PAGE_SIZE;
 
-	/* Attempt to get the page table entry and level from the guest,
-	 * from that we can calculate where in host physical memory it is.  */
-	PT_LEVEL tableLevel;
-	PT_ENTRY_64 guestEntry = getGuestPTEFromVA(mmContext, guestCR3, guestVA, &tableLevel);
-	if (0 != guestEntry.Flags)
-	{
+	/* The guest only invalidates the tables loaded on this processor here, the translations
+	 * of any other tables could have changed unseen and are walked every time. */
+	CR3 currentCR3;
+	__vmx_vmread(VMCS_GUEST_CR3, &currentCR3.Flags);
+
+	BOOLEAN cacheable = (guestCR3.AddressOfPageDirectory == currentCR3.AddressOfPageDirectory);
 
-		/* Check to see which level we retrieved from the guest mapping table. */
-		switch (tableLevel)
+	PMM_TRANSLATION translation = (TRUE == cacheable) ? lookupTranslation(mmContext, directoryBase, (SIZE_T)guestVA) : NULL;
+	if (NULL != translation)
+	{
+		result = translation->pageBase + ((SIZE_T)guestVA & (translation->pageSize - 1));
+	}
+	else
+	{
+		/* Attempt to get the page table entry and level from the guest,
+		 * from that we can calculate where in host physical memory it is.  */
+		PT_LEVEL tableLevel;
+		UINT64 pageSize = 0;
+		PT_ENTRY_64 guestEntry = getGuestPTEFromVA(mmContext, guestCR3, guestVA, &tableLevel);
+		if (0 != guestEntry.Flags)
 		{
-			case PT_LEVEL_PML4E:
-			{
-				/* Something went wrong, there should never be a PML4E
-				 * and no entries below. */
-				DbgBreakPoint();
-				break;
-			}
 
-			case PT_LEVEL_PDPTE:
+			/* Check to see which level we retrieved from the guest mapping table. */
+			switch (tableLevel)
 			{
-				/* If it is present it must mean below is a 1GB large page
-				 * as such we calculate where our address would be. */
-				PDPTE_1GB_64 guestPDPTE;
-				guestPDPTE.Flags = guestEntry.Flags;
-				if (TRUE == guestPDPTE.Present)
+				case PT_LEVEL_PML4E:
+				{
+					/* Something went wrong, there should never be a PML4E
+					 * and no entries below. The address is treated as not present. */
+					break;
+				}
+
+				case PT_LEVEL_PDPTE:
 				{
-					/* Calculate the base of where the page begins. */
-					result = (guestPDPTE.PageFrameNumber * SIZE_1GB);
+					/* If it is present it must mean below is a 1GB large page
+					 * as such we calculate where our address would be. */
+					PDPTE_1GB_64 guestPDPTE;
+					guestPDPTE.Flags = guestEntry.Flags;
+					if (TRUE == guestPDPTE.Present)
+					{
+						/* Calculate the base of where the page begins. */
+						result = (guestPDPTE.PageFrameNumber * SIZE_1GB);
 
-					/* Add the offset from the VA. */
-					/* TODO: Verify this is how offset calc should work on large pages. */
-					result += ADDRMASK_PML3_OFFSET(guestVA);
+						/* Add the offset from the VA. */
+						/* TODO: Verify this is how offset calc should work on large pages. */
+						result += ADDRMASK_PML3_OFFSET(guestVA);
+						pageSize = SIZE_1GB;
+					}
+					break;
 				}
-				break;
-			}
 
-			case PT_LEVEL_PDE:
-			{
-				/* If it is present it must mean below is a 2MB large page
-				 * as such we calculate where our address would be. */
-				PDE_2MB_64 guestPDE;
-				guestPDE.Flags = guestEntry.Flags;
-				if (TRUE == guestPDE.Present)
+				case PT_LEVEL_PDE:
 				{
-					/* Calculate the base of where the page is. */
-					result = (guestPDE.PageFrameNumber * SIZE_2MB);
+					/* If it is present it must mean below is a 2MB large page
+					 * as such we calculate where our address would be. */
+					PDE_2MB_64 guestPDE;
+					guestPDE.Flags = guestEntry.Flags;
+					if (TRUE == guestPDE.Present)
+					{
+						/* Calculate the base of where the page is. */
+						result = (guestPDE.PageFrameNumber * SIZE_2MB);
 
-					/* Add the offset from the VA. */
-					result += ADDRMASK_PML2_OFFSET(guestVA);
+						/* Add the offset from the VA. */
+						result += ADDRMASK_PML2_OFFSET(guestVA);
+						pageSize = SIZE_2MB;
+					}
+					break;
 				}
-				break;
-			}
 
-			case PT_LEVEL_PTE:
-			{
-				/* If it is present, this is a 4KB page. */
-				PTE_64 guestPTE;
-				guestPTE.Flags = guestEntry.Flags;
-				if (TRUE == guestPTE.Present)
+				case PT_LEVEL_PTE:
 				{
-					/* Calculate the base of where the page is. */
-					result = (guestPTE.PageFrameNumber * PAGE_SIZE);
+					/* If it is present, this is a 4KB page. */
+					PTE_64 guestPTE;
+					guestPTE.Flags = guestEntry.Flags;
+					if (TRUE == guestPTE.Present)
+					{
+						/* Calculate the base of where the page is. */
+						result = (guestPTE.PageFrameNumber * PAGE_SIZE);
 
-					/* Add the offset from the VA. */
-					result += ADDRMASK_PML1_OFFSET(guestVA);
+						/* Add the offset from the VA. */
+						result += ADDRMASK_PML1_OFFSET(guestVA);
+						pageSize = PAGE_SIZE;
+					}
+					break;
 				}
-				break;
-			}
 
-			default:
-			{
-				/* Something went wrong. */
-				DbgBreakPoint();
-				break;
+				default:
+				{
+					/* Something went wrong, the address is treated as not present. */
+					break;
+				}
 			}
+
 		}
 
+		/* Keep the translation for the next access to the page. */
+		if ((TRUE == cacheable) && (0 != pageSize))
+		{
+			insertTranslation(mmContext, directoryBase, (SIZE_T)guestVA, pageSize, result & ~(pageSize - 1));
+		}
+		else if (FALSE == cacheable)
+		{
+			mmContext->tlb.misses++;
+		}
 	}
 
 	return result;
@@ -234,3 +299,80 @@ static PT_ENTRY_64 getGuestPTEFromVA(PMM_CONTEXT mmContext, CR3 guestCR3, PVOID
 	return result;
 }
 
+static PMM_TRANSLATION lookupTranslation(PMM_CONTEXT mmContext, UINT64 directoryBase, SIZE_T guestVA)
+{
+	/* Returns the cached translation of the address, which is trusted without reading the tables
+	 * again. Like the TLB, the cache relies on the guest invalidating what it changes: INVLPG and
+	 * INVPCID exit, as do a MOV CR3 that flushes and a CR4.PGE toggle, and each drops what the
+	 * instruction would have dropped from the TLB. */
+	PMM_TLB tlb = &mmContext->tlb;
+	PMM_TRANSLATION result = NULL;
+
+	for (ULONG size = 0; (NULL == result) && (size < TRANSLATION_SIZE_COUNT); size++)
+	{
+		PMM_TRANSLATION set = getTranslationSet(mmContext, guestVA, TRANSLATION_SIZES[size]);
+		UINT64 virtualPage = guestVA & ~(TRANSLATION_SIZES[size] - 1);
+
+		for (ULONG way = 0; way < MEMMANAGE_TLB_WAYS; way++)
+		{
+			PMM_TRANSLATION translation = &set[way];
+
+			if ((TRANSLATION_SIZES[size] == translation->pageSize) &&
+				(virtualPage == translation->virtualPage) &&
+				(directoryBase == translation->directoryBase))
+			{
+				translation->lastUse = ++tlb->accessCount;
+				result = translation;
+				break;
+			}
+		}
+	}
+
+	if (NULL != result)
+	{
+		tlb->hits++;
+	}
+	else
+	{
+		tlb->misses++;
+	}
+
+	return result;
+}
+
+static void insertTranslation(PMM_CONTEXT mmContext, UINT64 directoryBase, SIZE_T guestVA, UINT64 pageSize, UINT64 pageBase)
+{
+	/* Takes an unused way of the set, otherwise the one used longest ago. */
+	PMM_TRANSLATION set = getTranslationSet(mmContext, guestVA, pageSize);
+	ULONG wayIndex = 0;
+
+	for (ULONG way = 0; way < MEMMANAGE_TLB_WAYS; way++)
+	{
+		if (0 == set[way].pageSize)
+		{
+			wayIndex = way;
+			break;
+		}
+
+		if (set[way].lastUse < set[wayIndex].lastUse)
+		{
+			wayIndex = way;
+		}
+	}
+
+	PMM_TRANSLATION translation = &set[wayIndex];
+	translation->directoryBase = directoryBase;
+	translation->virtualPage = guestVA & ~(pageSize - 1);
+	translation->pageSize = pageSize;
+	translation->pageBase = pageBase;
+	translation->lastUse = ++mmContext->tlb.accessCount;
+}
+
+static PMM_TRANSLATION getTranslationSet(PMM_CONTEXT mmContext, SIZE_T guestVA, UINT64 pageSize)
+{
+	/* The set is chosen by the virtual page number at the size of the page alone, so an
+	 * address can be invalidated without knowing which page table base mapped it. */
+	UINT64 pageNumber = guestVA / pageSize;
+
+	return mmContext->tlb.sets[(pageNumber ^ (pageSize >> 12)) % MEMMANAGE_TLB_SETS];
+}
@@ -11,3 +11,5 @@
 
 /******************** Public Prototypes ********************/
 HOST_PHYS_ADDRESS GuestShim_GuestUVAToHPA(PMM_CONTEXT mmContext, CR3 userCR3, GUEST_VIRTUAL_ADDRESS guestAddress);
+void GuestShim_flushTranslations(PMM_CONTEXT mmContext);
+void GuestShim_flushTranslation(PMM_CONTEXT mmContext, GUEST_VIRTUAL_ADDRESS guestAddress);
\ No newline at end of file
@@ -2,7 +2,8 @@
 
 	extern Handlers_hostToGuest:proc
     extern Handlers_guestToHost:proc
-    extern RtlCaptureContext:proc
+    extern _CaptureContext:proc
+    extern Handlers_hostNmi:proc
 
 	; Called when the transition to GUEST takes place. Assembly used for easy breakpointing.
 	HandlerShim_hostToGuest PROC
@@ -21,7 +22,8 @@
     push    rcx							; save the RCX register, which we spill below
     lea     rcx, [rsp+8h]				; store the context in the stack, bias for
 										; the return address and the push we just did.
-    call    RtlCaptureContext			; save the current register state.
+    call    _CaptureContext				; save the current register state, the kernel's
+										; RtlCaptureContext is not mapped in the host.
 										; note that this is a specially written function
 										; which has the following key characteristics:
 										;   1) it does not taint the value of RCX
@@ -45,4 +47,61 @@
 
 	HandlerShim_VMCALL ENDP
 
+	; Host IDT handler for vector 2 (NMI), taken on the hypervisor stack while in VMX root.
+	; The host never runs with a user mode CS so GS is left alone. The C handler only
+	; queues the NMI for the guest, it is delivered on the next VM entry.
+	HandlerShim_hostNmi PROC
+
+	push    rax
+	push    rcx
+	push    rdx
+	push    r8
+	push    r9
+	push    r10
+	push    r11
+	push    rbp
+	mov     rbp, rsp
+	and     rsp, -10h					; align the stack for the XMM spills and the call
+	sub     rsp, 80h					; home space plus the volatile XMM registers
+	movaps  [rsp+20h], xmm0
+	movaps  [rsp+30h], xmm1
+	movaps  [rsp+40h], xmm2
+	movaps  [rsp+50h], xmm3
+	movaps  [rsp+60h], xmm4
+	movaps  [rsp+70h], xmm5
+
+	mov     rcx, rbp					; any address within the hypervisor stack
+	call    Handlers_hostNmi
+
+	movaps  xmm0, [rsp+20h]
+	movaps  xmm1, [rsp+30h]
+	movaps  xmm2, [rsp+40h]
+	movaps  xmm3, [rsp+50h]
+	movaps  xmm4, [rsp+60h]
+	movaps  xmm5, [rsp+70h]
+	mov     rsp, rbp
+	pop     rbp
+	pop     r11
+	pop     r10
+	pop     r9
+	pop     r8
+	pop     rdx
+	pop     rcx
+	pop     rax
+	iretq
+
+	HandlerShim_hostNmi ENDP
+
+	; Host IDT handler for every other vector. Interrupts are masked in VMX root, so this is
+	; only reached by an exception in the hypervisor itself. The kernel (and its bugcheck) is
+	; not mapped in the host, the processor is stopped where a debugger can find it.
+	HandlerShim_hostFault PROC
+
+@@:
+	cli
+	hlt
+	jmp     @b
+
+	HandlerShim_hostFault ENDP
+
     end
\ No newline at end of file
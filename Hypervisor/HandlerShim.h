@@ -15,4 +15,6 @@
 
 void HandlerShim_hostToGuest(void);
 void HandlerShim_guestToHost(void);
-NTSTATUS HandlerShim_VMCALL(UINT64 key, void* params);
\ No newline at end of file
+NTSTATUS HandlerShim_VMCALL(UINT64 key, void* params);
+void HandlerShim_hostNmi(void);
+void HandlerShim_hostFault(void);
\ No newline at end of file
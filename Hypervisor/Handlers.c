@@ -7,6 +7,8 @@
 #include "CPUID.h"
 #include "VMCALL.h"
 #include "VMShadow.h"
+#include "GuestShim.h"
+#include "PageTable.h"
 #include "Debug.h"
 
 /******************** External API ********************/
@@ -28,6 +30,7 @@ SIZE_T monitoredRangeEnd = 0;
 static void handleExitReason(PVMM_DATA lpData);
 static void incrementRIP(void);
 static void indicateVMXFail(void);
+static void setNmiWindowExiting(BOOLEAN enabled);
 
 /******************** Public Code ********************/
 
@@ -54,7 +57,7 @@ DECLSPEC_NORETURN VOID Handlers_hostToGuest(void)
 
 DECLSPEC_NORETURN VOID Handlers_guestToHost(PCONTEXT guestContext)
 {
-	/* Because we had to use RCX when calling RtlCaptureContext, its value
+	/* Because we had to use RCX when calling _CaptureContext, its value
 	* was actually pushed on the stack right before the call.
 	* We find the bogus value we set to RCX to and overwrite it with what was originally there. */
 	guestContext->Rcx = *(UINT64*)((uintptr_t)guestContext - sizeof(guestContext->Rcx));
@@ -62,12 +65,24 @@ DECLSPEC_NORETURN VOID Handlers_guestToHost(PCONTEXT guestContext)
 	/* Find the LP_DATA structure by using the context variable that was passed in (technically the stack). */
 	PVMM_DATA lpData = (VOID*)((uintptr_t)(guestContext + 1) - KERNEL_STACK_SIZE);
 
-	/* Copy the guest context into our LP data structure. */
-	RtlCopyMemory(&lpData->guestContext, guestContext, sizeof(CONTEXT));
+	/* Drop cached host translations if the guest has changed the host tables since the last exit. */
+	PageTable_refreshHost(&lpData->hostGeneration);
+
+	/* Copy the guest context into our LP data structure. The kernel's memcpy is not
+	 * mapped in the host, so the copy is done inline. */
+	__movsb((PUCHAR)&lpData->guestContext, (const UCHAR*)guestContext, sizeof(CONTEXT));
 
 	/* Handle the exit reason. */
 	handleExitReason(lpData);
 
+	/* An NMI taken in VMX root may have had its window request overwritten while the exit was
+	 * handled, request it again. Once cleared, a later NMI requests the window itself. */
+	if (TRUE == lpData->nmiPending)
+	{
+		setNmiWindowExiting(TRUE);
+		lpData->nmiPending = FALSE;
+	}
+
 	/* Now to restore back to the guest. */
 
 	/* In the assembly stub code there was a PUSH RCX instruction we used,
@@ -94,6 +109,35 @@ DECLSPEC_NORETURN void Handlers_VMResume(void)
 	__vmx_vmresume();
 }
 
+VOID Handlers_hostNmi(UINT64 stackPointer)
+{
+	/* Called from the host IDT (vector 2) when an NMI arrives in VMX root. NMIs belong to the
+	 * guest kernel, so it is injected once the guest can take one. Without virtual NMIs the
+	 * NMI window cannot be used and the NMI is dropped. */
+	PVMM_DATA lpData = NULL;
+
+	/* The handler runs on the hypervisor stack of the processor. */
+	for (ULONG i = 0; (NULL == lpData) && (i < MAX_LOGICAL_PROCESSORS); i++)
+	{
+		PVMM_DATA processorData = VMM_getProcessorData(i);
+
+		if ((NULL != processorData) && (stackPointer >= (UINT64)processorData->hypervisorStack) &&
+			(stackPointer < ((UINT64)processorData->hypervisorStack + KERNEL_STACK_SIZE)))
+		{
+			lpData = processorData;
+		}
+	}
+
+	size_t pinControls;
+	__vmx_vmread(VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, &pinControls);
+
+	if ((NULL != lpData) && (0 != (pinControls & IA32_VMX_PINBASED_CTLS_VIRTUAL_NMI_FLAG)))
+	{
+		lpData->nmiPending = TRUE;
+		setNmiWindowExiting(TRUE);
+	}
+}
+
 /******************** Module Code ********************/
 
 static void handleExitReason(PVMM_DATA lpData)
@@ -132,33 +176,54 @@ static void handleExitReason(PVMM_DATA lpData)
 
 	switch (exitReason)
 	{
-		case VMX_EXIT_REASON_MONITOR_TRAP_FLAG:
+		case VMX_EXIT_REASON_EXCEPTION_OR_NMI:
 		{
-			if (TRUE == MTF_handleTrap(&lpData->mtfConfig))
-			{
-				/* Do nothing. */
-			}
-			else
-			{
-				DbgBreakPoint();
-			}
+			/* The exception bitmap is empty, so only NMIs exit. The NMI is injected as soon
+			 * as the guest is able to take one. */
+			setNmiWindowExiting(TRUE);
+			break;
+		}
 
+		case VMX_EXIT_REASON_NMI_WINDOW:
+		{
+			/* The guest can take the NMI that was queued. */
+			setNmiWindowExiting(FALSE);
+
+			VMENTRY_INTERRUPT_INFORMATION interruptInfo = { 0 };
+			interruptInfo.Vector = Nmi;
+			interruptInfo.InterruptionType = NonMaskableInterrupt;
+			interruptInfo.DeliverErrorCode = FALSE;
+			interruptInfo.Valid = TRUE;
+			__vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interruptInfo.Flags);
+			break;
+		}
+
+		case VMX_EXIT_REASON_MONITOR_TRAP_FLAG:
+		{
+			/* A trap no handler claims is left alone, the guest simply continues. The kernel
+			 * (and its debugger) cannot be called from VMX root. */
+			MTF_handleTrap(&lpData->mtfConfig);
 			break;
 		}
 
 		case VMX_EXIT_REASON_EPT_VIOLATION:
 		{
-			if (TRUE == EPT_handleViolation(&lpData->eptConfig, &lpData->guestContext))
-			{
-				/* If we have handled the violation properly, we don't want to move to the next instruction,
-				* We want to try process the instruction again, now that the page has been switched. */
-				moveToNextInstruction = FALSE;
-			}
-			else
+			/* With virtual NMIs, a violation during an IRET of the guest that unblocked NMIs has
+			 * to block them again, as the IRET is executed again. */
+			VMX_EXIT_QUALIFICATION_EPT_VIOLATION qualification;
+			__vmx_vmread(VMCS_EXIT_QUALIFICATION, &qualification.Flags);
+
+			if (TRUE == qualification.NmiUnblocking)
 			{
-				DbgBreakPoint();
+				size_t guestIS;
+				__vmx_vmread(VMCS_GUEST_INTERRUPTIBILITY_STATE, &guestIS);
+				__vmx_vmwrite(VMCS_GUEST_INTERRUPTIBILITY_STATE, guestIS | VMX_INTERRUPTIBILITY_STATE_BLOCKING_BY_NMI_FLAG);
 			}
 
+			/* Whether or not it was handled, we don't want to move to the next instruction,
+			 * We want to try process the instruction again, now that the page has been switched. */
+			EPT_handleViolation(&lpData->eptConfig, &lpData->guestContext);
+			moveToNextInstruction = FALSE;
 			break;
 		}
 
@@ -177,6 +242,36 @@ static void handleExitReason(PVMM_DATA lpData)
 			break;
 		}
 
+		case VMX_EXIT_REASON_EXECUTE_INVLPG:
+		{
+			/* INVLPG exiting is enabled, the qualification is the linear address.
+			 * INVVPID of the address covers every PCID, which is more than INVLPG needs to. */
+			size_t linearAddress;
+			__vmx_vmread(VMCS_EXIT_QUALIFICATION, &linearAddress);
+
+			INVVPID_DESCRIPTOR descriptor = { 0 };
+			descriptor.Vpid = 1;
+			descriptor.LinearAddress = linearAddress;
+			__invvpid(InvvpidIndividualAddress, &descriptor);
+
+			GuestShim_flushTranslation(&lpData->mmContext, linearAddress);
+			moveToNextInstruction = TRUE;
+			break;
+		}
+
+		case VMX_EXIT_REASON_EXECUTE_INVPCID:
+		{
+			/* Exits as INVLPG exiting is enabled. Rather than decoding the descriptor,
+			 * every INVPCID type is emulated by invalidating the whole VPID, globals included. */
+			INVVPID_DESCRIPTOR descriptor = { 0 };
+			descriptor.Vpid = 1;
+			__invvpid(InvvpidSingleContext, &descriptor);
+
+			GuestShim_flushTranslations(&lpData->mmContext);
+			moveToNextInstruction = TRUE;
+			break;
+		}
+
 		case VMX_EXIT_REASON_EXECUTE_XSETBV:
 		{
 			_xsetbv((UINT32)lpData->guestContext.Rcx, lpData->guestContext.Rdx << 32 | lpData->guestContext.Rax);
@@ -249,12 +344,7 @@ static void handleExitReason(PVMM_DATA lpData)
 
 		default:
 		{
-			if (FALSE == KD_DEBUGGER_NOT_PRESENT)
-			{
-				DbgBreakPoint();
-			}
-
-			DEBUG_PRINT("Unhandled VMExit with reason: 0x%I64X\r\n", exitReason);
+			/* Every other exit is one we never enable. */
 			break;
 		}
 	}
@@ -339,3 +429,21 @@ static void indicateVMXFail(void)
 	/* Set the EFLAGS in the VMCS with the updated field. */
 	//__vmx_vmwrite(VMCS_GUEST_RFLAGS, guestFlags);
 }
+
+static void setNmiWindowExiting(BOOLEAN enabled)
+{
+	/* While set, the guest exits as soon as it is able to take an NMI. */
+	size_t controls;
+	__vmx_vmread(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, &controls);
+
+	if (TRUE == enabled)
+	{
+		controls |= IA32_VMX_PROCBASED_CTLS_NMI_WINDOW_EXITING_FLAG;
+	}
+	else
+	{
+		controls &= ~(size_t)IA32_VMX_PROCBASED_CTLS_NMI_WINDOW_EXITING_FLAG;
+	}
+
+	__vmx_vmwrite(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, controls);
+}
@@ -14,3 +14,4 @@
 DECLSPEC_NORETURN VOID Handlers_hostToGuest(void);
 DECLSPEC_NORETURN VOID Handlers_guestToHost(PCONTEXT guestContext);
 DECLSPEC_NORETURN void Handlers_VMResume(void);
+VOID Handlers_hostNmi(UINT64 stackPointer);
@@ -3,6 +3,11 @@
 #include "Hypervisor.h"
 #include "PageTable.h"
 #include "VMM.h"
+#include "VMSync.h"
+#include "VMShadow.h"
+#include "VMHook.h"
+#include "VMUserHook.h"
+#include "ExportIndex.h"
 #include "Debug.h"
 #include "ia32.h"
 
@@ -13,7 +18,7 @@
 
 
 /******************** Module Constants ********************/
-#define MAX_LOGICAL_PROCESSORS 64
+
 
 /******************** Module Variables ********************/
 
@@ -21,6 +26,7 @@
 static VMM_DATA vmmData[MAX_LOGICAL_PROCESSORS] = { 0 };
 
 /******************** Module Prototypes ********************/
+static NTSTATUS launchHypervisor(CR3 hostCR3);
 static ULONG_PTR logicalProcessorInit(ULONG_PTR argument);
 static NTSTATUS isHVSupported(void);
 
@@ -32,6 +38,9 @@ NTSTATUS Hypervisor_init(void)
 	 * instrospection of it (as a guest) can take place. */
 	NTSTATUS status;
 
+	/* Holds the CR3/PML4 entry that our HOST (when we are VMX root) will use. */
+	CR3 hostCR3 = { .Flags = 0 };
+
 	//if (FALSE == KD_DEBUGGER_NOT_PRESENT)
 	//{
 	//	DbgBreakPoint();
@@ -40,21 +49,50 @@ NTSTATUS Hypervisor_init(void)
 	status = isHVSupported();
 	if (NT_SUCCESS(status))
 	{
-		/* Holds the CR3/PML4 entry that our HOST (when we are VMX root) will use. */
+		/* The host page tables come first, the other modules map the pool VMX root uses into them. */
 		CR3 originalCR3;
-		CR3 vmCR3;
 		originalCR3.Flags = __readcr3();
 
-		status = PageTable_init(originalCR3, &vmCR3);
+		status = PageTable_init(originalCR3, &hostCR3);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Runtime EPT edits are broadcast to every processor through VMSync. */
+		VMSync_init();
+
+		/* Shadow state that can only be set up at PASSIVE_LEVEL (execute page slab, process exit notification). */
+		status = VMShadow_initGlobal();
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* User hooks must be released before the address space of an exiting process is torn down. */
+		status = VMUserHook_initGlobal();
+
 		if (NT_SUCCESS(status))
 		{
+			/* Exports of the loaded modules are indexed once, so hooks can be installed by name.
+			 * Without the index only installing by name is refused (STATUS_DEVICE_NOT_READY). */
+			NTSTATUS indexStatus = ExportIndex_init();
+			if (!NT_SUCCESS(indexStatus))
+			{
+				DEBUG_PRINT("Unable to index the module exports: 0x%X\r\n", indexStatus);
+			}
 
-			/* We need to notify each logical processor to start the hypervisor.
-			 * This is done using using a IPI.
-			 *
-			 * TODO: IPI result only returns callee processors status
-			 *		 We are discarding other X logical processors results, need to fix this. */
-			status = (NTSTATUS)KeIpiGenericCall(logicalProcessorInit, (ULONG_PTR)vmCR3.Flags);
+			status = launchHypervisor(hostCR3);
+
+			if (!NT_SUCCESS(status))
+			{
+				ExportIndex_uninit();
+				VMUserHook_uninitGlobal();
+			}
+		}
+
+		/* The consumer is unloaded when we fail, nothing registered may outlive it. */
+		if (!NT_SUCCESS(status))
+		{
+			VMShadow_uninitGlobal();
 		}
 	}
 
@@ -63,6 +101,25 @@ NTSTATUS Hypervisor_init(void)
 
 /******************** Module Code ********************/
 
+static NTSTATUS launchHypervisor(CR3 hostCR3)
+{
+	/* Queued hooks are built once here, the processors only install them. Hooks that
+	 * cannot be prepared are skipped, they don't prevent the hypervisor from starting,
+	 * but the host not being able to reach the hooks does. */
+	NTSTATUS status = VMHook_prepare();
+	if (NT_SUCCESS(status))
+	{
+		/* We need to notify each logical processor to start the hypervisor.
+		 * This is done using using a IPI.
+		 *
+		 * TODO: IPI result only returns callee processors status
+		 *		 We are discarding other X logical processors results, need to fix this. */
+		status = (NTSTATUS)KeIpiGenericCall(logicalProcessorInit, (ULONG_PTR)hostCR3.Flags);
+	}
+
+	return status;
+}
+
 static ULONG_PTR logicalProcessorInit(ULONG_PTR argument)
 {
 	/* Re-cast the argument back to the correct type so we
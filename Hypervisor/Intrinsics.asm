@@ -22,6 +22,61 @@ include ksamd64.inc
 		ret
 	LEAF_END __invvpid, _TEXT$00
 
+    LEAF_ENTRY _CaptureContext, _TEXT$00
+        mov     CxRax[rcx], rax     ;
+        mov     CxRcx[rcx], rcx     ;
+        mov     CxRdx[rcx], rdx     ;
+        mov     CxR8[rcx], r8       ; Save volatile registers
+        mov     CxR9[rcx], r9       ;
+        mov     CxR10[rcx], r10     ;
+        mov     CxR11[rcx], r11     ;
+
+        mov     CxRbx[rcx], rbx     ;
+        mov     CxRsi[rcx], rsi     ;
+        mov     CxRdi[rcx], rdi     ;
+        mov     CxRbp[rcx], rbp     ; Save non volatile registers
+        mov     CxR12[rcx], r12     ;
+        mov     CxR13[rcx], r13     ;
+        mov     CxR14[rcx], r14     ;
+        mov     CxR15[rcx], r15     ;
+
+        movaps  CxXmm0[rcx], xmm0   ;
+        movaps  CxXmm1[rcx], xmm1   ;
+        movaps  CxXmm2[rcx], xmm2   ;
+        movaps  CxXmm3[rcx], xmm3   ;
+        movaps  CxXmm4[rcx], xmm4   ;
+        movaps  CxXmm5[rcx], xmm5   ;
+        movaps  CxXmm6[rcx], xmm6   ; Save all XMM registers
+        movaps  CxXmm7[rcx], xmm7   ;
+        movaps  CxXmm8[rcx], xmm8   ;
+        movaps  CxXmm9[rcx], xmm9   ;
+        movaps  CxXmm10[rcx], xmm10 ;
+        movaps  CxXmm11[rcx], xmm11 ;
+        movaps  CxXmm12[rcx], xmm12 ;
+        movaps  CxXmm13[rcx], xmm13 ;
+        movaps  CxXmm14[rcx], xmm14 ;
+        movaps  CxXmm15[rcx], xmm15 ;
+        stmxcsr CxMxCsr[rcx]        ;
+
+        mov     CxSegCs[rcx], cs    ;
+        mov     CxSegDs[rcx], ds    ;
+        mov     CxSegEs[rcx], es    ; Save segment selectors
+        mov     CxSegFs[rcx], fs    ;
+        mov     CxSegGs[rcx], gs    ;
+        mov     CxSegSs[rcx], ss    ;
+
+        pushfq                      ; Save RFLAGS, nothing above changes them
+        pop     rax                 ;
+        mov     CxEFlags[rcx], eax  ;
+        mov     rax, [rsp]          ; Caller's RIP is the return address
+        mov     CxRip[rcx], rax     ;
+        lea     rax, [rsp+8h]       ; Caller's RSP is above the return address
+        mov     CxRsp[rcx], rax     ;
+        mov     dword ptr CxContextFlags[rcx], CONTEXT_FULL or CONTEXT_SEGMENTS
+        mov     rax, CxRax[rcx]     ; Restore RAX since we spilled it
+        ret                         ;
+    LEAF_END _CaptureContext, _TEXT$00
+
     LEAF_ENTRY _RestoreContext, _TEXT$00
         movaps  xmm0, CxXmm0[rcx]   ;
         movaps  xmm1, CxXmm1[rcx]   ;
@@ -15,6 +15,14 @@ VOID _sldt(_In_ UINT16* Ldtr);
 VOID __invept(INVEPT_TYPE Type, INVEPT_DESCRIPTOR* Descriptor);
 VOID __invvpid(INVVPID_TYPE Type, INVVPID_DESCRIPTOR* Descriptor);
 
+/* Same as RtlCaptureContext, but part of the hypervisor image so it can be used from VMX root.
+ * RCX is not tainted and no home space is expected. */
+VOID
+__cdecl
+_CaptureContext(
+	_Out_ PCONTEXT ContextRecord
+);
+
 DECLSPEC_NORETURN
 VOID
 __cdecl
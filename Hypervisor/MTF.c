@@ -9,21 +9,6 @@
 
 /******************** Module Typedefs ********************/
 
-typedef struct _MTF_HANDLER
-{
-	/* Start/End addresses of the range monitored. */
-	PUINT8 rangeStart;
-	PUINT8 rangeEnd;
-
-	/* Callback of the handler, that will be called for processing the trap. */
-	fnMTFHandlerCallback callback;
-
-	/* Buffer that can be used for user-supplied configs. */
-	PVOID userParameter;
-
-	/* Linked list entry, used for traversal. */
-	LIST_ENTRY listEntry;
-} MTF_HANDLER, *PMTF_HANDLER;
 
 /******************** Module Constants ********************/
 
@@ -43,7 +28,7 @@ void MTF_initialise(PMTF_CONFIG mtfConfig)
 	 * 
 	 * This is so we can keep track of any MTF handlers are ran at runtime
 	 * before MTF tracing is enabled. */
-	InitializeListHead(&mtfConfig->handlerList);
+	mtfConfig->handlerCount = 0;
 }
 
 BOOLEAN MTF_handleTrap(PMTF_CONFIG mtfConfig)
@@ -55,19 +40,21 @@ BOOLEAN MTF_handleTrap(PMTF_CONFIG mtfConfig)
 	SIZE_T guestRIP;
 	__vmx_vmread(VMCS_GUEST_RIP, &guestRIP);
 
-	/* Search the list of MTF handler and determine which one to call. */
-	for (PLIST_ENTRY currentEntry = mtfConfig->handlerList.Flink;
-		currentEntry != &mtfConfig->handlerList;
-		currentEntry = currentEntry->Flink)
+	/* Offer the trap to every handler covering the guest RIP, the most recently added first.
+	 * A handler returning FALSE did not expect the trap. One instruction can be stepped for
+	 * several handlers at once (a watched page and a shadow), so each of them completes its step. */
+	for (ULONG i = mtfConfig->handlerCount; i > 0; i--)
 	{
 		/* Get the handler structure. */
-		PMTF_HANDLER mtfHandler = CONTAINING_RECORD(currentEntry, MTF_HANDLER, listEntry);
+		PMTF_HANDLER mtfHandler = &mtfConfig->handlers[i - 1];
 
 		/* Check to see if the guest RIP is within these bounds. */
 		if ((guestRIP >= (SIZE_T)mtfHandler->rangeStart) && (guestRIP <= (SIZE_T)mtfHandler->rangeEnd))
 		{
-			result = mtfHandler->callback(mtfConfig, mtfHandler->userParameter);
-			break;
+			if (TRUE == mtfHandler->callback(mtfConfig, mtfHandler->userParameter))
+			{
+				result = TRUE;
+			}
 		}
 	}
 
@@ -80,16 +67,15 @@ NTSTATUS MTF_addHandler(PMTF_CONFIG mtfConfig, PUINT8 rangeStart, PUINT8 rangeEn
 
 	if (NULL != callback)
 	{
-		PMTF_HANDLER newHandler = (PMTF_HANDLER)ExAllocatePool(NonPagedPoolNx, sizeof(MTF_HANDLER));
-		if (NULL != newHandler)
+		if (mtfConfig->handlerCount < MTF_MAX_HANDLERS)
 		{
+			PMTF_HANDLER newHandler = &mtfConfig->handlers[mtfConfig->handlerCount];
 			newHandler->rangeStart = rangeStart;
 			newHandler->rangeEnd = rangeEnd;
 			newHandler->callback = callback;
 			newHandler->userParameter = userParameter;
 
-			/* Add this structure to the linked list of already existing handlers. */
-			InsertHeadList(&mtfConfig->handlerList, &newHandler->listEntry);
+			mtfConfig->handlerCount++;
 			status = STATUS_SUCCESS;
 		}
 		else
@@ -113,18 +99,18 @@ NTSTATUS MTF_removeHandler(PMTF_CONFIG mtfConfig, fnMTFHandlerCallback callback)
 	{
 		status = STATUS_UNSUCCESSFUL;
 
-		/* Search the list of MTF handler and determine which one to remove. */
-		for (PLIST_ENTRY currentEntry = mtfConfig->handlerList.Flink;
-			currentEntry != &mtfConfig->handlerList;
-			currentEntry = currentEntry->Flink)
+		/* Search the MTF handlers and determine which one to remove. */
+		for (ULONG i = 0; i < mtfConfig->handlerCount; i++)
 		{
-			/* Get the handler structure. */
-			PMTF_HANDLER mtfHandler = CONTAINING_RECORD(currentEntry, MTF_HANDLER, listEntry);
-
-			/* Check to see if the guest RIP is within these bounds. */
-			if (callback == mtfHandler->callback)
+			if (callback == mtfConfig->handlers[i].callback)
 			{
-				RemoveEntryList(currentEntry);
+				/* Keep the remaining handlers in the order they were added. */
+				for (ULONG j = i + 1; j < mtfConfig->handlerCount; j++)
+				{
+					mtfConfig->handlers[j - 1] = mtfConfig->handlers[j];
+				}
+
+				mtfConfig->handlerCount--;
 				status = STATUS_SUCCESS;
 				break;
 			}
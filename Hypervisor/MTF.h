@@ -1,18 +1,39 @@
 #pragma once
 #include <wdm.h>
 
-/******************** Public Typedefs ********************/
+/******************** Public Defines ********************/
 
-typedef struct _MTF_CONFIG
-{
-	/* List of all MTF handlers that are used. */
-	LIST_ENTRY handlerList;
+/* Handlers each processor can hold, they are added before launch. */
+#define MTF_MAX_HANDLERS 8
 
-} MTF_CONFIG, *PMTF_CONFIG;
+/******************** Public Typedefs ********************/
+
+typedef struct _MTF_CONFIG MTF_CONFIG, *PMTF_CONFIG;
 
 /* Callback function for the MTF trap handler. */
 typedef BOOLEAN(*fnMTFHandlerCallback)(PMTF_CONFIG, PVOID userBuffer);
 
+typedef struct _MTF_HANDLER
+{
+	/* Start/End addresses of the range monitored. */
+	PUINT8 rangeStart;
+	PUINT8 rangeEnd;
+
+	/* Callback of the handler, that will be called for processing the trap. */
+	fnMTFHandlerCallback callback;
+
+	/* Buffer that can be used for user-supplied configs. */
+	PVOID userParameter;
+} MTF_HANDLER, *PMTF_HANDLER;
+
+struct _MTF_CONFIG
+{
+	/* All MTF handlers that are used, held within the processor data as handlers are
+	 * looked up from VMX root, where nothing else is mapped. */
+	MTF_HANDLER handlers[MTF_MAX_HANDLERS];
+	ULONG handlerCount;
+};
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
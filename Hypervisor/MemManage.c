@@ -2,6 +2,7 @@
 #include <ntddk.h>
 #include "MemManage.h"
 #include "GuestShim.h"
+#include "PageTable.h"
 #include "ia32.h"
 #include "Debug.h"
 
@@ -10,22 +11,13 @@
 
 /******************** Module Typedefs ********************/
 
-/* Each level of a paging structure. */
-typedef enum
-{
-	MM_LEVEL_PTE = 1,
-	MM_LEVEL_PDE = 2,
-	MM_LEVEL_PDPTE = 3,
-	MM_LEVEL_PML4E = 4
-} MM_LEVEL;
 
 /******************** Module Constants ********************/
-#define POOL_TAG '1TST'
-
 #define OFFSET_DIRECTORY_TABLE_BASE 0x028
 #define OFFSET_USER_DIR_TABLE 0x280
 
-#define SIZE_2MB (2 * 1024 * 1024)
+/* Frame number of a window slot that has never been mapped. */
+#define WINDOW_SLOT_EMPTY MAXULONG64
 
 /* Counts of how many entries are in a table. */
 #define PAGING_TABLE_ENTRY_COUNT 512
@@ -53,79 +45,65 @@ typedef enum
 
 
 /******************** Module Prototypes ********************/
-static PT_ENTRY_64* getSystemPTEFromVA(CR3 tableBase, PVOID virtualAddress, MM_LEVEL* level);
 static VOID* mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress);
-static void unmapPhysicalAddress(PMM_CONTEXT context);
-static NTSTATUS split2MbPage(PDE_2MB_64* pdeLarge);
-static UINT64 physicalFromVirtual(VOID* virtualAddress);
-static VOID* virtualFromPhysical(UINT64 physicalAddress);
 
 /******************** Public Code ********************/
 
-NTSTATUS MemManage_init(PMM_CONTEXT context, CR3 hostCR3)
+NTSTATUS MemManage_init(PMM_CONTEXT context, ULONG processorIndex)
 {
-	NTSTATUS status = STATUS_SUCCESS;
+	NTSTATUS status;
 
-	/* Reserve a single page, this will be used for mapping in the guest
-		* page data into. */
-	PVOID reservedPage = MmAllocateMappingAddress(PAGE_SIZE, POOL_TAG);
-	if (NULL != reservedPage)
+	/* The window of each processor is reserved in the host page tables, the guest page data
+	 * is mapped into these. They belong to the hypervisor, no guest paging structure changes. */
+	PUINT8 windowBase = NULL;
+	PTE_64* windowPTEs = PageTable_getWindow(processorIndex, &windowBase);
+	if (NULL != windowPTEs)
 	{
-		/* Attempt to get the page table entry of the reserved page,
-			* we need to ensure this is not a 2MB large page, if so we must split it. */
-		MM_LEVEL tableLevel;
-		PT_ENTRY_64* reservedPagePTE = getSystemPTEFromVA(hostCR3, reservedPage, &tableLevel);
-		if (MM_LEVEL_PDE == tableLevel)
+		for (ULONG i = 0; i < MEMMANAGE_WINDOW_SLOTS; i++)
 		{
-			/* A split must take place. */
-			status = split2MbPage((PDE_2MB_64*)reservedPagePTE);
+			/* A page that was never present cannot be in the TLB so the first mapping needs no invalidation. */
+			windowPTEs[i].Flags = 0;
 
-			/* Get the new PTE. */
-			reservedPagePTE = getSystemPTEFromVA(hostCR3, reservedPage, &tableLevel);
+			context->slots[i].pte = &windowPTEs[i];
+			context->slots[i].pageFrameNumber = WINDOW_SLOT_EMPTY;
+			context->slots[i].lastUse = 0;
 		}
 
-		/* Ensure we are still in success state, splitting could have failed. */
-		if (NT_SUCCESS(status))
-		{
-			/* Drop the translation of the virtual address,
-			 * If at any point we observe it at 0, we know nothing is "mapped". */
-			reservedPagePTE->Flags = 0;
+		context->windowBase = windowBase;
+		context->accessCount = 0;
 
-			context->reservedPage = reservedPage;
-			context->reservedPagePte = (PTE_64*)reservedPagePTE;
-		}
+		RtlZeroMemory(&context->tlb, sizeof(context->tlb));
+		status = STATUS_SUCCESS;
 	}
 	else
 	{
 		status = STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	/* If an error took place during initialisation, free
-		* all allocated memory to prevent leaks. */
-	if (NT_ERROR(status))
-	{
-		if (NULL != reservedPage)
-		{
-			MmFreeMappingAddress(reservedPage, POOL_TAG);
-		}
-	}
-
 	return status;
 }
 
 void MemManage_uninit(PMM_CONTEXT context)
 {
-	MmFreeMappingAddress(context->reservedPage, POOL_TAG);
+	/* Leave the window unmapped, the host page tables themselves are static. */
+	for (ULONG i = 0; i < MEMMANAGE_WINDOW_SLOTS; i++)
+	{
+		if (NULL != context->slots[i].pte)
+		{
+			context->slots[i].pte->Flags = 0;
+			context->slots[i].pageFrameNumber = WINDOW_SLOT_EMPTY;
+		}
+	}
 }
 
 NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA, PVOID buffer, SIZE_T size)
 {
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	NTSTATUS status = STATUS_SUCCESS;
 
 	GUEST_VIRTUAL_ADDRESS currentVA = guestVA;
 	PUINT8 currentBuffer = buffer;
 
-	while (0 != size)
+	while ((0 != size) && (NT_SUCCESS(status)))
 	{
 		/* We can only read one page at a time, therfore we need
 		 * to split our actions into a per page business. */
@@ -163,6 +141,11 @@ NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_
 				size -= bytesThisPage;
 			}
 		}
+		else
+		{
+			/* The page is not present in the guest, stop rather than retrying it forever. */
+			status = STATUS_INVALID_ADDRESS;
+		}
 	}
 
 	return status;
@@ -170,12 +153,12 @@ NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_
 
 NTSTATUS MemManage_writeVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA, PVOID buffer, SIZE_T size)
 {
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	NTSTATUS status = STATUS_SUCCESS;
 
 	GUEST_VIRTUAL_ADDRESS currentVA = guestVA;
 	PUINT8 currentBuffer = buffer;
 
-	while (0 != size)
+	while ((0 != size) && (NT_SUCCESS(status)))
 	{
 		/* We can only read one page at a time, therfore we need
 		 * to split our actions into a per page business. */
@@ -213,6 +196,11 @@ NTSTATUS MemManage_writeVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST
 				size -= bytesThisPage;
 			}
 		}
+		else
+		{
+			/* The page is not present in the guest, stop rather than retrying it forever. */
+			status = STATUS_INVALID_ADDRESS;
+		}
 	}
 
 	return status;
@@ -222,15 +210,20 @@ NTSTATUS MemManage_readPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS ph
 {
 	NTSTATUS status;
 
-	/* Map the physical memory. */
-	VOID* mappedVA = mapPhysicalAddress(context, physicalAddress);
-	if (NULL != mappedVA)
+	/* Use the direct map of the host page tables, or map the physical memory into the window.
+	 * The window only exists in the host tables and maps one page at a time. */
+	VOID* mappedVA = PageTable_physicalToHost(physicalAddress, bytesToCopy);
+	if ((NULL == mappedVA) && (TRUE == PageTable_isLoaded()) &&
+		((ADDRMASK_PML1_OFFSET(physicalAddress) + bytesToCopy) <= PAGE_SIZE))
 	{
-		/* Do the copy. */
-		RtlCopyMemory(buffer, mappedVA, bytesToCopy);
+		mappedVA = mapPhysicalAddress(context, physicalAddress);
+	}
 
-		/* Unmap the physical memory. */
-		unmapPhysicalAddress(context);
+	if (NULL != mappedVA)
+	{
+		/* Do the copy, a window frame stays mapped for the next access to it. The kernel's
+		 * memcpy is not mapped in the host, so the copy is done inline. */
+		__movsb((PUCHAR)buffer, (const UCHAR*)mappedVA, bytesToCopy);
 		status = STATUS_SUCCESS;
 	}
 	else
@@ -245,15 +238,20 @@ NTSTATUS MemManage_writePhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS p
 {
 	NTSTATUS status;
 
-	/* Map the physical memory. */
-	VOID* mappedVA = mapPhysicalAddress(context, physicalAddress);
-	if (NULL != mappedVA)
+	/* Use the direct map of the host page tables, or map the physical memory into the window.
+	 * The window only exists in the host tables and maps one page at a time. */
+	VOID* mappedVA = PageTable_physicalToHost(physicalAddress, bytesToCopy);
+	if ((NULL == mappedVA) && (TRUE == PageTable_isLoaded()) &&
+		((ADDRMASK_PML1_OFFSET(physicalAddress) + bytesToCopy) <= PAGE_SIZE))
 	{
-		/* Do the copy. */
-		RtlCopyMemory(mappedVA, buffer, bytesToCopy);
+		mappedVA = mapPhysicalAddress(context, physicalAddress);
+	}
 
-		/* Unmap the physical memory. */
-		unmapPhysicalAddress(context);
+	if (NULL != mappedVA)
+	{
+		/* Do the copy, a window frame stays mapped for the next access to it. The kernel's
+		 * memcpy is not mapped in the host, so the copy is done inline. */
+		__movsb((PUCHAR)mappedVA, (const UCHAR*)buffer, bytesToCopy);
 		status = STATUS_SUCCESS;
 	}
 	else
@@ -292,125 +290,67 @@ CR3 MemManage_getPageTableBase(PEPROCESS process)
 	return tableBase;
 }
 
-/******************** Module Code ********************/
-
-static PT_ENTRY_64* getSystemPTEFromVA(CR3 tableBase, PVOID virtualAddress, MM_LEVEL* level)
+SIZE_T MemManage_getResidentSize(PVOID address, SIZE_T maximumSize)
 {
-	PT_ENTRY_64* result = NULL;
-
-	/* Gather the indexes for the page tables from the VA. */
-	UINT64 indexPML4 = ADDRMASK_PML4_INDEX(virtualAddress);
-	UINT64 indexPML3 = ADDRMASK_PML3_INDEX(virtualAddress);
-	UINT64 indexPML2 = ADDRMASK_PML2_INDEX(virtualAddress);
-	UINT64 indexPML1 = ADDRMASK_PML1_INDEX(virtualAddress);
+	/* Called from the guest, returns how many of the maximumSize bytes from address can be
+	 * read without a page fault (up to the first page that is not present). */
+	SIZE_T result = 0;
 
-	/* Read the PML4 from the target. */
-	PML4E_64* pml4 = virtualFromPhysical(tableBase.AddressOfPageDirectory * PAGE_SIZE);
-	PML4E_64* pml4e = &pml4[indexPML4];
-
-	result = (PT_ENTRY_64*)pml4e;
-	*level = MM_LEVEL_PML4E;
-	if (TRUE == pml4e->Present)
+	while ((result < maximumSize) && (TRUE == MmIsAddressValid((PUINT8)address + result)))
 	{
-		/* Read PML3 from the guest. */
-		PDPTE_64* pdpt = virtualFromPhysical(pml4e->PageFrameNumber * PAGE_SIZE);
-		PDPTE_64* pdpte = &pdpt[indexPML3];
-
-		result = (PT_ENTRY_64*)pdpte;
-		*level = MM_LEVEL_PDPTE;
-
-		/* Only attempt to get lower level if present and not a large page. */
-		if ((TRUE == pdpte->Present) && (FALSE == pdpte->LargePage))
-		{
-			/* Read PML2 from the guest. */
-			PDE_64* pd = virtualFromPhysical(pdpte->PageFrameNumber * PAGE_SIZE);
-			PDE_64* pde = &pd[indexPML2];
-
-			result = (PT_ENTRY_64*)pde;
-			*level = MM_LEVEL_PDE;
-			if ((TRUE == pde->Present) && (FALSE == pde->LargePage))
-			{
-				/* Read PML1 from the guest. */
-				PTE_64* pt = virtualFromPhysical(pde->PageFrameNumber * PAGE_SIZE);
-				PTE_64* pte = &pt[indexPML1];
-
-				result = (PT_ENTRY_64*)pte;
-				*level = MM_LEVEL_PTE;
-			}
-		}
+		result += PAGE_SIZE - (((ULONG_PTR)address + result) & (PAGE_SIZE - 1));
 	}
 
-	return result;
-}
-
-static VOID* mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress)
-{
-	/* Map the requested physical address to our reserved page. */
-	context->reservedPagePte->Present = TRUE;
-	context->reservedPagePte->Write = TRUE;
-	context->reservedPagePte->PageFrameNumber = physicalAddress / PAGE_SIZE;
-
-	/* Invalidate the TLB entries so we don't get cached old data. */
-	__invlpg(context->reservedPage);
-
-	return (VOID*)(((PUINT8)context->reservedPage) + ADDRMASK_PML1_OFFSET(physicalAddress));
+	return min(result, maximumSize);
 }
 
-static void unmapPhysicalAddress(PMM_CONTEXT context)
-{
-	/* Clear the page entry and flush the cache (TLB). */
-	context->reservedPagePte->Flags = 0;
-	__invlpg(context->reservedPage);
-}
+/******************** Module Code ********************/
 
-static NTSTATUS split2MbPage(PDE_2MB_64* pdeLarge)
+static VOID* mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress)
 {
-	NTSTATUS status;
+	/* Frames that are touched repeatedly (page tables, VMCALL buffers) stay mapped in the window.
+	 * Otherwise the least recently used slot is remapped, the window is only ever used by this
+	 * processor so only its own stale TLB entry needs invalidating. */
+	UINT64 pageFrameNumber = physicalAddress / PAGE_SIZE;
+	ULONG slotIndex = 0;
 
-	/* Allocate a new page table, this will be used for splitting the 2MB
-	 * entry into 512 4kb pages, 512 8byte entries = one page. */
-	PTE_64* pt = ExAllocatePool(NonPagedPoolNx, PAGE_SIZE);
-	if (NULL != pt)
+	for (ULONG i = 0; i < MEMMANAGE_WINDOW_SLOTS; i++)
 	{
-		/* Close the large page bit and then propagate the current permissions to
-		 * all the entries in our newly allocated PT. */
-		pdeLarge->LargePage = FALSE;
-		__stosq((UINT64*)pt, pdeLarge->Flags, PAGING_TABLE_ENTRY_COUNT);
-
-		/* Calculate the physical address of where the PDPTE will be. */
-		UINT64 base = pdeLarge->PageFrameNumber * SIZE_2MB;
-
-		/* Update the page frame mapping for each PTE. */
-		for (SIZE_T i = 0; i < PAGING_TABLE_ENTRY_COUNT; i++)
+		if (pageFrameNumber == context->slots[i].pageFrameNumber)
 		{
-			UINT64 physAddrToMap = base + (i * PAGE_SIZE);
-			pt[i].PageFrameNumber = physAddrToMap / PAGE_SIZE;
+			slotIndex = i;
+			break;
 		}
 
-		/* Now update the convert the largePDE to a standard entry. */
-		PDE_64* pde = (PDE_64*)pdeLarge;
-		pde->Reserved1 = 0;
-		pde->Reserved2 = 0;
-		pde->PageFrameNumber = physicalFromVirtual(pt) / PAGE_SIZE;
-		status = STATUS_SUCCESS;
+		if (context->slots[i].lastUse < context->slots[slotIndex].lastUse)
+		{
+			slotIndex = i;
+		}
 	}
-	else
+
+	PMM_WINDOW_SLOT slot = &context->slots[slotIndex];
+	PUINT8 slotPage = context->windowBase + (slotIndex * PAGE_SIZE);
+
+	if (pageFrameNumber != slot->pageFrameNumber)
 	{
-		status = STATUS_INSUFFICIENT_RESOURCES;
+		PTE_64 pte = { 0 };
+		pte.Present = TRUE;
+		pte.Write = TRUE;
+		pte.PageFrameNumber = pageFrameNumber;
+
+		/* Map the requested physical address to the slot. */
+		BOOLEAN evicting = (WINDOW_SLOT_EMPTY != slot->pageFrameNumber);
+		slot->pte->Flags = pte.Flags;
+		slot->pageFrameNumber = pageFrameNumber;
+
+		/* Invalidate the TLB entry of the previous frame so we don't get cached old data. */
+		if (TRUE == evicting)
+		{
+			__invlpg(slotPage);
+		}
 	}
-	
-	return status;
-}
 
-static UINT64 physicalFromVirtual(VOID* virtualAddress)
-{
-	return MmGetPhysicalAddress(virtualAddress).QuadPart;
-}
-
-static VOID* virtualFromPhysical(UINT64 physicalAddress)
-{
-	PHYSICAL_ADDRESS pa;
-	pa.QuadPart = physicalAddress;
+	slot->lastUse = ++context->accessCount;
 
-	return MmGetVirtualForPhysical(pa);
+	return (VOID*)(slotPage + ADDRMASK_PML1_OFFSET(physicalAddress));
 }
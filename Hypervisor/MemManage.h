@@ -1,15 +1,71 @@
 #pragma once
 #include <wdm.h>
 #include "ia32.h"
+#include "PageTable.h"
+
+/******************** Public Defines ********************/
+
+/* Pages in the window that each logical processor maps physical memory through. */
+#define MEMMANAGE_WINDOW_SLOTS PAGETABLE_WINDOW_PAGES
+
+/* Guest translations cached by each logical processor, in sets of ways. */
+#define MEMMANAGE_TLB_SETS 64
+#define MEMMANAGE_TLB_WAYS 4
 
 /******************** Public Typedefs ********************/
+
+/* A page of the window, it keeps its mapping until it is reused for another frame. */
+typedef struct _MM_WINDOW_SLOT
+{
+	/* PTE that belongs to the page. */
+	PTE_64* pte;
+
+	/* Frame currently mapped, and the access count when it was last used. */
+	UINT64 pageFrameNumber;
+	UINT64 lastUse;
+} MM_WINDOW_SLOT, *PMM_WINDOW_SLOT;
+
+/* A guest leaf translation, keyed by the page table base and the virtual page it maps. */
+typedef struct _MM_TRANSLATION
+{
+	/* Physical address of the PML4, and the virtual address rounded down to the page. */
+	UINT64 directoryBase;
+	UINT64 virtualPage;
+
+	/* Size of the page mapped, 0 if the way is unused. */
+	UINT64 pageSize;
+
+	/* Physical address the page starts at. */
+	UINT64 pageBase;
+
+	/* Access count when the translation was last used, the oldest in a set is replaced. */
+	UINT64 lastUse;
+} MM_TRANSLATION, *PMM_TRANSLATION;
+
+typedef struct _MM_TLB
+{
+	MM_TRANSLATION sets[MEMMANAGE_TLB_SETS][MEMMANAGE_TLB_WAYS];
+	UINT64 accessCount;
+
+	/* Lookups found cached, lookups that needed a walk, translations dropped by a guest INVLPG
+	 * and flushes of the whole cache. Read by VMCALL_ACTION_EXPORT_TLB_STATS. */
+	UINT64 hits;
+	UINT64 misses;
+	UINT64 invalidations;
+	UINT64 flushes;
+} MM_TLB, *PMM_TLB;
+
 typedef struct _MM_CONTEXT
 {
-	/* The reserved page that will be used for storing data in. */
-	PVOID reservedPage;
+	/* The reserved pages that physical memory is mapped into, a slot for each. */
+	PUINT8 windowBase;
+	MM_WINDOW_SLOT slots[MEMMANAGE_WINDOW_SLOTS];
+
+	/* Incremented on every access, the slot used longest ago is the one reused. */
+	UINT64 accessCount;
 
-	/* PTE that belongs to the reserved page. */
-	PTE_64* reservedPagePte;
+	/* Translations of guest virtual addresses, owned by GuestShim. */
+	MM_TLB tlb;
 } MM_CONTEXT, *PMM_CONTEXT;
 
 typedef SIZE_T HOST_PHYS_ADDRESS;
@@ -20,10 +76,11 @@ typedef SIZE_T GUEST_VIRTUAL_ADDRESS;
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
-NTSTATUS MemManage_init(PMM_CONTEXT context, CR3 hostCR3);
+NTSTATUS MemManage_init(PMM_CONTEXT context, ULONG processorIndex);
 void MemManage_uninit(PMM_CONTEXT context);
 NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA, PVOID buffer, SIZE_T size);
 NTSTATUS MemManage_writeVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA, PVOID buffer, SIZE_T size);
 NTSTATUS MemManage_readPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress, VOID* buffer, SIZE_T bytesToCopy);
 NTSTATUS MemManage_writePhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress, VOID* buffer, SIZE_T bytesToCopy);
-CR3 MemManage_getPageTableBase(PEPROCESS process);
\ No newline at end of file
+CR3 MemManage_getPageTableBase(PEPROCESS process);
+SIZE_T MemManage_getResidentSize(PVOID address, SIZE_T maximumSize);
\ No newline at end of file
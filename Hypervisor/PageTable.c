@@ -1,44 +1,140 @@
 #include <ntifs.h>
+#include <intrin.h>
 #include "PageTable.h"
+#include "ProcessDefines.h"
 
 /******************** External API ********************/
 
 
 /******************** Module Typedefs ********************/
 
+/* A table of the host paging structures that the hypervisor owns. */
+typedef struct _PRIVATE_TABLE
+{
+	UINT64 physicalAddress;
+	PUINT64 entries;
+} PRIVATE_TABLE, *PPRIVATE_TABLE;
+
 
 /******************** Module Constants ********************/
 #define PML4E_COUNT 512
+#define PDPTE_COUNT 512
+#define PDE_COUNT 512
+#define PTE_COUNT 512
+
+#define SIZE_2MB 0x200000ULL
+#define SIZE_1GB 0x40000000ULL
+
+/* CPUID leaf and EDX bit reporting support for 1GB pages. */
+#define CPUID_EXTENDED_FEATURES 0x80000001
+#define CPUID_EDX_PAGES_1GB 0x04000000
+
+/* The direct map and the window are placed in the highest free PML4 slots of the kernel half. */
+#define PML4_KERNEL_FIRST_SLOT 256
+
+/* Bits of a paging entry. */
+#define ENTRY_FRAME_MASK 0x000FFFFFFFFFF000ULL
+#define ENTRY_PRESENT (1ULL << 0)
+#define ENTRY_WRITE (1ULL << 1)
+#define ENTRY_GLOBAL (1ULL << 8)
+#define ENTRY_EXECUTE_DISABLE (1ULL << 63)
+
+/* Paging structures the hypervisor allocates for the host tables, the direct map and the
+ * tables leading to the image and to the pool mapped with PageTable_mapHost. */
+#define PRIVATE_TABLE_COUNT 1024
+
+/* Page tables needed to hold the window of every processor. */
+#define WINDOW_TABLE_COUNT ((PAGETABLE_WINDOW_PAGES * PAGETABLE_WINDOW_PROCESSORS) / PTE_COUNT)
+
+/* Amount of 2MB blocks the direct map can cover. */
+#define DIRECT_MAP_BLOCKS (PAGETABLE_DIRECT_MAP_SIZE / SIZE_2MB)
 
 /******************** Module Variables ********************/
 
 static DECLSPEC_ALIGN(PAGE_SIZE) PML4E_64 vmPML4[PML4E_COUNT] = { 0 };
 
-/******************** Module Prototypes ********************/
+/* Private to the host page tables, maps physical RAM at directMapBase + physical address. */
+static DECLSPEC_ALIGN(PAGE_SIZE) PDPTE_64 directPDPT[PDPTE_COUNT] = { 0 };
+static PUINT8 directMapBase = NULL;
+
+/* 2MB blocks of physical memory that are mapped, anything else (MMIO, partial blocks) is not. */
+static UINT64 directMapped[DIRECT_MAP_BLOCKS / 64] = { 0 };
+
+/* Tables of the host paging structures the hypervisor has allocated. */
+static PRIVATE_TABLE privateTables[PRIVATE_TABLE_COUNT] = { 0 };
+static ULONG privateTableCount = 0;
+
+/* Maps the window of each processor, one after another. */
+static DECLSPEC_ALIGN(PAGE_SIZE) PDPTE_64 windowPDPT[PDPTE_COUNT] = { 0 };
+static DECLSPEC_ALIGN(PAGE_SIZE) PDE_64 windowPD[PDE_COUNT] = { 0 };
+static DECLSPEC_ALIGN(PAGE_SIZE) PTE_64 windowPT[WINDOW_TABLE_COUNT][PTE_COUNT] = { 0 };
+static PUINT8 windowBase = NULL;
 
+/* Page directory base of vmPML4, the direct map is only usable while it is loaded. */
+static UINT64 hostDirectoryBase = 0;
+
+/* Serialises the guest adding to the host tables once they are in use. */
+static FAST_MUTEX hostLock;
+
+/* Changes whenever a host page is pointed at a different frame, processors compare it on
+ * each VM exit to know when their cached translations are stale. Processors start out
+ * with zero so their first exit always flushes. */
+static volatile LONG64 hostGeneration = 1;
+
+/******************** Module Prototypes ********************/
+static ULONG reserveSlot(PML4E_64* originalPML4);
+static BOOLEAN isHostOnly(PUINT8 address);
+static NTSTATUS mirrorImage(void);
+static NTSTATUS mapRange(PUINT8 base, SIZE_T size, BOOLEAN executable);
+static PUINT64 getHostTable(PUINT64 entry);
+static void releaseTables(void);
+static NTSTATUS buildWindow(PML4E_64* originalPML4);
+static NTSTATUS buildDirectMap(PML4E_64* originalPML4);
+static NTSTATUS mapDirectBlock(UINT64 physicalAddress, BOOLEAN largePages);
 
 /******************** Public Code ********************/
 
 NTSTATUS PageTable_init(CR3 originalCR3, CR3* newCR3)
 {
-	/* We emulate providing our own page table,
-	 * to do this, we copy the original hosts PML4E
-	 * and provide our own CR3, this should be enough. */
+	/* The host gets page tables of its own, every table is owned by the hypervisor and they
+	 * start empty. Only what VMX root uses is mapped: the hypervisor image (its code, data and
+	 * the processor stacks within it), pool handed to the host with PageTable_mapHost, the
+	 * window of each processor and the direct map of physical RAM. The rest of the kernel is
+	 * not reachable from the host, and the guest cannot change how the host sees itself.
+	 * Buffers of the guest are accessed through the page tables of the guest (MemManage). */
 	NTSTATUS status;
 
-	/* Get the virtual address of the original hosts PML4. */
+	ExInitializeFastMutex(&hostLock);
+
+	/* The original PML4 is only read so the slots the host adds are kept clear of the kernel's,
+	 * an address of the kernel never means something different in the host. */
 	PHYSICAL_ADDRESS physOrigPML4;
 	physOrigPML4.QuadPart = originalCR3.AddressOfPageDirectory * PAGE_SIZE;
 
 	PML4E_64* originalPML4 = (PML4E_64*)MmGetVirtualForPhysical(physOrigPML4);
 	if (NULL != originalPML4)
 	{
-		/* Copy the PML4E entries from the host/original CR3. */
-		for (SIZE_T i = 0; i < PML4E_COUNT; i++)
-		{
-			vmPML4[i] = originalPML4[i];
-		}
+		/* Reserve the pages each processor maps physical memory into. */
+		status = buildWindow(originalPML4);
+	}
+	else
+	{
+		status = STATUS_INVALID_ADDRESS;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Add the direct map of physical memory to one of the slots left empty. */
+		status = buildDirectMap(originalPML4);
+	}
 
+	if (NT_SUCCESS(status))
+	{
+		status = mirrorImage();
+	}
+
+	if (NT_SUCCESS(status))
+	{
 		/* Calculate the physical address of our PML4 table. */
 		PHYSICAL_ADDRESS physNewPML4;
 		physNewPML4 = MmGetPhysicalAddress(vmPML4);
@@ -47,15 +143,418 @@ NTSTATUS PageTable_init(CR3 originalCR3, CR3* newCR3)
 		newCR3->Flags = 0;
 		newCR3->AddressOfPageDirectory = (physNewPML4.QuadPart) / PAGE_SIZE;
 
-		status = STATUS_SUCCESS;
+		hostDirectoryBase = newCR3->AddressOfPageDirectory * PAGE_SIZE;
 	}
 	else
 	{
-		status = STATUS_INVALID_ADDRESS;
+		releaseTables();
+	}
+
+	return status;
+}
+
+NTSTATUS PageTable_mapHost(PVOID base, SIZE_T size)
+{
+	/* Called from the guest at or below APC_LEVEL, before VMX root is given the address of
+	 * nonpaged memory it is going to access. The range is mapped at the same address in the
+	 * host and stays mapped, memory that is freed is simply no longer used by the host. */
+	NTSTATUS status = STATUS_INVALID_PARAMETER;
+
+	if ((NULL != base) && (0 != size) && (0 != hostDirectoryBase))
+	{
+		ExAcquireFastMutex(&hostLock);
+		status = mapRange((PUINT8)base, size, FALSE);
+		ExReleaseFastMutex(&hostLock);
 	}
 
 	return status;
 }
 
+void PageTable_refreshHost(PUINT64 generation)
+{
+	/* Called in VMX root on every VM exit with the generation the processor last saw. The host
+	 * pages are global, so when one has changed they are dropped by toggling CR4.PGE. This also
+	 * drops any global kernel pages left from before the processor's first VM exit. */
+	UINT64 currentGeneration = (UINT64)hostGeneration;
+
+	if (*generation != currentGeneration)
+	{
+		UINT64 cr4 = __readcr4();
+
+		__writecr4(cr4 ^ CR4_PAGE_GLOBAL_ENABLE_FLAG);
+		__writecr4(cr4);
+
+		*generation = currentGeneration;
+	}
+}
+
+BOOLEAN PageTable_isLoaded(void)
+{
+	/* The host tables are only loaded in VMX root. */
+	return (0 != hostDirectoryBase) && (hostDirectoryBase == (__readcr3() & ~(PAGE_SIZE - 1)));
+}
+
+PTE_64* PageTable_getWindow(ULONG processorIndex, PUINT8* base)
+{
+	/* Returns the PTEs of the window reserved for the processor, PAGETABLE_WINDOW_PAGES of them.
+	 * The pages are not present until the caller maps a frame into them. */
+	PTE_64* result = NULL;
+
+	if ((NULL != windowBase) && (processorIndex < PAGETABLE_WINDOW_PROCESSORS))
+	{
+		ULONG firstPage = processorIndex * PAGETABLE_WINDOW_PAGES;
+
+		*base = windowBase + ((SIZE_T)firstPage * PAGE_SIZE);
+		result = &windowPT[firstPage / PTE_COUNT][firstPage % PTE_COUNT];
+	}
+
+	return result;
+}
+
+PVOID PageTable_physicalToHost(UINT64 physicalAddress, SIZE_T size)
+{
+	/* Returns where the physical range can be accessed directly, or NULL if it isn't covered
+	 * by the direct map or the host page tables are not loaded (outside of VMX root). */
+	PVOID result = NULL;
+
+	if ((NULL != directMapBase) && (0 != size) && ((physicalAddress + size) <= PAGETABLE_DIRECT_MAP_SIZE) &&
+		(TRUE == PageTable_isLoaded()))
+	{
+		BOOLEAN mapped = TRUE;
+
+		for (UINT64 block = physicalAddress / SIZE_2MB; (TRUE == mapped) && (block <= ((physicalAddress + size - 1) / SIZE_2MB)); block++)
+		{
+			mapped = (0 != (directMapped[block / 64] & (1ULL << (block % 64))));
+		}
+
+		if (TRUE == mapped)
+		{
+			result = directMapBase + physicalAddress;
+		}
+	}
+
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static ULONG reserveSlot(PML4E_64* originalPML4)
+{
+	/* Returns the highest kernel half PML4 slot that neither the kernel nor the host uses,
+	 * or PML4E_COUNT if there are none. */
+	ULONG result = PML4E_COUNT;
+
+	for (ULONG slot = PML4E_COUNT - 1; slot >= PML4_KERNEL_FIRST_SLOT; slot--)
+	{
+		if ((FALSE == vmPML4[slot].Present) && (FALSE == originalPML4[slot].Present))
+		{
+			result = slot;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static BOOLEAN isHostOnly(PUINT8 address)
+{
+	/* Whether the address is within the slot of the window or of the direct map. */
+	UINT64 slot = ((UINT64)address >> 39) & 0x1FF;
+
+	return ((NULL != windowBase) && (slot == (((UINT64)windowBase >> 39) & 0x1FF))) ||
+		((NULL != directMapBase) && (slot == (((UINT64)directMapBase >> 39) & 0x1FF)));
+}
+
+static NTSTATUS mirrorImage(void)
+{
+	/* Maps the image this code is in, the processor data and stacks are static within it.
+	 * Discardable and pageable (PAGE*) sections are never used from VMX root and are left out.
+	 * Code is mapped read only and nothing else is executable. */
+	NTSTATUS status = STATUS_INVALID_IMAGE_FORMAT;
+	PUINT8 imageBase = NULL;
+
+	RtlPcToFileHeader((PVOID)mirrorImage, (PVOID*)&imageBase);
+	if ((NULL != imageBase) && (IMAGE_DOS_SIGNATURE == ((PIMAGE_DOS_HEADER)imageBase)->e_magic))
+	{
+		PIMAGE_NT_HEADERS64 ntHeaders = (PIMAGE_NT_HEADERS64)(imageBase + ((PIMAGE_DOS_HEADER)imageBase)->e_lfanew);
+
+		if (IMAGE_NT_SIGNATURE == ntHeaders->Signature)
+		{
+			PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(ntHeaders);
+			status = STATUS_SUCCESS;
+
+			for (USHORT i = 0; (NT_SUCCESS(status)) && (i < ntHeaders->FileHeader.NumberOfSections); i++, section++)
+			{
+				BOOLEAN pageable = (0 == strncmp((const char*)section->Name, "PAGE", 4));
+				BOOLEAN discardable = (0 != (section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE));
+
+				if ((FALSE == pageable) && (FALSE == discardable) && (0 != section->Misc.VirtualSize))
+				{
+					status = mapRange(imageBase + section->VirtualAddress, section->Misc.VirtualSize,
+									  (0 != (section->Characteristics & IMAGE_SCN_MEM_EXECUTE)));
+				}
+			}
+		}
+	}
+
+	return status;
+}
+
+static NTSTATUS mapRange(PUINT8 base, SIZE_T size, BOOLEAN executable)
+{
+	/* Maps each page of the range at the same address in the host, to the frame the kernel has
+	 * there now. Pages are global as they are only reachable with the host tables loaded,
+	 * so they survive the CR3 load of every VM exit. */
+	static const ULONG INDEX_SHIFTS[] = { 39, 30, 21 };
+
+	NTSTATUS status = STATUS_SUCCESS;
+	UINT64 pageFlags = ENTRY_PRESENT | ENTRY_GLOBAL | ((TRUE == executable) ? 0 : (ENTRY_WRITE | ENTRY_EXECUTE_DISABLE));
 
-/******************** Module Code ********************/
\ No newline at end of file
+	for (PUINT8 page = (PUINT8)PAGE_ALIGN(base); (NT_SUCCESS(status)) && (page < (base + size)); page += PAGE_SIZE)
+	{
+		PHYSICAL_ADDRESS physPage = MmGetPhysicalAddress(page);
+
+		/* Only resident kernel memory, and never over the host's own slots. */
+		if ((0 == physPage.QuadPart) || ((((UINT64)page >> 39) & 0x1FF) < PML4_KERNEL_FIRST_SLOT) || (TRUE == isHostOnly(page)))
+		{
+			status = STATUS_INVALID_ADDRESS;
+		}
+		else
+		{
+			PUINT64 table = &vmPML4[0].Flags;
+
+			for (ULONG level = 0; (NULL != table) && (level < ARRAYSIZE(INDEX_SHIFTS)); level++)
+			{
+				table = getHostTable(&table[((UINT64)page >> INDEX_SHIFTS[level]) & 0x1FF]);
+			}
+
+			if (NULL != table)
+			{
+				UINT64 newEntry = ((UINT64)physPage.QuadPart & ENTRY_FRAME_MASK) | pageFlags;
+				UINT64 oldEntry = (UINT64)InterlockedExchange64((volatile LONG64*)&table[((UINT64)page >> 12) & 0x1FF], (LONG64)newEntry);
+
+				if ((0 != (oldEntry & ENTRY_PRESENT)) && (oldEntry != newEntry))
+				{
+					/* The page was reused for a different frame, processors must drop the old one. */
+					InterlockedIncrement64(&hostGeneration);
+				}
+			}
+			else
+			{
+				status = STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+	}
+
+	return status;
+}
+
+static PUINT64 getHostTable(PUINT64 entry)
+{
+	/* Returns the table the entry references, an empty one is allocated the first time. The
+	 * entry is only made present once the table is zeroed, as processors in VMX root may be
+	 * walking the tables while the guest adds to them. */
+	PUINT64 result = NULL;
+
+	if (0 != (*entry & ENTRY_PRESENT))
+	{
+		/* A large page is never one of ours, so it is not found. */
+		UINT64 physicalAddress = *entry & ENTRY_FRAME_MASK;
+
+		for (ULONG i = 0; i < privateTableCount; i++)
+		{
+			if (physicalAddress == privateTables[i].physicalAddress)
+			{
+				result = privateTables[i].entries;
+				break;
+			}
+		}
+	}
+	else if (privateTableCount < PRIVATE_TABLE_COUNT)
+	{
+		/* A page sized allocation is page aligned. The table itself is not mapped in the host,
+		 * only the processor reads it. */
+		PUINT64 table = (PUINT64)ExAllocatePool(NonPagedPoolNx, PAGE_SIZE);
+		if (NULL != table)
+		{
+			RtlZeroMemory(table, PAGE_SIZE);
+
+			privateTables[privateTableCount].physicalAddress = MmGetPhysicalAddress(table).QuadPart;
+			privateTables[privateTableCount].entries = table;
+
+			InterlockedExchange64((volatile LONG64*)entry, (LONG64)(privateTables[privateTableCount].physicalAddress | ENTRY_PRESENT | ENTRY_WRITE));
+			privateTableCount++;
+
+			result = table;
+		}
+	}
+
+	return result;
+}
+
+static void releaseTables(void)
+{
+	/* Undoes a failed initialisation, the tables have never been loaded. */
+	for (ULONG i = 0; i < privateTableCount; i++)
+	{
+		ExFreePool(privateTables[i].entries);
+	}
+
+	privateTableCount = 0;
+	windowBase = NULL;
+	directMapBase = NULL;
+
+	RtlZeroMemory(vmPML4, sizeof(vmPML4));
+	RtlZeroMemory(directPDPT, sizeof(directPDPT));
+	RtlZeroMemory(directMapped, sizeof(directMapped));
+}
+
+static NTSTATUS buildWindow(PML4E_64* originalPML4)
+{
+	/* The window of every processor lives in a slot of its own, in the static tables. */
+	NTSTATUS status = STATUS_NO_MEMORY;
+	ULONG slot = reserveSlot(originalPML4);
+
+	if (PML4E_COUNT != slot)
+	{
+		for (ULONG i = 0; i < WINDOW_TABLE_COUNT; i++)
+		{
+			windowPD[i].Present = TRUE;
+			windowPD[i].Write = TRUE;
+			windowPD[i].PageFrameNumber = MmGetPhysicalAddress(windowPT[i]).QuadPart / PAGE_SIZE;
+		}
+
+		windowPDPT[0].Present = TRUE;
+		windowPDPT[0].Write = TRUE;
+		windowPDPT[0].PageFrameNumber = MmGetPhysicalAddress(windowPD).QuadPart / PAGE_SIZE;
+
+		vmPML4[slot].Present = TRUE;
+		vmPML4[slot].Write = TRUE;
+		vmPML4[slot].PageFrameNumber = MmGetPhysicalAddress(windowPDPT).QuadPart / PAGE_SIZE;
+
+		/* Sign extend the slot into a canonical address, it is always in the upper half. */
+		windowBase = (PUINT8)(0xFFFF000000000000ULL | ((UINT64)slot << 39));
+		status = STATUS_SUCCESS;
+	}
+
+	return status;
+}
+
+static NTSTATUS buildDirectMap(PML4E_64* originalPML4)
+{
+	/* Maps every whole 2MB block of physical RAM, with 1GB pages where the processor supports
+	 * them and the RAM covers the whole gigabyte. Only RAM is mapped, so the processor cannot
+	 * speculatively touch device memory through it. The map is never executable, and global
+	 * as it only exists in the host tables. */
+	NTSTATUS status = STATUS_NOT_FOUND;
+	ULONG slot = reserveSlot(originalPML4);
+
+	if (PML4E_COUNT != slot)
+	{
+		status = STATUS_SUCCESS;
+	}
+
+	PPHYSICAL_MEMORY_RANGE memoryRanges = NULL;
+	if (NT_SUCCESS(status))
+	{
+		memoryRanges = MmGetPhysicalMemoryRanges();
+		status = (NULL != memoryRanges) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		INT32 cpuInfo[4];
+		__cpuid(cpuInfo, CPUID_EXTENDED_FEATURES);
+		BOOLEAN largePages = (0 != (cpuInfo[3] & CPUID_EDX_PAGES_1GB));
+
+		/* The list ends with an empty range. */
+		for (ULONG i = 0; (NT_SUCCESS(status)) && (0 != memoryRanges[i].NumberOfBytes.QuadPart); i++)
+		{
+			UINT64 rangeStart = (UINT64)memoryRanges[i].BaseAddress.QuadPart;
+			UINT64 rangeEnd = rangeStart + (UINT64)memoryRanges[i].NumberOfBytes.QuadPart;
+
+			/* Only whole blocks below the limit are mapped. */
+			UINT64 block = (rangeStart + SIZE_2MB - 1) & ~(SIZE_2MB - 1);
+			rangeEnd = min(rangeEnd & ~(SIZE_2MB - 1), PAGETABLE_DIRECT_MAP_SIZE);
+
+			while ((NT_SUCCESS(status)) && (block < rangeEnd))
+			{
+				BOOLEAN wholeGigabyte = (TRUE == largePages) && (0 == (block % SIZE_1GB)) && ((block + SIZE_1GB) <= rangeEnd);
+
+				status = mapDirectBlock(block, wholeGigabyte);
+				block += (TRUE == wholeGigabyte) ? SIZE_1GB : SIZE_2MB;
+			}
+		}
+
+		ExFreePool(memoryRanges);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		PML4E_64 pml4e = { 0 };
+		pml4e.Present = TRUE;
+		pml4e.Write = TRUE;
+		pml4e.PageFrameNumber = MmGetPhysicalAddress(directPDPT).QuadPart / PAGE_SIZE;
+
+		vmPML4[slot] = pml4e;
+
+		/* Sign extend the slot into a canonical address, it is always in the upper half. */
+		directMapBase = (PUINT8)(0xFFFF000000000000ULL | ((UINT64)slot << 39));
+	}
+
+	return status;
+}
+
+static NTSTATUS mapDirectBlock(UINT64 physicalAddress, BOOLEAN largePages)
+{
+	/* Maps a 1GB or 2MB block, page directories are allocated as the first 2MB block
+	 * of each gigabyte is mapped. */
+	NTSTATUS status = STATUS_SUCCESS;
+	PDPTE_64* pdpte = &directPDPT[physicalAddress / SIZE_1GB];
+
+	if (TRUE == largePages)
+	{
+		PDPTE_1GB_64 largePDPTE = { 0 };
+		largePDPTE.Present = TRUE;
+		largePDPTE.Write = TRUE;
+		largePDPTE.LargePage = TRUE;
+		largePDPTE.Global = TRUE;
+		largePDPTE.ExecuteDisable = TRUE;
+		largePDPTE.PageFrameNumber = physicalAddress / SIZE_1GB;
+
+		pdpte->Flags = largePDPTE.Flags;
+	}
+	else
+	{
+		PDE_2MB_64* pd = (PDE_2MB_64*)getHostTable(&pdpte->Flags);
+
+		if (NULL != pd)
+		{
+			PDE_2MB_64* pde = &pd[(physicalAddress % SIZE_1GB) / SIZE_2MB];
+
+			pde->Present = TRUE;
+			pde->Write = TRUE;
+			pde->LargePage = TRUE;
+			pde->Global = TRUE;
+			pde->ExecuteDisable = TRUE;
+			pde->PageFrameNumber = physicalAddress / SIZE_2MB;
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		ULONG blockCount = (ULONG)(((TRUE == largePages) ? SIZE_1GB : SIZE_2MB) / SIZE_2MB);
+		UINT64 firstBlock = physicalAddress / SIZE_2MB;
+
+		for (UINT64 block = firstBlock; block < (firstBlock + blockCount); block++)
+		{
+			directMapped[block / 64] |= (1ULL << (block % 64));
+		}
+	}
+
+	return status;
+}
@@ -2,6 +2,15 @@
 #include <wdm.h>
 #include "ia32.h"
 
+/******************** Public Defines ********************/
+
+/* Physical memory below this is mapped directly into the host page tables, one PML4 slot. */
+#define PAGETABLE_DIRECT_MAP_SIZE 0x8000000000ULL
+
+/* Pages reserved in the host tables for the window of each processor, and how many processors. */
+#define PAGETABLE_WINDOW_PAGES 16
+#define PAGETABLE_WINDOW_PROCESSORS 64
+
 /******************** Public Typedefs ********************/
 
 /******************** Public Constants ********************/
@@ -11,3 +20,8 @@
 /******************** Public Prototypes ********************/
 
 NTSTATUS PageTable_init(CR3 originalCR3, CR3* newCR3);
+NTSTATUS PageTable_mapHost(PVOID base, SIZE_T size);
+void PageTable_refreshHost(PUINT64 generation);
+BOOLEAN PageTable_isLoaded(void);
+PVOID PageTable_physicalToHost(UINT64 physicalAddress, SIZE_T size);
+PTE_64* PageTable_getWindow(ULONG processorIndex, PUINT8* base);
\ No newline at end of file
@@ -0,0 +1,51 @@
+#pragma once
+
+/* Lets the code that is plain C (the instruction decoder and the relocation engine) build
+ * outside of the WDK, so the tools can test it in user mode. Windows builds use the WDK headers. */
+#ifdef _WIN32
+#include <wdm.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/******************** Public Defines ********************/
+
+#define TRUE	1
+#define FALSE	0
+
+#define MINLONG		INT32_MIN
+#define MAXLONG		INT32_MAX
+
+#define STATUS_SUCCESS					((NTSTATUS)0x00000000L)
+#define STATUS_ILLEGAL_INSTRUCTION		((NTSTATUS)0xC000001DL)
+#define STATUS_NOT_CAPABLE				((NTSTATUS)0xC0000429L)
+
+#define NT_SUCCESS(status)				(((NTSTATUS)(status)) >= 0)
+
+#define RtlCopyMemory(destination, source, length)	memcpy((destination), (source), (length))
+#define RtlZeroMemory(destination, length)			memset((destination), 0, (length))
+
+#ifndef min
+#define min(a, b)	(((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef max
+#define max(a, b)	(((a) > (b)) ? (a) : (b))
+#endif
+
+/******************** Public Typedefs ********************/
+
+/* Windows is LLP64, LONG and ULONG stay 32 bits wide on every platform. */
+typedef int32_t NTSTATUS;
+typedef uint8_t BOOLEAN;
+typedef char CHAR;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64;
+typedef uint8_t UINT8, *PUINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64, *PUINT64;
+typedef uintptr_t SIZE_T, *PSIZE_T;
+#endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 #define IMAGE_SIZEOF_SHORT_NAME              8
 #define IMAGE_SIZEOF_SECTION_HEADER          40
 
+#define IMAGE_SCN_MEM_DISCARDABLE            0x02000000  // Section can be discarded.
 #define IMAGE_SCN_MEM_EXECUTE                0x20000000  // Section is executable.
 #define IMAGE_SCN_MEM_READ                   0x40000000  // Section is readable.
 #define IMAGE_SCN_MEM_WRITE                  0x80000000  // Section is writeable.
@@ -0,0 +1,488 @@
+#include "Relocate.h"
+#include "Decoder.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Relative branches that need rewriting when moved. */
+typedef enum _BRANCH_KIND
+{
+	BRANCH_NONE = 0,
+	BRANCH_JMP,
+	BRANCH_CALL,
+	BRANCH_JCC,
+	BRANCH_LOOP
+} BRANCH_KIND;
+
+/******************** Module Constants ********************/
+
+/* CALL [RIP+2], JMP SHORT +8, DQ target. */
+#define FAR_CALL_SIZE			16
+
+/* MOV r64, imm64 */
+#define MOV_ABSOLUTE_SIZE		10
+
+/******************** Module Variables ********************/
+
+/******************** Module Prototypes ********************/
+static BRANCH_KIND getBranchKind(PINSTRUCTION_LAYOUT layout);
+static UINT64 getBranchTarget(PUINT8 address, PINSTRUCTION_LAYOUT layout);
+static BOOLEAN isTerminator(PINSTRUCTION_LAYOUT layout);
+static BOOLEAN isRel32Reachable(SIZE_T nextAddress, UINT64 targetAddress);
+static SIZE_T relocateBranch(PUINT8 source, PINSTRUCTION_LAYOUT layout, PUINT8 destination, SIZE_T destinationAddress);
+static NTSTATUS relocateRIPRelative(PUINT8 source, PINSTRUCTION_LAYOUT layout, PUINT8 destination, SIZE_T destinationAddress, PSIZE_T written);
+
+/******************** Public Code ********************/
+
+ULONG Relocate_getJumpSize(SIZE_T sourceAddress, SIZE_T targetAddress)
+{
+	/* The rel32 displacement is relative to the end of the 5 byte jump. */
+	return (TRUE == isRel32Reachable(sourceAddress + RELOCATE_REL32_JUMP_SIZE, targetAddress)) ?
+		RELOCATE_REL32_JUMP_SIZE : RELOCATE_ABSOLUTE_JUMP_SIZE;
+}
+
+ULONG Relocate_writeJump(PUINT8 targetBuffer, SIZE_T sourceAddress, SIZE_T targetAddress)
+{
+	/* Writes a jump that will be executed at sourceAddress, returns its size.
+	 * Neither form touches a register or the stack, so unlike a PUSH/RET sequence
+	 * the return stack buffer stays in sync with the hooked function's callers.
+	 * Tools/DetourBench measures the cost of each form per hooked call. */
+	ULONG jumpSize = Relocate_getJumpSize(sourceAddress, targetAddress);
+
+	if (RELOCATE_REL32_JUMP_SIZE == jumpSize)
+	{
+		/* JMP rel32 */
+		targetBuffer[0] = 0xE9;
+		*((PLONG)&targetBuffer[1]) = (LONG)((LONG64)targetAddress - (LONG64)(sourceAddress + RELOCATE_REL32_JUMP_SIZE));
+	}
+	else
+	{
+		/* JMP QWORD PTR [RIP+0] */
+		targetBuffer[0] = 0xFF;
+		targetBuffer[1] = 0x25;
+		*((PLONG)&targetBuffer[2]) = 0;
+
+		/* DQ targetAddress */
+		*((PSIZE_T)&targetBuffer[6]) = targetAddress;
+	}
+
+	return jumpSize;
+}
+
+NTSTATUS Relocate_copyInstructions(
+	PUINT8 source,
+	SIZE_T minimumSize,
+	PUINT8 destination,
+	SIZE_T destinationAddress,
+	PSIZE_T sourceSize,
+	PSIZE_T destinationSize
+)
+{
+	/* Copies whole instructions from source until at least minimumSize bytes are covered,
+	 * rewriting anything relative to RIP so it behaves the same when executed at destinationAddress.
+	 * That is usually destination itself, but the buffer may be another mapping of the same memory.
+	 * A NULL destination only measures, assuming the longest form of every instruction. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	SIZE_T sourceOffset = 0;
+	SIZE_T destinationOffset = 0;
+
+	while ((NT_SUCCESS(status)) && (sourceOffset < minimumSize))
+	{
+		PUINT8 current = source + sourceOffset;
+		PUINT8 output = (NULL != destination) ? (destination + destinationOffset) : NULL;
+		SIZE_T outputAddress = destinationAddress + destinationOffset;
+		SIZE_T written = 0;
+
+		INSTRUCTION_LAYOUT layout;
+		status = Decoder_decode(current, DECODER_MAX_INSTRUCTION_LENGTH, &layout);
+
+		if (NT_SUCCESS(status))
+		{
+			if (((sourceOffset + layout.length) < minimumSize) && (TRUE == isTerminator(&layout)))
+			{
+				/* The function ends before enough bytes are covered, what follows belongs to something else. */
+				status = STATUS_NOT_CAPABLE;
+			}
+			else if (BRANCH_NONE != getBranchKind(&layout))
+			{
+				written = relocateBranch(current, &layout, output, outputAddress);
+			}
+			else if (TRUE == layout.ripRelative)
+			{
+				status = relocateRIPRelative(current, &layout, output, outputAddress, &written);
+			}
+			else
+			{
+				/* Nothing relative to RIP, just copy. */
+				if (NULL != output)
+				{
+					RtlCopyMemory(output, current, layout.length);
+				}
+
+				written = layout.length;
+			}
+
+			sourceOffset += layout.length;
+			destinationOffset += written;
+		}
+	}
+
+	*sourceSize = sourceOffset;
+	*destinationSize = destinationOffset;
+
+	return status;
+}
+
+NTSTATUS Relocate_checkBranchTargets(PUINT8 function, SIZE_T overwrittenSize, SIZE_T scanSize)
+{
+	/* Decodes the first scanSize bytes of the function linearly, and refuses the hook if any
+	 * relative branch lands inside the overwritten bytes (other than on the first one).
+	 * The scan ends at padding between functions, undecodable bytes or the end of scanSize,
+	 * nothing past it is read so the caller decides what is safe to touch. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PUINT8 current = function;
+	PUINT8 end = function + min(scanSize, RELOCATE_SCAN_SIZE);
+
+	while ((NT_SUCCESS(status)) && ((current + 1) < end))
+	{
+		INSTRUCTION_LAYOUT layout;
+		ULONG availableSize = (ULONG)min((SIZE_T)(end - current), DECODER_MAX_INSTRUCTION_LENGTH);
+
+		if (((0xCC == current[0]) && (0xCC == current[1])) ||
+			(FALSE == NT_SUCCESS(Decoder_decode(current, availableSize, &layout))))
+		{
+			break;
+		}
+
+		if (BRANCH_NONE != getBranchKind(&layout))
+		{
+			UINT64 target = getBranchTarget(current, &layout);
+
+			if ((target > (UINT64)function) && (target < ((UINT64)function + overwrittenSize)))
+			{
+				status = STATUS_NOT_CAPABLE;
+			}
+		}
+
+		current += layout.length;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static BRANCH_KIND getBranchKind(PINSTRUCTION_LAYOUT layout)
+{
+	BRANCH_KIND result = BRANCH_NONE;
+
+	if ((FALSE == layout->vexEncoded) && (OPCODE_MAP_ONE_BYTE == layout->opcodeMap))
+	{
+		if ((layout->opcode >= 0x70) && (layout->opcode <= 0x7F))
+		{
+			/* Jcc rel8 */
+			result = BRANCH_JCC;
+		}
+		else if ((layout->opcode >= 0xE0) && (layout->opcode <= 0xE3))
+		{
+			/* LOOPNE, LOOPE, LOOP, JRCXZ rel8 */
+			result = BRANCH_LOOP;
+		}
+		else if (0xE8 == layout->opcode)
+		{
+			/* CALL rel32 */
+			result = BRANCH_CALL;
+		}
+		else if ((0xE9 == layout->opcode) || (0xEB == layout->opcode))
+		{
+			/* JMP rel32, JMP rel8 */
+			result = BRANCH_JMP;
+		}
+	}
+	else if ((FALSE == layout->vexEncoded) && (OPCODE_MAP_0F == layout->opcodeMap))
+	{
+		if ((layout->opcode >= 0x80) && (layout->opcode <= 0x8F))
+		{
+			/* Jcc rel32 */
+			result = BRANCH_JCC;
+		}
+	}
+
+	return result;
+}
+
+static UINT64 getBranchTarget(PUINT8 address, PINSTRUCTION_LAYOUT layout)
+{
+	/* The displacement is the immediate of every relative branch, 8 or 32 bits. */
+	LONG64 displacement;
+
+	if (sizeof(LONG) == layout->immediateSize)
+	{
+		displacement = *((PLONG)&address[layout->immediateOffset]);
+	}
+	else
+	{
+		displacement = (CHAR)address[layout->immediateOffset];
+	}
+
+	return (UINT64)address + layout->length + displacement;
+}
+
+static BOOLEAN isTerminator(PINSTRUCTION_LAYOUT layout)
+{
+	/* Returns TRUE for instructions that never fall through to the next one. */
+	BOOLEAN result = FALSE;
+
+	if ((FALSE == layout->vexEncoded) && (OPCODE_MAP_ONE_BYTE == layout->opcodeMap))
+	{
+		switch (layout->opcode)
+		{
+		case 0xC2:	/* RET imm16 */
+		case 0xC3:	/* RET */
+		case 0xCA:	/* RETF imm16 */
+		case 0xCB:	/* RETF */
+		case 0xCC:	/* INT3 */
+		case 0xCF:	/* IRET */
+		case 0xE9:	/* JMP rel32 */
+		case 0xEB:	/* JMP rel8 */
+			result = TRUE;
+			break;
+
+		case 0xFF:
+			/* JMP r/m64, JMP m16:64 */
+			result = (4 == ((layout->modRM >> 3) & 0x7)) || (5 == ((layout->modRM >> 3) & 0x7));
+			break;
+
+		default:
+			break;
+		}
+	}
+	else if ((FALSE == layout->vexEncoded) && (OPCODE_MAP_0F == layout->opcodeMap))
+	{
+		/* UD2 */
+		result = (0x0B == layout->opcode);
+	}
+
+	return result;
+}
+
+static BOOLEAN isRel32Reachable(SIZE_T nextAddress, UINT64 targetAddress)
+{
+	LONG64 displacement = (LONG64)targetAddress - (LONG64)nextAddress;
+
+	return ((displacement >= MINLONG) && (displacement <= MAXLONG));
+}
+
+static SIZE_T relocateBranch(PUINT8 source, PINSTRUCTION_LAYOUT layout, PUINT8 destination, SIZE_T destinationAddress)
+{
+	/* Writes a branch to the same target as the source branch, returns its size.
+	 * Short forms are always widened, as the target is rarely within reach of a rel8. */
+	SIZE_T result = 0;
+	UINT64 target = getBranchTarget(source, layout);
+
+	switch (getBranchKind(layout))
+	{
+	case BRANCH_JMP:
+		result = (NULL != destination) ?
+			Relocate_writeJump(destination, destinationAddress, target) : RELOCATE_ABSOLUTE_JUMP_SIZE;
+		break;
+
+	case BRANCH_CALL:
+		if ((NULL != destination) && (TRUE == isRel32Reachable(destinationAddress + 5, target)))
+		{
+			/* CALL rel32 */
+			destination[0] = 0xE8;
+			*((PLONG)&destination[1]) = (LONG)((LONG64)target - (LONG64)(destinationAddress + 5));
+			result = 5;
+		}
+		else
+		{
+			/* CALL [RIP+2], the call returns to a JMP over the address it read. No register is
+			 * clobbered, unlike loading the target into one and calling through it. */
+			if (NULL != destination)
+			{
+				static const UINT8 farCall[8] = { 0xFF, 0x15, 0x02, 0x00, 0x00, 0x00, 0xEB, 0x08 };
+				RtlCopyMemory(destination, farCall, sizeof(farCall));
+				*((PUINT64)&destination[8]) = target;
+			}
+
+			result = FAR_CALL_SIZE;
+		}
+		break;
+
+	case BRANCH_JCC:
+	{
+		UINT8 condition = layout->opcode & 0x0F;
+
+		if ((NULL != destination) && (TRUE == isRel32Reachable(destinationAddress + 6, target)))
+		{
+			/* Jcc rel32 */
+			destination[0] = 0x0F;
+			destination[1] = 0x80 | condition;
+			*((PLONG)&destination[2]) = (LONG)((LONG64)target - (LONG64)(destinationAddress + 6));
+			result = 6;
+		}
+		else if (NULL != destination)
+		{
+			/* The inverted condition skips over a jump to the target. */
+			ULONG jumpSize = Relocate_writeJump(&destination[2], destinationAddress + 2, target);
+			destination[0] = 0x70 | (condition ^ 1);
+			destination[1] = (UINT8)jumpSize;
+			result = 2 + jumpSize;
+		}
+		else
+		{
+			result = 2 + RELOCATE_ABSOLUTE_JUMP_SIZE;
+		}
+		break;
+	}
+
+	case BRANCH_LOOP:
+	{
+		/* LOOP/JRCXZ only take a rel8, so they branch to a jump placed after a short jump over it:
+		 *   LOOP +2; JMP SHORT +n; JMP target
+		 * Prefixes are kept, an address size prefix selects ECX instead of RCX. */
+		ULONG prefixLength = layout->opcodeOffset;
+
+		if (NULL != destination)
+		{
+			RtlCopyMemory(destination, source, prefixLength);
+			destination[prefixLength] = layout->opcode;
+			destination[prefixLength + 1] = 2;
+			destination[prefixLength + 2] = 0xEB;
+
+			ULONG jumpSize = Relocate_writeJump(&destination[prefixLength + 4], destinationAddress + prefixLength + 4, target);
+			destination[prefixLength + 3] = (UINT8)jumpSize;
+
+			result = prefixLength + 4 + jumpSize;
+		}
+		else
+		{
+			result = prefixLength + 4 + RELOCATE_ABSOLUTE_JUMP_SIZE;
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return result;
+}
+
+static NTSTATUS relocateRIPRelative(PUINT8 source, PINSTRUCTION_LAYOUT layout, PUINT8 destination, SIZE_T destinationAddress, PSIZE_T written)
+{
+	/* Rewrites an instruction with a [RIP + disp32] operand. When the new displacement does
+	 * not fit, LEA and MOV loads are replaced by an equivalent sequence using the absolute address. */
+	NTSTATUS status = STATUS_SUCCESS;
+	SIZE_T size = 0;
+
+	LONG displacement = *((PLONG)&source[layout->displacementOffset]);
+	UINT64 target = (UINT64)source + layout->length + displacement;
+
+	/* Register operand from ModRM.reg extended by REX.R. */
+	UINT8 reg = ((layout->modRM >> 3) & 0x7) | ((0 != (layout->rex & 0x04)) ? 8 : 0);
+	BOOLEAN wide = (0 != (layout->rex & 0x08));
+
+	BOOLEAN isLEA = (FALSE == layout->vexEncoded) && (OPCODE_MAP_ONE_BYTE == layout->opcodeMap) &&
+					(0x8D == layout->opcode) && (0 == layout->prefixLength);
+	BOOLEAN isLoad = (FALSE == layout->vexEncoded) && (OPCODE_MAP_ONE_BYTE == layout->opcodeMap) &&
+					 (0x8B == layout->opcode) && (0 == layout->prefixLength);
+
+	if ((NULL != destination) && (TRUE == isRel32Reachable(destinationAddress + layout->length, target)))
+	{
+		/* Same instruction, with the displacement adjusted for the new address. */
+		RtlCopyMemory(destination, source, layout->length);
+		*((PLONG)&destination[layout->displacementOffset]) = (LONG)((LONG64)target - (LONG64)(destinationAddress + layout->length));
+		size = layout->length;
+	}
+	else if (TRUE == isLEA)
+	{
+		if (TRUE == wide)
+		{
+			/* MOV r64, imm64 */
+			if (NULL != destination)
+			{
+				destination[0] = 0x48 | (reg >> 3);
+				destination[1] = 0xB8 + (reg & 0x7);
+				*((PUINT64)&destination[2]) = target;
+			}
+
+			size = MOV_ABSOLUTE_SIZE;
+		}
+		else
+		{
+			/* LEA r32 keeps the low 32 bits of the address, MOV r32, imm32 */
+			ULONG offset = 0;
+
+			if (NULL != destination)
+			{
+				if (reg >= 8)
+				{
+					destination[offset++] = 0x41;
+				}
+
+				destination[offset++] = 0xB8 + (reg & 0x7);
+				*((PULONG)&destination[offset]) = (ULONG)target;
+			}
+
+			size = (reg >> 3) + 5;
+		}
+	}
+	else if (TRUE == isLoad)
+	{
+		/* MOV r64, imm64 into the destination register, then the same load through it:
+		 * MOV reg, [reg] (which needs a SIB for RSP/R12 and a disp8 for RBP/R13). */
+		ULONG baseLength = ((0x4 == (reg & 0x7)) || (0x5 == (reg & 0x7))) ? 1 : 0;
+
+		if (NULL != destination)
+		{
+			ULONG offset = 0;
+
+			destination[offset++] = 0x48 | (reg >> 3);
+			destination[offset++] = 0xB8 + (reg & 0x7);
+			*((PUINT64)&destination[offset]) = target;
+			offset += sizeof(UINT64);
+
+			/* REX keeps W and R, B selects the high registers as the base. */
+			destination[offset++] = 0x40 | (layout->rex & 0x0C) | (reg >> 3);
+			destination[offset++] = 0x8B;
+
+			if (0x5 == (reg & 0x7))
+			{
+				destination[offset++] = 0x40 | ((reg & 0x7) << 3) | (reg & 0x7);
+				destination[offset++] = 0x00;
+			}
+			else
+			{
+				destination[offset++] = ((reg & 0x7) << 3) | (reg & 0x7);
+
+				if (0x4 == (reg & 0x7))
+				{
+					destination[offset++] = 0x24;
+				}
+			}
+		}
+
+		size = MOV_ABSOLUTE_SIZE + 3 + baseLength;
+	}
+	else if (NULL != destination)
+	{
+		/* Anything else would need a scratch register. */
+		status = STATUS_NOT_CAPABLE;
+	}
+
+	/* When measuring, allow for either form being used. */
+	if (NULL == destination)
+	{
+		size = max(size, layout->length);
+	}
+
+	*written = size;
+
+	return status;
+}
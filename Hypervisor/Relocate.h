@@ -0,0 +1,35 @@
+#pragma once
+#include "Platform_Common.h"
+
+/******************** Public Defines ********************/
+
+/* Sizes of the jumps written by Relocate_writeJump, JMP rel32 when the destination is
+ * within 2GB and JMP [RIP+0] followed by the absolute destination otherwise. */
+#define RELOCATE_REL32_JUMP_SIZE 5
+#define RELOCATE_ABSOLUTE_JUMP_SIZE 14
+
+/* Amount of code after the start of a function searched for branches into its prologue,
+ * callers pass how much of it is resident. */
+#define RELOCATE_SCAN_SIZE 0x400
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+ULONG Relocate_getJumpSize(SIZE_T sourceAddress, SIZE_T targetAddress);
+ULONG Relocate_writeJump(PUINT8 targetBuffer, SIZE_T sourceAddress, SIZE_T targetAddress);
+
+NTSTATUS Relocate_copyInstructions(
+	PUINT8 source,
+	SIZE_T minimumSize,
+	PUINT8 destination,
+	SIZE_T destinationAddress,
+	PSIZE_T sourceSize,
+	PSIZE_T destinationSize
+);
+
+NTSTATUS Relocate_checkBranchTargets(PUINT8 function, SIZE_T overwrittenSize, SIZE_T scanSize);
\ No newline at end of file
@@ -1,16 +1,58 @@
+#include <intrin.h>
 #include "VMCALL.h"
 #include "VMCALL_Common.h"
 #include "MemManage.h"
 #include "VMShadow.h"
+#include "VMHook.h"
+#include "VMSync.h"
 #include "Process.h"
 
 /******************** External API ********************/
 
+/* Executes the VMCALL instruction (VMCALL_Stub.asm). */
+extern NTSTATUS VMCALL_issue(UINT64 key, PVMCALL_COMMAND command);
 
 /******************** Module Typedefs ********************/
 
 typedef NTSTATUS(*fnActionHandler)(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
 
+/* Amount of layout records staged before being written to the guest. */
+#define EXPORT_CHUNK_RECORDS 32
+
+/* State of an EPT layout export into a guest buffer. */
+typedef struct _EXPORT_CONTEXT
+{
+	PVMM_DATA lpData;
+	CR3 guestCR3;
+	GUEST_VIRTUAL_ADDRESS buffer;
+	SIZE_T bufferSize;
+
+	/* Offset of the next chunk within the guest buffer, and the total amount of records. */
+	SIZE_T offset;
+	UINT32 recordCount;
+
+	EPT_LAYOUT_RECORD chunk[EXPORT_CHUNK_RECORDS];
+	UINT32 chunkCount;
+
+	/* Status of writing to the guest, the records are still counted if it fails. */
+	NTSTATUS writeStatus;
+} EXPORT_CONTEXT, *PEXPORT_CONTEXT;
+
+/* State of a hook statistics export into a guest buffer, there are few enough
+ * records for each to be written as it is produced. */
+typedef struct _HOOK_STATS_CONTEXT
+{
+	PVMM_DATA lpData;
+	CR3 guestCR3;
+	GUEST_VIRTUAL_ADDRESS buffer;
+	SIZE_T bufferSize;
+
+	SIZE_T offset;
+	UINT32 recordCount;
+
+	NTSTATUS writeStatus;
+} HOOK_STATS_CONTEXT, *PHOOK_STATS_CONTEXT;
+
 /******************** Module Constants ********************/
 
 
@@ -18,9 +60,17 @@ typedef NTSTATUS(*fnActionHandler)(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL
 
 
 /******************** Module Prototypes ********************/
+static NTSTATUS shadowInProcessAll(PVOID buffer, SIZE_T bufferSize);
 static NTSTATUS actionCheckPresence(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
 static NTSTATUS actionRunAsRoot(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
 static NTSTATUS actionShadowInProcess(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS actionSyncEPT(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS actionExportEPT(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS exportRecord(const PEPT_LAYOUT_RECORD record, PVOID userParameter);
+static void flushExportChunk(PEXPORT_CONTEXT context);
+static NTSTATUS actionExportHookStats(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS exportHookStatsRecord(const PVMHOOK_STATS_RECORD record, PVOID userParameter);
+static NTSTATUS actionExportTlbStats(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
 
 /******************** Action Handlers ********************/
 
@@ -29,10 +79,33 @@ static const fnActionHandler ACTION_HANDLERS[VMCALL_ACTION_COUNT] =
 	[VMCALL_ACTION_CHECK_PRESENCE] = actionCheckPresence,
 	[VMCALL_ACTION_RUN_AS_ROOT] = actionRunAsRoot,
 	[VMCALL_ACTION_SHADOW_IN_PROCESS] = actionShadowInProcess,
+	[VMCALL_ACTION_SYNC_EPT] = actionSyncEPT,
+	[VMCALL_ACTION_EXPORT_EPT] = actionExportEPT,
+	[VMCALL_ACTION_EXPORT_HOOK_STATS] = actionExportHookStats,
+	[VMCALL_ACTION_EXPORT_TLB_STATS] = actionExportTlbStats,
 };
 
 /******************** Public Code ********************/
 
+NTSTATUS VMCALL_actionHost(UINT64 key, PVMCALL_COMMAND command)
+{
+	/* Called from the guest. An IPI cannot be sent from VMX root, so actions that change
+	 * every processor are carried out here with a VMSync broadcast, everything else is
+	 * handled by the hypervisor of the calling processor. */
+	NTSTATUS status;
+
+	if ((VMCALL_KEY == key) && (NULL != command) && (VMCALL_ACTION_SHADOW_IN_PROCESS == command->action))
+	{
+		status = shadowInProcessAll(command->buffer, command->bufferSize);
+	}
+	else
+	{
+		status = VMCALL_issue(key, command);
+	}
+
+	return status;
+}
+
 BOOLEAN VMCALL_handle(PVMM_DATA lpData)
 {
 	UNREFERENCED_PARAMETER(lpData);
@@ -101,10 +174,18 @@ static NTSTATUS actionRunAsRoot(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_AD
 		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
 		if (NT_SUCCESS(status))
 		{
-			/* Call the specified function (we will currently be in VMX ROOT). */
+			/* Call the specified function (we will currently be in VMX ROOT). The function and
+			 * whatever it touches belong to the guest, which the host tables do not map, so it runs
+			 * under the page tables of the caller. The host tables are loaded again afterwards and
+			 * the global kernel pages the function left in the TLB are dropped with them. */
 			if (NULL != params.callback)
 			{
+				__writecr3(guestCR3.Flags);
 				status = params.callback(lpData, params.parameter);
+				__writecr3(lpData->hostCR3.Flags);
+
+				lpData->hostGeneration = 0;
+				PageTable_refreshHost(&lpData->hostGeneration);
 			}
 			else
 			{
@@ -120,38 +201,300 @@ static NTSTATUS actionRunAsRoot(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_AD
 	return status;
 }
 
+static NTSTATUS shadowInProcessAll(PVOID buffer, SIZE_T bufferSize)
+{
+	/* Called from the guest by VMCALL_actionHost, the page is hidden on every processor. */
+	NTSTATUS status;
+
+	if ((NULL != buffer) && (sizeof(VM_PARAM_SHADOW_PROC) == bufferSize) && (KeGetCurrentIrql() <= APC_LEVEL))
+	{
+		PVM_PARAM_SHADOW_PROC params = (PVM_PARAM_SHADOW_PROC)buffer;
+
+		/* Get the PEPROCESS of the target process. */
+		PEPROCESS targetProcess;
+		if (0 != params->procID)
+		{
+			status = PsLookupProcessByProcessId((HANDLE)(ULONG_PTR)params->procID, &targetProcess);
+			if (NT_SUCCESS(status))
+			{
+				/* Tell the VMShadow module to hide the executable page at the specified
+				 * address, for the target process only. */
+				status = VMShadow_hideExecInProcessAll(targetProcess,
+					params->userTargetVA,
+					params->kernelExecPageVA,
+					NULL);
+
+				ObDereferenceObject(targetProcess);
+			}
+		}
+		else
+		{
+			status = STATUS_INVALID_PARAMETER;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
 static NTSTATUS actionShadowInProcess(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	UNREFERENCED_PARAMETER(lpData);
+	UNREFERENCED_PARAMETER(guestCR3);
+	UNREFERENCED_PARAMETER(buffer);
+	UNREFERENCED_PARAMETER(bufferSize);
+
+	/* Only reached when the VMCALL instruction is issued directly, VMCALL_actionHost
+	 * carries this action out from the guest so that every processor is changed. */
+	return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS actionSyncEPT(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	UNREFERENCED_PARAMETER(guestCR3);
+	UNREFERENCED_PARAMETER(buffer);
+	UNREFERENCED_PARAMETER(bufferSize);
+
+	/* The batch is owned by the VMSync module, nothing is taken from the guest buffer. */
+	return VMSync_applyPending(lpData);
+}
+
+static NTSTATUS actionExportEPT(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
 {
 	NTSTATUS status;
 
-	if ((0 != buffer) && (sizeof(VM_PARAM_SHADOW_PROC) == bufferSize))
+	if ((0 != buffer) && (sizeof(VM_PARAM_EXPORT_EPT) == bufferSize))
 	{
-		VM_PARAM_SHADOW_PROC params = { 0 };
+		VM_PARAM_EXPORT_EPT params = { 0 };
 
 		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
 		if (NT_SUCCESS(status))
 		{
+			/* Records are written after the header, which is written last once the count is known.
+			 * The context holds a chunk of records, so it is cleared inline as the kernel's memset
+			 * is not mapped in the host. */
+			EXPORT_CONTEXT context;
+			__stosb((PUCHAR)&context, 0, sizeof(context));
+			context.lpData = lpData;
+			context.guestCR3 = guestCR3;
+			context.buffer = (GUEST_VIRTUAL_ADDRESS)params.buffer;
+			context.bufferSize = params.bufferSize;
+			context.offset = sizeof(EPT_LAYOUT_HEADER);
+			context.writeStatus = ((NULL != params.buffer) && (params.bufferSize >= sizeof(EPT_LAYOUT_HEADER))) ?
+								  STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL;
+
+			status = EPT_exportLayout(&lpData->eptConfig, exportRecord, &context);
+			if (NT_SUCCESS(status))
+			{
+				flushExportChunk(&context);
+
+				if (NT_SUCCESS(context.writeStatus))
+				{
+					EPT_LAYOUT_HEADER header = { 0 };
+					header.magic = EPT_LAYOUT_MAGIC;
+					header.version = EPT_LAYOUT_VERSION;
+					header.processorIndex = lpData->processorIndex;
+					header.recordCount = context.recordCount;
+					header.eptPointer = lpData->eptConfig.eptPointer.Flags;
+
+					context.writeStatus = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, 
+																		context.buffer, &header, sizeof(header));
+				}
+
+				/* Let the caller know the size needed, even if the buffer was too small. */
+				params.requiredSize = sizeof(EPT_LAYOUT_HEADER) + ((SIZE_T)context.recordCount * sizeof(EPT_LAYOUT_RECORD));
+				status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+
+				if (NT_SUCCESS(status))
+				{
+					status = context.writeStatus;
+				}
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS exportRecord(const PEPT_LAYOUT_RECORD record, PVOID userParameter)
+{
+	PEXPORT_CONTEXT context = (PEXPORT_CONTEXT)userParameter;
+
+	context->chunk[context->chunkCount++] = *record;
+	context->recordCount++;
+
+	if (EXPORT_CHUNK_RECORDS == context->chunkCount)
+	{
+		flushExportChunk(context);
+	}
+
+	/* Always continue, so that the required size can be reported. */
+	return STATUS_SUCCESS;
+}
+
+static void flushExportChunk(PEXPORT_CONTEXT context)
+{
+	SIZE_T chunkSize = context->chunkCount * sizeof(EPT_LAYOUT_RECORD);
+
+	if (NT_SUCCESS(context->writeStatus) && (0 != chunkSize))
+	{
+		if ((context->offset + chunkSize) <= context->bufferSize)
+		{
+			context->writeStatus = MemManage_writeVirtualAddress(&context->lpData->mmContext, context->guestCR3,
+																 context->buffer + context->offset, context->chunk, chunkSize);
+		}
+		else
+		{
+			context->writeStatus = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+
+	context->offset += chunkSize;
+	context->chunkCount = 0;
+}
+
+static NTSTATUS actionExportHookStats(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_EXPORT_HOOK_STATS) == bufferSize))
+	{
+		VM_PARAM_EXPORT_HOOK_STATS params = { 0 };
 
-			/* Get the PEPROCESS of the target process. */
-			PEPROCESS targetProcess;
-			if (0 != params.procID)
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			/* Records are written after the header, which is written last once the count is known. */
+			HOOK_STATS_CONTEXT context = { 0 };
+			context.lpData = lpData;
+			context.guestCR3 = guestCR3;
+			context.buffer = (GUEST_VIRTUAL_ADDRESS)params.buffer;
+			context.bufferSize = params.bufferSize;
+			context.offset = sizeof(VMHOOK_STATS_HEADER);
+			context.writeStatus = ((NULL != params.buffer) && (params.bufferSize >= sizeof(VMHOOK_STATS_HEADER))) ?
+								  STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL;
+
+			status = VMHook_exportStats(exportHookStatsRecord, &context);
+			if (NT_SUCCESS(status))
 			{
-				status = PsLookupProcessByProcessId((HANDLE)params.procID, &targetProcess);
+				if (NT_SUCCESS(context.writeStatus))
+				{
+					VMHOOK_STATS_HEADER header = { 0 };
+					header.magic = VMHOOK_STATS_MAGIC;
+					header.version = VMHOOK_STATS_VERSION;
+					header.recordCount = context.recordCount;
+					header.tscFrequency = VMM_getTSCFrequency();
+
+					context.writeStatus = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3,
+																		context.buffer, &header, sizeof(header));
+				}
+
+				/* Let the caller know the size needed, even if the buffer was too small. */
+				params.requiredSize = sizeof(VMHOOK_STATS_HEADER) + ((SIZE_T)context.recordCount * sizeof(VMHOOK_STATS_RECORD));
+				status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+
 				if (NT_SUCCESS(status))
 				{
-					/* Tell the VMShadow module to hide the executable page at the specified
-						* address, for the target process only. */
-					status = VMShadow_hideExecInProcess(lpData,
-						targetProcess,
-						params.userTargetVA,
-						params.kernelExecPageVA);
-
-					ObDereferenceObject(targetProcess);
+					status = context.writeStatus;
 				}
 			}
-			else
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS exportHookStatsRecord(const PVMHOOK_STATS_RECORD record, PVOID userParameter)
+{
+	PHOOK_STATS_CONTEXT context = (PHOOK_STATS_CONTEXT)userParameter;
+
+	if (NT_SUCCESS(context->writeStatus))
+	{
+		if ((context->offset + sizeof(VMHOOK_STATS_RECORD)) <= context->bufferSize)
+		{
+			context->writeStatus = MemManage_writeVirtualAddress(&context->lpData->mmContext, context->guestCR3,
+																 context->buffer + context->offset, record, sizeof(VMHOOK_STATS_RECORD));
+		}
+		else
+		{
+			context->writeStatus = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+
+	context->offset += sizeof(VMHOOK_STATS_RECORD);
+	context->recordCount++;
+
+	/* Always continue, so that the required size can be reported. */
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS actionExportTlbStats(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_EXPORT_TLB_STATS) == bufferSize))
+	{
+		VM_PARAM_EXPORT_TLB_STATS params = { 0 };
+
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			NTSTATUS writeStatus = (NULL != params.buffer) ? STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL;
+			SIZE_T recordCount = 0;
+
+			/* The counters of other processors are read while they may still be counting,
+			 * which is fine for statistics as no one relies on them being exact. */
+			for (ULONG i = 0; i < MAX_LOGICAL_PROCESSORS; i++)
 			{
-				status = STATUS_INVALID_PARAMETER;
+				PVMM_DATA processorData = VMM_getProcessorData(i);
+
+				if (NULL != processorData)
+				{
+					SIZE_T offset = recordCount * sizeof(VM_TLB_STATS);
+
+					if (NT_SUCCESS(writeStatus))
+					{
+						if ((offset + sizeof(VM_TLB_STATS)) <= params.bufferSize)
+						{
+							VM_TLB_STATS record;
+							__stosb((PUINT8)&record, 0, sizeof(record));
+							record.processorIndex = i;
+							record.hits = processorData->mmContext.tlb.hits;
+							record.misses = processorData->mmContext.tlb.misses;
+							record.invalidations = processorData->mmContext.tlb.invalidations;
+							record.flushes = processorData->mmContext.tlb.flushes;
+
+							writeStatus = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3,
+																		(GUEST_VIRTUAL_ADDRESS)params.buffer + offset, &record, sizeof(record));
+						}
+						else
+						{
+							writeStatus = STATUS_BUFFER_TOO_SMALL;
+						}
+					}
+
+					recordCount++;
+				}
+			}
+
+			/* Let the caller know the size needed, even if the buffer was too small. */
+			params.requiredSize = recordCount * sizeof(VM_TLB_STATS);
+			status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+
+			if (NT_SUCCESS(status))
+			{
+				status = writeStatus;
 			}
 		}
 	}
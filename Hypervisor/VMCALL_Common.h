@@ -13,6 +13,10 @@ typedef enum
 	VMCALL_ACTION_CHECK_PRESENCE = 0,
 	VMCALL_ACTION_RUN_AS_ROOT,
 	VMCALL_ACTION_SHADOW_IN_PROCESS,
+	VMCALL_ACTION_SYNC_EPT,
+	VMCALL_ACTION_EXPORT_EPT,
+	VMCALL_ACTION_EXPORT_HOOK_STATS,
+	VMCALL_ACTION_EXPORT_TLB_STATS,
 	VMCALL_ACTION_COUNT
 } VMCALL_ACTION;
 
@@ -36,6 +40,42 @@ typedef struct _VM_PARAM_SHADOW_PROC
 	PUINT8 kernelExecPageVA;	/* IN */
 } VM_PARAM_SHADOW_PROC, *PVM_PARAM_SHADOW_PROC;
 
+/* Buffer receives an EPT_LAYOUT_HEADER followed by its EPT_LAYOUT_RECORDs (EPTLayout_Common.h)
+ * for the processor executing the VMCALL. */
+typedef struct _VM_PARAM_EXPORT_EPT
+{
+	PVOID buffer;				/* IN */
+	SIZE_T bufferSize;			/* IN */
+	SIZE_T requiredSize;		/* OUT */
+} VM_PARAM_EXPORT_EPT, *PVM_PARAM_EXPORT_EPT;
+
+/* Buffer receives a VMHOOK_STATS_HEADER followed by a VMHOOK_STATS_RECORD (VMHookStats_Common.h)
+ * for each installed hook that was instrumented. */
+typedef struct _VM_PARAM_EXPORT_HOOK_STATS
+{
+	PVOID buffer;				/* IN */
+	SIZE_T bufferSize;			/* IN */
+	SIZE_T requiredSize;		/* OUT */
+} VM_PARAM_EXPORT_HOOK_STATS, *PVM_PARAM_EXPORT_HOOK_STATS;
+
+/* Counters of the guest translation cache the host keeps for a logical processor. */
+typedef struct _VM_TLB_STATS
+{
+	UINT32 processorIndex;
+	UINT64 hits;
+	UINT64 misses;
+	UINT64 invalidations;		/* Translations dropped by a guest INVLPG. */
+	UINT64 flushes;
+} VM_TLB_STATS, *PVM_TLB_STATS;
+
+/* Buffer receives a VM_TLB_STATS for each logical processor running the hypervisor. */
+typedef struct _VM_PARAM_EXPORT_TLB_STATS
+{
+	PVOID buffer;				/* IN */
+	SIZE_T bufferSize;			/* IN */
+	SIZE_T requiredSize;		/* OUT */
+} VM_PARAM_EXPORT_TLB_STATS, *PVM_PARAM_EXPORT_TLB_STATS;
+
 /******************** Public Constants ********************/
 
 #define VMCALL_KEY	((UINT64)0xDEADDEAD)
@@ -44,7 +84,8 @@ typedef struct _VM_PARAM_SHADOW_PROC
 
 /******************** Public Prototypes ********************/
 
-/* Calling convention of the function for calling the host. */
+/* Calling convention of the function for calling the host.
+ * VMCALL_ACTION_SHADOW_IN_PROCESS changes every processor and must be requested at IRQL <= APC_LEVEL. */
 NTSTATUS VMCALL_actionHost(UINT64 key, PVMCALL_COMMAND command);
 
 #ifdef __cplusplus
@@ -1,6 +1,6 @@
     .code
 
-	VMCALL_actionHost PROC
+	VMCALL_issue PROC
 
 	; RCX should hold the key (hopefully convention not broken)
 	; RDX should hold a pointer to VMCALL_COMMAND parameters (same as above)
@@ -11,6 +11,6 @@
 
 	ret
 
-	VMCALL_actionHost ENDP
+	VMCALL_issue ENDP
 
     end
\ No newline at end of file
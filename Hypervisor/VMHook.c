@@ -2,7 +2,11 @@
 #include <intrin.h>
 #include "VMHook.h"
 #include "VMShadow.h"
-#include "BEA\BeaEngine.h"
+#include "VMSync.h"
+#include "Relocate.h"
+#include "MemManage.h"
+#include "VMM.h"
+#include "ExportIndex.h"
 #include "Debug.h"
 
 /******************** External API ********************/
@@ -10,237 +14,1343 @@
 
 /******************** Module Typedefs ********************/
 
-typedef struct _PENDING_HOOK
+/* Life cycle of a registry entry, every transition is made with an interlocked operation. */
+typedef enum _HOOK_STATE
 {
+	HOOK_STATE_FREE = 0,
+
+	/* Owned by a single caller that is filling in, preparing or removing the hook. */
+	HOOK_STATE_BUSY,
+
+	/* Registered before launch, waiting for VMHook_prepare. */
+	HOOK_STATE_QUEUED,
+
+	/* Prepared and installed by every processor (or about to be, at launch). */
+	HOOK_STATE_ACTIVE
+} HOOK_STATE;
+
+/* Statistics one processor keeps for an instrumented hook, updated by the stubs emitted around it. */
+typedef struct _HOOK_CPU_STATS
+{
+	UINT64 calls;
+
+	/* TSC when the hook was entered, taken (and cleared) when the hook calls the original function. */
+	UINT64 entryTSC;
+
+	UINT64 timedCalls;
+	UINT64 totalCycles;
+	UINT32 cycleBuckets[VMHOOK_CYCLE_BUCKETS];
+} HOOK_CPU_STATS, *PHOOK_CPU_STATS;
+
+/* Keeps the statistics of each processor on cache lines of their own. */
+C_ASSERT(0 == (sizeof(HOOK_CPU_STATS) % 64));
+
+typedef struct _HOOK_ENTRY
+{
+	volatile LONG state;
+
+	/* Incremented every time the entry is released, so stale handles are rejected. */
+	volatile LONG generation;
+
 	PVOID target;
 	PVOID hook;
 	PVOID* original;
-} PENDING_HOOK, *PPENDING_HOOK;
+
+	/* Page of the target, resolved in the guest as VMX root cannot translate it.
+	 * The page is locked so the frame stays the target's for as long as it may be shadowed. */
+	PHYSICAL_ADDRESS targetPA;
+	PMDL targetMdl;
+
+	/* Built on the guest side, then installed by every processor. */
+	UINT8 detour[RELOCATE_ABSOLUTE_JUMP_SIZE];
+	ULONG detourSize;
+	PUINT8 trampoline;
+	SIZE_T trampolineSize;
+
+	/* Instrumentation (VMHOOK_FLAG_*), the statistics of every processor and the stub
+	 * the detour jumps to, which updates them before jumping to the hook. */
+	ULONG flags;
+	PHOOK_CPU_STATS stats;
+	PUINT8 entryStub;
+	SIZE_T entryStubSize;
+	UINT64 installTSC;
+
+	/* Processors that failed the last edit broadcast for this hook. */
+	volatile LONG failedProcessors;
+} HOOK_ENTRY, *PHOOK_ENTRY;
+
+/* Segments are never freed or moved, so an entry stays valid while the registry grows. */
+typedef struct _HOOK_SEGMENT
+{
+	HOOK_ENTRY entries[VMHOOK_SEGMENT_ENTRIES];
+} HOOK_SEGMENT, *PHOOK_SEGMENT;
+
+/* Executable chunks that trampolines are packed into, TRAMPOLINE_SLOT_SIZE bytes at a time. */
+typedef struct _TRAMPOLINE_ARENA
+{
+	PUINT8 chunks[TRAMPOLINE_ARENA_MAX_CHUNKS];
+
+	/* Chunks are only added at PASSIVE_LEVEL, a chunk is published by incrementing the count. */
+	volatile LONG chunkCount;
+
+	/* Protects the slot bitmaps. */
+	volatile LONG lock;
+
+	/* One bit per slot, set when the slot is in use. */
+	UINT64 usedSlots[TRAMPOLINE_ARENA_MAX_CHUNKS][TRAMPOLINE_CHUNK_SLOTS / 64];
+} TRAMPOLINE_ARENA, *PTRAMPOLINE_ARENA;
 
 /******************** Module Constants ********************/
-#define MAX_HOOKS 50
+
+#define HOOK_REGISTRY_SIZE (VMHOOK_SEGMENT_ENTRIES * VMHOOK_MAX_SEGMENTS)
+
+/* A handle holds the entry index plus one in its low word and the entry generation in its high word. */
+#define HOOK_HANDLE_INDEX_MASK 0xFFFF
+#define HOOK_HANDLE_GENERATION_SHIFT 16
+
+/* KPCR.Prcb.Number, the index returned by KeGetCurrentProcessorIndex. The stubs read it
+ * through GS, it is checked against KeGetCurrentProcessorIndex before any stub is built. */
+#define PCR_PROCESSOR_INDEX_OFFSET 0x1A4
+
+/* Longest statistics stub, not counting the jump that ends an entry stub. */
+#define HOOK_STUB_MAX_SIZE 128
 
 /******************** Module Variables ********************/
 
-static SIZE_T pendingHookCount = 0;
-static PENDING_HOOK pendingHooks[MAX_HOOKS] = { 0 };
+/* Segments of the hook registry, each published with a compare exchange when first needed. */
+static PHOOK_SEGMENT volatile hookSegments[VMHOOK_MAX_SEGMENTS] = { 0 };
+
+/* Set once the queued hooks have been prepared, later hooks are installed straight away. */
+static volatile LONG hooksLaunched = FALSE;
+
+/* Executable memory shared by every trampoline. */
+static TRAMPOLINE_ARENA trampolineArena = { 0 };
 
 /******************** Module Prototypes ********************/
-static NTSTATUS hookAFunction(PEPT_CONFIG eptConfig, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
-static NTSTATUS createTrampoline(PUINT8 hookPage, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
-static void generateAbsoluteJump(PUINT8 targetBuffer, SIZE_T targetAddress);
+static NTSTATUS prepareHook(PHOOK_ENTRY entry, BOOLEAN hypervisorRunning);
+static NTSTATUS installHook(PEPT_CONFIG eptConfig, PHOOK_ENTRY entry);
+static NTSTATUS syncInstallHook(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS syncRemoveHook(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS claimEntry(PHOOK_ENTRY* entry, PVMHOOK_HANDLE handle);
+static PHOOK_ENTRY acquireEntry(VMHOOK_HANDLE handle, PLONG previousState);
+static void releaseEntry(PHOOK_ENTRY entry);
+static NTSTATUS lockTargetPage(PHOOK_ENTRY entry);
+static void unlockTargetPage(PHOOK_ENTRY entry);
+static PHOOK_ENTRY getEntry(ULONG index);
+static BOOLEAN isTargetHooked(PHOOK_ENTRY entry);
+static NTSTATUS allocateHookStats(PHOOK_ENTRY entry);
+static void freeHookCode(PHOOK_ENTRY entry);
+static NTSTATUS createTrampoline(PHOOK_ENTRY entry);
+static NTSTATUS createEntryStub(PHOOK_ENTRY entry);
+static ULONG emitStatsPrologue(PUINT8 stub, PHOOK_CPU_STATS stats, PULONG skipOffset);
+static ULONG emitEntryStub(PUINT8 stub, PHOOK_CPU_STATS stats, BOOLEAN measureCycles);
+static ULONG emitChainStub(PUINT8 stub, PHOOK_CPU_STATS stats);
+static UINT64 getCycleBucketBound(ULONG bucket);
+static NTSTATUS growTrampolineArena(void);
+static PUINT8 allocateTrampoline(SIZE_T size, SIZE_T nearAddress);
+static PUINT8 takeTrampolineSlots(SIZE_T size, SIZE_T nearAddress);
+static void freeTrampoline(PUINT8 trampoline, SIZE_T size);
+static ULONG findFreeSlots(PUINT64 usedSlots, ULONG slotCount);
+static void setSlots(PUINT64 usedSlots, ULONG firstSlot, ULONG slotCount, BOOLEAN used);
+static KIRQL lockTrampolineArena(void);
+static void unlockTrampolineArena(KIRQL oldIrql);
 
 /******************** Public Code ********************/
 
+NTSTATUS VMHook_prepare(void)
+{
+	/* Called at PASSIVE_LEVEL before the hypervisor is launched. Each queued hook is decoded,
+	 * relocated into its trampoline and patched into its execute page once, so every processor
+	 * only has to install the result. A hook that cannot be prepared is released, the hypervisor
+	 * must not be launched if this fails as VMX root could not reach the registry. */
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG preparedCount = 0;
+
+	/* Hooks registered from now on are installed by a broadcast instead. */
+	InterlockedExchange(&hooksLaunched, TRUE);
+
+	/* Calibrated here at PASSIVE_LEVEL, the statistics are exported from VMX root. */
+	VMM_getTSCFrequency();
+
+	/* VMX root walks the registry, segments allocated from now on are mapped in the host as they are. */
+	for (ULONG segmentIndex = 0; (segmentIndex < VMHOOK_MAX_SEGMENTS) && (NT_SUCCESS(status)); segmentIndex++)
+	{
+		if (NULL != hookSegments[segmentIndex])
+		{
+			status = PageTable_mapHost(hookSegments[segmentIndex], sizeof(HOOK_SEGMENT));
+		}
+	}
+
+	for (ULONG index = 0; (index < HOOK_REGISTRY_SIZE) && (NT_SUCCESS(status)); index++)
+	{
+		PHOOK_ENTRY current = getEntry(index);
+
+		if ((NULL != current) &&
+			(HOOK_STATE_QUEUED == InterlockedCompareExchange(&current->state, HOOK_STATE_BUSY, HOOK_STATE_QUEUED)))
+		{
+			NTSTATUS hookStatus = prepareHook(current, FALSE);
+
+			if (NT_SUCCESS(hookStatus))
+			{
+				current->installTSC = __rdtsc();
+				InterlockedExchange(&current->state, HOOK_STATE_ACTIVE);
+				preparedCount++;
+			}
+			else
+			{
+				DEBUG_PRINT("Unable to prepare the hook of %p: 0x%X\r\n", current->target, hookStatus);
+
+				if (NULL != current->stats)
+				{
+					ExFreePool(current->stats);
+				}
+
+				releaseEntry(current);
+			}
+		}
+	}
+
+	/* Each processor installs every hook before launch, without being able to allocate.
+	 * Every hook may need its page split and a handler for its shadow. */
+	if ((NT_SUCCESS(status)) && (0 != preparedCount))
+	{
+		status = EPT_reserve(preparedCount, preparedCount);
+	}
+
+	return status;
+}
+
 NTSTATUS VMHook_init(PEPT_CONFIG eptConfig)
 {
 	/* This is called when the hypervisor IS initialised. Hooks can be pending before.
-	* This is called once per logical-processor. */
+	* This is called once per logical-processor, nothing is allocated here. */
 
 	/* Assume successful until failure. */
 	NTSTATUS status = STATUS_SUCCESS;
 
-	/* Iterate through all the pending hooks and initialise them. */
-	for (SIZE_T i = 0; i < pendingHookCount; i++)
+	/* Iterate through all the prepared hooks and install them. */
+	for (ULONG index = 0; index < HOOK_REGISTRY_SIZE; index++)
 	{
-		PPENDING_HOOK current = &pendingHooks[i];
-
-		status = hookAFunction(eptConfig, current->target, current->hook, current->original);
+		PHOOK_ENTRY current = getEntry(index);
 
-		if (FALSE == NT_SUCCESS(status))
+		if ((NULL != current) && (HOOK_STATE_ACTIVE == current->state))
 		{
-			/* Don't continue with hooking, just fail gracefully. */
-			break;
+			status = installHook(eptConfig, current);
+
+			if (FALSE == NT_SUCCESS(status))
+			{
+				/* Don't continue with hooking, just fail gracefully. */
+				break;
+			}
 		}
 	}
 
 	return status;
 }
 
-void VMHook_queueHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+NTSTATUS VMHook_queueHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
 {
 	/* As some hooks are may be called before the hypervisor is initialised, we provide the
 	* ability to create a queue of hooks, this means we can do the hooks without needing to be
 	* running at the hypervisor's DPC IRQL.
 	*
-	* All pending hooks are hooked at hypervisor initialisation. */
+	* Hooks registered before launch are prepared by VMHook_prepare and hooked at hypervisor
+	* initialisation, afterwards this is the same as VMHook_install without keeping the handle. */
+	VMHOOK_HANDLE handle;
+
+	return VMHook_install(targetFunction, hookFunction, origFunction, 0, &handle);
+}
+
+NTSTATUS VMHook_install(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction, ULONG flags, PVMHOOK_HANDLE handle)
+{
+	/* Called at PASSIVE_LEVEL, before or while the hypervisor is running. The trampoline is built
+	 * here in the guest, then every processor installs the detour from one VMSync broadcast.
+	 * Installs from several callers that commit at the same time share a single broadcast.
+	 *
+	 * The flags optionally count the calls of the hook on each processor, and measure the cycles
+	 * spent in the hook until it calls the original function, see VMHook_exportStats.
+	 *
+	 * NOTE: This only works with virtual addresses in the kernel as they are mapped to every
+	 * logical processor, functions of a user process are hooked with VMUserHook_install. */
+	NTSTATUS status;
+	PHOOK_ENTRY entry = NULL;
+
+	/* Set once the stubs may have been executed, they (and the statistics) are then never freed. */
+	BOOLEAN codeExecuted = FALSE;
+
+	if ((NULL != targetFunction) && (NULL != hookFunction) && (NULL != origFunction) && (NULL != handle) &&
+		(0 == (flags & ~(VMHOOK_FLAG_COUNT_CALLS | VMHOOK_FLAG_MEASURE_CYCLES))))
+	{
+		status = claimEntry(&entry, handle);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
 
-	/* NOTE: At the moment this only works with virtual addresses in the kernel as they are mapped
-	* to every logical processor. We will need to use IoAllocateMdl if we want to hook usermode
-	* addresses in the future. */
+	if (NT_SUCCESS(status))
+	{
+		entry->target = targetFunction;
+		entry->hook = hookFunction;
+		entry->original = origFunction;
+		entry->flags = flags;
+
+		if (TRUE == isTargetHooked(entry))
+		{
+			/* Two detours cannot share a target, racing installs of the same target both fail. */
+			status = STATUS_ALREADY_REGISTERED;
+		}
+		else if ((0 != flags) && (FALSE == NT_SUCCESS(allocateHookStats(entry))))
+		{
+			status = STATUS_NOT_SUPPORTED;
+		}
+		else if (FALSE == hooksLaunched)
+		{
+			/* The hypervisor is not running yet, VMHook_prepare will build it. */
+			InterlockedExchange(&entry->state, HOOK_STATE_QUEUED);
+		}
+		else
+		{
+			/* VMX root cannot allocate, so each processor must have a split and a handler to hand. */
+			status = EPT_reserve(1, 1);
+
+			if (NT_SUCCESS(status))
+			{
+				status = prepareHook(entry, TRUE);
+			}
 
-	PPENDING_HOOK newHook = &pendingHooks[pendingHookCount];
+			if (NT_SUCCESS(status))
+			{
+				entry->failedProcessors = 0;
+				status = VMSync_broadcastEdit(syncInstallHook, entry, 0, NULL);
 
-	newHook->target = targetFunction;
-	newHook->hook = hookFunction;
-	newHook->original = origFunction;
+				/* The batch may hold edits of other callers, only this hook's failures count. */
+				if ((STATUS_PARTIAL_COPY == status) && (0 == entry->failedProcessors))
+				{
+					status = STATUS_SUCCESS;
+				}
 
-	pendingHookCount++;
+				if (NT_SUCCESS(status))
+				{
+					entry->installTSC = __rdtsc();
+					InterlockedExchange(&entry->state, HOOK_STATE_ACTIVE);
+				}
+				else
+				{
+					/* Undo the detour on the processors that installed it. Any of them may
+					 * already have run the hook, so the trampoline is kept rather than freed. */
+					DEBUG_PRINT("Unable to install the hook of %p: 0x%X\r\n", targetFunction, status);
+					VMSync_broadcastEdit(syncRemoveHook, entry, 0, NULL);
+					codeExecuted = TRUE;
+				}
+			}
+		}
+
+		if (FALSE == NT_SUCCESS(status))
+		{
+			if ((FALSE == codeExecuted) && (NULL != entry->stats))
+			{
+				ExFreePool(entry->stats);
+			}
+
+			releaseEntry(entry);
+			*handle = 0;
+		}
+	}
+
+	return status;
 }
 
-/******************** Module Code ********************/
+NTSTATUS VMHook_installByName(
+	PCSTR moduleName,
+	PCSTR exportName,
+	PVOID hookFunction,
+	PVOID* origFunction,
+	ULONG flags,
+	PVMHOOK_HANDLE handle
+)
+{
+	/* Called at PASSIVE_LEVEL, hooks an export of a loaded kernel module ("ntoskrnl.exe", "NtCreateFile").
+	 * The address comes from the export index, so no export directory is scanned here. */
+	PVOID targetFunction = NULL;
+	NTSTATUS status = ExportIndex_resolveKernel(moduleName, exportName, &targetFunction);
+
+	if (NT_SUCCESS(status))
+	{
+		status = VMHook_install(targetFunction, hookFunction, origFunction, flags, handle);
+	}
 
-static NTSTATUS hookAFunction(PEPT_CONFIG eptConfig, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+	return status;
+}
+
+NTSTATUS VMHook_remove(VMHOOK_HANDLE handle)
 {
+	/* Called at PASSIVE_LEVEL. Every processor restores the original bytes from one VMSync
+	 * broadcast, then the trampoline is returned to the arena. As with any detour, the caller
+	 * must ensure the hook function is no longer running, as it may still call the trampoline.
+	 *
+	 * The entry stub runs before the hook, so the caller cannot know that no thread was interrupted
+	 * in it. Like the code of a hook that failed to install, it is never freed and its slots are never
+	 * reused, and neither are the statistics it updates. */
 	NTSTATUS status;
 
-	/* Create the page that will be used as the shadow. */
-	PVOID alignedTarget = PAGE_ALIGN(targetFunction);
+	LONG previousState = HOOK_STATE_FREE;
+	PHOOK_ENTRY entry = acquireEntry(handle, &previousState);
 
-	/* Create a buffer that will contain the hook
-	* First copy the original bytes of the page into it. */
-	PUINT8 hookPage = (PUINT8)ExAllocatePool(NonPagedPoolNx, PAGE_SIZE);
+	if (NULL == entry)
+	{
+		status = STATUS_INVALID_HANDLE;
+	}
+	else if (HOOK_STATE_QUEUED == previousState)
+	{
+		/* Never prepared, so there is nothing to undo. */
+		if (NULL != entry->stats)
+		{
+			ExFreePool(entry->stats);
+		}
 
-	if (NULL != hookPage)
+		releaseEntry(entry);
+		status = STATUS_SUCCESS;
+	}
+	else
 	{
-		/* Copy the original bytes into the hook page. */
-		RtlCopyMemory(hookPage, alignedTarget, PAGE_SIZE);
+		entry->failedProcessors = 0;
+		status = VMSync_broadcastEdit(syncRemoveHook, entry, 0, NULL);
 
-		/* Create the trampoline in the hook page. */
-		status = createTrampoline(hookPage, targetFunction, hookFunction, origFunction);
+		if ((STATUS_PARTIAL_COPY == status) && (0 == entry->failedProcessors))
+		{
+			status = STATUS_SUCCESS;
+		}
 
 		if (NT_SUCCESS(status))
 		{
-			PHYSICAL_ADDRESS targetPA = MmGetPhysicalAddress(alignedTarget);
-			status = VMShadow_hidePageGlobally(eptConfig, targetPA, hookPage, FALSE);
+			if (NULL != entry->trampoline)
+			{
+				freeTrampoline(entry->trampoline, entry->trampolineSize);
+			}
+
+			releaseEntry(entry);
+		}
+		else
+		{
+			/* A processor may still run the detour, keep the hook so the removal can be retried. */
+			InterlockedExchange(&entry->state, HOOK_STATE_ACTIVE);
+		}
+	}
+
+	return status;
+}
+
+NTSTATUS VMHook_exportStats(fnHookStatsCallback callback, PVOID userParameter)
+{
+	/* Called in VMX root, reports every active instrumented hook summed over all processors.
+	 * The counters are updated atomically (see emitStatsPrologue) and read while the stubs keep
+	 * updating them, each value is exact but the values of one record can be a few calls apart. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	UINT64 tscFrequency = VMM_getTSCFrequency();
+
+	for (ULONG index = 0; (index < HOOK_REGISTRY_SIZE) && (NT_SUCCESS(status)); index++)
+	{
+		PHOOK_ENTRY current = getEntry(index);
+
+		if ((NULL != current) && (HOOK_STATE_ACTIVE == current->state) && (NULL != current->stats))
+		{
+			/* Cleared inline, the kernel's memset is not mapped in the host. */
+			VMHOOK_STATS_RECORD record;
+			__stosb((PUCHAR)&record, 0, sizeof(record));
+			record.targetAddress = (UINT64)current->target;
+			record.hookAddress = (UINT64)current->hook;
+			record.handle = ((ULONG)current->generation << HOOK_HANDLE_GENERATION_SHIFT) | (index + 1);
+			record.flags = current->flags;
+
+			UINT64 totalCycles = 0;
+			UINT64 cycleBuckets[VMHOOK_CYCLE_BUCKETS];
+			__stosb((PUCHAR)cycleBuckets, 0, sizeof(cycleBuckets));
+
+			for (ULONG processorIndex = 0; processorIndex < MAX_LOGICAL_PROCESSORS; processorIndex++)
+			{
+				PHOOK_CPU_STATS cpuStats = &current->stats[processorIndex];
+
+				record.calls += cpuStats->calls;
+				record.timedCalls += cpuStats->timedCalls;
+				totalCycles += cpuStats->totalCycles;
+
+				for (ULONG bucket = 0; bucket < VMHOOK_CYCLE_BUCKETS; bucket++)
+				{
+					cycleBuckets[bucket] += cpuStats->cycleBuckets[bucket];
+				}
+			}
+
+			record.elapsedCycles = __rdtsc() - current->installTSC;
+			UINT64 elapsedMs = record.elapsedCycles / max(tscFrequency / 1000, 1);
+			record.callsPerSecond = (record.calls * 1000) / max(elapsedMs, 1);
+
+			if (0 != record.timedCalls)
+			{
+				record.averageCycles = totalCycles / record.timedCalls;
+
+				/* First bucket that takes the running count to 99% of the timed calls. */
+				UINT64 rank = ((record.timedCalls * 99) + 99) / 100;
+				UINT64 runningCount = 0;
+
+				for (ULONG bucket = 0; bucket < VMHOOK_CYCLE_BUCKETS; bucket++)
+				{
+					runningCount += cycleBuckets[bucket];
+					if (runningCount >= rank)
+					{
+						record.p99Cycles = getCycleBucketBound(bucket);
+						break;
+					}
+				}
+			}
+
+			status = callback(&record, userParameter);
 		}
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS prepareHook(PHOOK_ENTRY entry, BOOLEAN hypervisorRunning)
+{
+	NTSTATUS status;
+
+	/* VMX root cannot translate the target, and only sees the statistics once they are mapped in the host. */
+	status = lockTargetPage(entry);
 
-		/* Free the memory as no longer needed as VMShadow copies the hooked page. */
-		ExFreePool(hookPage);
+	if ((NT_SUCCESS(status)) && (NULL != entry->stats))
+	{
+		status = PageTable_mapHost(entry->stats, MAX_LOGICAL_PROCESSORS * sizeof(HOOK_CPU_STATS));
 	}
-	else
+
+	if (NT_SUCCESS(status))
 	{
-		status = STATUS_NO_MEMORY;
+		/* Build the trampoline and the detour that will be written over the target. */
+		status = createTrampoline(entry);
 	}
 
+	if (NT_SUCCESS(status))
+	{
+		if (FALSE == hypervisorRunning)
+		{
+			/* Nothing executes the execute page before launch, so the shared copy is patched once now.
+			 * Once running, the detour is written while every processor is in VMX root instead. */
+			status = VMShadow_preparePatch(entry->target, entry->detour, entry->detourSize);
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* Store the trampoline, so the original function can be called by the hook. */
+			*entry->original = entry->trampoline;
+		}
+		else
+		{
+			/* The hook was never installed, so nothing can be executing the trampoline. */
+			freeHookCode(entry);
+		}
+	}
+
+	/* No processor has shadowed the page yet, so it may be paged again. */
+	if (FALSE == NT_SUCCESS(status))
+	{
+		unlockTargetPage(entry);
+	}
 
 	return status;
 }
 
-static NTSTATUS createTrampoline(PUINT8 hookPage, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+static NTSTATUS installHook(PEPT_CONFIG eptConfig, PHOOK_ENTRY entry)
 {
-	static const Int32 GP_CONTROL_TRANSFER = (GENERAL_PURPOSE_INSTRUCTION | CONTROL_TRANSFER);
-	static const SIZE_T BYTES_FOR_ABSOLUTE_JUMP = 16;
+	NTSTATUS status;
 
-	NTSTATUS status = STATUS_SUCCESS;
+	/* Hooks on the same page share a single shadow, the first processor to take the slab lock
+	 * writes the detour into the shared execute page and the others find it already there. */
+	status = VMShadow_addPatch(eptConfig, entry->target, entry->targetPA, entry->detour, entry->detourSize, FALSE);
 
-	/* Calculate the function's offset into the page. */
-	SIZE_T offsetIntoPage = ADDRMASK_EPT_PML1_OFFSET((UINT64)targetFunction);
+	return status;
+}
+
+static NTSTATUS syncInstallHook(PVMM_DATA lpData, PVOID parameter)
+{
+	/* Called in VMX root on every processor. KeIpiGenericCall holds every processor until all of
+	 * them have arrived, and none can return before the detour is fully written under the slab
+	 * lock, so the guest never executes a half written detour. */
+	PHOOK_ENTRY entry = (PHOOK_ENTRY)parameter;
+
+	NTSTATUS status = installHook(&lpData->eptConfig, entry);
+
+	if (FALSE == NT_SUCCESS(status))
+	{
+		InterlockedIncrement(&entry->failedProcessors);
+	}
+
+	return status;
+}
+
+static NTSTATUS syncRemoveHook(PVMM_DATA lpData, PVOID parameter)
+{
+	UNREFERENCED_PARAMETER(lpData);
+
+	/* Called in VMX root on every processor, the first one restores the original bytes
+	 * under the slab lock and the others find the patch already removed. */
+	PHOOK_ENTRY entry = (PHOOK_ENTRY)parameter;
+
+	NTSTATUS status = VMShadow_removePatchFromRoot(entry->target, entry->targetPA);
 
-	/* Allocate some memory for the trampoline. */
-	PUINT8 trampoline = ExAllocatePool(NonPagedPoolExecute, PAGE_SIZE);
+	if (STATUS_NOT_FOUND == status)
+	{
+		status = STATUS_SUCCESS;
+	}
 
-	if (NULL != trampoline)
+	if (FALSE == NT_SUCCESS(status))
 	{
-		/* Zero the trampoline buffer. */
-		RtlZeroMemory(trampoline, PAGE_SIZE);
+		InterlockedIncrement(&entry->failedProcessors);
+	}
 
-		/* Determine the number of instructions necessary to overwrite to fit the hook using a disassembler. */
-		SIZE_T sizeOfTrampoline = 0;
-		SIZE_T sizeOfDisassembled = 0;
+	return status;
+}
 
-		/* Get the size of instructions we will overwrite. */
-		DISASM disInfo = { 0 };
-		disInfo.EIP = (UIntPtr)targetFunction;
+static NTSTATUS claimEntry(PHOOK_ENTRY* entry, PVMHOOK_HANDLE handle)
+{
+	/* Lock-free, an entry belongs to whoever moves it out of HOOK_STATE_FREE. A segment is
+	 * allocated once the ones before it are full, and published with a compare exchange. */
+	NTSTATUS status = STATUS_QUOTA_EXCEEDED;
 
-		while (sizeOfTrampoline < BYTES_FOR_ABSOLUTE_JUMP)
+	for (ULONG segmentIndex = 0; (segmentIndex < VMHOOK_MAX_SEGMENTS) && (STATUS_QUOTA_EXCEEDED == status); segmentIndex++)
+	{
+		PHOOK_SEGMENT segment = hookSegments[segmentIndex];
+
+		if (NULL == segment)
 		{
-			SIZE_T instrLength = Disasm(&disInfo);
+			PHOOK_SEGMENT newSegment = (PHOOK_SEGMENT)ExAllocatePool(NonPagedPoolNx, sizeof(HOOK_SEGMENT));
+			if (NULL == newSegment)
+			{
+				status = STATUS_NO_MEMORY;
+				break;
+			}
 
-			/* Check to see if the disassembled instruction uses relative control transfers
-			* CALL, JXX etc. If it does we need to patch the address. */
-			if (disInfo.Error != UNKNOWN_OPCODE)
+			RtlZeroMemory(newSegment, sizeof(HOOK_SEGMENT));
+
+			/* Once running, VMX root may walk the segment as soon as it is published. Segments
+			 * allocated before launch are mapped by VMHook_prepare. */
+			if (TRUE == hooksLaunched)
 			{
-				if (((disInfo.Instruction.Category & GP_CONTROL_TRANSFER) == GP_CONTROL_TRANSFER) &&
-					(CallType == disInfo.Instruction.BranchType))
-				{
-					/* At the moment we will only fix CALL's, we trash the R11 register doing so too.
-					* hopefully as it's rare R11 is used in first few bytes this is acceptable. */
-
-					/* MOVABS R11, 0x0000000000000000
-					* CALL R11 */
-					UINT8 shimAbsCall[12] = { 0x48, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xD0 };
-					*((UINT64*)&shimAbsCall[2]) = disInfo.Instruction.AddrValue;
-
-					/* Copy the shim. */
-					RtlCopyMemory(trampoline + sizeOfTrampoline,
-						shimAbsCall,
-						sizeof(shimAbsCall));
-
-					/* Adjust the size of hooked instruction + EIP. */
-					sizeOfTrampoline += sizeof(shimAbsCall);
-					sizeOfDisassembled += instrLength;		/* Not the same size as the shim. */
-					disInfo.EIP += instrLength;
-				}
-				else
+				NTSTATUS mapStatus = PageTable_mapHost(newSegment, sizeof(HOOK_SEGMENT));
+				if (FALSE == NT_SUCCESS(mapStatus))
 				{
-					/* We don't need to patch, just copy. */
-					RtlCopyMemory(trampoline + sizeOfTrampoline,
-						((PUINT8)targetFunction) + sizeOfTrampoline,
-						instrLength);
-
-					sizeOfTrampoline += instrLength;
-					sizeOfDisassembled += instrLength;
-					disInfo.EIP += instrLength;
+					ExFreePool(newSegment);
+					status = mapStatus;
+					break;
 				}
 			}
+
+			segment = (PHOOK_SEGMENT)InterlockedCompareExchangePointer((PVOID volatile*)&hookSegments[segmentIndex], newSegment, NULL);
+			if (NULL == segment)
+			{
+				segment = newSegment;
+			}
 			else
 			{
-				/* No tidy way of returning here really. */
-				status = STATUS_UNSUCCESSFUL;
+				/* Another caller published this segment first. */
+				ExFreePool(newSegment);
+			}
+		}
+
+		for (ULONG entryIndex = 0; entryIndex < VMHOOK_SEGMENT_ENTRIES; entryIndex++)
+		{
+			PHOOK_ENTRY current = &segment->entries[entryIndex];
+
+			if (HOOK_STATE_FREE == InterlockedCompareExchange(&current->state, HOOK_STATE_BUSY, HOOK_STATE_FREE))
+			{
+				ULONG index = (segmentIndex * VMHOOK_SEGMENT_ENTRIES) + entryIndex;
+
+				*entry = current;
+				*handle = ((ULONG)current->generation << HOOK_HANDLE_GENERATION_SHIFT) | (index + 1);
+
+				status = STATUS_SUCCESS;
 				break;
 			}
 		}
+	}
 
-		/* Ensure the hook isn't over two pages. */
-		if ((offsetIntoPage + sizeOfTrampoline) < (PAGE_SIZE - 1))
+	return status;
+}
+
+static PHOOK_ENTRY acquireEntry(VMHOOK_HANDLE handle, PLONG previousState)
+{
+	/* Takes ownership of a queued or active hook, NULL if the handle is stale or
+	 * the hook is already owned by another caller. */
+	PHOOK_ENTRY result = NULL;
+
+	ULONG index = (handle & HOOK_HANDLE_INDEX_MASK);
+	USHORT generation = (USHORT)(handle >> HOOK_HANDLE_GENERATION_SHIFT);
+
+	PHOOK_ENTRY entry = ((0 != index) && (index <= HOOK_REGISTRY_SIZE)) ? getEntry(index - 1) : NULL;
+
+	if ((NULL != entry) && (generation == (USHORT)entry->generation))
+	{
+		const LONG ownedStates[] = { HOOK_STATE_ACTIVE, HOOK_STATE_QUEUED };
+
+		for (ULONG i = 0; i < (sizeof(ownedStates) / sizeof(ownedStates[0])); i++)
 		{
-			/* Add the absolute jump to the trampoline to return back to actual code. */
-			generateAbsoluteJump(&trampoline[sizeOfTrampoline], (SIZE_T)targetFunction + sizeOfDisassembled);
+			if (ownedStates[i] == InterlockedCompareExchange(&entry->state, HOOK_STATE_BUSY, ownedStates[i]))
+			{
+				/* The entry could have been released and claimed again since the generation was read. */
+				if (generation == (USHORT)entry->generation)
+				{
+					*previousState = ownedStates[i];
+					result = entry;
+				}
+				else
+				{
+					InterlockedExchange(&entry->state, ownedStates[i]);
+				}
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
+static void releaseEntry(PHOOK_ENTRY entry)
+{
+	/* The caller owns the entry (HOOK_STATE_BUSY), the code and statistics are freed separately. */
+	entry->target = NULL;
+	entry->hook = NULL;
+	entry->original = NULL;
+	entry->targetPA.QuadPart = 0;
+	entry->targetMdl = NULL;
+	RtlZeroMemory(entry->detour, sizeof(entry->detour));
+	entry->detourSize = 0;
+	entry->trampoline = NULL;
+	entry->trampolineSize = 0;
+	entry->flags = 0;
+	entry->stats = NULL;
+	entry->entryStub = NULL;
+	entry->entryStubSize = 0;
+	entry->installTSC = 0;
+	entry->failedProcessors = 0;
+
+	/* Invalidate outstanding handles before the entry can be claimed again. */
+	InterlockedIncrement(&entry->generation);
+	InterlockedExchange(&entry->state, HOOK_STATE_FREE);
+}
+
+static NTSTATUS lockTargetPage(PHOOK_ENTRY entry)
+{
+	/* Called at PASSIVE_LEVEL, locks the page of the target and takes its frame from the MDL.
+	 * A shadow is kept once a processor has installed it, even after the hook is removed, so the
+	 * lock of an installed hook is never released and its MDL is dropped with the entry. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PMDL mdl = IoAllocateMdl(PAGE_ALIGN(entry->target), PAGE_SIZE, FALSE, FALSE, NULL);
+
+	if (NULL != mdl)
+	{
+		__try
+		{
+			MmProbeAndLockPages(mdl, KernelMode, IoReadAccess);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			status = GetExceptionCode();
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			entry->targetMdl = mdl;
+			entry->targetPA.QuadPart = (LONGLONG)MmGetMdlPfnArray(mdl)[0] << PAGE_SHIFT;
+		}
+		else
+		{
+			IoFreeMdl(mdl);
+		}
+	}
+	else
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return status;
+}
+
+static void unlockTargetPage(PHOOK_ENTRY entry)
+{
+	if (NULL != entry->targetMdl)
+	{
+		MmUnlockPages(entry->targetMdl);
+		IoFreeMdl(entry->targetMdl);
+
+		entry->targetMdl = NULL;
+		entry->targetPA.QuadPart = 0;
+	}
+}
+
+static PHOOK_ENTRY getEntry(ULONG index)
+{
+	/* NULL when the segment holding the index has not been allocated yet. */
+	PHOOK_SEGMENT segment = hookSegments[index / VMHOOK_SEGMENT_ENTRIES];
+
+	return (NULL != segment) ? &segment->entries[index % VMHOOK_SEGMENT_ENTRIES] : NULL;
+}
 
-			/* Add the absolute jump to detour the target to the hook code. */
-			generateAbsoluteJump(&hookPage[offsetIntoPage], (SIZE_T)hookFunction);
+static BOOLEAN isTargetHooked(PHOOK_ENTRY entry)
+{
+	/* TRUE if any other registered hook has the same target. */
+	BOOLEAN result = FALSE;
+
+	for (ULONG index = 0; (index < HOOK_REGISTRY_SIZE) && (FALSE == result); index++)
+	{
+		PHOOK_ENTRY current = getEntry(index);
+
+		result = (NULL != current) && (current != entry) &&
+				 (HOOK_STATE_FREE != current->state) && (current->target == entry->target);
+	}
+
+	return result;
+}
+
+static NTSTATUS allocateHookStats(PHOOK_ENTRY entry)
+{
+	/* Called at PASSIVE_LEVEL. The stubs find the statistics of the current processor through
+	 * the PCR, so check the field holds the processor index on this build before relying on it. */
+	NTSTATUS status;
+
+	KIRQL oldIrql;
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	BOOLEAN indexMatches = (__readgsdword(PCR_PROCESSOR_INDEX_OFFSET) == KeGetCurrentProcessorIndex());
+	KeLowerIrql(oldIrql);
+
+	if (TRUE == indexMatches)
+	{
+		SIZE_T statsSize = MAX_LOGICAL_PROCESSORS * sizeof(HOOK_CPU_STATS);
+
+		entry->stats = (PHOOK_CPU_STATS)ExAllocatePool(NonPagedPoolNx, statsSize);
+		if (NULL != entry->stats)
+		{
+			RtlZeroMemory(entry->stats, statsSize);
 
-			/* Store the hook function, so it can be used. */
-			*origFunction = trampoline;
+			/* Calibrated here at PASSIVE_LEVEL, the statistics are exported from VMX root. */
+			VMM_getTSCFrequency();
 
 			status = STATUS_SUCCESS;
 		}
 		else
 		{
-			status = STATUS_NOT_CAPABLE;
+			status = STATUS_NO_MEMORY;
 		}
 	}
 	else
+	{
+		status = STATUS_NOT_SUPPORTED;
+	}
+
+	return status;
+}
+
+static void freeHookCode(PHOOK_ENTRY entry)
+{
+	/* Returns the trampoline and entry stub of a hook that was never installed to the arena. */
+	if (NULL != entry->trampoline)
+	{
+		freeTrampoline(entry->trampoline, entry->trampolineSize);
+		entry->trampoline = NULL;
+	}
+
+	if (NULL != entry->entryStub)
+	{
+		freeTrampoline(entry->entryStub, entry->entryStubSize);
+		entry->entryStub = NULL;
+	}
+}
+
+static NTSTATUS createTrampoline(PHOOK_ENTRY entry)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	/* Calculate the function's offset into the page. */
+	SIZE_T offsetIntoPage = ADDRMASK_EPT_PML1_OFFSET((UINT64)entry->target);
+
+	/* Instrumented hooks are detoured to a stub that counts the call before jumping to the hook. */
+	SIZE_T detourTarget = (SIZE_T)entry->hook;
+
+	if (NULL != entry->stats)
+	{
+		status = createEntryStub(entry);
+		detourTarget = (SIZE_T)entry->entryStub;
+	}
+
+	/* When measuring cycles, the trampoline starts with a stub that stops the clock. */
+	UINT8 chainStub[HOOK_STUB_MAX_SIZE];
+	ULONG chainStubSize = (0 != (entry->flags & VMHOOK_FLAG_MEASURE_CYCLES)) ? emitChainStub(chainStub, entry->stats) : 0;
+
+	SIZE_T sizeOfDisassembled = 0;
+	SIZE_T sizeOfTrampoline = 0;
+
+	if (NT_SUCCESS(status))
+	{
+		/* The detour only needs 5 bytes when its destination is within reach of a rel32 jump. */
+		entry->detourSize = Relocate_getJumpSize((SIZE_T)entry->target, detourTarget);
+
+		/* Measure the instructions the detour overwrites, and the longest they can be once relocated. */
+		status = Relocate_copyInstructions((PUINT8)entry->target, entry->detourSize, NULL, 0, &sizeOfDisassembled, &sizeOfTrampoline);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Branches back into the overwritten bytes would land in the middle of the detour. */
+		status = Relocate_checkBranchTargets((PUINT8)entry->target, entry->detourSize,
+											 MemManage_getResidentSize(entry->target, RELOCATE_SCAN_SIZE));
+	}
+
+	/* Ensure the hook isn't over two pages. */
+	if (NT_SUCCESS(status) && ((offsetIntoPage + sizeOfDisassembled) > PAGE_SIZE))
+	{
+		status = STATUS_NOT_CAPABLE;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Leave room for the longest jump back, the arena prefers a chunk within reach of the target. */
+		SIZE_T allocationSize = chainStubSize + sizeOfTrampoline + RELOCATE_ABSOLUTE_JUMP_SIZE;
+		PUINT8 newTrampoline = allocateTrampoline(allocationSize, (SIZE_T)entry->target);
+
+		if (NULL != newTrampoline)
+		{
+			RtlCopyMemory(newTrampoline, chainStub, chainStubSize);
+
+			/* Relocate for real now the address is known, the result is never longer than measured. */
+			PUINT8 relocated = &newTrampoline[chainStubSize];
+			status = Relocate_copyInstructions((PUINT8)entry->target, entry->detourSize, relocated, (SIZE_T)relocated,
+											 &sizeOfDisassembled, &sizeOfTrampoline);
+
+			if (NT_SUCCESS(status))
+			{
+				/* Add the jump to the trampoline to return back to actual code. */
+				Relocate_writeJump(&relocated[sizeOfTrampoline], (SIZE_T)&relocated[sizeOfTrampoline], (SIZE_T)entry->target + sizeOfDisassembled);
+
+				/* Create the jump to detour the target, it will be executed at the target's address. */
+				Relocate_writeJump(entry->detour, (SIZE_T)entry->target, detourTarget);
+
+				entry->trampoline = newTrampoline;
+				entry->trampolineSize = allocationSize;
+			}
+			else
+			{
+				freeTrampoline(newTrampoline, allocationSize);
+			}
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+
+	if ((FALSE == NT_SUCCESS(status)) && (NULL != entry->entryStub))
+	{
+		freeTrampoline(entry->entryStub, entry->entryStubSize);
+		entry->entryStub = NULL;
+	}
+
+	return status;
+}
+
+static NTSTATUS createEntryStub(PHOOK_ENTRY entry)
+{
+	/* The stub is placed within reach of the target when possible, so the detour stays 5 bytes. */
+	NTSTATUS status;
+
+	UINT8 stub[HOOK_STUB_MAX_SIZE];
+	ULONG stubSize = emitEntryStub(stub, entry->stats, (0 != (entry->flags & VMHOOK_FLAG_MEASURE_CYCLES)));
+
+	SIZE_T allocationSize = stubSize + RELOCATE_ABSOLUTE_JUMP_SIZE;
+	PUINT8 newStub = allocateTrampoline(allocationSize, (SIZE_T)entry->target);
+
+	if (NULL != newStub)
+	{
+		RtlCopyMemory(newStub, stub, stubSize);
+		Relocate_writeJump(&newStub[stubSize], (SIZE_T)&newStub[stubSize], (SIZE_T)entry->hook);
+
+		entry->entryStub = newStub;
+		entry->entryStubSize = allocationSize;
+
+		status = STATUS_SUCCESS;
+	}
+	else
 	{
 		status = STATUS_NO_MEMORY;
 	}
 
-	if (FALSE == NT_SUCCESS(status))
+	return status;
+}
+
+static ULONG emitStatsPrologue(PUINT8 stub, PHOOK_CPU_STATS stats, PULONG skipOffset)
+{
+	/* Saves RAX, RCX and RDX and points RCX at the statistics of the current processor.
+	 * skipOffset receives the rel8 to patch with the distance to the epilogue, taken when
+	 * the index is out of range. The flags are not preserved, like across any call.
+	 *
+	 * A thread can be moved to another processor after reading its index, so the counters are
+	 * updated with LOCK and stay exact. The line is nearly always owned by the processor already,
+	 * so the prefix costs a few cycles rather than a transfer. */
+	ULONG offset = 0;
+
+	/* push rax; push rcx; push rdx */
+	stub[offset++] = 0x50;
+	stub[offset++] = 0x51;
+	stub[offset++] = 0x52;
+
+	/* mov eax, gs:[PCR_PROCESSOR_INDEX_OFFSET] */
+	stub[offset++] = 0x65;
+	stub[offset++] = 0x8B;
+	stub[offset++] = 0x04;
+	stub[offset++] = 0x25;
+	*((PULONG)&stub[offset]) = PCR_PROCESSOR_INDEX_OFFSET;
+	offset += sizeof(ULONG);
+
+	/* cmp eax, MAX_LOGICAL_PROCESSORS; jae epilogue */
+	stub[offset++] = 0x3D;
+	*((PULONG)&stub[offset]) = MAX_LOGICAL_PROCESSORS;
+	offset += sizeof(ULONG);
+	stub[offset++] = 0x73;
+	*skipOffset = offset++;
+
+	/* imul rax, rax, sizeof(HOOK_CPU_STATS) */
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x69;
+	stub[offset++] = 0xC0;
+	*((PULONG)&stub[offset]) = sizeof(HOOK_CPU_STATS);
+	offset += sizeof(ULONG);
+
+	/* mov rcx, stats; add rcx, rax */
+	stub[offset++] = 0x48;
+	stub[offset++] = 0xB9;
+	*((PUINT64)&stub[offset]) = (UINT64)stats;
+	offset += sizeof(UINT64);
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x01;
+	stub[offset++] = 0xC1;
+
+	return offset;
+}
+
+static ULONG emitEntryStub(PUINT8 stub, PHOOK_CPU_STATS stats, BOOLEAN measureCycles)
+{
+	/* Executed in place of the hook, counts the call and starts the clock, then falls
+	 * through to the jump to the hook that the caller adds. */
+	ULONG skipOffset;
+	ULONG offset = emitStatsPrologue(stub, stats, &skipOffset);
+
+	/* lock inc qword ptr [rcx + calls] */
+	stub[offset++] = 0xF0;
+	stub[offset++] = 0x48;
+	stub[offset++] = 0xFF;
+	stub[offset++] = 0x41;
+	stub[offset++] = (UINT8)FIELD_OFFSET(HOOK_CPU_STATS, calls);
+
+	if (TRUE == measureCycles)
 	{
-		ExFreePool(trampoline);
+		/* rdtsc; shl rdx, 32; or rax, rdx */
+		stub[offset++] = 0x0F;
+		stub[offset++] = 0x31;
+		stub[offset++] = 0x48;
+		stub[offset++] = 0xC1;
+		stub[offset++] = 0xE2;
+		stub[offset++] = 0x20;
+		stub[offset++] = 0x48;
+		stub[offset++] = 0x09;
+		stub[offset++] = 0xD0;
+
+		/* mov [rcx + entryTSC], rax */
+		stub[offset++] = 0x48;
+		stub[offset++] = 0x89;
+		stub[offset++] = 0x41;
+		stub[offset++] = (UINT8)FIELD_OFFSET(HOOK_CPU_STATS, entryTSC);
+	}
+
+	/* Epilogue: pop rdx; pop rcx; pop rax */
+	stub[skipOffset] = (UINT8)(offset - (skipOffset + 1));
+	stub[offset++] = 0x5A;
+	stub[offset++] = 0x59;
+	stub[offset++] = 0x58;
+
+	return offset;
+}
+
+static ULONG emitChainStub(PUINT8 stub, PHOOK_CPU_STATS stats)
+{
+	/* Executed when the hook calls the original function, adds the cycles since the entry stub
+	 * started the clock on this processor. The start is cleared as it is taken, so a hook that
+	 * never chained, or moved to another processor, is not timed against a stale start. */
+	ULONG skipOffset;
+	ULONG offset = emitStatsPrologue(stub, stats, &skipOffset);
+	ULONG epilogueJumps[2];
+
+	/* rdtsc; shl rdx, 32; or rax, rdx */
+	stub[offset++] = 0x0F;
+	stub[offset++] = 0x31;
+	stub[offset++] = 0x48;
+	stub[offset++] = 0xC1;
+	stub[offset++] = 0xE2;
+	stub[offset++] = 0x20;
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x09;
+	stub[offset++] = 0xD0;
+
+	/* xor rdx, rdx; xchg [rcx + entryTSC], rdx */
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x31;
+	stub[offset++] = 0xD2;
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x87;
+	stub[offset++] = 0x51;
+	stub[offset++] = (UINT8)FIELD_OFFSET(HOOK_CPU_STATS, entryTSC);
+
+	/* test rdx, rdx; jz epilogue */
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x85;
+	stub[offset++] = 0xD2;
+	stub[offset++] = 0x74;
+	epilogueJumps[0] = offset++;
+
+	/* sub rax, rdx; js epilogue */
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x29;
+	stub[offset++] = 0xD0;
+	stub[offset++] = 0x78;
+	epilogueJumps[1] = offset++;
+
+	/* lock inc qword ptr [rcx + timedCalls]; lock add [rcx + totalCycles], rax */
+	stub[offset++] = 0xF0;
+	stub[offset++] = 0x48;
+	stub[offset++] = 0xFF;
+	stub[offset++] = 0x41;
+	stub[offset++] = (UINT8)FIELD_OFFSET(HOOK_CPU_STATS, timedCalls);
+	stub[offset++] = 0xF0;
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x01;
+	stub[offset++] = 0x41;
+	stub[offset++] = (UINT8)FIELD_OFFSET(HOOK_CPU_STATS, totalCycles);
+
+	/* bsr rdx, rax; jnz +2; xor edx, edx */
+	stub[offset++] = 0x48;
+	stub[offset++] = 0x0F;
+	stub[offset++] = 0xBD;
+	stub[offset++] = 0xD0;
+	stub[offset++] = 0x75;
+	stub[offset++] = 0x02;
+	stub[offset++] = 0x31;
+	stub[offset++] = 0xD2;
+
+	/* cmp edx, VMHOOK_CYCLE_BUCKETS - 1; jbe +5; mov edx, VMHOOK_CYCLE_BUCKETS - 1 */
+	stub[offset++] = 0x83;
+	stub[offset++] = 0xFA;
+	stub[offset++] = VMHOOK_CYCLE_BUCKETS - 1;
+	stub[offset++] = 0x76;
+	stub[offset++] = 0x05;
+	stub[offset++] = 0xBA;
+	*((PULONG)&stub[offset]) = VMHOOK_CYCLE_BUCKETS - 1;
+	offset += sizeof(ULONG);
+
+	/* lock inc dword ptr [rcx + rdx * 4 + cycleBuckets] */
+	stub[offset++] = 0xF0;
+	stub[offset++] = 0xFF;
+	stub[offset++] = 0x44;
+	stub[offset++] = 0x91;
+	stub[offset++] = (UINT8)FIELD_OFFSET(HOOK_CPU_STATS, cycleBuckets);
+
+	/* Epilogue: pop rdx; pop rcx; pop rax */
+	stub[skipOffset] = (UINT8)(offset - (skipOffset + 1));
+	stub[epilogueJumps[0]] = (UINT8)(offset - (epilogueJumps[0] + 1));
+	stub[epilogueJumps[1]] = (UINT8)(offset - (epilogueJumps[1] + 1));
+	stub[offset++] = 0x5A;
+	stub[offset++] = 0x59;
+	stub[offset++] = 0x58;
+
+	return offset;
+}
+
+static UINT64 getCycleBucketBound(ULONG bucket)
+{
+	/* Highest cycle count counted in the bucket, the last one is unbounded. */
+	return ((bucket + 1) < VMHOOK_CYCLE_BUCKETS) ? ((1ULL << (bucket + 1)) - 1) : MAXULONG64;
+}
+
+static NTSTATUS growTrampolineArena(void)
+{
+	/* Called at PASSIVE_LEVEL. Allocations of 2MB are eligible for a large page,
+	 * so every trampoline in a chunk shares a single iTLB entry. */
+	NTSTATUS status;
+
+	if (trampolineArena.chunkCount < TRAMPOLINE_ARENA_MAX_CHUNKS)
+	{
+		PUINT8 newChunk = ExAllocatePool(NonPagedPoolExecute, SIZE_2MB);
+
+		if (NULL != newChunk)
+		{
+			/* Fill with INT3 so a stray jump into a free slot faults straight away. */
+			RtlFillMemory(newChunk, SIZE_2MB, 0xCC);
+
+			KIRQL oldIrql = lockTrampolineArena();
+			trampolineArena.chunks[trampolineArena.chunkCount] = newChunk;
+			InterlockedIncrement(&trampolineArena.chunkCount);
+			unlockTrampolineArena(oldIrql);
+
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+	else
+	{
+		status = STATUS_QUOTA_EXCEEDED;
 	}
 
 	return status;
 }
 
-static void generateAbsoluteJump(PUINT8 targetBuffer, SIZE_T targetAddress)
+static PUINT8 allocateTrampoline(SIZE_T size, SIZE_T nearAddress)
+{
+	/* Called at PASSIVE_LEVEL, the arena grows by a chunk when no chunk has room. */
+	PUINT8 result = takeTrampolineSlots(size, nearAddress);
+
+	if ((NULL == result) && (NT_SUCCESS(growTrampolineArena())))
+	{
+		result = takeTrampolineSlots(size, nearAddress);
+	}
+
+	return result;
+}
+
+static PUINT8 takeTrampolineSlots(SIZE_T size, SIZE_T nearAddress)
+{
+	/* Takes enough contiguous slots for size bytes, from a chunk that a rel32 jump
+	 * from nearAddress can reach if there is one, otherwise from any chunk. */
+	PUINT8 result = NULL;
+	ULONG slotCount = (ULONG)((size + TRAMPOLINE_SLOT_SIZE - 1) / TRAMPOLINE_SLOT_SIZE);
+
+	KIRQL oldIrql = lockTrampolineArena();
+
+	for (ULONG pass = 0; (pass < 2) && (NULL == result); pass++)
+	{
+		for (LONG chunkIndex = 0; chunkIndex < trampolineArena.chunkCount; chunkIndex++)
+		{
+			PUINT8 chunk = trampolineArena.chunks[chunkIndex];
+
+			BOOLEAN reachable = (RELOCATE_REL32_JUMP_SIZE == Relocate_getJumpSize(nearAddress, (SIZE_T)chunk)) &&
+								(RELOCATE_REL32_JUMP_SIZE == Relocate_getJumpSize(nearAddress, (SIZE_T)chunk + SIZE_2MB));
+
+			if ((0 != pass) || (TRUE == reachable))
+			{
+				ULONG firstSlot = findFreeSlots(trampolineArena.usedSlots[chunkIndex], slotCount);
+
+				if (TRAMPOLINE_CHUNK_SLOTS != firstSlot)
+				{
+					setSlots(trampolineArena.usedSlots[chunkIndex], firstSlot, slotCount, TRUE);
+					result = chunk + ((SIZE_T)firstSlot * TRAMPOLINE_SLOT_SIZE);
+					break;
+				}
+			}
+		}
+	}
+
+	unlockTrampolineArena(oldIrql);
+
+	return result;
+}
+
+static void freeTrampoline(PUINT8 trampoline, SIZE_T size)
 {
-	/* PUSH RAX */
-	targetBuffer[0] = 0x50;
+	/* Returns the slots of a trampoline to its chunk, the caller ensures it is no longer executed. */
+	ULONG slotCount = (ULONG)((size + TRAMPOLINE_SLOT_SIZE - 1) / TRAMPOLINE_SLOT_SIZE);
+
+	KIRQL oldIrql = lockTrampolineArena();
+
+	for (LONG chunkIndex = 0; chunkIndex < trampolineArena.chunkCount; chunkIndex++)
+	{
+		PUINT8 chunk = trampolineArena.chunks[chunkIndex];
 
-	/* MOV RAX, targetAddress */
-	targetBuffer[1] = 0x48;
-	targetBuffer[2] = 0xB8;
+		if ((trampoline >= chunk) && (trampoline < (chunk + SIZE_2MB)))
+		{
+			RtlFillMemory(trampoline, (SIZE_T)slotCount * TRAMPOLINE_SLOT_SIZE, 0xCC);
+			setSlots(trampolineArena.usedSlots[chunkIndex], (ULONG)((trampoline - chunk) / TRAMPOLINE_SLOT_SIZE), slotCount, FALSE);
+			break;
+		}
+	}
 
-	*((PSIZE_T)&targetBuffer[3]) = targetAddress;
+	unlockTrampolineArena(oldIrql);
+}
 
-	/* XCHG [RSP], RAX */
-	targetBuffer[11] = 0x48;
-	targetBuffer[12] = 0x87;
-	targetBuffer[13] = 0x04;
-	targetBuffer[14] = 0x24;
+static ULONG findFreeSlots(PUINT64 usedSlots, ULONG slotCount)
+{
+	/* First fit, returns the first of slotCount free slots or TRAMPOLINE_CHUNK_SLOTS if there are none. */
+	ULONG result = TRAMPOLINE_CHUNK_SLOTS;
+	ULONG runLength = 0;
 
-	/* RET */
-	targetBuffer[15] = 0xC3;
+	for (ULONG slot = 0; slot < TRAMPOLINE_CHUNK_SLOTS; slot++)
+	{
+		/* Skip over words that are entirely in use. */
+		if ((0 == (slot % 64)) && (~0ULL == usedSlots[slot / 64]))
+		{
+			runLength = 0;
+			slot += 63;
+		}
+		else if (0 != (usedSlots[slot / 64] & (1ULL << (slot % 64))))
+		{
+			runLength = 0;
+		}
+		else
+		{
+			runLength++;
+			if (runLength == slotCount)
+			{
+				result = slot + 1 - slotCount;
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
+static void setSlots(PUINT64 usedSlots, ULONG firstSlot, ULONG slotCount, BOOLEAN used)
+{
+	for (ULONG slot = firstSlot; slot < (firstSlot + slotCount); slot++)
+	{
+		if (TRUE == used)
+		{
+			usedSlots[slot / 64] |= (1ULL << (slot % 64));
+		}
+		else
+		{
+			usedSlots[slot / 64] &= ~(1ULL << (slot % 64));
+		}
+	}
+}
+
+static KIRQL lockTrampolineArena(void)
+{
+	/* Trampolines are only allocated and freed from the guest, the lock is
+	 * held at DISPATCH_LEVEL so its owner cannot be preempted. */
+	KIRQL oldIrql;
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+	while (0 != InterlockedCompareExchange(&trampolineArena.lock, 1, 0))
+	{
+		_mm_pause();
+	}
+
+	return oldIrql;
+}
+
+static void unlockTrampolineArena(KIRQL oldIrql)
+{
+	InterlockedExchange(&trampolineArena.lock, 0);
+	KeLowerIrql(oldIrql);
 }
@@ -1,15 +1,45 @@
 #pragma once
 #include <wdm.h>
 #include "EPT.h"
+#include "VMHookStats_Common.h"
 
 /******************** Public Defines ********************/
 
+/* Trampolines are packed into 2MB executable chunks in 16 byte aligned slots. */
+#define TRAMPOLINE_ARENA_MAX_CHUNKS 4
+#define TRAMPOLINE_SLOT_SIZE 16
+#define TRAMPOLINE_CHUNK_SLOTS (SIZE_2MB / TRAMPOLINE_SLOT_SIZE)
+
+/* The hook registry grows a segment of entries at a time, up to 4096 hooks. */
+#define VMHOOK_SEGMENT_ENTRIES 64
+#define VMHOOK_MAX_SEGMENTS 64
+
 /******************** Public Typedefs ********************/
 
+/* Identifies a hook in the registry until it is removed, 0 is never a valid handle. */
+typedef ULONG VMHOOK_HANDLE, *PVMHOOK_HANDLE;
+
+/* Called in VMX root by VMHook_exportStats for each instrumented hook. */
+typedef NTSTATUS(*fnHookStatsCallback)(const PVMHOOK_STATS_RECORD record, PVOID userParameter);
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
+NTSTATUS VMHook_prepare(void);
 NTSTATUS VMHook_init(PEPT_CONFIG eptConfig);
-void VMHook_queueHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
+NTSTATUS VMHook_queueHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
+NTSTATUS VMHook_install(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction, ULONG flags, PVMHOOK_HANDLE handle);
+
+NTSTATUS VMHook_installByName(
+	PCSTR moduleName,
+	PCSTR exportName,
+	PVOID hookFunction,
+	PVOID* origFunction,
+	ULONG flags,
+	PVMHOOK_HANDLE handle
+);
+
+NTSTATUS VMHook_remove(VMHOOK_HANDLE handle);
+NTSTATUS VMHook_exportStats(fnHookStatsCallback callback, PVOID userParameter);
@@ -0,0 +1,63 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Shared between the hypervisor and tools, only fixed width types are used.
+ * Windows builds are expected to have included the Windows/WDK headers beforehand. */
+#ifndef _WIN32
+#include <stdint.h>
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#endif
+
+/******************** Public Defines ********************/
+
+#define VMHOOK_STATS_MAGIC			0x53484D56	/* 'VMHS' */
+#define VMHOOK_STATS_VERSION		1
+
+/* Instrumentation of a hook, requested when it is installed. */
+#define VMHOOK_FLAG_COUNT_CALLS		0x1
+#define VMHOOK_FLAG_MEASURE_CYCLES	0x2
+
+/* Cycles spent in a hook body are counted in power of two buckets, bucket N holds
+ * the calls that took [2^N, 2^(N+1)) cycles and the last bucket everything longer. */
+#define VMHOOK_CYCLE_BUCKETS		40
+
+/******************** Public Typedefs ********************/
+
+/* Start of the exported statistics, followed by recordCount records. */
+typedef struct _VMHOOK_STATS_HEADER
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT32 recordCount;
+	UINT32 reserved;
+	UINT64 tscFrequency;
+} VMHOOK_STATS_HEADER, *PVMHOOK_STATS_HEADER;
+
+/* Statistics of one instrumented hook, summed over every processor since it was installed. */
+typedef struct _VMHOOK_STATS_RECORD
+{
+	UINT64 targetAddress;
+	UINT64 hookAddress;
+	UINT32 handle;
+	UINT32 flags;
+
+	UINT64 calls;
+	UINT64 callsPerSecond;
+	UINT64 elapsedCycles;
+
+	/* Cycles from entering the hook until it called the original function, only for hooks
+	 * installed with VMHOOK_FLAG_MEASURE_CYCLES. Calls that never chained are not timed.
+	 * The 99th percentile is the upper bound of the bucket it falls into. */
+	UINT64 timedCalls;
+	UINT64 averageCycles;
+	UINT64 p99Cycles;
+} VMHOOK_STATS_RECORD, *PVMHOOK_STATS_RECORD;
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include <ntifs.h>
+#include <intrin.h>
 #include "VMM.h"
 #include "VMHook.h"
+#include "VMWatch.h"
+#include "VMShadow.h"
 #include "Intrinsics.h"
 #include "MSR.h"
 #include "GDT.h"
@@ -16,10 +19,16 @@
 
 
 /******************** Module Constants ********************/
-
+#define VECTOR_NMI 2
 
 /******************** Module Variables ********************/
 
+/* Holds the runtime data registered for each logical processor,
+ * used to find another processor's data (exporting its counters). */
+static PVMM_DATA processorData[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/* Calibrated TSC frequency, used for turning cycle counts into rates. */
+static UINT64 tscFrequency = 0;
 
 /******************** Module Prototypes ********************/
 static NTSTATUS launchVMMOnProcessor(PVMM_DATA lpData);
@@ -27,6 +36,8 @@ static NTSTATUS enterRootMode(PVMM_DATA lpData);
 static void setupVMCS(PVMM_DATA lpData);
 static NTSTATUS launchVMX(void);
 static void captureControlRegisters(PCONTROL_REGISTERS registers);
+static void setupHostDescriptors(PVMM_DATA lpData);
+static void buildIdtEntry(PKIDTENTRY64 entry, PVOID handler);
 
 /******************** Public Code ********************/
 
@@ -34,6 +45,12 @@ NTSTATUS VMM_init(PVMM_DATA lpData)
 {
 	NTSTATUS status;
 
+	/* Register the processor data so it can be found later from other processors. */
+	if (lpData->processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		processorData[lpData->processorIndex] = lpData;
+	}
+
 	/* Capture the control registers for the processor. */
 	captureControlRegisters(&lpData->controlRegisters);
 	DEBUG_PRINT("VMM %d Control Registers:\r\n"
@@ -71,6 +88,42 @@ NTSTATUS VMM_init(PVMM_DATA lpData)
 	return status;
 }
 
+PVMM_DATA VMM_getProcessorData(ULONG processorIndex)
+{
+	PVMM_DATA result = NULL;
+
+	if (processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		result = processorData[processorIndex];
+	}
+
+	return result;
+}
+
+UINT64 VMM_getTSCFrequency(void)
+{
+	/* Calibrated on the first call, which must be at PASSIVE_LEVEL in the guest.
+	 * Later calls (including from VMX root) return the cached value. */
+	if (0 == tscFrequency)
+	{
+		/* Measure the TSC against the performance counter over a short stall. */
+		LARGE_INTEGER qpcFrequency;
+		LARGE_INTEGER qpcStart = KeQueryPerformanceCounter(&qpcFrequency);
+		UINT64 tscStart = __rdtsc();
+
+		KeStallExecutionProcessor(1000);
+
+		LARGE_INTEGER qpcEnd = KeQueryPerformanceCounter(NULL);
+		UINT64 tscEnd = __rdtsc();
+
+		UINT64 qpcElapsed = (UINT64)(qpcEnd.QuadPart - qpcStart.QuadPart);
+
+		tscFrequency = ((tscEnd - tscStart) * (UINT64)qpcFrequency.QuadPart) / max(qpcElapsed, 1);
+	}
+
+	return tscFrequency;
+}
+
 /******************** Module Code ********************/
 
 static NTSTATUS launchVMMOnProcessor(PVMM_DATA lpData)
@@ -84,7 +137,7 @@ static NTSTATUS launchVMMOnProcessor(PVMM_DATA lpData)
 	MTRR_readAll(lpData->mtrrTable);
 
 	/* Initialise the memory manager module. */
-	status = MemManage_init(&lpData->mmContext, lpData->hostCR3);
+	status = MemManage_init(&lpData->mmContext, lpData->processorIndex);
 	if (NT_SUCCESS(status))
 	{
 		/* Initialise the MTF structure. */
@@ -93,9 +146,15 @@ static NTSTATUS launchVMMOnProcessor(PVMM_DATA lpData)
 		/* Initialise EPT structure. */
 		EPT_initialise(&lpData->eptConfig, (const PMTRR_RANGE)&lpData->mtrrTable);
 
-		/* Initialise all of the pending hooks. */
+		/* Initialise the shadow page state. */
+		VMShadow_init(lpData);
+
+		/* Install the hooks prepared before launch. */
 		VMHook_init(&lpData->eptConfig);
 
+		/* Initialise the watchpoint state, watches themselves are added at runtime. */
+		VMWatch_init(lpData);
+
 		/* Attempt to enter VMX root. */
 		status = enterRootMode(lpData);
 
@@ -243,21 +302,35 @@ static void setupVMCS(PVMM_DATA lpData)
 	__vmx_vmwrite(VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, adjustedMSR);
 
 	/*
-	* Enable no pin-based options ourselves, but there may be some required by
-	* the processor. Use ShvUtilAdjustMsr to add those in.
+	* NMIs cause an exit and are given back to the guest once it can take one,
+	* which needs virtual NMIs. This keeps NMIs that arrive in VMX root (taken by
+	* the host IDT) from being lost. Without virtual NMIs no pin-based options are
+	* enabled, apart from those required by the processor.
 	*/
-	adjustedMSR = MSR_adjustMSR(lpData->msrData[13], 0);
+	adjustedMSR = MSR_adjustMSR(lpData->msrData[13],
+		IA32_VMX_PINBASED_CTLS_NMI_EXITING_FLAG |
+		IA32_VMX_PINBASED_CTLS_VIRTUAL_NMI_FLAG);
+
+	if (0 == (adjustedMSR & IA32_VMX_PINBASED_CTLS_VIRTUAL_NMI_FLAG))
+	{
+		adjustedMSR = MSR_adjustMSR(lpData->msrData[13], 0);
+	}
+
 	__vmx_vmwrite(VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, adjustedMSR);
 
 	/*
 	* In order for our choice of supporting RDTSCP and XSAVE/RESTORES above to
 	* actually mean something, we have to request secondary controls. We also
 	* want to activate the MSR bitmap in order to keep them from being caught.
+	*
+	* INVLPG exiting (which also makes INVPCID exit) lets the host see every
+	* invalidation of the guest, its cached guest translations rely on them.
 	*/
 	adjustedMSR = MSR_adjustMSR(lpData->msrData[14],
 		IA32_VMX_PROCBASED_CTLS_USE_MSR_BITMAPS_FLAG |
 		IA32_VMX_PROCBASED_CTLS_ACTIVATE_SECONDARY_CONTROLS_FLAG | 
-		IA32_VMX_PROCBASED_CTLS_CR3_LOAD_EXITING_FLAG);
+		IA32_VMX_PROCBASED_CTLS_CR3_LOAD_EXITING_FLAG |
+		IA32_VMX_PROCBASED_CTLS_INVLPG_EXITING_FLAG);
 
 	__vmx_vmwrite(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, adjustedMSR);
 
@@ -337,15 +410,17 @@ static void setupVMCS(PVMM_DATA lpData)
 	__vmx_vmwrite(VMCS_GUEST_LDTR_ACCESS_RIGHTS, vmxGdtEntry.AccessRights);
 	__vmx_vmwrite(VMCS_GUEST_LDTR_BASE, vmxGdtEntry.Base);
 
-	/* Now load the GDT itself */
+	/* Now load the GDT itself, the host uses a copy within the hypervisor */
+	setupHostDescriptors(lpData);
+
 	__vmx_vmwrite(VMCS_GUEST_GDTR_BASE, (uintptr_t)controlRegisters->Gdtr.Base);
 	__vmx_vmwrite(VMCS_GUEST_GDTR_LIMIT, controlRegisters->Gdtr.Limit);
-	__vmx_vmwrite(VMCS_HOST_GDTR_BASE, (uintptr_t)controlRegisters->Gdtr.Base);
+	__vmx_vmwrite(VMCS_HOST_GDTR_BASE, (uintptr_t)lpData->hostGdt);
 
 	/* And then the IDT */
 	__vmx_vmwrite(VMCS_GUEST_IDTR_BASE, (uintptr_t)controlRegisters->Idtr.Base);
 	__vmx_vmwrite(VMCS_GUEST_IDTR_LIMIT, controlRegisters->Idtr.Limit);
-	__vmx_vmwrite(VMCS_HOST_IDTR_BASE, (uintptr_t)controlRegisters->Idtr.Base);
+	__vmx_vmwrite(VMCS_HOST_IDTR_BASE, (uintptr_t)lpData->hostIdt);
 
 	/* Load CR0 */
 	__vmx_vmwrite(VMCS_CTRL_CR0_READ_SHADOW, controlRegisters->Cr0);
@@ -373,11 +448,15 @@ static void setupVMCS(PVMM_DATA lpData)
 	*
 	* Setting a bit to 0 ensures that the bit is guest owned,
 	* meaning that the actual value will be read.
+	*
+	* PGE is host owned too, so the guest toggling it to flush global
+	* translations exits and the host can drop its cached translations.
 	*/
 	static const UINT64 POSITION_VMXE_BIT = (1 << 13);
+	static const UINT64 POSITION_PGE_BIT = (1 << 7);
 	static const UINT64 DISABLE_VMXE_BIT = ~((UINT64)(1 << 13));
 
-	__vmx_vmwrite(VMCS_CTRL_CR4_GUEST_HOST_MASK, POSITION_VMXE_BIT);
+	__vmx_vmwrite(VMCS_CTRL_CR4_GUEST_HOST_MASK, POSITION_VMXE_BIT | POSITION_PGE_BIT);
 	__vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, controlRegisters->Cr4 & DISABLE_VMXE_BIT);
 
 	/* Load debug MSR and register (DR7) */
@@ -445,4 +524,38 @@ static void captureControlRegisters(PCONTROL_REGISTERS registers)
 	__sidt(&registers->Idtr.Limit);
 	_str(&registers->Tr);
 	_sldt(&registers->Ldtr);
-}
\ No newline at end of file
+}
+
+static void setupHostDescriptors(PVMM_DATA lpData)
+{
+	/* The host runs with its own copy of the GDT (read by IRETQ when returning from an
+	 * interrupt) and its own IDT. Interrupts are masked in VMX root, so the only vectors
+	 * taken are NMIs, which are queued for the guest, and exceptions caused by the
+	 * hypervisor itself, which stop the processor. The TSS is never used as no handler
+	 * changes privilege level or uses an IST stack. */
+	PCONTROL_REGISTERS controlRegisters = &lpData->controlRegisters;
+
+	RtlCopyMemory(lpData->hostGdt, controlRegisters->Gdtr.Base,
+				  min((SIZE_T)controlRegisters->Gdtr.Limit + 1, sizeof(lpData->hostGdt)));
+
+	for (ULONG vector = 0; vector < ARRAYSIZE(lpData->hostIdt); vector++)
+	{
+		buildIdtEntry(&lpData->hostIdt[vector], (VECTOR_NMI == vector) ? (PVOID)HandlerShim_hostNmi : (PVOID)HandlerShim_hostFault);
+	}
+}
+
+static void buildIdtEntry(PKIDTENTRY64 entry, PVOID handler)
+{
+	/* A present ring 0 interrupt gate running on the current stack. */
+	UINT64 handlerAddress = (UINT64)handler;
+
+	RtlZeroMemory(entry, sizeof(KIDTENTRY64));
+	entry->OffsetLow = (UINT16)handlerAddress;
+	entry->OffsetMiddle = (UINT16)(handlerAddress >> 16);
+	entry->OffsetHigh = (UINT32)(handlerAddress >> 32);
+	entry->Selector = KGDT64_R0_CODE;
+	entry->IstIndex = 0;
+	entry->Type = 0xE;
+	entry->Dpl = 0;
+	entry->Present = 1;
+}
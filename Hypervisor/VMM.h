@@ -4,6 +4,11 @@
 #include "EPT.h"
 #include "MTF.h"
 #include "MemManage.h"
+#include "GDT.h"
+
+/******************** Public Defines ********************/
+
+#define MAX_LOGICAL_PROCESSORS 64
 
 /******************** Public Typedefs ********************/
 
@@ -41,9 +46,20 @@ typedef struct _VMM_DATA
 	DECLSPEC_ALIGN(PAGE_SIZE) VMCS vmxOn;
 	DECLSPEC_ALIGN(PAGE_SIZE) VMCS vmcs;
 
+	/* Descriptor tables loaded on VM exit, the kernel's are not mapped in the host. */
+	DECLSPEC_ALIGN(PAGE_SIZE) KIDTENTRY64 hostIdt[256];
+	DECLSPEC_ALIGN(PAGE_SIZE) UINT8 hostGdt[PAGE_SIZE];
+
 	MM_CONTEXT mmContext;
 	ULONG processorIndex;
 	CR3 hostCR3;
+
+	/* Generation of the host page tables last seen on this processor (PageTable_refreshHost). */
+	UINT64 hostGeneration;
+
+	/* Set by the host NMI handler, the NMI is injected into the guest once it can take one. */
+	volatile BOOLEAN nmiPending;
+
 	CONTROL_REGISTERS controlRegisters;
 	CONTEXT hostContext;
 	CONTEXT guestContext;
@@ -59,3 +75,5 @@ typedef struct _VMM_DATA
 /******************** Public Prototypes ********************/
 
 NTSTATUS VMM_init(PVMM_DATA lpData);
+PVMM_DATA VMM_getProcessorData(ULONG processorIndex);
+UINT64 VMM_getTSCFrequency(void);
@@ -4,6 +4,7 @@
 #include "MemManage.h"
 #include "GuestShim.h"
 #include "Intrinsics.h"
+#include "MTF.h"
 #include "Debug.h"
 
 /******************** External API ********************/
@@ -11,39 +12,303 @@
 
 /******************** Module Typedefs ********************/
 
-/* Structure that will hold the shadow configuration for hiding executable pages. */
-typedef struct _SHADOW_PAGE
+/* Part of a shadow touched on every exec/RW flip, kept apart from the rest
+ * of the descriptor so that two of them share a cache line. */
+typedef struct _SHADOW_HOT
 {
-	DECLSPEC_ALIGN(PAGE_SIZE) UINT8 executePage[PAGE_SIZE];
-
-	/* Target process that will be hooked, NULL if global. */
-	CR3 targetCR3;
-
 	/* Pointer to the PML1 entry that will be modified between RW and E. */
 	PEPT_PML1_ENTRY targetPML1E;
 
-	/* Will store the flags of the specific PML1E's that will be
-	 * used for targetting shadowing. */
-	EPT_PML1_ENTRY originalPML1E;
-	EPT_PML1_ENTRY activeExecTargetPML1E;
-	EPT_PML1_ENTRY activeExecNotTargetPML1E;
+	/* Exec entry for processes without their own variant (the global execute page if there
+	 * is one, otherwise the original page) and the entry used for any data access. */
+	EPT_PML1_ENTRY activeExecDefaultPML1E;
 	EPT_PML1_ENTRY activeRWPML1E;
 
+	/* Table of per process execute pages, only consulted when it holds any. */
+	UINT32 variantTable;
+	UINT32 variantCount;
+} SHADOW_HOT, *PSHADOW_HOT;
+
+C_ASSERT(sizeof(SHADOW_HOT) == 32);
+
+/* Remaining state of a shadow page, only touched when creating, counting or reporting. */
+typedef struct _SHADOW_PAGE
+{
+	/* Page executed by every process without a variant, NULL if the page is only
+	 * shadowed for specific processes. Taken from the execute page slab. */
+	PUINT8 executePage;
+
+	/* Set when the descriptor is in use. */
+	BOOLEAN inUse;
+
+	/* Original flags of the PML1E, restored if the shadow cannot be registered. */
+	EPT_PML1_ENTRY originalPML1E;
+
+	/* Physical page that is shadowed. */
+	PHYSICAL_ADDRESS targetPA;
+
+	/* Counters for the exec/RW flips of the page, used to detect thrashing. */
+	UINT64 createdTSC;
+	UINT64 flipCount;
+	UINT64 stepCount;
+	UINT64 windowStartTSC;
+	UINT32 windowFlips;
+
+	/* When thrashing, data accesses are single stepped under the RW view
+	 * and the exec view that was active is restored afterwards. */
+	BOOLEAN thrashing;
+
+	/* Set when writes to the original page are merged into the global execute page. */
+	BOOLEAN tracked;
+
 } SHADOW_PAGE, *PSHADOW_PAGE;
 
+/* Open addressed table from the page directory of a process to the slab slot of the
+ * execute page used for it. Each entry packs the page directory PFN in the low
+ * VARIANT_KEY_BITS and the slot above them, zero marks an empty entry. */
+typedef struct _SHADOW_VARIANT_TABLE
+{
+	BOOLEAN inUse;
+	UINT64 entries[VMSHADOW_MAX_VARIANTS];
+} SHADOW_VARIANT_TABLE, *PSHADOW_VARIANT_TABLE;
+
+/* A shadow opened for the instruction being single stepped, and the view to restore once the step completes. */
+typedef struct _SHADOW_STEP
+{
+	PSHADOW_HOT shadowHot;
+	EPT_PML1_ENTRY restorePML1E;
+
+	/* Set when the instruction writes to a tracked page, the write
+	 * is merged into the execute page once the step completes. */
+	BOOLEAN write;
+} SHADOW_STEP, *PSHADOW_STEP;
+
+/* Shadow pages owned by a single logical processor, hot[i] and shadows[i] describe the same shadow.
+ * There is at most one shadow of a physical page, whichever processes it is shadowed for. */
+typedef struct _SHADOW_REGISTRY
+{
+	DECLSPEC_CACHEALIGN SHADOW_HOT hot[VMSHADOW_MAX_SHADOWS];
+	SHADOW_PAGE shadows[VMSHADOW_MAX_SHADOWS];
+
+	/* Variant tables, only handed to shadows that are scoped to processes. */
+	SHADOW_VARIANT_TABLE variantTables[VMSHADOW_MAX_VARIANT_TABLES];
+
+	/* Bitmap of shadows switched to an exec view since the last CR3 switch,
+	 * these are the only ones that need to be reset on a CR3 switch. */
+	UINT64 activeExec[VMSHADOW_MAX_SHADOWS / 64];
+
+	/* Shadows opened for the instruction being single stepped on this processor. One instruction
+	 * can fault on several shadows (a movs between two of them, or a write crossing into the next
+	 * page), each stays open until the trap. */
+	SHADOW_STEP steps[VMSHADOW_MAX_STEPS];
+	ULONG stepCount;
+	UINT64 steppingRIP;
+
+	/* Copy of the tracked page being merged, VMX root reads the original page through
+	 * MemManage as it is not mapped in the host. */
+	DECLSPEC_ALIGN(16) UINT8 trackedCopy[PAGE_SIZE];
+
+	/* Merged writes, the oldest are overwritten when the ring is full. */
+	VMSHADOW_WRITE_EVENT writeEvents[VMSHADOW_WRITE_RING_SIZE];
+	ULONG writeHead;
+	ULONG writeCount;
+	ULONG writeDropped;
+} SHADOW_REGISTRY, *PSHADOW_REGISTRY;
+
+/* Owner of a page in the execute page slab, the page is shared by every
+ * processor shadowing the same physical page for the same process. */
+typedef struct _EXEC_PAGE_SLOT
+{
+	PHYSICAL_ADDRESS targetPA;
+	CR3 targetCR3;
+	LONG refCount;
+} EXEC_PAGE_SLOT, *PEXEC_PAGE_SLOT;
+
+/* Bytes written over an execute page, with the bytes they replaced so the patch can be removed. */
+typedef struct _SHADOW_PATCH
+{
+	BOOLEAN inUse;
+	ULONG slotIndex;
+	USHORT offset;
+	USHORT size;
+	UINT8 bytes[VMSHADOW_MAX_PATCH_SIZE];
+	UINT8 original[VMSHADOW_MAX_PATCH_SIZE];
+} SHADOW_PATCH, *PSHADOW_PATCH;
+
+/* Execute pages are carved from physically contiguous, 2MB aligned chunks. */
+typedef struct _EXEC_PAGE_SLAB
+{
+	PUINT8 chunks[EXEC_SLAB_MAX_CHUNKS];
+	PHYSICAL_ADDRESS chunksPhysical[EXEC_SLAB_MAX_CHUNKS];
+
+	/* Chunks are only added from the guest, a chunk is published by incrementing the count. */
+	volatile LONG chunkCount;
+	volatile LONG growing;
+
+	/* Protects the slots, only taken in VMX root or at IPI level. */
+	volatile LONG lock;
+	volatile LONG usedCount;
+
+	EXEC_PAGE_SLOT slots[EXEC_SLAB_MAX_CHUNKS * EXEC_SLAB_CHUNK_PAGES];
+
+	/* Patches applied to the execute pages, also protected by the lock. */
+	SHADOW_PATCH patches[VMSHADOW_MAX_PATCHES];
+} EXEC_PAGE_SLAB, *PEXEC_PAGE_SLAB;
+
+/* Output of a statistics query, filled by each processor from VMX root.
+ * The output is written through the page tables of the caller. */
+typedef struct _SHADOW_STATS_QUERY
+{
+	PVMSHADOW_STATS stats;
+	CR3 guestCR3;
+	ULONG capacity;
+	volatile LONG written;
+} SHADOW_STATS_QUERY, *PSHADOW_STATS_QUERY;
+
+/* Parameters of a shadow in process, applied on each processor by VMSync.
+ * The page table base is resolved by the guest, as VMX root cannot read the process,
+ * and the execute page is staged in memory mapped in the host. */
+typedef struct _SHADOW_PROC_EDIT
+{
+	CR3 tableBase;
+	PUINT8 targetVA;
+	PUINT8 execVA;
+} SHADOW_PROC_EDIT, *PSHADOW_PROC_EDIT;
+
+/* Parameters of a write tracking change, applied on each processor by VMSync. */
+typedef struct _SHADOW_TRACK_EDIT
+{
+	PHYSICAL_ADDRESS targetPA;
+	BOOLEAN enabled;
+} SHADOW_TRACK_EDIT, *PSHADOW_TRACK_EDIT;
+
+/* Output of a write event drain, filled by each processor from VMX root.
+ * The output is written through the page tables of the caller. */
+typedef struct _SHADOW_WRITE_DRAIN
+{
+	PVMSHADOW_WRITE_EVENT events;
+	CR3 guestCR3;
+	ULONG capacity;
+	volatile LONG written;
+	volatile LONG dropped;
+} SHADOW_WRITE_DRAIN, *PSHADOW_WRITE_DRAIN;
+
 /******************** Module Constants ********************/
 
+/* A shadow is considered thrashing when it flips at least SHADOW_THRASH_FLIPS
+ * times within SHADOW_THRASH_WINDOW_CYCLES TSC cycles. */
+#define SHADOW_THRASH_WINDOW_CYCLES		(100ULL * 1000 * 1000)
+#define SHADOW_THRASH_FLIPS				64
+
+/* Bit 63 of a value moved to CR3, requests no TLB invalidation when PCIDs are enabled. */
+#define CR3_NO_FLUSH_BIT				(1ULL << 63)
+
+/* Layout of a variant table entry, the key is CR3.AddressOfPageDirectory. */
+#define VARIANT_KEY_BITS				36
+#define VARIANT_KEY_MASK				((1ULL << VARIANT_KEY_BITS) - 1)
+
+/* Variant tables are kept at most three quarters full so probe sequences stay short. */
+#define VARIANT_TABLE_LOAD				((VMSHADOW_MAX_VARIANTS * 3) / 4)
+
+/* Marks a shadow without a variant table, or a failed slot allocation. */
+#define VARIANT_TABLE_NONE				MAXULONG
+#define EXEC_SLOT_NONE					MAXULONG
 
 /******************** Module Variables ********************/
 
+/* Shadow pages of each logical processor. */
+static SHADOW_REGISTRY registries[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/* Execute pages of every shadow on every processor. */
+static EXEC_PAGE_SLAB execSlab = { 0 };
+
+/* Page directory PFNs that have been given a variant on any processor, recorded from VMX root.
+ * Lets the guest skip exiting processes that were never shadowed without an IPI. */
+static volatile LONG64 scopedDirectories[VMSHADOW_MAX_SCOPED_PROCESSES] = { 0 };
+
+/* Execute page of a shadow in process, copied here by the guest before the broadcast
+ * as the caller's page is not mapped in the host. Also holds the target page of a patch
+ * while its execute page is taken from the slab, as the target may be pageable. */
+static DECLSPEC_ALIGN(PAGE_SIZE) UINT8 stagingPage[PAGE_SIZE] = { 0 };
+static FAST_MUTEX stagingLock;
 
 /******************** Module Prototypes ********************/
-static BOOLEAN handleShadowExec(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PVOID userBuffer);
-static NTSTATUS hidePage(PEPT_CONFIG eptConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA, PVOID executePage);
-static void setAllShadowsToReadWrite(PEPT_CONFIG eptConfig);
+static BOOLEAN handleShadowExec(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation, PVOID userBuffer);
+static NTSTATUS hidePage(PEPT_CONFIG eptConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA, PVOID payloadPage, PUINT8* executePage);
+static NTSTATUS hideExecInDirectory(PVMM_DATA lpData, CR3 tableBase, PUINT8 targetVA, PUINT8 execVA);
+static BOOLEAN resetActiveShadows(PSHADOW_REGISTRY registry);
+static ULONG64 readMovCRRegister(PVMM_DATA lpData, VMX_EXIT_QUALIFICATION_MOV_CR exitQualification);
+static NTSTATUS createShadow(PEPT_CONFIG eptConfig, PSHADOW_REGISTRY registry, PHYSICAL_ADDRESS targetPA, PSHADOW_PAGE* shadowPage);
+static NTSTATUS addVariant(PMM_CONTEXT mmContext, PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage, CR3 targetCR3, PVOID payloadPage, PUINT8* executePage);
+static PSHADOW_REGISTRY getRegistry(PEPT_CONFIG eptConfig);
+static PSHADOW_PAGE allocateShadow(PSHADOW_REGISTRY registry);
+static PSHADOW_PAGE findShadow(PSHADOW_REGISTRY registry, PHYSICAL_ADDRESS targetPA);
+static void freeShadow(PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage);
+static ULONG lookupVariant(PSHADOW_VARIANT_TABLE variantTable, UINT64 directoryPFN);
+static void insertVariant(PSHADOW_VARIANT_TABLE variantTable, UINT64 directoryPFN, ULONG slotIndex);
+static ULONG removeVariant(PSHADOW_VARIANT_TABLE variantTable, UINT64 directoryPFN);
+static ULONG hashDirectory(UINT64 directoryPFN);
+static NTSTATUS syncHideExecInProcess(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS syncUnhideProcess(PVMM_DATA lpData, PVOID parameter);
+static void destroyShadow(PEPT_CONFIG eptConfig, PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage);
+static void processNotify(HANDLE parentId, HANDLE processId, BOOLEAN create);
+static BOOLEAN trackScopedDirectory(UINT64 directoryPFN);
+static BOOLEAN handleShadowStep(PMTF_CONFIG mtfConfig, PVOID userBuffer);
+static void countFlip(PSHADOW_PAGE shadowPage);
+static NTSTATUS syncQueryStats(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS growExecSlab(void);
+static ULONG acquireExecSlot(PMM_CONTEXT mmContext, PHYSICAL_ADDRESS targetPA, CR3 targetCR3, PVOID payloadPage);
+static void releaseExecSlot(ULONG slotIndex);
+static PUINT8 getExecSlotPage(ULONG slotIndex);
+static UINT64 getExecSlotPFN(ULONG slotIndex);
+static ULONG findExecSlot(PUINT8 executePage);
+static PSHADOW_PATCH findPatch(ULONG slotIndex, ULONG offset, ULONG size);
+static NTSTATUS applyPatch(PUINT8 executePage, ULONG offset, const UINT8* patchBytes, ULONG patchSize);
+static NTSTATUS removePatch(PVOID targetAddress, PHYSICAL_ADDRESS targetPA);
+static void lockExecSlab(void);
+static void unlockExecSlab(void);
+static NTSTATUS syncSetWriteTracking(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS syncDrainWriteEvents(PVMM_DATA lpData, PVOID parameter);
+static void stepTrackedWrite(PVMM_DATA lpData, PSHADOW_REGISTRY registry, PSHADOW_HOT shadowHot, PSHADOW_PAGE shadowPage, EPT_PML1_ENTRY restorePML1E);
+static PSHADOW_STEP beginStep(PVMM_DATA lpData, PSHADOW_REGISTRY registry, PSHADOW_HOT shadowHot, EPT_PML1_ENTRY restorePML1E);
+static PSHADOW_STEP findStep(PSHADOW_REGISTRY registry, PSHADOW_HOT shadowHot);
+static void completeSteps(PVMM_DATA lpData, PSHADOW_REGISTRY registry);
+static void mergeTrackedWrites(PMM_CONTEXT mmContext, PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage, PUINT32 mergedBytes, PUINT32 conflictBytes);
+static void recordWriteEvent(PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage, UINT32 processorIndex, UINT32 mergedBytes, UINT32 conflictBytes);
 
 /******************** Public Code ********************/
 
+NTSTATUS VMShadow_initGlobal(void)
+{
+	/* Called at PASSIVE_LEVEL before the hypervisor is launched. Contiguous memory cannot be
+	 * allocated from VMX root so the first chunk of the slab is allocated up front, and process
+	 * exits are watched so the shadows scoped to them can be removed. */
+	ExInitializeFastMutex(&stagingLock);
+
+	NTSTATUS status = growExecSlab();
+
+	if (NT_SUCCESS(status))
+	{
+		status = PsSetCreateProcessNotifyRoutine(processNotify, FALSE);
+	}
+
+	return status;
+}
+
+void VMShadow_uninitGlobal(void)
+{
+	/* Called when the hypervisor fails to start, the consumer is unloaded afterwards
+	 * so the process notification must not outlive it. */
+	PsSetCreateProcessNotifyRoutine(processNotify, TRUE);
+}
+
+NTSTATUS VMShadow_init(PVMM_DATA lpData)
+{
+	/* Called once per logical processor before launch, thrashing shadows restore their
+	 * exec view after a single step. The MTF handler declines traps it did not expect. */
+	return MTF_addHandler(&lpData->mtfConfig, (PUINT8)0, (PUINT8)MAXULONG_PTR, handleShadowStep, NULL);
+}
+
 BOOLEAN VMShadow_handleMovCR(PVMM_DATA lpData)
 {
 	/* Cast the exit qualification to its proper type. */
@@ -55,36 +320,67 @@ BOOLEAN VMShadow_handleMovCR(PVMM_DATA lpData)
 	{
 		if (VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR == exitQualification.AccessType)
 		{
-			/* TODO: Make it so we only switch shadows to execute if new CR3 is
-			 *		 in one of the target pages. Will be quicker. */
-
 			/* MOV CR3, XXX has taken place, this indicates a new page table has been loaded.
-			 * We should iterate through all of the shadow pages and ensure RW pages are all
-			 * set instead of execute. That way if an execute happens on one, the target
-			 * will flip to the right execute entry later depending if it is a targetted process or not. */
-			setAllShadowsToReadWrite(&lpData->eptConfig);
-			EPT_invalidateAndFlush(&lpData->eptConfig);
+			 * Any shadow left in an exec view is set back to RW. That way if an execute happens on one,
+			 * the target will flip to the right execute entry later depending if it is a targetted process or not.
+			 * Only shadows switched to exec since the last switch need resetting. */
+			if (TRUE == resetActiveShadows(&registries[lpData->processorIndex]))
+			{
+				EPT_invalidateAndFlush(&lpData->eptConfig);
+			}
 
 			/* Set the guest CR3 register, to the value of the general purpose register. */
-			ULONG64* registerList = &lpData->guestContext.Rax;
+			ULONG64 registerValue = readMovCRRegister(lpData, exitQualification);
 
-			ULONG64 registerValue;
-			if (VMX_EXIT_QUALIFICATION_GENREG_RSP == exitQualification.GeneralPurposeRegister)
-			{
-				__vmx_vmread(VMCS_GUEST_RSP, &registerValue);
-			}
-			else
+			/* With PCIDs enabled, bit 63 asks for the TLB entries of the new PCID to be kept.
+			 * The bit is not part of CR3 itself so it is never written to the guest state. */
+			CR4 guestCR4;
+			__vmx_vmread(VMCS_GUEST_CR4, &guestCR4.Flags);
+
+			BOOLEAN preserveTLB = (guestCR4.PcidEnable) && (0 != (registerValue & CR3_NO_FLUSH_BIT));
+			registerValue &= ~CR3_NO_FLUSH_BIT;
+
+			__vmx_vmwrite(VMCS_GUEST_CR3, registerValue);
+
+			/* Emulate the invalidation the MOV CR3 would have done natively. INVVPID cannot target
+			 * a single PCID, so all non-global entries of the VPID are flushed instead. */
+			if (FALSE == preserveTLB)
 			{
-				registerValue = registerList[exitQualification.GeneralPurposeRegister];
+				INVVPID_DESCRIPTOR descriptor = { 0 };
+				descriptor.Vpid = 1;
+				__invvpid(InvvpidSingleContextRetainingGlobals, &descriptor);
+
+				/* The cached guest translations are dropped along with the TLB. */
+				GuestShim_flushTranslations(&lpData->mmContext);
 			}
-			registerValue &= ~(1ULL << 63);
+		}
+	}
+	else if ((VMX_EXIT_QUALIFICATION_REGISTER_CR4 == exitQualification.ControlRegister) &&
+			 (VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR == exitQualification.AccessType))
+	{
+		/* Only exits when the guest changes a host owned bit (VMXE or PGE) from its value in the
+		 * shadow. The guest reads back what it wrote, while VMXE stays set in the real register. */
+		CR4 newCR4;
+		newCR4.Flags = readMovCRRegister(lpData, exitQualification);
 
-			__vmx_vmwrite(VMCS_GUEST_CR3, registerValue);
+		CR4 shadowCR4;
+		__vmx_vmread(VMCS_CTRL_CR4_READ_SHADOW, &shadowCR4.Flags);
+
+		BOOLEAN flushGlobals = (newCR4.PageGlobalEnable != shadowCR4.PageGlobalEnable);
+
+		__vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, newCR4.Flags);
 
-			/* Flush the TLB for the current logical processor. */
+		newCR4.VmxEnable = TRUE;
+		__vmx_vmwrite(VMCS_GUEST_CR4, newCR4.Flags);
+
+		/* Toggling PGE flushes every translation natively, globals included. */
+		if (TRUE == flushGlobals)
+		{
 			INVVPID_DESCRIPTOR descriptor = { 0 };
 			descriptor.Vpid = 1;
-			__invvpid(InvvpidSingleContextRetainingGlobals, &descriptor);
+			__invvpid(InvvpidSingleContext, &descriptor);
+
+			GuestShim_flushTranslations(&lpData->mmContext);
 		}
 	}
 
@@ -95,13 +391,16 @@ NTSTATUS VMShadow_hidePageGlobally(
 	PEPT_CONFIG eptConfig,
 	PHYSICAL_ADDRESS targetPA,
 	PUINT8 payloadPage,
-	BOOLEAN hypervisorRunning
+	BOOLEAN hypervisorRunning,
+	PUINT8* executePage
 )
 {
+	/* The payload must be mapped in the host when called from VMX root. Without a payload
+	 * the execute page starts as a copy of the original page, read from VMX root. */
 	NTSTATUS status = STATUS_INVALID_PARAMETER;
 
 	CR3 nullCR3 = { .Flags = 0 };
-	status = hidePage(eptConfig, nullCR3, targetPA, payloadPage);
+	status = hidePage(eptConfig, nullCR3, targetPA, payloadPage, executePage);
 
 	if (NT_SUCCESS(status) && (TRUE == hypervisorRunning))
 	{
@@ -112,218 +411,1732 @@ NTSTATUS VMShadow_hidePageGlobally(
 	return status;
 }
 
-NTSTATUS VMShadow_hideExecInProcess(
-	PVMM_DATA lpData,
-	PEPROCESS targetProcess,
-	PUINT8 targetVA,
-	PUINT8 execVA
+NTSTATUS VMShadow_addPatch(
+	PEPT_CONFIG eptConfig,
+	PVOID targetAddress,
+	PHYSICAL_ADDRESS targetPA,
+	const UINT8* patchBytes,
+	ULONG patchSize,
+	BOOLEAN hypervisorRunning
 )
 {
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	/* Hides the kernel page holding targetAddress (if not already hidden on this processor)
+	 * and writes the patch into its execute page. Every patch of a page shares the one shadow,
+	 * so hooks that are close together do not need overlapping shadows. The physical address
+	 * of the page is resolved by the caller in the guest, the patch must be mapped in the host. */
+	NTSTATUS status;
 
-	/* Get the process/page table we want to shadow the memory from. */
-	CR3 tableBase = MemManage_getPageTableBase(targetProcess);
-	if (0 != tableBase.Flags)
+	ULONG offset = (ULONG)ADDRMASK_EPT_PML1_OFFSET((UINT64)targetAddress);
+
+	if ((NULL != patchBytes) && (0 != patchSize) && (patchSize <= VMSHADOW_MAX_PATCH_SIZE) &&
+		((offset + patchSize) <= PAGE_SIZE))
 	{
-		/* Calculate the physical address of the target VA,
-		* I know we could calculate this by reading the PTE here and
-		* calculating, however we have a function for this already (at the expense of reading PTE again.. */
-		PHYSICAL_ADDRESS physTargetVA = { 0 };
-		physTargetVA.QuadPart = GuestShim_GuestUVAToHPA(&lpData->mmContext, tableBase, (GUEST_VIRTUAL_ADDRESS)targetVA);
-		if (0 != physTargetVA.QuadPart)
+		PUINT8 executePage = NULL;
+		status = VMShadow_hidePageGlobally(eptConfig, targetPA, NULL, hypervisorRunning, &executePage);
+
+		if (NT_SUCCESS(status))
 		{
-			/* Hide the executable page, for that page only. */
-			status = hidePage(&lpData->eptConfig, tableBase, physTargetVA, execVA);
-			if (NT_SUCCESS(status))
-			{			
-				/* As we are attempting to hide exec memory in a process,
-				 * it's safe to say the hypervisor & EPT is already running.
-			     * Therefore we should invalidate the already existing EPT to flush
-				 * in the new config. */
-				EPT_invalidateAndFlush(&lpData->eptConfig);
-			}
+			status = applyPatch(executePage, offset, patchBytes, patchSize);
 		}
 	}
 	else
 	{
-		/* Unable to get the table base. */
-		status = STATUS_INVALID_MEMBER;
+		status = STATUS_INVALID_PARAMETER;
 	}
 
 	return status;
 }
 
-/******************** Module Code ********************/
-
-static BOOLEAN handleShadowExec(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PVOID userBuffer)
+NTSTATUS VMShadow_preparePatch(PVOID targetAddress, const UINT8* patchBytes, ULONG patchSize)
 {
-	UNREFERENCED_PARAMETER(eptConfig);
-	UNREFERENCED_PARAMETER(guestContext);
-	BOOLEAN result = FALSE;
+	/* Called at PASSIVE_LEVEL before the processors apply the same patch with VMShadow_addPatch.
+	 * The execute page is copied and patched once here, the processors then only share it.
+	 * The reference taken on the page is held for as long as the patch is wanted.
+	 * Nothing pageable may be touched once the slab is taken at HIGH_LEVEL, so the target page
+	 * is locked and copied to the staging page, and the patch to the stack, beforehand. */
+	NTSTATUS status;
 
-	/* Cast the exit qualification to it's proper type, as an EPT violation. */
-	VMX_EXIT_QUALIFICATION_EPT_VIOLATION violationQual;
-	__vmx_vmread(VMCS_EXIT_QUALIFICATION, &violationQual.Flags);
+	ULONG offset = (ULONG)ADDRMASK_EPT_PML1_OFFSET((UINT64)targetAddress);
 
-	/* We should only deal with shadow pages caused by translation. */
-	if (TRUE == violationQual.CausedByTranslation)
+	if ((NULL != patchBytes) && (0 != patchSize) && (patchSize <= VMSHADOW_MAX_PATCH_SIZE) &&
+		((offset + patchSize) <= PAGE_SIZE))
 	{
-		/* The user supplied parameter when the handler was registered supplies
-		 * the shadow page config, so we re-cast it to the desired type. */
-		PSHADOW_PAGE shadowPage = (PSHADOW_PAGE)userBuffer;
-		if (NULL != shadowPage)
+		PMDL mdl = IoAllocateMdl(PAGE_ALIGN(targetAddress), PAGE_SIZE, FALSE, FALSE, NULL);
+
+		if (NULL != mdl)
 		{
-			/* Check to see if the violation was from trying to execute a non-executable page. */
-			if ((FALSE == violationQual.EptExecutable) && (TRUE == violationQual.ExecuteAccess))
+			status = STATUS_SUCCESS;
+
+			__try
 			{
-				/* Check to see if target process matches. */
-				CR3 guestCR3;
-				__vmx_vmread(VMCS_GUEST_CR3, &guestCR3.Flags);
+				MmProbeAndLockPages(mdl, KernelMode, IoReadAccess);
+			}
+			__except (EXCEPTION_EXECUTE_HANDLER)
+			{
+				status = GetExceptionCode();
+			}
+
+			if (NT_SUCCESS(status))
+			{
+				PVOID lockedTarget = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
 
-				if ((0 == shadowPage->targetCR3.Flags) || (guestCR3.AddressOfPageDirectory == shadowPage->targetCR3.AddressOfPageDirectory))
+				if (NULL != lockedTarget)
 				{
-					/* Switch to the target execute page, this is if there it is a global shadow (no target CR3)
-					* or the CR3 matches the target. */
-					shadowPage->targetPML1E->Flags = shadowPage->activeExecTargetPML1E.Flags;
+					/* The page is resident while locked, so its frame is the one the processors shadow. */
+					PHYSICAL_ADDRESS targetPA;
+					targetPA.QuadPart = (LONGLONG)MmGetMdlPfnArray(mdl)[0] << PAGE_SHIFT;
+					CR3 nullCR3 = { .Flags = 0 };
+
+					UINT8 patchCopy[VMSHADOW_MAX_PATCH_SIZE];
+					RtlCopyMemory(patchCopy, patchBytes, patchSize);
+
+					ExAcquireFastMutex(&stagingLock);
+					RtlCopyMemory(stagingPage, lockedTarget, PAGE_SIZE);
+
+					/* The slab lock is also taken in VMX root when an IPI arrives,
+					 * so it cannot be held by the guest while IPIs can be delivered. */
+					KIRQL oldIrql;
+					KeRaiseIrql(HIGH_LEVEL, &oldIrql);
+
+					ULONG slotIndex = acquireExecSlot(NULL, targetPA, nullCR3, stagingPage);
+					if (EXEC_SLOT_NONE != slotIndex)
+					{
+						status = applyPatch(getExecSlotPage(slotIndex), offset, patchCopy, patchSize);
+
+						if (FALSE == NT_SUCCESS(status))
+						{
+							releaseExecSlot(slotIndex);
+						}
+					}
+					else
+					{
+						status = STATUS_NO_MEMORY;
+					}
+
+					KeLowerIrql(oldIrql);
+					ExReleaseFastMutex(&stagingLock);
 				}
 				else
 				{
-					/* Switch to the original execute page */
-					shadowPage->targetPML1E->Flags = shadowPage->activeExecNotTargetPML1E.Flags;
+					status = STATUS_INSUFFICIENT_RESOURCES;
 				}
 
-				result = TRUE;
-			}
-			else if ((TRUE == violationQual.EptExecutable) &&
-					 (violationQual.ReadAccess || violationQual.WriteAccess))
-			{
-				/* If so, we update the PML1E so that the read/write page is visible to the guest. */
-				shadowPage->targetPML1E->Flags = shadowPage->activeRWPML1E.Flags;
-				result = TRUE;
+				MmUnlockPages(mdl);
 			}
+
+			IoFreeMdl(mdl);
+		}
+		else
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
 		}
 	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
 
-	return result;
+	return status;
 }
 
-static NTSTATUS hidePage(PEPT_CONFIG eptConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA, PVOID executePage)
+NTSTATUS VMShadow_removePatch(PVOID targetAddress)
 {
+	/* Called from the guest, restores the bytes replaced by the patch at targetAddress.
+	 * The shadow itself is kept, it executes the original bytes from now on. */
 	NTSTATUS status;
 
-	if (0ULL != targetPA.QuadPart)
-	{
-		PSHADOW_PAGE shadowConfig = (PSHADOW_PAGE)ExAllocatePool(NonPagedPoolNx, sizeof(SHADOW_PAGE));
+	/* The slab lock is also taken in VMX root when an IPI arrives,
+	 * so it cannot be held by the guest while IPIs can be delivered. */
+	PHYSICAL_ADDRESS targetPA = MmGetPhysicalAddress(PAGE_ALIGN(targetAddress));
 
-		if (NULL != shadowConfig)
-		{
-			/* As we have set up PDT to 2MB large pages we need to split this for performance.
-			* The lowest we can split it to is the size of a page, 2MB = 512 * 4096 blocks. */
-			status = EPT_splitLargePage(eptConfig, targetPA);
+	KIRQL oldIrql;
+	KeRaiseIrql(HIGH_LEVEL, &oldIrql);
 
-			/* If the page split was successful or was already split, continue. */
-			if (NT_SUCCESS(status) || (STATUS_ALREADY_COMPLETE == status))
-			{
-				/* Zero the newly allocated page config. */
-				RtlZeroMemory(shadowConfig, sizeof(SHADOW_PAGE));
+	status = removePatch(targetAddress, targetPA);
 
-				/* Calculate the start and end of the physical address page we are hooking. */
-				PHYSICAL_ADDRESS physStart;
-				PHYSICAL_ADDRESS physEnd;
+	KeLowerIrql(oldIrql);
 
-				physStart.QuadPart = (LONGLONG)PAGE_ALIGN(targetPA.QuadPart);
-				physEnd.QuadPart = physStart.QuadPart + PAGE_SIZE;
+	return status;
+}
 
-				/* Store the target process. */
-				shadowConfig->targetCR3 = targetCR3;
+NTSTATUS VMShadow_removePatchFromRoot(PVOID targetAddress, PHYSICAL_ADDRESS targetPA)
+{
+	/* Called in VMX root, usually by every processor from a VMSync edit. The first processor
+	 * restores the bytes under the slab lock, the others find the patch already gone.
+	 * The physical address of the page is resolved by the caller in the guest. */
+	return removePatch(targetAddress, targetPA);
+}
 
-				/* Store a pointer to the PML1E we will be modifying. */
-				shadowConfig->targetPML1E = EPT_getPML1EFromAddress(eptConfig, targetPA);
+NTSTATUS VMShadow_hideExecInProcess(
+	PVMM_DATA lpData,
+	PEPROCESS targetProcess,
+	PUINT8 targetVA,
+	PUINT8 execVA
+)
+{
+	/* Get the process/page table we want to shadow the memory from.
+	 * The execute page must be mapped in the host. */
+	CR3 tableBase = MemManage_getPageTableBase(targetProcess);
 
-				if (NULL != shadowConfig->targetPML1E)
-				{
-					/* Store a copy of the original */
-					shadowConfig->originalPML1E.Flags = shadowConfig->targetPML1E->Flags;
-
-					/* Create the executable PML1E when it IS the target process. */
-					shadowConfig->activeExecTargetPML1E.Flags = shadowConfig->targetPML1E->Flags;
-					shadowConfig->activeExecTargetPML1E.ReadAccess = 0;
-					shadowConfig->activeExecTargetPML1E.WriteAccess = 0;
-					shadowConfig->activeExecTargetPML1E.ExecuteAccess = 1;
-					shadowConfig->activeExecTargetPML1E.PageFrameNumber = MmGetPhysicalAddress(&shadowConfig->executePage).QuadPart / PAGE_SIZE;
-
-					/* Create the executable PML1E when the it is NOT the target process.
-					 * Here we want to keep original flags and guest physical address, but just disable read/write. */
-					shadowConfig->activeExecNotTargetPML1E.Flags = shadowConfig->targetPML1E->Flags;
-					shadowConfig->activeExecNotTargetPML1E.ReadAccess = 0;
-					shadowConfig->activeExecNotTargetPML1E.WriteAccess = 0;
-					shadowConfig->activeExecNotTargetPML1E.ExecuteAccess = 1;
-
-					/* Create the readwrite PML1E when ANY read write to the page takes place.
-					 * Here we want to keep original flags, however disable execute access. */
-					shadowConfig->activeRWPML1E.Flags = shadowConfig->targetPML1E->Flags;
-					shadowConfig->activeRWPML1E.ReadAccess = 1;
-					shadowConfig->activeRWPML1E.WriteAccess = 1;
-					shadowConfig->activeRWPML1E.ExecuteAccess = 0;
-
-					/* Set the actual PML1E to the value of the readWrite. */
-					shadowConfig->targetPML1E->Flags = shadowConfig->activeRWPML1E.Flags;
-
-					/* Copy the fake bytes */
-					RtlCopyMemory(&shadowConfig->executePage[0], executePage, PAGE_SIZE);
-
-					/* Calculate the range, that this handler will be for. */
-					
-
-					PHYSICAL_RANGE handlerRange;
-					handlerRange.start = physStart;
-					handlerRange.end = physEnd;
-
-					/* Add this shadow hook to the EPT shadow list. */
-					status = EPT_addViolationHandler(eptConfig, handlerRange, handleShadowExec, (PVOID)shadowConfig);
-				}
-				else
-				{
-					/* Unable to find the PML1E for the target page. */
-					ExFreePool(shadowConfig);
-					status = STATUS_NO_SUCH_MEMBER;
-				}
-			}
+	return hideExecInDirectory(lpData, tableBase, targetVA, execVA);
+}
+
+NTSTATUS VMShadow_queryStats(PVMSHADOW_STATS stats, ULONG capacity, PULONG count)
+{
+	/* Called from the guest, every processor reports its own shadows. The output is written
+	 * through the page tables of this thread, so it must be resident. */
+	NTSTATUS status;
+
+	if ((NULL != stats) && (0 != capacity) && (NULL != count))
+	{
+		UINT64 tscFrequency = VMM_getTSCFrequency();
+
+		SHADOW_STATS_QUERY query = { 0 };
+		query.stats = stats;
+		query.capacity = capacity;
+		query.guestCR3.Flags = __readcr3();
+
+		status = VMSync_broadcastQuery(syncQueryStats, &query, sizeof(query));
+
+		*count = (ULONG)min(query.written, (LONG)capacity);
+
+		/* Convert the elapsed cycles to a rate now the TSC frequency is known. */
+		for (ULONG i = 0; i < *count; i++)
+		{
+			UINT64 elapsedMs = stats[i].elapsedCycles / max(tscFrequency / 1000, 1);
+			stats[i].flipsPerSecond = (stats[i].flipCount * 1000) / max(elapsedMs, 1);
 		}
-		else
+
+		if ((NT_SUCCESS(status)) && (query.written > (LONG)capacity))
 		{
-			status = STATUS_NO_MEMORY;
+			status = STATUS_BUFFER_OVERFLOW;
 		}
 	}
 	else
 	{
-		status = STATUS_INVALID_ADDRESS;
+		status = STATUS_INVALID_PARAMETER;
 	}
 
 	return status;
 }
 
-static void setAllShadowsToReadWrite(PEPT_CONFIG eptConfig)
+NTSTATUS VMShadow_hideExecInProcessAll(
+	PEPROCESS targetProcess,
+	PUINT8 targetVA,
+	PUINT8 execVA,
+	PVMSYNC_STATS stats
+)
 {
-	/* Go through the whole linked list of the EPT handlers for each of the
-	 * user addresses. If the handler matches the one we use for shadow exec, set it to read/write. */
-	for (PLIST_ENTRY currentEntry = eptConfig->handlerList.Flink;
-		currentEntry != &eptConfig->handlerList;
-		currentEntry = currentEntry->Flink)
+	/* Called from the guest at PASSIVE_LEVEL, hides the executable page on every logical processor
+	 * so that the shadow is active regardless of where the process is scheduled. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	SHADOW_PROC_EDIT edit = { 0 };
+	edit.tableBase = MemManage_getPageTableBase(targetProcess);
+	edit.targetVA = targetVA;
+	edit.execVA = stagingPage;
+
+	/* The slab can only grow from the guest, make sure there is room before
+	 * the processors try to take a page from it. */
+	if (execSlab.usedCount >= (execSlab.chunkCount * EXEC_SLAB_CHUNK_PAGES))
+	{
+		status = growExecSlab();
+	}
+
+	/* VMX root cannot allocate, so each processor must have a split and a handler to hand. */
+	if (NT_SUCCESS(status))
 	{
-		PEPT_HANDLER eptHandler = CONTAINING_RECORD(currentEntry, EPT_HANDLER, listEntry);
+		status = EPT_reserve(1, 1);
+	}
+
+	/* The process must be known to be scoped before any processor gives it a variant,
+	 * so its variants are removed when it exits. */
+	if ((NT_SUCCESS(status)) && (FALSE == trackScopedDirectory(edit.tableBase.AddressOfPageDirectory)))
+	{
+		status = STATUS_QUOTA_EXCEEDED;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* The processors copy the execute page from the staging page, which is only
+		 * reused once every one of them has returned. */
+		ExAcquireFastMutex(&stagingLock);
+
+		RtlCopyMemory(stagingPage, execVA, PAGE_SIZE);
+		status = VMSync_broadcastEdit(syncHideExecInProcess, &edit, sizeof(edit), stats);
+
+		ExReleaseFastMutex(&stagingLock);
+	}
+
+	return status;
+}
 
-		/* TODO: Not a great solution, maybe think of something more elegant,
-		 *		 VMShadow is currently coupled to EPT internal configs (which is shouldn't really have access to). */
-		if (eptHandler->callback == handleShadowExec)
+NTSTATUS VMShadow_unhideProcess(CR3 tableBase, PVMSYNC_STATS stats)
+{
+	/* Called from the guest, removes every variant of the process on every processor in
+	 * a single batch (one EPT invalidation per processor). Shadows left without any
+	 * execute page are removed entirely, along with their EPT handler. */
+	NTSTATUS status = STATUS_NOT_FOUND;
+	UINT64 directoryPFN = tableBase.AddressOfPageDirectory;
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_SCOPED_PROCESSES; i++)
+	{
+		if ((LONG64)directoryPFN == InterlockedCompareExchange64(&scopedDirectories[i], 0, (LONG64)directoryPFN))
 		{
-			PSHADOW_PAGE shadowPage = (PSHADOW_PAGE)eptHandler->userParameter;
+			status = VMSync_broadcastEdit(syncUnhideProcess, &directoryPFN, sizeof(directoryPFN), stats);
+			break;
+		}
+	}
 
-			/* Only set hooks that are currently enabled. */
-			if (shadowPage->targetPML1E->Flags != shadowPage->originalPML1E.Flags)
-			{
-				shadowPage->targetPML1E->Flags = shadowPage->activeRWPML1E.Flags;
-			}
+	return status;
+}
+
+NTSTATUS VMShadow_setWriteTracking(PVOID targetAddress, BOOLEAN enabled, PVMSYNC_STATS stats)
+{
+	/* Called from the guest, traps writes to the globally shadowed kernel page holding
+	 * targetAddress and merges them into its execute page, so code that patches itself
+	 * keeps running the updated bytes. Bytes under a patch are never overwritten, the
+	 * write updates the bytes restored when the patch is removed instead. */
+	SHADOW_TRACK_EDIT edit = { 0 };
+	edit.targetPA = MmGetPhysicalAddress(PAGE_ALIGN(targetAddress));
+	edit.enabled = enabled;
+
+	return VMSync_broadcastEdit(syncSetWriteTracking, &edit, sizeof(edit), stats);
+}
+
+NTSTATUS VMShadow_drainWriteEvents(
+	PVMSHADOW_WRITE_EVENT events,
+	ULONG capacity,
+	PULONG eventCount,
+	PULONG droppedCount
+)
+{
+	/* Called from the guest, each processor copies out its own ring from VMX root. The output
+	 * is written through the page tables of this thread, so it must be resident. */
+	NTSTATUS status;
+
+	if ((NULL != events) && (0 != capacity) && (NULL != eventCount))
+	{
+		SHADOW_WRITE_DRAIN drain = { 0 };
+		drain.events = events;
+		drain.capacity = capacity;
+		drain.guestCR3.Flags = __readcr3();
+
+		status = VMSync_broadcastQuery(syncDrainWriteEvents, &drain, sizeof(drain));
+
+		*eventCount = (ULONG)min(drain.written, (LONG)capacity);
+		if (NULL != droppedCount)
+		{
+			*droppedCount = (ULONG)drain.dropped;
 		}
 	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static BOOLEAN handleShadowExec(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation, PVOID userBuffer)
+{
+	UNREFERENCED_PARAMETER(guestContext);
+	BOOLEAN result = FALSE;
+
+	VMX_EXIT_QUALIFICATION_EPT_VIOLATION violationQual = violation->qualification;
+
+	/* We should only deal with shadow pages caused by translation. */
+	if (TRUE == violationQual.CausedByTranslation)
+	{
+		/* The user supplied parameter when the handler was registered is the
+		 * hot part of the shadow, the index locates the rest of it. */
+		PSHADOW_HOT shadowHot = (PSHADOW_HOT)userBuffer;
+		if (NULL != shadowHot)
+		{
+			PVMM_DATA lpData = CONTAINING_RECORD(eptConfig, VMM_DATA, eptConfig);
+			PSHADOW_REGISTRY registry = getRegistry(eptConfig);
+			ULONG shadowIndex = (ULONG)(shadowHot - registry->hot);
+			PSHADOW_PAGE shadowPage = &registry->shadows[shadowIndex];
+
+			/* Check to see if the violation was from trying to execute a non-executable page. */
+			if ((FALSE == violationQual.EptExecutable) && (TRUE == violationQual.ExecuteAccess))
+			{
+				countFlip(shadowPage);
+
+				/* Processes without a variant execute the global page (or the original one). */
+				EPT_PML1_ENTRY execPML1E = shadowHot->activeExecDefaultPML1E;
+
+				if (0 != shadowHot->variantCount)
+				{
+					/* Check to see if the process has its own execute page. */
+					CR3 guestCR3 = violation->guestCR3;
+
+					ULONG slotIndex = lookupVariant(&registry->variantTables[shadowHot->variantTable], guestCR3.AddressOfPageDirectory);
+					if (EXEC_SLOT_NONE != slotIndex)
+					{
+						execPML1E.PageFrameNumber = getExecSlotPFN(slotIndex);
+					}
+				}
+
+				shadowHot->targetPML1E->Flags = execPML1E.Flags;
+
+				/* Remember the shadow needs resetting on the next CR3 switch. */
+				registry->activeExec[shadowIndex / 64] |= (1ULL << (shadowIndex % 64));
+
+				result = TRUE;
+			}
+			else if ((TRUE == violationQual.EptExecutable) &&
+					 (violationQual.ReadAccess || violationQual.WriteAccess))
+			{
+				countFlip(shadowPage);
+
+				if ((TRUE == violationQual.WriteAccess) && (TRUE == shadowPage->tracked))
+				{
+					/* Step the write under a writable RW view and keep the exec view active afterwards. */
+					stepTrackedWrite(lpData, registry, shadowHot, shadowPage, *shadowHot->targetPML1E);
+					shadowPage->stepCount++;
+				}
+				else if (TRUE == shadowPage->thrashing)
+				{
+					/* The page keeps alternating between code and data, serve this access under
+					 * the original page for a single instruction and keep the exec view active afterwards.
+					 * The step has to be executable, otherwise an access made by code on the page
+					 * itself would fault again on the fetch and flip back and forth forever.
+					 * Tracked pages keep write access removed, writes are stepped separately. */
+					EPT_PML1_ENTRY stepPML1E = shadowPage->originalPML1E;
+					stepPML1E.ReadAccess = 1;
+					stepPML1E.WriteAccess = (FALSE == shadowPage->tracked);
+					stepPML1E.ExecuteAccess = 1;
+
+					beginStep(lpData, registry, shadowHot, *shadowHot->targetPML1E);
+
+					shadowHot->targetPML1E->Flags = stepPML1E.Flags;
+					shadowPage->stepCount++;
+
+					MTF_setTracingEnabled(TRUE);
+				}
+				else
+				{
+					/* If so, we update the PML1E so that the read/write page is visible to the guest. */
+					shadowHot->targetPML1E->Flags = shadowHot->activeRWPML1E.Flags;
+				}
+
+				result = TRUE;
+			}
+			else if ((FALSE == violationQual.EptExecutable) && (TRUE == violationQual.WriteAccess) &&
+					 (TRUE == shadowPage->tracked))
+			{
+				/* Write under the RW view of a tracked page, which has write access removed.
+				 * The single instruction writes the original page and is merged afterwards. */
+				stepTrackedWrite(lpData, registry, shadowHot, shadowPage, shadowHot->activeRWPML1E);
+				shadowPage->stepCount++;
+
+				result = TRUE;
+			}
+		}
+	}
+
+	return result;
+}
+
+static NTSTATUS hidePage(PEPT_CONFIG eptConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA, PVOID payloadPage, PUINT8* executePage)
+{
+	NTSTATUS status;
+
+	if (0ULL != targetPA.QuadPart)
+	{
+		PVMM_DATA lpData = CONTAINING_RECORD(eptConfig, VMM_DATA, eptConfig);
+		PSHADOW_REGISTRY registry = getRegistry(eptConfig);
+
+		PHYSICAL_ADDRESS alignedPA;
+		alignedPA.QuadPart = (LONGLONG)PAGE_ALIGN(targetPA.QuadPart);
+
+		/* A page is only shadowed once on each processor, hiding it for another process
+		 * adds a variant to the existing shadow. */
+		PSHADOW_PAGE shadowConfig = findShadow(registry, alignedPA);
+		BOOLEAN created = FALSE;
+
+		if (NULL != shadowConfig)
+		{
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = createShadow(eptConfig, registry, targetPA, &shadowConfig);
+			created = TRUE;
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* Hiding the page again for the same process returns the existing execute page
+			 * (which is not overwritten) so it can be patched. */
+			status = addVariant(&lpData->mmContext, registry, shadowConfig, targetCR3, payloadPage, executePage);
+
+			if ((FALSE == NT_SUCCESS(status)) && (TRUE == created))
+			{
+				/* Nothing is shadowed, leave the page as it was. */
+				destroyShadow(eptConfig, registry, shadowConfig);
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_ADDRESS;
+	}
+
+	return status;
+}
+
+static NTSTATUS createShadow(PEPT_CONFIG eptConfig, PSHADOW_REGISTRY registry, PHYSICAL_ADDRESS targetPA, PSHADOW_PAGE* shadowPage)
+{
+	/* Creates the shadow of a physical page without any execute page yet,
+	 * until a variant is added it executes the original page. */
+	NTSTATUS status;
+
+	PSHADOW_PAGE shadowConfig = allocateShadow(registry);
+	if (NULL != shadowConfig)
+	{
+		PSHADOW_HOT shadowHot = &registry->hot[shadowConfig - registry->shadows];
+
+		/* As we have set up PDT to 2MB large pages we need to split this for performance.
+		* The lowest we can split it to is the size of a page, 2MB = 512 * 4096 blocks. */
+		status = EPT_splitLargePage(eptConfig, targetPA);
+
+		/* If the page split was successful or was already split, continue. */
+		if (NT_SUCCESS(status) || (STATUS_ALREADY_COMPLETE == status))
+		{
+			/* Calculate the start and end of the physical address page we are hooking. */
+			PHYSICAL_ADDRESS physStart;
+			PHYSICAL_ADDRESS physEnd;
+
+			physStart.QuadPart = (LONGLONG)PAGE_ALIGN(targetPA.QuadPart);
+			physEnd.QuadPart = physStart.QuadPart + PAGE_SIZE;
+
+			/* Store the target page. */
+			shadowConfig->targetPA = physStart;
+
+			/* Start the flip counters. */
+			shadowConfig->createdTSC = __rdtsc();
+			shadowConfig->windowStartTSC = shadowConfig->createdTSC;
+
+			/* Store a pointer to the PML1E we will be modifying. */
+			shadowHot->targetPML1E = EPT_getPML1EFromAddress(eptConfig, targetPA);
+
+			if (NULL != shadowHot->targetPML1E)
+			{
+				/* Store a copy of the original */
+				shadowConfig->originalPML1E.Flags = shadowHot->targetPML1E->Flags;
+
+				/* Create the executable PML1E used when the process has no variant.
+				 * Here we want to keep original flags and guest physical address, but just disable read/write. */
+				shadowHot->activeExecDefaultPML1E.Flags = shadowHot->targetPML1E->Flags;
+				shadowHot->activeExecDefaultPML1E.ReadAccess = 0;
+				shadowHot->activeExecDefaultPML1E.WriteAccess = 0;
+				shadowHot->activeExecDefaultPML1E.ExecuteAccess = 1;
+
+				/* Create the readwrite PML1E when ANY read write to the page takes place.
+				 * Here we want to keep original flags, however disable execute access. */
+				shadowHot->activeRWPML1E.Flags = shadowHot->targetPML1E->Flags;
+				shadowHot->activeRWPML1E.ReadAccess = 1;
+				shadowHot->activeRWPML1E.WriteAccess = 1;
+				shadowHot->activeRWPML1E.ExecuteAccess = 0;
+
+				/* Set the actual PML1E to the value of the readWrite. */
+				shadowHot->targetPML1E->Flags = shadowHot->activeRWPML1E.Flags;
+
+				/* Calculate the range, that this handler will be for. */
+				PHYSICAL_RANGE handlerRange;
+				handlerRange.start = physStart;
+				handlerRange.end = physEnd;
+
+				/* Add this shadow hook to the EPT shadow list. */
+				status = EPT_addViolationHandler(eptConfig, handlerRange, handleShadowExec, (PVOID)shadowHot);
+				if (NT_SUCCESS(status))
+				{
+					*shadowPage = shadowConfig;
+				}
+				else
+				{
+					shadowHot->targetPML1E->Flags = shadowConfig->originalPML1E.Flags;
+					freeShadow(registry, shadowConfig);
+				}
+			}
+			else
+			{
+				/* Unable to find the PML1E for the target page. */
+				freeShadow(registry, shadowConfig);
+				status = STATUS_NO_SUCH_MEMBER;
+			}
+		}
+		else
+		{
+			freeShadow(registry, shadowConfig);
+		}
+	}
+	else
+	{
+		status = STATUS_NO_MEMORY;
+	}
+
+	return status;
+}
+
+static NTSTATUS addVariant(PMM_CONTEXT mmContext, PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage, CR3 targetCR3, PVOID payloadPage, PUINT8* executePage)
+{
+	/* Gives the shadow an execute page for targetCR3 (every process if NULL), shadows of the same
+	 * page for the same process on other processors share it. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PSHADOW_HOT shadowHot = &registry->hot[shadowPage - registry->shadows];
+	PUINT8 variantPage = NULL;
+
+	if (0 == targetCR3.Flags)
+	{
+		if (NULL == shadowPage->executePage)
+		{
+			ULONG slotIndex = acquireExecSlot(mmContext, shadowPage->targetPA, targetCR3, payloadPage);
+			if (EXEC_SLOT_NONE != slotIndex)
+			{
+				shadowPage->executePage = getExecSlotPage(slotIndex);
+				shadowHot->activeExecDefaultPML1E.PageFrameNumber = getExecSlotPFN(slotIndex);
+			}
+			else
+			{
+				/* The slab is exhausted, or the original page could not be read. */
+				status = STATUS_NO_MEMORY;
+			}
+		}
+
+		variantPage = shadowPage->executePage;
+	}
+	else
+	{
+		if (VARIANT_TABLE_NONE == shadowHot->variantTable)
+		{
+			for (ULONG i = 0; i < VMSHADOW_MAX_VARIANT_TABLES; i++)
+			{
+				if (FALSE == registry->variantTables[i].inUse)
+				{
+					__stosb((PUCHAR)&registry->variantTables[i], 0, sizeof(SHADOW_VARIANT_TABLE));
+					registry->variantTables[i].inUse = TRUE;
+					shadowHot->variantTable = i;
+					break;
+				}
+			}
+		}
+
+		if (VARIANT_TABLE_NONE != shadowHot->variantTable)
+		{
+			PSHADOW_VARIANT_TABLE variantTable = &registry->variantTables[shadowHot->variantTable];
+
+			ULONG slotIndex = lookupVariant(variantTable, targetCR3.AddressOfPageDirectory);
+			if (EXEC_SLOT_NONE == slotIndex)
+			{
+				if ((shadowHot->variantCount < VARIANT_TABLE_LOAD) &&
+					(TRUE == trackScopedDirectory(targetCR3.AddressOfPageDirectory)))
+				{
+					slotIndex = acquireExecSlot(mmContext, shadowPage->targetPA, targetCR3, payloadPage);
+					if (EXEC_SLOT_NONE != slotIndex)
+					{
+						insertVariant(variantTable, targetCR3.AddressOfPageDirectory, slotIndex);
+						shadowHot->variantCount++;
+					}
+					else
+					{
+						status = STATUS_NO_MEMORY;
+					}
+				}
+				else
+				{
+					status = STATUS_QUOTA_EXCEEDED;
+				}
+			}
+
+			if (EXEC_SLOT_NONE != slotIndex)
+			{
+				variantPage = getExecSlotPage(slotIndex);
+			}
+		}
+		else
+		{
+			status = STATUS_QUOTA_EXCEEDED;
+		}
+	}
+
+	if ((NT_SUCCESS(status)) && (NULL != executePage))
+	{
+		*executePage = variantPage;
+	}
+
+	return status;
+}
+
+static NTSTATUS hideExecInDirectory(PVMM_DATA lpData, CR3 tableBase, PUINT8 targetVA, PUINT8 execVA)
+{
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+	if (0 != tableBase.Flags)
+	{
+		/* Calculate the physical address of the target VA,
+		* I know we could calculate this by reading the PTE here and
+		* calculating, however we have a function for this already (at the expense of reading PTE again.. */
+		PHYSICAL_ADDRESS physTargetVA = { 0 };
+		physTargetVA.QuadPart = GuestShim_GuestUVAToHPA(&lpData->mmContext, tableBase, (GUEST_VIRTUAL_ADDRESS)targetVA);
+		if (0 != physTargetVA.QuadPart)
+		{
+			/* Hide the executable page, for that page only.
+			 * The hypervisor & EPT is already running so the caller must invalidate EPT
+			 * afterwards, this allows multiple edits to share a single INVEPT. */
+			status = hidePage(&lpData->eptConfig, tableBase, physTargetVA, execVA, NULL);
+		}
+	}
+	else
+	{
+		/* Unable to get the table base. */
+		status = STATUS_INVALID_MEMBER;
+	}
+
+	return status;
+}
+
+static ULONG64 readMovCRRegister(PVMM_DATA lpData, VMX_EXIT_QUALIFICATION_MOV_CR exitQualification)
+{
+	/* Returns the general purpose register a MOV to CR reads, RSP is only held in the VMCS. */
+	ULONG64* registerList = &lpData->guestContext.Rax;
+
+	ULONG64 registerValue;
+	if (VMX_EXIT_QUALIFICATION_GENREG_RSP == exitQualification.GeneralPurposeRegister)
+	{
+		__vmx_vmread(VMCS_GUEST_RSP, &registerValue);
+	}
+	else
+	{
+		registerValue = registerList[exitQualification.GeneralPurposeRegister];
+	}
+
+	return registerValue;
+}
+
+static BOOLEAN resetActiveShadows(PSHADOW_REGISTRY registry)
+{
+	/* Sets every shadow switched to an exec view back to RW, returns TRUE if any
+	 * entry was modified (meaning EPT needs to be invalidated). */
+	BOOLEAN modified = FALSE;
+
+	for (ULONG word = 0; word < ARRAYSIZE(registry->activeExec); word++)
+	{
+		UINT64 pending = registry->activeExec[word];
+		unsigned long bit;
+
+		while (0 != _BitScanForward64(&bit, pending))
+		{
+			PSHADOW_HOT shadowHot = &registry->hot[(word * 64) + bit];
+
+			/* May have been switched to RW by a data access since. */
+			if (shadowHot->targetPML1E->Flags != shadowHot->activeRWPML1E.Flags)
+			{
+				shadowHot->targetPML1E->Flags = shadowHot->activeRWPML1E.Flags;
+				modified = TRUE;
+			}
+
+			pending &= (pending - 1);
+		}
+
+		registry->activeExec[word] = 0;
+	}
+
+	return modified;
+}
+
+static PSHADOW_REGISTRY getRegistry(PEPT_CONFIG eptConfig)
+{
+	/* Every EPT config belongs to a logical processor's VMM data. */
+	PVMM_DATA lpData = CONTAINING_RECORD(eptConfig, VMM_DATA, eptConfig);
+
+	return &registries[lpData->processorIndex];
+}
+
+static PSHADOW_PAGE allocateShadow(PSHADOW_REGISTRY registry)
+{
+	PSHADOW_PAGE result = NULL;
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_SHADOWS; i++)
+	{
+		PSHADOW_PAGE shadowPage = &registry->shadows[i];
+
+		if (FALSE == shadowPage->inUse)
+		{
+			__stosb((PUCHAR)shadowPage, 0, sizeof(SHADOW_PAGE));
+			__stosb((PUCHAR)&registry->hot[i], 0, sizeof(SHADOW_HOT));
+			registry->hot[i].variantTable = VARIANT_TABLE_NONE;
+			shadowPage->inUse = TRUE;
+			result = shadowPage;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static PSHADOW_PAGE findShadow(PSHADOW_REGISTRY registry, PHYSICAL_ADDRESS targetPA)
+{
+	PSHADOW_PAGE result = NULL;
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_SHADOWS; i++)
+	{
+		PSHADOW_PAGE shadowPage = &registry->shadows[i];
+
+		if ((TRUE == shadowPage->inUse) && (shadowPage->targetPA.QuadPart == targetPA.QuadPart))
+		{
+			result = shadowPage;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static void freeShadow(PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage)
+{
+	PSHADOW_HOT shadowHot = &registry->hot[shadowPage - registry->shadows];
+
+	if (NULL != shadowPage->executePage)
+	{
+		releaseExecSlot(findExecSlot(shadowPage->executePage));
+		shadowPage->executePage = NULL;
+	}
+
+	if (VARIANT_TABLE_NONE != shadowHot->variantTable)
+	{
+		PSHADOW_VARIANT_TABLE variantTable = &registry->variantTables[shadowHot->variantTable];
+
+		for (ULONG i = 0; i < VMSHADOW_MAX_VARIANTS; i++)
+		{
+			if (0 != variantTable->entries[i])
+			{
+				releaseExecSlot((ULONG)(variantTable->entries[i] >> VARIANT_KEY_BITS));
+			}
+		}
+
+		variantTable->inUse = FALSE;
+		shadowHot->variantTable = VARIANT_TABLE_NONE;
+		shadowHot->variantCount = 0;
+	}
+
+	shadowPage->inUse = FALSE;
+}
+
+static ULONG lookupVariant(PSHADOW_VARIANT_TABLE variantTable, UINT64 directoryPFN)
+{
+	/* Returns the slot of the execute page used for the page directory, EXEC_SLOT_NONE if it has none.
+	 * The table is never full, so the probe always ends at an empty entry. */
+	ULONG result = EXEC_SLOT_NONE;
+	ULONG index = hashDirectory(directoryPFN);
+
+	while (0 != variantTable->entries[index])
+	{
+		if ((variantTable->entries[index] & VARIANT_KEY_MASK) == directoryPFN)
+		{
+			result = (ULONG)(variantTable->entries[index] >> VARIANT_KEY_BITS);
+			break;
+		}
+
+		index = (index + 1) & (VMSHADOW_MAX_VARIANTS - 1);
+	}
+
+	return result;
+}
+
+static void insertVariant(PSHADOW_VARIANT_TABLE variantTable, UINT64 directoryPFN, ULONG slotIndex)
+{
+	/* Linear probing, the caller has checked the key is not present and the table has room. */
+	ULONG index = hashDirectory(directoryPFN);
+
+	while (0 != variantTable->entries[index])
+	{
+		index = (index + 1) & (VMSHADOW_MAX_VARIANTS - 1);
+	}
+
+	variantTable->entries[index] = (directoryPFN & VARIANT_KEY_MASK) | ((UINT64)slotIndex << VARIANT_KEY_BITS);
+}
+
+static ULONG removeVariant(PSHADOW_VARIANT_TABLE variantTable, UINT64 directoryPFN)
+{
+	/* Removes the page directory from the table and returns the slot it used, EXEC_SLOT_NONE if absent. */
+	ULONG result = EXEC_SLOT_NONE;
+	ULONG index = hashDirectory(directoryPFN);
+
+	while (0 != variantTable->entries[index])
+	{
+		if ((variantTable->entries[index] & VARIANT_KEY_MASK) == directoryPFN)
+		{
+			result = (ULONG)(variantTable->entries[index] >> VARIANT_KEY_BITS);
+			break;
+		}
+
+		index = (index + 1) & (VMSHADOW_MAX_VARIANTS - 1);
+	}
+
+	if (EXEC_SLOT_NONE != result)
+	{
+		/* Backward shift deletion, entries further along the probe sequence are moved into the
+		 * hole unless their home index lies after it, so lookups never stop early. */
+		ULONG hole = index;
+		ULONG next = (index + 1) & (VMSHADOW_MAX_VARIANTS - 1);
+
+		while (0 != variantTable->entries[next])
+		{
+			ULONG home = hashDirectory(variantTable->entries[next] & VARIANT_KEY_MASK);
+
+			if (((next - home) & (VMSHADOW_MAX_VARIANTS - 1)) >= ((next - hole) & (VMSHADOW_MAX_VARIANTS - 1)))
+			{
+				variantTable->entries[hole] = variantTable->entries[next];
+				hole = next;
+			}
+
+			next = (next + 1) & (VMSHADOW_MAX_VARIANTS - 1);
+		}
+
+		variantTable->entries[hole] = 0;
+	}
+
+	return result;
+}
+
+static ULONG hashDirectory(UINT64 directoryPFN)
+{
+	/* Fibonacci hashing, page directories are allocated close together so the low bits alone cluster. */
+	return (ULONG)((directoryPFN * 0x9E3779B97F4A7C15ULL) >> (64 - VMSHADOW_VARIANT_BITS));
+}
+
+static NTSTATUS syncHideExecInProcess(PVMM_DATA lpData, PVOID parameter)
+{
+	/* Applied in VMX root on each processor, VMSync invalidates EPT after the batch. */
+	PSHADOW_PROC_EDIT edit = (PSHADOW_PROC_EDIT)parameter;
+
+	return hideExecInDirectory(lpData, edit->tableBase, edit->targetVA, edit->execVA);
+}
+
+static NTSTATUS syncUnhideProcess(PVMM_DATA lpData, PVOID parameter)
+{
+	/* Applied in VMX root on each processor, VMSync invalidates EPT after the batch. */
+	UINT64 directoryPFN = *(PUINT64)parameter;
+	PSHADOW_REGISTRY registry = &registries[lpData->processorIndex];
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_SHADOWS; i++)
+	{
+		PSHADOW_HOT shadowHot = &registry->hot[i];
+		PSHADOW_PAGE shadowPage = &registry->shadows[i];
+
+		if ((TRUE == shadowPage->inUse) && (0 != shadowHot->variantCount))
+		{
+			ULONG slotIndex = removeVariant(&registry->variantTables[shadowHot->variantTable], directoryPFN);
+			if (EXEC_SLOT_NONE != slotIndex)
+			{
+				/* The exec view may be the variant being removed, go back to RW. */
+				shadowHot->targetPML1E->Flags = shadowHot->activeRWPML1E.Flags;
+
+				releaseExecSlot(slotIndex);
+				shadowHot->variantCount--;
+
+				if (0 == shadowHot->variantCount)
+				{
+					if (NULL == shadowPage->executePage)
+					{
+						destroyShadow(&lpData->eptConfig, registry, shadowPage);
+					}
+					else
+					{
+						/* Still shadowed globally, only the variant table is returned. */
+						registry->variantTables[shadowHot->variantTable].inUse = FALSE;
+						shadowHot->variantTable = VARIANT_TABLE_NONE;
+					}
+				}
+			}
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static void destroyShadow(PEPT_CONFIG eptConfig, PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage)
+{
+	/* Removes the shadow from EPT and restores the original entry, the caller invalidates EPT. */
+	ULONG shadowIndex = (ULONG)(shadowPage - registry->shadows);
+	PSHADOW_HOT shadowHot = &registry->hot[shadowIndex];
+
+	EPT_removeViolationHandler(eptConfig, handleShadowExec, shadowHot);
+	shadowHot->targetPML1E->Flags = shadowPage->originalPML1E.Flags;
+
+	/* The descriptor may be reused, so forget any pending reset or single step of it. */
+	registry->activeExec[shadowIndex / 64] &= ~(1ULL << (shadowIndex % 64));
+
+	ULONG kept = 0;
+	for (ULONG i = 0; i < registry->stepCount; i++)
+	{
+		if (shadowHot != registry->steps[i].shadowHot)
+		{
+			registry->steps[kept++] = registry->steps[i];
+		}
+	}
+	registry->stepCount = kept;
+
+	freeShadow(registry, shadowPage);
+}
+
+static void processNotify(HANDLE parentId, HANDLE processId, BOOLEAN create)
+{
+	UNREFERENCED_PARAMETER(parentId);
+
+	/* Page directories of exited processes are recycled, a shadow left keyed to one
+	 * could end up applied to an unrelated process. */
+	if (FALSE == create)
+	{
+		PEPROCESS process;
+		if (NT_SUCCESS(PsLookupProcessByProcessId(processId, &process)))
+		{
+			CR3 tableBase = MemManage_getPageTableBase(process);
+			ObDereferenceObject(process);
+
+			if (0 != tableBase.Flags)
+			{
+				VMShadow_unhideProcess(tableBase, NULL);
+			}
+		}
+	}
+}
+
+static BOOLEAN trackScopedDirectory(UINT64 directoryPFN)
+{
+	/* Called from the guest before broadcasting and from VMX root on each processor,
+	 * only the first records the directory. Returns FALSE when the table is full, a
+	 * variant that is not tracked would never be removed when the process exits. */
+	ULONG freeIndex = VMSHADOW_MAX_SCOPED_PROCESSES;
+	BOOLEAN tracked = FALSE;
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_SCOPED_PROCESSES; i++)
+	{
+		if ((LONG64)directoryPFN == scopedDirectories[i])
+		{
+			tracked = TRUE;
+			break;
+		}
+		else if ((0 == scopedDirectories[i]) && (VMSHADOW_MAX_SCOPED_PROCESSES == freeIndex))
+		{
+			freeIndex = i;
+		}
+	}
+
+	while ((FALSE == tracked) && (freeIndex < VMSHADOW_MAX_SCOPED_PROCESSES))
+	{
+		LONG64 previous = InterlockedCompareExchange64(&scopedDirectories[freeIndex], (LONG64)directoryPFN, 0);
+
+		/* Either recorded now, or another processor raced us to it. */
+		if ((0 == previous) || ((LONG64)directoryPFN == previous))
+		{
+			tracked = TRUE;
+		}
+		else
+		{
+			freeIndex++;
+		}
+	}
+
+	return tracked;
+}
+
+static BOOLEAN handleShadowStep(PMTF_CONFIG mtfConfig, PVOID userBuffer)
+{
+	UNREFERENCED_PARAMETER(userBuffer);
+
+	BOOLEAN result = FALSE;
+
+	PVMM_DATA lpData = CONTAINING_RECORD(mtfConfig, VMM_DATA, mtfConfig);
+	PSHADOW_REGISTRY registry = &registries[lpData->processorIndex];
+
+	/* Only handle the trap if this processor was stepping a data access to a shadow. */
+	if (0 != registry->stepCount)
+	{
+		MTF_setTracingEnabled(FALSE);
+		completeSteps(lpData, registry);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static void countFlip(PSHADOW_PAGE shadowPage)
+{
+	UINT64 currentTSC = __rdtsc();
+
+	shadowPage->flipCount++;
+
+	/* At the end of each window decide whether the page is still thrashing,
+	 * so a page that calms down goes back to plain flipping. */
+	if ((currentTSC - shadowPage->windowStartTSC) > SHADOW_THRASH_WINDOW_CYCLES)
+	{
+		shadowPage->thrashing = (shadowPage->windowFlips >= SHADOW_THRASH_FLIPS);
+		shadowPage->windowStartTSC = currentTSC;
+		shadowPage->windowFlips = 0;
+	}
+
+	shadowPage->windowFlips++;
+	if (shadowPage->windowFlips >= SHADOW_THRASH_FLIPS)
+	{
+		shadowPage->thrashing = TRUE;
+	}
+}
+
+static NTSTATUS syncQueryStats(PVMM_DATA lpData, PVOID parameter)
+{
+	PSHADOW_STATS_QUERY query = (PSHADOW_STATS_QUERY)parameter;
+	UINT64 currentTSC = __rdtsc();
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PSHADOW_REGISTRY registry = &registries[lpData->processorIndex];
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_SHADOWS; i++)
+	{
+		PSHADOW_PAGE shadowPage = &registry->shadows[i];
+
+		if (TRUE == shadowPage->inUse)
+		{
+			/* Reserve a slot, anything past the capacity is only counted. */
+			LONG index = InterlockedIncrement(&query->written) - 1;
+			if ((index < (LONG)query->capacity) && (NT_SUCCESS(status)))
+			{
+				VMSHADOW_STATS stats;
+				stats.physicalAddress = shadowPage->targetPA.QuadPart;
+				stats.global = (NULL != shadowPage->executePage);
+				stats.variantCount = registry->hot[i].variantCount;
+				stats.processorIndex = lpData->processorIndex;
+				stats.thrashing = shadowPage->thrashing;
+				stats.flipCount = shadowPage->flipCount;
+				stats.stepCount = shadowPage->stepCount;
+				stats.elapsedCycles = currentTSC - shadowPage->createdTSC;
+				stats.flipsPerSecond = 0;
+
+				/* The output belongs to the caller, so it is written through its page tables. */
+				status = MemManage_writeVirtualAddress(&lpData->mmContext, query->guestCR3,
+													   (GUEST_VIRTUAL_ADDRESS)&query->stats[index], &stats, sizeof(stats));
+			}
+		}
+	}
+
+	return status;
+}
+
+static NTSTATUS growExecSlab(void)
+{
+	/* Adds a chunk to the execute page slab, only callable from the guest at PASSIVE_LEVEL. */
+	NTSTATUS status;
+
+	if (0 == InterlockedCompareExchange(&execSlab.growing, 1, 0))
+	{
+		LONG chunkIndex = execSlab.chunkCount;
+
+		if (chunkIndex < EXEC_SLAB_MAX_CHUNKS)
+		{
+			/* A 2MB aligned, physically contiguous chunk can be covered by a single large page
+			 * in both the host and EPT mappings, and is never split as it is not shadowed. */
+			PHYSICAL_ADDRESS lowestAddress = { .QuadPart = 0 };
+			PHYSICAL_ADDRESS highestAddress = { .QuadPart = MAXLONGLONG };
+			PHYSICAL_ADDRESS boundaryAddress = { .QuadPart = SIZE_2MB };
+
+			PUINT8 chunk = (PUINT8)MmAllocateContiguousMemorySpecifyCache(SIZE_2MB, lowestAddress, highestAddress, boundaryAddress, MmCached);
+			if (NULL != chunk)
+			{
+				/* VMX root copies and patches the execute pages, so the chunk is mapped in the host. */
+				status = PageTable_mapHost(chunk, SIZE_2MB);
+
+				if (NT_SUCCESS(status))
+				{
+					execSlab.chunks[chunkIndex] = chunk;
+					execSlab.chunksPhysical[chunkIndex] = MmGetPhysicalAddress(chunk);
+
+					/* Publish the chunk only once it is fully described. */
+					InterlockedExchange(&execSlab.chunkCount, chunkIndex + 1);
+				}
+				else
+				{
+					MmFreeContiguousMemory(chunk);
+				}
+			}
+			else
+			{
+				status = STATUS_NO_MEMORY;
+			}
+		}
+		else
+		{
+			status = STATUS_QUOTA_EXCEEDED;
+		}
+
+		InterlockedExchange(&execSlab.growing, 0);
+	}
+	else
+	{
+		/* Another thread is already adding a chunk. */
+		status = STATUS_SUCCESS;
+	}
+
+	return status;
+}
+
+static ULONG acquireExecSlot(PMM_CONTEXT mmContext, PHYSICAL_ADDRESS targetPA, CR3 targetCR3, PVOID payloadPage)
+{
+	/* Returns the slot of the execute page shared by every shadow of targetPA for targetCR3,
+	 * taking a new page from the slab if this is the first such shadow. Without a payload the
+	 * new page is a copy of targetPA, which is only possible from VMX root. */
+	ULONG result = EXEC_SLOT_NONE;
+	ULONG slotCount = (ULONG)execSlab.chunkCount * EXEC_SLAB_CHUNK_PAGES;
+	ULONG freeSlot = EXEC_SLOT_NONE;
+
+	lockExecSlab();
+
+	for (ULONG i = 0; i < slotCount; i++)
+	{
+		PEXEC_PAGE_SLOT slot = &execSlab.slots[i];
+
+		if (0 == slot->refCount)
+		{
+			/* Remember the first free slot in case no page is shared. */
+			if (EXEC_SLOT_NONE == freeSlot)
+			{
+				freeSlot = i;
+			}
+		}
+		else if ((slot->targetPA.QuadPart == targetPA.QuadPart) && (slot->targetCR3.Flags == targetCR3.Flags))
+		{
+			slot->refCount++;
+			result = i;
+			break;
+		}
+	}
+
+	if ((EXEC_SLOT_NONE == result) && (EXEC_SLOT_NONE != freeSlot))
+	{
+		PEXEC_PAGE_SLOT slot = &execSlab.slots[freeSlot];
+		slot->targetPA = targetPA;
+		slot->targetCR3 = targetCR3;
+		slot->refCount = 1;
+		execSlab.usedCount++;
+
+		/* Copy the fake bytes, under the lock so no other processor can see a partial page. */
+		NTSTATUS status = STATUS_SUCCESS;
+
+		if (NULL != payloadPage)
+		{
+			__movsb(getExecSlotPage(freeSlot), (const UCHAR*)payloadPage, PAGE_SIZE);
+		}
+		else
+		{
+			status = MemManage_readPhysicalAddress(mmContext, (HOST_PHYS_ADDRESS)targetPA.QuadPart, getExecSlotPage(freeSlot), PAGE_SIZE);
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			result = freeSlot;
+		}
+		else
+		{
+			__stosb((PUCHAR)slot, 0, sizeof(EXEC_PAGE_SLOT));
+			execSlab.usedCount--;
+		}
+	}
+
+	unlockExecSlab();
+
+	return result;
+}
+
+static void releaseExecSlot(ULONG slotIndex)
+{
+	lockExecSlab();
+
+	if (slotIndex < (ULONG)(execSlab.chunkCount * EXEC_SLAB_CHUNK_PAGES))
+	{
+		PEXEC_PAGE_SLOT slot = &execSlab.slots[slotIndex];
+
+		slot->refCount--;
+		if (0 == slot->refCount)
+		{
+			/* Patches belong to the page, so they go with it. */
+			for (ULONG i = 0; i < VMSHADOW_MAX_PATCHES; i++)
+			{
+				if ((TRUE == execSlab.patches[i].inUse) && (slotIndex == execSlab.patches[i].slotIndex))
+				{
+					__stosb((PUCHAR)&execSlab.patches[i], 0, sizeof(SHADOW_PATCH));
+				}
+			}
+
+			__stosb((PUCHAR)slot, 0, sizeof(EXEC_PAGE_SLOT));
+			execSlab.usedCount--;
+		}
+	}
+
+	unlockExecSlab();
+}
+
+static PUINT8 getExecSlotPage(ULONG slotIndex)
+{
+	return execSlab.chunks[slotIndex / EXEC_SLAB_CHUNK_PAGES] + ((slotIndex % EXEC_SLAB_CHUNK_PAGES) * PAGE_SIZE);
+}
+
+static UINT64 getExecSlotPFN(ULONG slotIndex)
+{
+	/* Chunks are physically contiguous, so the page frame is found without a translation. */
+	return (execSlab.chunksPhysical[slotIndex / EXEC_SLAB_CHUNK_PAGES].QuadPart / PAGE_SIZE) + (slotIndex % EXEC_SLAB_CHUNK_PAGES);
+}
+
+static ULONG findExecSlot(PUINT8 executePage)
+{
+	/* Returns the slot of an execute page, or the slot count if the page is not from the slab. */
+	ULONG result = (ULONG)(execSlab.chunkCount * EXEC_SLAB_CHUNK_PAGES);
+
+	for (LONG chunkIndex = 0; chunkIndex < execSlab.chunkCount; chunkIndex++)
+	{
+		PUINT8 chunk = execSlab.chunks[chunkIndex];
+
+		if ((executePage >= chunk) && (executePage < (chunk + SIZE_2MB)))
+		{
+			result = (chunkIndex * EXEC_SLAB_CHUNK_PAGES) + (ULONG)((executePage - chunk) / PAGE_SIZE);
+			break;
+		}
+	}
+
+	return result;
+}
+
+static PSHADOW_PATCH findPatch(ULONG slotIndex, ULONG offset, ULONG size)
+{
+	/* Returns a patch of the execute page overlapping [offset, offset + size), NULL if none. */
+	PSHADOW_PATCH result = NULL;
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_PATCHES; i++)
+	{
+		PSHADOW_PATCH patch = &execSlab.patches[i];
+
+		if ((TRUE == patch->inUse) && (slotIndex == patch->slotIndex) &&
+			(offset < (ULONG)(patch->offset + patch->size)) && (patch->offset < (offset + size)))
+		{
+			result = patch;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static NTSTATUS applyPatch(PUINT8 executePage, ULONG offset, const UINT8* patchBytes, ULONG patchSize)
+{
+	/* Writes a patch into a shared execute page, or accepts an identical patch already there. */
+	NTSTATUS status;
+
+	lockExecSlab();
+
+	ULONG slotIndex = findExecSlot(executePage);
+	PSHADOW_PATCH existing = findPatch(slotIndex, offset, patchSize);
+
+	if (NULL != existing)
+	{
+		/* Every processor applies the same patch when hooking, only identical patches may overlap. */
+		if ((existing->offset != offset) || (existing->size != patchSize))
+		{
+			status = STATUS_CONFLICTING_ADDRESSES;
+		}
+		else
+		{
+			status = STATUS_SUCCESS;
+
+			for (ULONG i = 0; i < patchSize; i++)
+			{
+				if (existing->bytes[i] != patchBytes[i])
+				{
+					status = STATUS_CONFLICTING_ADDRESSES;
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_QUOTA_EXCEEDED;
+
+		for (ULONG i = 0; i < VMSHADOW_MAX_PATCHES; i++)
+		{
+			PSHADOW_PATCH patch = &execSlab.patches[i];
+
+			if (FALSE == patch->inUse)
+			{
+				patch->inUse = TRUE;
+				patch->slotIndex = slotIndex;
+				patch->offset = (USHORT)offset;
+				patch->size = (USHORT)patchSize;
+				__movsb(patch->bytes, patchBytes, patchSize);
+				__movsb(patch->original, &executePage[offset], patchSize);
+
+				/* Edit the shared execute page in place. */
+				__movsb(&executePage[offset], patchBytes, patchSize);
+
+				status = STATUS_SUCCESS;
+				break;
+			}
+		}
+	}
+
+	unlockExecSlab();
+
+	return status;
+}
+
+static void lockExecSlab(void)
+{
+	/* Processors in VMX root cannot wait on kernel objects, so spin. */
+	while (0 != InterlockedCompareExchange(&execSlab.lock, 1, 0))
+	{
+		_mm_pause();
+	}
+}
+
+static void unlockExecSlab(void)
+{
+	InterlockedExchange(&execSlab.lock, 0);
+}
+
+static NTSTATUS syncSetWriteTracking(PVMM_DATA lpData, PVOID parameter)
+{
+	/* Applied in VMX root on each processor, VMSync invalidates EPT after the batch. */
+	PSHADOW_TRACK_EDIT edit = (PSHADOW_TRACK_EDIT)parameter;
+	PSHADOW_REGISTRY registry = &registries[lpData->processorIndex];
+	NTSTATUS status;
+
+	/* Only the global execute page is kept in sync, process variants are supplied by the caller. */
+	PSHADOW_PAGE shadowPage = findShadow(registry, edit->targetPA);
+	if ((NULL != shadowPage) && (NULL != shadowPage->executePage))
+	{
+		PSHADOW_HOT shadowHot = &registry->hot[shadowPage - registry->shadows];
+
+		/* Writes are trapped by removing write access from the RW view. */
+		shadowHot->activeRWPML1E.WriteAccess = (FALSE == edit->enabled);
+
+		shadowHot->targetPML1E->Flags = shadowHot->activeRWPML1E.Flags;
+
+		PSHADOW_STEP step = findStep(registry, shadowHot);
+		if (NULL != step)
+		{
+			step->restorePML1E.Flags = shadowHot->activeRWPML1E.Flags;
+		}
+
+		if (TRUE == edit->enabled)
+		{
+			/* Catch up with any write made before tracking started. */
+			UINT32 mergedBytes;
+			UINT32 conflictBytes;
+
+			shadowPage->tracked = TRUE;
+			mergeTrackedWrites(&lpData->mmContext, registry, shadowPage, &mergedBytes, &conflictBytes);
+		}
+		else
+		{
+			shadowPage->tracked = FALSE;
+		}
+
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_NOT_FOUND;
+	}
+
+	return status;
+}
+
+static NTSTATUS syncDrainWriteEvents(PVMM_DATA lpData, PVOID parameter)
+{
+	PSHADOW_WRITE_DRAIN drain = (PSHADOW_WRITE_DRAIN)parameter;
+	PSHADOW_REGISTRY registry = &registries[lpData->processorIndex];
+
+	/* Reserve space in the output for this processor's events. */
+	LONG offset = InterlockedExchangeAdd(&drain->written, (LONG)registry->writeCount);
+	ULONG available = (offset < (LONG)drain->capacity) ? (drain->capacity - (ULONG)offset) : 0;
+	ULONG toCopy = min(registry->writeCount, available);
+
+	/* Copy out the oldest events first, anything that does not fit stays in the ring. The output
+	 * belongs to the caller, so it is written through its page tables. Events that cannot be
+	 * written are kept for the next drain. */
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG tail = (registry->writeHead + VMSHADOW_WRITE_RING_SIZE - registry->writeCount) % VMSHADOW_WRITE_RING_SIZE;
+	ULONG copied = 0;
+
+	while ((copied < toCopy) && (NT_SUCCESS(status)))
+	{
+		status = MemManage_writeVirtualAddress(&lpData->mmContext, drain->guestCR3,
+											   (GUEST_VIRTUAL_ADDRESS)&drain->events[offset + copied],
+											   &registry->writeEvents[(tail + copied) % VMSHADOW_WRITE_RING_SIZE], sizeof(VMSHADOW_WRITE_EVENT));
+
+		if (NT_SUCCESS(status))
+		{
+			copied++;
+		}
+	}
+
+	registry->writeCount -= copied;
+
+	InterlockedExchangeAdd(&drain->dropped, (LONG)registry->writeDropped);
+	registry->writeDropped = 0;
+
+	return status;
+}
+
+static void stepTrackedWrite(PVMM_DATA lpData, PSHADOW_REGISTRY registry, PSHADOW_HOT shadowHot, PSHADOW_PAGE shadowPage, EPT_PML1_ENTRY restorePML1E)
+{
+	/* Lets the current instruction write to the original page, restorePML1E
+	 * is put back and the write merged when the MTF trap arrives. The step is
+	 * also executable, a write made by code on the page itself would otherwise
+	 * fault on the fetch and never retire. */
+	PSHADOW_STEP step = beginStep(lpData, registry, shadowHot, restorePML1E);
+	step->write = TRUE;
+
+	EPT_PML1_ENTRY writablePML1E = shadowPage->originalPML1E;
+	writablePML1E.ReadAccess = 1;
+	writablePML1E.WriteAccess = 1;
+	writablePML1E.ExecuteAccess = 1;
+	shadowHot->targetPML1E->Flags = writablePML1E.Flags;
+
+	MTF_setTracingEnabled(TRUE);
+}
+
+static PSHADOW_STEP beginStep(PVMM_DATA lpData, PSHADOW_REGISTRY registry, PSHADOW_HOT shadowHot, EPT_PML1_ENTRY restorePML1E)
+{
+	/* Shadows already opened for this instruction stay open, restoring them here would fault
+	 * on them again and never let the instruction complete. A shadow faulting again while
+	 * stepped (a write to a tracked page opened for a read) keeps the view it had before the
+	 * first step, the entry it has now is the step itself. */
+	PSHADOW_STEP step = findStep(registry, shadowHot);
+
+	if (NULL == step)
+	{
+		/* Running out of steps means the trap was missed, so finish those before starting again. */
+		if (VMSHADOW_MAX_STEPS == registry->stepCount)
+		{
+			completeSteps(lpData, registry);
+		}
+
+		step = &registry->steps[registry->stepCount++];
+		step->shadowHot = shadowHot;
+		step->restorePML1E.Flags = restorePML1E.Flags;
+		step->write = FALSE;
+	}
+
+	__vmx_vmread(VMCS_GUEST_RIP, &registry->steppingRIP);
+
+	return step;
+}
+
+static PSHADOW_STEP findStep(PSHADOW_REGISTRY registry, PSHADOW_HOT shadowHot)
+{
+	PSHADOW_STEP result = NULL;
+
+	for (ULONG i = 0; i < registry->stepCount; i++)
+	{
+		if (shadowHot == registry->steps[i].shadowHot)
+		{
+			result = &registry->steps[i];
+			break;
+		}
+	}
+
+	return result;
+}
+
+static void completeSteps(PVMM_DATA lpData, PSHADOW_REGISTRY registry)
+{
+	/* Restore the views of every shadow opened for the instruction, read/write access
+	 * is removed so the cached translations need to be invalidated. */
+	for (ULONG i = 0; i < registry->stepCount; i++)
+	{
+		PSHADOW_STEP step = &registry->steps[i];
+		step->shadowHot->targetPML1E->Flags = step->restorePML1E.Flags;
+	}
+
+	EPT_invalidateAndFlush(&lpData->eptConfig);
+
+	for (ULONG i = 0; i < registry->stepCount; i++)
+	{
+		PSHADOW_STEP step = &registry->steps[i];
+
+		if (TRUE == step->write)
+		{
+			/* The write has reached the original page, bring the execute page up to date. */
+			PSHADOW_PAGE shadowPage = &registry->shadows[step->shadowHot - registry->hot];
+			UINT32 mergedBytes;
+			UINT32 conflictBytes;
+
+			mergeTrackedWrites(&lpData->mmContext, registry, shadowPage, &mergedBytes, &conflictBytes);
+			recordWriteEvent(registry, shadowPage, lpData->processorIndex, mergedBytes, conflictBytes);
+		}
+	}
+
+	registry->stepCount = 0;
+}
+
+static void mergeTrackedWrites(PMM_CONTEXT mmContext, PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage, PUINT32 mergedBytes, PUINT32 conflictBytes)
+{
+	/* Copies every byte of the original page that differs from the global execute page,
+	 * 16 bytes are compared at a time. Bytes under a patch are skipped, a write to them
+	 * only updates the bytes the patch restores and is reported as a conflict. */
+	PUINT8 source = registry->trackedCopy;
+	PUINT8 executePage = shadowPage->executePage;
+
+	/* One bit per byte of the page, set for the bytes covered by a patch. */
+	UINT64 patchedMask[PAGE_SIZE / 64];
+	__stosb((PUCHAR)patchedMask, 0, sizeof(patchedMask));
+
+	*mergedBytes = 0;
+	*conflictBytes = 0;
+
+	/* If the original page cannot be read nothing is merged, the next tracked write catches up. */
+	if (FALSE == NT_SUCCESS(MemManage_readPhysicalAddress(mmContext, (HOST_PHYS_ADDRESS)shadowPage->targetPA.QuadPart, source, PAGE_SIZE)))
+	{
+		return;
+	}
+
+	lockExecSlab();
+
+	ULONG slotIndex = findExecSlot(executePage);
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_PATCHES; i++)
+	{
+		PSHADOW_PATCH patch = &execSlab.patches[i];
+
+		if ((TRUE == patch->inUse) && (slotIndex == patch->slotIndex))
+		{
+			for (ULONG j = 0; j < patch->size; j++)
+			{
+				ULONG offset = patch->offset + j;
+				patchedMask[offset / 64] |= (1ULL << (offset % 64));
+
+				if (source[offset] != patch->original[j])
+				{
+					patch->original[j] = source[offset];
+					(*conflictBytes)++;
+				}
+			}
+		}
+	}
+
+	for (ULONG offset = 0; offset < PAGE_SIZE; offset += 16)
+	{
+		__m128i sourceBlock = _mm_load_si128((const __m128i*)&source[offset]);
+		__m128i executeBlock = _mm_load_si128((const __m128i*)&executePage[offset]);
+
+		unsigned long changed = (~(unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(sourceBlock, executeBlock))) & 0xFFFF;
+		unsigned long patched = (unsigned long)(patchedMask[offset / 64] >> (offset % 64)) & 0xFFFF;
+
+		changed &= ~patched;
+
+		if (0 != changed)
+		{
+			if (0 == patched)
+			{
+				/* Nothing to preserve in this block, store it whole. */
+				_mm_store_si128((__m128i*)&executePage[offset], sourceBlock);
+				*mergedBytes += __popcnt(changed);
+			}
+			else
+			{
+				unsigned long bit;
+
+				while (0 != _BitScanForward(&bit, changed))
+				{
+					executePage[offset + bit] = source[offset + bit];
+					(*mergedBytes)++;
+
+					changed &= (changed - 1);
+				}
+			}
+		}
+	}
+
+	unlockExecSlab();
+}
+
+static void recordWriteEvent(PSHADOW_REGISTRY registry, PSHADOW_PAGE shadowPage, UINT32 processorIndex, UINT32 mergedBytes, UINT32 conflictBytes)
+{
+	UINT64 currentTSC = __rdtsc();
+
+	/* Coalesce with the latest record if it is the same instruction writing the same page. */
+	if (0 != registry->writeCount)
+	{
+		PVMSHADOW_WRITE_EVENT latest = &registry->writeEvents[(registry->writeHead + VMSHADOW_WRITE_RING_SIZE - 1) % VMSHADOW_WRITE_RING_SIZE];
+
+		if ((latest->guestRIP == registry->steppingRIP) &&
+			(latest->physicalAddress == (UINT64)shadowPage->targetPA.QuadPart))
+		{
+			latest->writeCount++;
+			latest->mergedBytes += mergedBytes;
+			latest->conflictBytes += conflictBytes;
+			latest->lastTSC = currentTSC;
+			return;
+		}
+	}
+
+	/* New record, the oldest is overwritten if the ring is full. */
+	PVMSHADOW_WRITE_EVENT newEvent = &registry->writeEvents[registry->writeHead];
+	newEvent->physicalAddress = shadowPage->targetPA.QuadPart;
+	newEvent->processorIndex = processorIndex;
+	newEvent->guestRIP = registry->steppingRIP;
+	newEvent->writeCount = 1;
+	newEvent->mergedBytes = mergedBytes;
+	newEvent->conflictBytes = conflictBytes;
+	newEvent->firstTSC = currentTSC;
+	newEvent->lastTSC = currentTSC;
+
+	registry->writeHead = (registry->writeHead + 1) % VMSHADOW_WRITE_RING_SIZE;
+	if (registry->writeCount < VMSHADOW_WRITE_RING_SIZE)
+	{
+		registry->writeCount++;
+	}
+	else
+	{
+		registry->writeDropped++;
+	}
+}
+
+static NTSTATUS removePatch(PVOID targetAddress, PHYSICAL_ADDRESS targetPA)
+{
+	/* The caller is either in VMX root or at HIGH_LEVEL. */
+	NTSTATUS status = STATUS_NOT_FOUND;
+
+	ULONG offset = (ULONG)ADDRMASK_EPT_PML1_OFFSET((UINT64)targetAddress);
+
+	lockExecSlab();
+
+	for (ULONG i = 0; i < VMSHADOW_MAX_PATCHES; i++)
+	{
+		PSHADOW_PATCH patch = &execSlab.patches[i];
+
+		if ((TRUE == patch->inUse) && (patch->offset == offset))
+		{
+			PEXEC_PAGE_SLOT slot = &execSlab.slots[patch->slotIndex];
+
+			if ((slot->targetPA.QuadPart == targetPA.QuadPart) && (0 == slot->targetCR3.Flags))
+			{
+				PUINT8 executePage = getExecSlotPage(patch->slotIndex);
+
+				__movsb(&executePage[patch->offset], patch->original, patch->size);
+				__stosb((PUCHAR)patch, 0, sizeof(SHADOW_PATCH));
+
+				status = STATUS_SUCCESS;
+				break;
+			}
+		}
+	}
+
+	unlockExecSlab();
+
+	return status;
 }
@@ -2,29 +2,135 @@
 #include <wdm.h>
 #include "VMM.h"
 #include "EPT.h"
+#include "VMSync.h"
 
 /******************** Public Defines ********************/
 
+/* Maximum amount of shadow pages per logical processor. */
+#define VMSHADOW_MAX_SHADOWS 128
+
+/* Shadows scoped to processes take one of a processor's variant tables, each table
+ * maps up to three quarters of VMSHADOW_MAX_VARIANTS processes to their execute page. */
+#define VMSHADOW_MAX_VARIANT_TABLES 32
+#define VMSHADOW_VARIANT_BITS 6
+#define VMSHADOW_MAX_VARIANTS (1 << VMSHADOW_VARIANT_BITS)
+
+/* Processes with variants that are removed automatically when they exit. */
+#define VMSHADOW_MAX_SCOPED_PROCESSES 256
+
+/* Execute pages are taken from a slab of 2MB chunks shared by every processor. */
+#define EXEC_SLAB_CHUNK_PAGES (SIZE_2MB / PAGE_SIZE)
+#define EXEC_SLAB_MAX_CHUNKS 8
+
+/* Patches written over execute pages, shared by every processor. */
+#define VMSHADOW_MAX_PATCHES 256
+#define VMSHADOW_MAX_PATCH_SIZE 32
+
+/* Amount of merged writes buffered per logical processor before the oldest are overwritten. */
+#define VMSHADOW_WRITE_RING_SIZE 64
+
+/* Most shadows a single instruction can fault on while it is stepped, its code
+ * and both operands of a string instruction, each of them crossing a page boundary. */
+#define VMSHADOW_MAX_STEPS 8
+
 /******************** Public Typedefs ********************/
 
+/* Statistics of a single shadow page on a single processor. */
+typedef struct _VMSHADOW_STATS
+{
+	UINT64 physicalAddress;
+	UINT32 processorIndex;
+
+	/* TRUE when every process executes a shadow page, and the number of processes with their own. */
+	BOOLEAN global;
+	UINT32 variantCount;
+
+	/* TRUE when data accesses are currently being single stepped instead of flipped. */
+	BOOLEAN thrashing;
+
+	/* Amount of exec/RW flips, and data accesses served by single stepping. */
+	UINT64 flipCount;
+	UINT64 stepCount;
+
+	/* Cycles since the shadow was created and the average flip rate over that time. */
+	UINT64 elapsedCycles;
+	UINT64 flipsPerSecond;
+} VMSHADOW_STATS, *PVMSHADOW_STATS;
+
+/* Record of writes merged from a tracked page into its execute page, consecutive
+ * writes from the same instruction to the same page are coalesced into a single record. */
+typedef struct _VMSHADOW_WRITE_EVENT
+{
+	UINT64 physicalAddress;
+	UINT32 processorIndex;
+
+	/* Instruction that wrote to the page, and the amount of times it was coalesced. */
+	UINT64 guestRIP;
+	UINT32 writeCount;
+
+	/* Bytes copied to the execute page, and bytes written under a patch (kept out of it). */
+	UINT32 mergedBytes;
+	UINT32 conflictBytes;
+
+	/* TSC of the first and latest write. */
+	UINT64 firstTSC;
+	UINT64 lastTSC;
+} VMSHADOW_WRITE_EVENT, *PVMSHADOW_WRITE_EVENT;
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
 
+NTSTATUS VMShadow_initGlobal(void);
+void VMShadow_uninitGlobal(void);
+NTSTATUS VMShadow_init(PVMM_DATA lpData);
 BOOLEAN VMShadow_handleMovCR(PVMM_DATA lpData);
+NTSTATUS VMShadow_queryStats(PVMSHADOW_STATS stats, ULONG capacity, PULONG count);
 
 NTSTATUS VMShadow_hidePageGlobally(
 	PEPT_CONFIG eptConfig,
 	PHYSICAL_ADDRESS targetPA,
 	PUINT8 payloadPage,
+	BOOLEAN hypervisorRunning,
+	PUINT8* executePage
+);
+
+NTSTATUS VMShadow_addPatch(
+	PEPT_CONFIG eptConfig,
+	PVOID targetAddress,
+	PHYSICAL_ADDRESS targetPA,
+	const UINT8* patchBytes,
+	ULONG patchSize,
 	BOOLEAN hypervisorRunning
 );
 
+NTSTATUS VMShadow_preparePatch(PVOID targetAddress, const UINT8* patchBytes, ULONG patchSize);
+NTSTATUS VMShadow_removePatch(PVOID targetAddress);
+NTSTATUS VMShadow_removePatchFromRoot(PVOID targetAddress, PHYSICAL_ADDRESS targetPA);
+
 NTSTATUS VMShadow_hideExecInProcess(
 	PVMM_DATA lpData,
 	PEPROCESS targetProcess,
 	PUINT8 targetVA,
 	PUINT8 execVA
+);
+
+NTSTATUS VMShadow_hideExecInProcessAll(
+	PEPROCESS targetProcess,
+	PUINT8 targetVA,
+	PUINT8 execVA,
+	PVMSYNC_STATS stats
+);
+
+NTSTATUS VMShadow_unhideProcess(CR3 tableBase, PVMSYNC_STATS stats);
+
+NTSTATUS VMShadow_setWriteTracking(PVOID targetAddress, BOOLEAN enabled, PVMSYNC_STATS stats);
+
+NTSTATUS VMShadow_drainWriteEvents(
+	PVMSHADOW_WRITE_EVENT events,
+	ULONG capacity,
+	PULONG eventCount,
+	PULONG droppedCount
 );
\ No newline at end of file
@@ -0,0 +1,295 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "VMSync.h"
+#include "VMCALL_Common.h"
+#include "EPT.h"
+#include "Debug.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+typedef struct _SYNC_EDIT
+{
+	fnSyncEdit callback;
+
+	/* Parameter passed as is when parameterSize is zero, otherwise it is copied into
+	 * parameterData so that VMX root never dereferences memory owned by the caller. */
+	PVOID parameter;
+	SIZE_T parameterSize;
+	UINT64 parameterData[VMSYNC_MAX_PARAMETER_SIZE / sizeof(UINT64)];
+
+	/* Set for a query, which only reads the configuration and changes no EPT entry. */
+	BOOLEAN readOnly;
+} SYNC_EDIT, *PSYNC_EDIT;
+
+/* Batch of edits currently being applied by all of the processors. */
+typedef struct _SYNC_BATCH
+{
+	SYNC_EDIT edits[VMSYNC_MAX_EDITS];
+	ULONG editCount;
+
+	/* TSC at the time the batch was broadcast. */
+	UINT64 startTSC;
+
+	/* Updated by each processor from VMX root. */
+	volatile LONG acknowledged;
+	volatile LONG failed;
+	UINT64 ackCycles[MAX_LOGICAL_PROCESSORS];
+} SYNC_BATCH, *PSYNC_BATCH;
+
+/******************** Module Constants ********************/
+
+
+/******************** Module Variables ********************/
+
+/* Serialises queueing and committing, a commit holds the lock for its whole duration
+ * so the batch (and the parameter copies in it) is not replaced while being applied. */
+static FAST_MUTEX syncLock;
+
+/* Edits that have been queued but not yet committed. */
+static SYNC_EDIT pendingEdits[VMSYNC_MAX_EDITS];
+static ULONG pendingCount = 0;
+
+/* Batch that the processors apply when receiving VMCALL_ACTION_SYNC_EPT. */
+static SYNC_BATCH activeBatch = { 0 };
+
+/******************** Module Prototypes ********************/
+static NTSTATUS queueEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize, BOOLEAN readOnly, PULONG editIndex);
+static NTSTATUS broadcastEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize, BOOLEAN readOnly, PVMSYNC_STATS stats);
+static NTSTATUS commitBatch(PVMSYNC_STATS stats);
+static ULONG_PTR broadcastSync(ULONG_PTR argument);
+
+/******************** Public Code ********************/
+
+void VMSync_init(void)
+{
+	ExInitializeFastMutex(&syncLock);
+}
+
+NTSTATUS VMSync_queueEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize)
+{
+	NTSTATUS status;
+	ULONG editIndex;
+
+	ExAcquireFastMutex(&syncLock);
+	status = queueEdit(callback, parameter, parameterSize, FALSE, &editIndex);
+	ExReleaseFastMutex(&syncLock);
+
+	return status;
+}
+
+NTSTATUS VMSync_commit(PVMSYNC_STATS stats)
+{
+	NTSTATUS status;
+
+	ExAcquireFastMutex(&syncLock);
+	status = commitBatch(stats);
+	ExReleaseFastMutex(&syncLock);
+
+	return status;
+}
+
+NTSTATUS VMSync_broadcastEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize, PVMSYNC_STATS stats)
+{
+	return broadcastEdit(callback, parameter, parameterSize, FALSE, stats);
+}
+
+NTSTATUS VMSync_broadcastQuery(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize)
+{
+	/* Same as a broadcast edit, for callbacks that only read the configuration of each
+	 * processor (statistics, draining events). They change no EPT entry, so a batch made
+	 * only of queries is applied without invalidating EPT. */
+	return broadcastEdit(callback, parameter, parameterSize, TRUE, NULL);
+}
+
+NTSTATUS VMSync_applyPending(PVMM_DATA lpData)
+{
+	/* Called in VMX root on each processor from VMCALL_ACTION_SYNC_EPT. */
+	NTSTATUS status = STATUS_SUCCESS;
+	BOOLEAN modified = FALSE;
+
+	for (ULONG i = 0; i < activeBatch.editCount; i++)
+	{
+		PSYNC_EDIT edit = &activeBatch.edits[i];
+		PVOID parameter = (0 != edit->parameterSize) ? (PVOID)edit->parameterData : edit->parameter;
+
+		if (FALSE == edit->readOnly)
+		{
+			modified = TRUE;
+		}
+
+		NTSTATUS editStatus = edit->callback(lpData, parameter);
+		if ((NT_SUCCESS(status)) && (FALSE == NT_SUCCESS(editStatus)))
+		{
+			/* Keep the first failure, but still attempt the remaining edits. */
+			status = editStatus;
+		}
+	}
+
+	/* One invalidation for the whole batch, none if it only held queries. */
+	if (TRUE == modified)
+	{
+		EPT_invalidateAndFlush(&lpData->eptConfig);
+	}
+
+	if (FALSE == NT_SUCCESS(status))
+	{
+		InterlockedIncrement(&activeBatch.failed);
+	}
+
+	if (lpData->processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		activeBatch.ackCycles[lpData->processorIndex] = __rdtsc() - activeBatch.startTSC;
+	}
+	InterlockedIncrement(&activeBatch.acknowledged);
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS queueEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize, BOOLEAN readOnly, PULONG editIndex)
+{
+	/* Called with the lock held. */
+	NTSTATUS status;
+
+	if ((NULL != callback) && (parameterSize <= VMSYNC_MAX_PARAMETER_SIZE) &&
+		((0 == parameterSize) || (NULL != parameter)))
+	{
+		if (pendingCount < VMSYNC_MAX_EDITS)
+		{
+			PSYNC_EDIT edit = &pendingEdits[pendingCount];
+			edit->callback = callback;
+			edit->parameter = parameter;
+			edit->parameterSize = parameterSize;
+			edit->readOnly = readOnly;
+
+			if (0 != parameterSize)
+			{
+				RtlCopyMemory(edit->parameterData, parameter, parameterSize);
+			}
+
+			*editIndex = pendingCount;
+			pendingCount++;
+
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			/* Queue is full, the caller must commit first. */
+			status = STATUS_QUOTA_EXCEEDED;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS broadcastEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize, BOOLEAN readOnly, PVMSYNC_STATS stats)
+{
+	/* Convenience for a single edit, queued and committed under a single acquisition of the
+	 * lock so that the copy of the parameter, along with anything the processors wrote
+	 * to it, can be handed back to the caller. */
+	NTSTATUS status;
+	ULONG editIndex;
+
+	ExAcquireFastMutex(&syncLock);
+
+	status = queueEdit(callback, parameter, parameterSize, readOnly, &editIndex);
+	if (NT_SUCCESS(status))
+	{
+		status = commitBatch(stats);
+
+		if (0 != parameterSize)
+		{
+			RtlCopyMemory(parameter, activeBatch.edits[editIndex].parameterData, parameterSize);
+		}
+	}
+
+	ExReleaseFastMutex(&syncLock);
+
+	return status;
+}
+
+static NTSTATUS commitBatch(PVMSYNC_STATS stats)
+{
+	/* Called from the guest (IRQL <= APC_LEVEL) with the lock held. Every processor is
+	 * interrupted and applies the whole batch inside a single VMCALL, followed by a single
+	 * INVEPT unless the batch only held queries. KeIpiGenericCall only returns once every processor has finished, so the
+	 * edits are visible everywhere when this returns. */
+	NTSTATUS status;
+	VMSYNC_STATS result = { 0 };
+
+	/* Take ownership of the pending edits. */
+	RtlZeroMemory(&activeBatch, sizeof(activeBatch));
+	RtlCopyMemory(activeBatch.edits, pendingEdits, pendingCount * sizeof(SYNC_EDIT));
+	activeBatch.editCount = pendingCount;
+	pendingCount = 0;
+
+	result.editCount = activeBatch.editCount;
+	result.processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	if (0 != activeBatch.editCount)
+	{
+		activeBatch.startTSC = __rdtsc();
+		KeIpiGenericCall(broadcastSync, 0);
+		result.latencyCycles = __rdtsc() - activeBatch.startTSC;
+
+		result.acknowledged = (ULONG)activeBatch.acknowledged;
+		result.failed = (ULONG)activeBatch.failed;
+
+		for (ULONG i = 0; i < MAX_LOGICAL_PROCESSORS; i++)
+		{
+			if (activeBatch.ackCycles[i] > result.slowestAckCycles)
+			{
+				result.slowestAckCycles = activeBatch.ackCycles[i];
+			}
+		}
+
+		if (result.acknowledged != result.processorCount)
+		{
+			/* A processor did not apply the edits, the configurations are now inconsistent. */
+			DEBUG_PRINT("VMSync: only %d of %d processors acknowledged.\r\n", result.acknowledged, result.processorCount);
+			status = STATUS_UNSUCCESSFUL;
+		}
+		else if (0 != result.failed)
+		{
+			status = STATUS_PARTIAL_COPY;
+		}
+		else
+		{
+			status = STATUS_SUCCESS;
+		}
+	}
+	else
+	{
+		/* Nothing to apply (could have been committed by another caller already). */
+		result.acknowledged = result.processorCount;
+		status = STATUS_SUCCESS;
+	}
+
+	if (NULL != stats)
+	{
+		*stats = result;
+	}
+
+	return status;
+}
+
+static ULONG_PTR broadcastSync(ULONG_PTR argument)
+{
+	UNREFERENCED_PARAMETER(argument);
+
+	/* Ask the hypervisor on this processor to apply the active batch. */
+	VMCALL_COMMAND command = { 0 };
+	command.action = VMCALL_ACTION_SYNC_EPT;
+	command.buffer = NULL;
+	command.bufferSize = 0;
+
+	return (ULONG_PTR)VMCALL_actionHost(VMCALL_KEY, &command);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <wdm.h>
+#include "VMM.h"
+
+/******************** Public Defines ********************/
+
+/* Maximum amount of edits that can be queued before a commit is required. */
+#define VMSYNC_MAX_EDITS 32
+
+/* Largest parameter that can be copied into an edit. */
+#define VMSYNC_MAX_PARAMETER_SIZE 64
+
+/******************** Public Typedefs ********************/
+
+/* Edit applied by every logical processor to its own configuration while in VMX root.
+ * The parameter is a copy owned by VMSync and shared by every processor applying the edit,
+ * unless it was queued with a size of zero. In that case it is passed as is and must be
+ * memory allocated by the hypervisor, which stays valid until the commit has returned. */
+typedef NTSTATUS(*fnSyncEdit)(PVMM_DATA lpData, PVOID parameter);
+
+/* Statistics of a single commit, reported back to the caller. */
+typedef struct _VMSYNC_STATS
+{
+	/* Amount of edits that were applied by each processor. */
+	ULONG editCount;
+
+	/* Amount of active processors, and how many of them acknowledged the commit. */
+	ULONG processorCount;
+	ULONG acknowledged;
+
+	/* Amount of processors where at least one edit failed. */
+	ULONG failed;
+
+	/* TSC cycles from the broadcast until every processor acknowledged,
+	 * and the slowest single processor acknowledgement. */
+	UINT64 latencyCycles;
+	UINT64 slowestAckCycles;
+} VMSYNC_STATS, *PVMSYNC_STATS;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+void VMSync_init(void);
+NTSTATUS VMSync_queueEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize);
+NTSTATUS VMSync_commit(PVMSYNC_STATS stats);
+NTSTATUS VMSync_broadcastEdit(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize, PVMSYNC_STATS stats);
+NTSTATUS VMSync_broadcastQuery(fnSyncEdit callback, PVOID parameter, SIZE_T parameterSize);
+NTSTATUS VMSync_applyPending(PVMM_DATA lpData);
\ No newline at end of file
@@ -0,0 +1,619 @@
+#include <ntifs.h>
+#include "VMUserHook.h"
+#include "VMShadow.h"
+#include "MemManage.h"
+#include "Relocate.h"
+
+/******************** External API ********************/
+
+/* Exported by ntoskrnl, but not declared by the WDK headers. */
+NTSYSAPI NTSTATUS NTAPI ZwProtectVirtualMemory(
+	HANDLE ProcessHandle,
+	PVOID* BaseAddress,
+	PSIZE_T RegionSize,
+	ULONG NewProtect,
+	PULONG OldProtect
+);
+
+/******************** Module Typedefs ********************/
+
+/* A page of the process with detours in its execute page. The page is locked so the physical
+ * page the shadow is keyed to cannot be trimmed and reused while it is hooked. */
+typedef struct _USER_HOOK_PAGE
+{
+	PUINT8 targetPage;
+	PMDL lockMdl;
+} USER_HOOK_PAGE, *PUSER_HOOK_PAGE;
+
+/* Hooks of a single process. Its trampolines live in memory allocated in the process, which
+ * it only sees as read-execute. Nothing the process already had is modified. */
+typedef struct _USER_HOOK_PROCESS
+{
+	HANDLE processId;
+	PEPROCESS process;
+	CR3 tableBase;
+
+	/* Memory of the process holding the trampolines, locked by regionMdl. The trampolines are
+	 * written through the kernel mapping of the locked pages and executed at userRegion. */
+	PUINT8 region;
+	PMDL regionMdl;
+	PUINT8 userRegion;
+	ULONG regionUsed;
+
+	USER_HOOK_PAGE pages[VMUSERHOOK_MAX_PAGES];
+	ULONG pageCount;
+} USER_HOOK_PROCESS, *PUSER_HOOK_PROCESS;
+
+/******************** Module Constants ********************/
+
+/* Marks a target of a batch that has not been handled yet. */
+#define TARGET_PENDING STATUS_PENDING
+
+/******************** Module Variables ********************/
+
+/* Serialises installs, removals and process exits, all of which happen at PASSIVE_LEVEL. */
+static FAST_MUTEX userHookLock;
+
+static USER_HOOK_PROCESS userHookProcesses[VMUSERHOOK_MAX_PROCESSES] = { 0 };
+
+/******************** Module Prototypes ********************/
+static NTSTATUS acquireProcess(HANDLE processId, PEPROCESS process, PUSER_HOOK_PROCESS* hookProcess);
+static PUSER_HOOK_PROCESS findProcess(HANDLE processId);
+static NTSTATUS mapRegion(PUSER_HOOK_PROCESS hookProcess);
+static void releaseProcess(PUSER_HOOK_PROCESS hookProcess, PVMSYNC_STATS stats);
+static BOOLEAN isPageHooked(PUSER_HOOK_PROCESS hookProcess, PUINT8 targetPage);
+static void hookPage(PUSER_HOOK_PROCESS hookProcess, PVMUSERHOOK_TARGET targets, ULONG count, ULONG first, PUINT8 payload, PVMSYNC_STATS stats);
+static NTSTATUS prepareTarget(PUSER_HOOK_PROCESS hookProcess, PVMUSERHOOK_TARGET target, PUINT8 payload, PUINT64 coveredBytes);
+static NTSTATUS lockPage(PUINT8 targetPage, PMDL* lockMdl);
+static void processNotify(HANDLE parentId, HANDLE processId, BOOLEAN create);
+
+/******************** Public Code ********************/
+
+NTSTATUS VMUserHook_initGlobal(void)
+{
+	/* Called at PASSIVE_LEVEL before the hypervisor is launched. The pages locked for an exiting
+	 * process must be unlocked, and its region freed, before its address space is torn down. */
+	ExInitializeFastMutex(&userHookLock);
+
+	return PsSetCreateProcessNotifyRoutine(processNotify, FALSE);
+}
+
+void VMUserHook_uninitGlobal(void)
+{
+	/* Called when the hypervisor fails to start, no process can have been hooked yet. */
+	PsSetCreateProcessNotifyRoutine(processNotify, TRUE);
+}
+
+NTSTATUS VMUserHook_install(HANDLE processId, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+{
+	/* Called at PASSIVE_LEVEL, hooks a single function of the process. */
+	NTSTATUS status;
+
+	if (NULL != origFunction)
+	{
+		VMUSERHOOK_TARGET target = { 0 };
+		target.targetFunction = targetFunction;
+		target.hookFunction = hookFunction;
+
+		status = VMUserHook_installBatch(processId, &target, 1, NULL);
+		if (NT_SUCCESS(status))
+		{
+			status = target.status;
+			*origFunction = target.origFunction;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS VMUserHook_installBatch(HANDLE processId, PVMUSERHOOK_TARGET targets, ULONG count, PVMSYNC_STATS stats)
+{
+	/* Called at PASSIVE_LEVEL while the hypervisor is running. Detours are only ever written into
+	 * execute pages that are shadowed for this process alone (VMShadow_hideExecInProcessAll), so the
+	 * process keeps reading its original code and other processes sharing the page are unaffected.
+	 *
+	 * Targets on the same page share one execute page and one broadcast. The status of each target
+	 * is reported in the array, pages already hooked by an earlier call cannot be hooked again.
+	 * If only some processors install a page (STATUS_PARTIAL_COPY), the page is kept so it is
+	 * still removed with the rest of the process.
+	 *
+	 * NOTE: A page the process writes to (copy on write, a debugger breakpoint) is given a new
+	 * physical page, which the shadow no longer applies to. */
+	NTSTATUS status;
+	PEPROCESS process = NULL;
+
+	if ((NULL != targets) && (0 != count))
+	{
+		status = PsLookupProcessByProcessId(processId, &process);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Built in the guest and copied into an execute page by each processor. */
+		PUINT8 payload = (PUINT8)ExAllocatePool(NonPagedPoolNx, PAGE_SIZE);
+
+		if (NULL != payload)
+		{
+			ExAcquireFastMutex(&userHookLock);
+
+			PUSER_HOOK_PROCESS hookProcess;
+			status = acquireProcess(processId, process, &hookProcess);
+
+			if (NT_SUCCESS(status))
+			{
+				/* User addresses of the process are only accessible while attached to it. */
+				KAPC_STATE apcState;
+				KeStackAttachProcess(process, &apcState);
+
+				for (ULONG i = 0; i < count; i++)
+				{
+					targets[i].origFunction = NULL;
+					targets[i].status = ((NULL != targets[i].targetFunction) && (NULL != targets[i].hookFunction) &&
+										 ((SIZE_T)targets[i].targetFunction <= (SIZE_T)MM_HIGHEST_USER_ADDRESS)) ?
+										TARGET_PENDING : STATUS_INVALID_PARAMETER;
+				}
+
+				for (ULONG i = 0; i < count; i++)
+				{
+					if (TARGET_PENDING == targets[i].status)
+					{
+						hookPage(hookProcess, targets, count, i, payload, stats);
+					}
+				}
+
+				KeUnstackDetachProcess(&apcState);
+
+				/* Don't keep the process (and its mapping) for a batch that hooked nothing. */
+				if (0 == hookProcess->pageCount)
+				{
+					releaseProcess(hookProcess, NULL);
+				}
+			}
+
+			ExReleaseFastMutex(&userHookLock);
+
+			ExFreePool(payload);
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+
+		ObDereferenceObject(process);
+	}
+
+	return status;
+}
+
+NTSTATUS VMUserHook_remove(HANDLE processId, PVMSYNC_STATS stats)
+{
+	/* Called at PASSIVE_LEVEL, removes every hook of the process. The caller ensures no thread of
+	 * the process is executing a trampoline, as the region is freed once the shadows are gone. */
+	NTSTATUS status;
+
+	ExAcquireFastMutex(&userHookLock);
+
+	PUSER_HOOK_PROCESS hookProcess = findProcess(processId);
+	if (NULL != hookProcess)
+	{
+		releaseProcess(hookProcess, stats);
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_NOT_FOUND;
+	}
+
+	ExReleaseFastMutex(&userHookLock);
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS acquireProcess(HANDLE processId, PEPROCESS process, PUSER_HOOK_PROCESS* hookProcess)
+{
+	/* Returns the hooks of the process, allocating a region in it on its first hook. */
+	NTSTATUS status = STATUS_SUCCESS;
+	PUSER_HOOK_PROCESS result = findProcess(processId);
+
+	if (NULL == result)
+	{
+		result = findProcess(NULL);
+
+		if (NULL != result)
+		{
+			result->processId = processId;
+			result->process = process;
+			result->tableBase = MemManage_getPageTableBase(process);
+			ObReferenceObject(process);
+
+			status = mapRegion(result);
+			if (FALSE == NT_SUCCESS(status))
+			{
+				releaseProcess(result, NULL);
+			}
+		}
+		else
+		{
+			status = STATUS_QUOTA_EXCEEDED;
+		}
+	}
+
+	*hookProcess = result;
+
+	return status;
+}
+
+static PUSER_HOOK_PROCESS findProcess(HANDLE processId)
+{
+	/* A NULL process ID finds a free entry. */
+	PUSER_HOOK_PROCESS result = NULL;
+
+	for (ULONG i = 0; i < VMUSERHOOK_MAX_PROCESSES; i++)
+	{
+		if (processId == userHookProcesses[i].processId)
+		{
+			result = &userHookProcesses[i];
+			break;
+		}
+	}
+
+	return result;
+}
+
+static NTSTATUS mapRegion(PUSER_HOOK_PROCESS hookProcess)
+{
+	/* The region is allocated writable so it can be locked for writing, then the process is
+	 * left with a read-execute view. The kernel mapping of the locked pages stays writable
+	 * and is never executed. Whatever fails is undone by releaseProcess. */
+	NTSTATUS status;
+
+	PVOID userRegion = NULL;
+	SIZE_T regionSize = VMUSERHOOK_REGION_SIZE;
+
+	KAPC_STATE apcState;
+	KeStackAttachProcess(hookProcess->process, &apcState);
+
+	status = ZwAllocateVirtualMemory(ZwCurrentProcess(), &userRegion, 0, &regionSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (NT_SUCCESS(status))
+	{
+		hookProcess->userRegion = (PUINT8)userRegion;
+
+		PMDL mdl = IoAllocateMdl(userRegion, VMUSERHOOK_REGION_SIZE, FALSE, FALSE, NULL);
+		if (NULL != mdl)
+		{
+			__try
+			{
+				MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+			}
+			__except (EXCEPTION_EXECUTE_HANDLER)
+			{
+				status = GetExceptionCode();
+			}
+
+			if (NT_SUCCESS(status))
+			{
+				hookProcess->regionMdl = mdl;
+				hookProcess->region = (PUINT8)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+			}
+			else
+			{
+				IoFreeMdl(mdl);
+			}
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		if (NULL != hookProcess->region)
+		{
+			/* Fill with INT3 so a stray jump into unused space faults straight away. */
+			RtlFillMemory(hookProcess->region, VMUSERHOOK_REGION_SIZE, 0xCC);
+
+			ULONG oldProtect = 0;
+			status = ZwProtectVirtualMemory(ZwCurrentProcess(), &userRegion, &regionSize, PAGE_EXECUTE_READ, &oldProtect);
+		}
+		else
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	KeUnstackDetachProcess(&apcState);
+
+	return status;
+}
+
+static void releaseProcess(PUSER_HOOK_PROCESS hookProcess, PVMSYNC_STATS stats)
+{
+	/* Removes the shadows of the process from every processor first, then nothing executes the
+	 * detours and the pages and region can be released. Also called for a process that is
+	 * exiting, VMShadow may have already removed its shadows. */
+	if (0 != hookProcess->pageCount)
+	{
+		VMShadow_unhideProcess(hookProcess->tableBase, stats);
+	}
+
+	KAPC_STATE apcState;
+	KeStackAttachProcess(hookProcess->process, &apcState);
+
+	for (ULONG i = 0; i < hookProcess->pageCount; i++)
+	{
+		MmUnlockPages(hookProcess->pages[i].lockMdl);
+		IoFreeMdl(hookProcess->pages[i].lockMdl);
+	}
+
+	/* Unlocking also removes the kernel mapping of the region. */
+	if (NULL != hookProcess->regionMdl)
+	{
+		MmUnlockPages(hookProcess->regionMdl);
+		IoFreeMdl(hookProcess->regionMdl);
+	}
+
+	/* Memory of the process must be freed in its context. */
+	if (NULL != hookProcess->userRegion)
+	{
+		PVOID userRegion = hookProcess->userRegion;
+		SIZE_T regionSize = 0;
+		ZwFreeVirtualMemory(ZwCurrentProcess(), &userRegion, &regionSize, MEM_RELEASE);
+	}
+
+	KeUnstackDetachProcess(&apcState);
+
+	ObDereferenceObject(hookProcess->process);
+	RtlZeroMemory(hookProcess, sizeof(USER_HOOK_PROCESS));
+}
+
+static BOOLEAN isPageHooked(PUSER_HOOK_PROCESS hookProcess, PUINT8 targetPage)
+{
+	BOOLEAN result = FALSE;
+
+	for (ULONG i = 0; i < hookProcess->pageCount; i++)
+	{
+		if (targetPage == hookProcess->pages[i].targetPage)
+		{
+			result = TRUE;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static void hookPage(PUSER_HOOK_PROCESS hookProcess, PVMUSERHOOK_TARGET targets, ULONG count, ULONG first, PUINT8 payload, PVMSYNC_STATS stats)
+{
+	/* Called attached to the process. Builds the execute page of the page holding targets[first]
+	 * with the detours of every pending target on it, then shadows it on every processor. */
+	NTSTATUS status;
+	PUINT8 targetPage = (PUINT8)PAGE_ALIGN(targets[first].targetFunction);
+	PMDL lockMdl = NULL;
+
+	if (TRUE == isPageHooked(hookProcess, targetPage))
+	{
+		status = STATUS_ALREADY_REGISTERED;
+	}
+	else if (VMUSERHOOK_MAX_PAGES == hookProcess->pageCount)
+	{
+		status = STATUS_QUOTA_EXCEEDED;
+	}
+	else
+	{
+		status = lockPage(targetPage, &lockMdl);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* The original bytes, read through the locked page so they cannot fault. */
+		PUINT8 originalPage = (PUINT8)MmGetSystemAddressForMdlSafe(lockMdl, NormalPagePriority | MdlMappingNoExecute);
+		if (NULL != originalPage)
+		{
+			RtlCopyMemory(payload, originalPage, PAGE_SIZE);
+		}
+		else
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Bytes of the page replaced or relocated by a detour, detours on a page cannot overlap. */
+		UINT64 coveredBytes[PAGE_SIZE / 64] = { 0 };
+		BOOLEAN prepared = FALSE;
+
+		for (ULONG i = first; i < count; i++)
+		{
+			if ((TARGET_PENDING == targets[i].status) && (targetPage == PAGE_ALIGN(targets[i].targetFunction)))
+			{
+				targets[i].status = prepareTarget(hookProcess, &targets[i], payload, coveredBytes);
+				prepared |= NT_SUCCESS(targets[i].status);
+			}
+		}
+
+		if (TRUE == prepared)
+		{
+			status = VMShadow_hideExecInProcessAll(hookProcess->process, targetPage, payload, stats);
+
+			/* Even if it failed, some processors may execute the detours now. The page stays
+			 * locked until the process is removed. */
+			hookProcess->pages[hookProcess->pageCount].targetPage = targetPage;
+			hookProcess->pages[hookProcess->pageCount].lockMdl = lockMdl;
+			hookProcess->pageCount++;
+
+			for (ULONG i = first; (FALSE == NT_SUCCESS(status)) && (i < count); i++)
+			{
+				if ((NT_SUCCESS(targets[i].status)) && (targetPage == PAGE_ALIGN(targets[i].targetFunction)))
+				{
+					targets[i].status = status;
+				}
+			}
+		}
+		else
+		{
+			MmUnlockPages(lockMdl);
+			IoFreeMdl(lockMdl);
+		}
+	}
+	else
+	{
+		if (NULL != lockMdl)
+		{
+			MmUnlockPages(lockMdl);
+			IoFreeMdl(lockMdl);
+		}
+
+		/* Every target on the page fails the same way. */
+		for (ULONG i = first; i < count; i++)
+		{
+			if ((TARGET_PENDING == targets[i].status) && (targetPage == PAGE_ALIGN(targets[i].targetFunction)))
+			{
+				targets[i].status = status;
+			}
+		}
+	}
+}
+
+static NTSTATUS prepareTarget(PUSER_HOOK_PROCESS hookProcess, PVMUSERHOOK_TARGET target, PUINT8 payload, PUINT64 coveredBytes)
+{
+	/* Called attached to the process. Builds the trampoline in the region, and writes the detour
+	 * into the payload. The code is read at its user address, as that is what it is relative to. */
+	NTSTATUS status;
+
+	PUINT8 targetFunction = (PUINT8)target->targetFunction;
+	ULONG offsetIntoPage = BYTE_OFFSET(targetFunction);
+	ULONG detourSize = Relocate_getJumpSize((SIZE_T)targetFunction, (SIZE_T)target->hookFunction);
+
+	SIZE_T sizeOfDisassembled = 0;
+	SIZE_T sizeOfTrampoline = 0;
+
+	/* The code after the target may be on a page that is not resident, or not mapped at all. */
+	__try
+	{
+		status = Relocate_copyInstructions(targetFunction, detourSize, NULL, 0, &sizeOfDisassembled, &sizeOfTrampoline);
+
+		if (NT_SUCCESS(status))
+		{
+			status = Relocate_checkBranchTargets(targetFunction, detourSize, MemManage_getResidentSize(targetFunction, RELOCATE_SCAN_SIZE));
+		}
+
+		/* Ensure the detour isn't over two pages, or over another detour. */
+		if (NT_SUCCESS(status) && ((offsetIntoPage + sizeOfDisassembled) > PAGE_SIZE))
+		{
+			status = STATUS_NOT_CAPABLE;
+		}
+
+		for (ULONG i = offsetIntoPage; (NT_SUCCESS(status)) && (i < (offsetIntoPage + sizeOfDisassembled)); i++)
+		{
+			if (0 != (coveredBytes[i / 64] & (1ULL << (i % 64))))
+			{
+				status = STATUS_ALREADY_REGISTERED;
+			}
+		}
+
+		SIZE_T trampolineSize = ALIGN_UP_BY(sizeOfTrampoline + RELOCATE_ABSOLUTE_JUMP_SIZE, VMUSERHOOK_TRAMPOLINE_ALIGNMENT);
+		if (NT_SUCCESS(status) && ((hookProcess->regionUsed + trampolineSize) > VMUSERHOOK_REGION_SIZE))
+		{
+			status = STATUS_QUOTA_EXCEEDED;
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* Written through the kernel mapping, relocated for the user address it executes at. */
+			PUINT8 trampoline = &hookProcess->region[hookProcess->regionUsed];
+			PUINT8 userTrampoline = &hookProcess->userRegion[hookProcess->regionUsed];
+			status = Relocate_copyInstructions(targetFunction, detourSize, trampoline, (SIZE_T)userTrampoline,
+											   &sizeOfDisassembled, &sizeOfTrampoline);
+
+			if (NT_SUCCESS(status))
+			{
+				/* Add the jump to the trampoline to return back to actual code. */
+				Relocate_writeJump(&trampoline[sizeOfTrampoline], (SIZE_T)&userTrampoline[sizeOfTrampoline], (SIZE_T)targetFunction + sizeOfDisassembled);
+
+				/* Create the detour in the execute page, it will be executed at the target's address. */
+				Relocate_writeJump(&payload[offsetIntoPage], (SIZE_T)targetFunction, (SIZE_T)target->hookFunction);
+
+				for (ULONG i = offsetIntoPage; i < (offsetIntoPage + sizeOfDisassembled); i++)
+				{
+					coveredBytes[i / 64] |= (1ULL << (i % 64));
+				}
+
+				/* Space of a trampoline whose page then fails to install is not reused. */
+				hookProcess->regionUsed += (ULONG)trampolineSize;
+				target->origFunction = userTrampoline;
+			}
+		}
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		status = GetExceptionCode();
+	}
+
+	return status;
+}
+
+static NTSTATUS lockPage(PUINT8 targetPage, PMDL* lockMdl)
+{
+	/* Called attached to the process, locks a page of its code in memory. */
+	NTSTATUS status;
+
+	PMDL mdl = IoAllocateMdl(targetPage, PAGE_SIZE, FALSE, FALSE, NULL);
+	if (NULL != mdl)
+	{
+		__try
+		{
+			MmProbeAndLockPages(mdl, UserMode, IoReadAccess);
+			status = STATUS_SUCCESS;
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			status = GetExceptionCode();
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			*lockMdl = mdl;
+		}
+		else
+		{
+			IoFreeMdl(mdl);
+		}
+	}
+	else
+	{
+		status = STATUS_NO_MEMORY;
+	}
+
+	return status;
+}
+
+static void processNotify(HANDLE parentId, HANDLE processId, BOOLEAN create)
+{
+	UNREFERENCED_PARAMETER(parentId);
+
+	/* Called in the context of the exiting process, before its address space is torn down. */
+	if (FALSE == create)
+	{
+		ExAcquireFastMutex(&userHookLock);
+
+		PUSER_HOOK_PROCESS hookProcess = findProcess(processId);
+		if (NULL != hookProcess)
+		{
+			releaseProcess(hookProcess, NULL);
+		}
+
+		ExReleaseFastMutex(&userHookLock);
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <wdm.h>
+#include "VMSync.h"
+
+/******************** Public Defines ********************/
+
+/* Processes that can have user hooks at once, and the pages that can be hooked in each. */
+#define VMUSERHOOK_MAX_PROCESSES 16
+#define VMUSERHOOK_MAX_PAGES 64
+
+/* Trampolines of a process are packed into a region allocated in it, 16 byte aligned. */
+#define VMUSERHOOK_REGION_SIZE 0x10000
+#define VMUSERHOOK_TRAMPOLINE_ALIGNMENT 16
+
+/******************** Public Typedefs ********************/
+
+/* A function to hook in the target process, every address is a user address within it. */
+typedef struct _VMUSERHOOK_TARGET
+{
+	PVOID targetFunction;		/* IN */
+	PVOID hookFunction;			/* IN */
+	PVOID origFunction;			/* OUT, calls the original function */
+	NTSTATUS status;			/* OUT */
+} VMUSERHOOK_TARGET, *PVMUSERHOOK_TARGET;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS VMUserHook_initGlobal(void);
+void VMUserHook_uninitGlobal(void);
+NTSTATUS VMUserHook_install(HANDLE processId, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
+NTSTATUS VMUserHook_installBatch(HANDLE processId, PVMUSERHOOK_TARGET targets, ULONG count, PVMSYNC_STATS stats);
+NTSTATUS VMUserHook_remove(HANDLE processId, PVMSYNC_STATS stats);
\ No newline at end of file
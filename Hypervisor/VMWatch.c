@@ -0,0 +1,598 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "VMWatch.h"
+#include "VMSync.h"
+#include "EPT.h"
+#include "MTF.h"
+#include "MemManage.h"
+#include "Debug.h"
+#include "ia32.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Configuration of a single watchpoint, shared by all processors. */
+typedef struct _VMWATCH
+{
+	/* Non-zero when the slot is in use. */
+	volatile LONG inUse;
+
+	UINT32 id;
+	PHYSICAL_ADDRESS start;
+	SIZE_T size;
+	UINT32 triggers;
+
+	/* Writes are only recorded when (value & filterMask) == filterValue,
+	 * a mask of zero records every write. */
+	UINT64 filterMask;
+	UINT64 filterValue;
+} VMWATCH, *PVMWATCH;
+
+/* A watched page opened for the instruction being single stepped. */
+typedef struct _VMWATCH_STEP
+{
+	PVMWATCH watch;
+	PEPT_PML1_ENTRY pml1e;
+	ULONG page;
+	EPT_VIOLATION violation;
+} VMWATCH_STEP, *PVMWATCH_STEP;
+
+/* State of a single logical processor, only accessed in VMX root on that processor. */
+typedef struct _VMWATCH_CPU
+{
+	/* Entries of each watched page as they were before arming, restored when
+	 * the page is opened for a single step and when the watch is removed. */
+	EPT_PML1_ENTRY savedPML1E[VMWATCH_MAX_WATCHES][VMWATCH_MAX_PAGES];
+
+	/* Pages opened for the instruction being single stepped. One instruction can fault on
+	 * several watched pages (a movs between two watches), each stays open until the trap. */
+	VMWATCH_STEP steps[VMWATCH_MAX_STEPS];
+	ULONG stepCount;
+	UINT64 steppingRIP;
+
+	/* Event ring, head is the next slot to be written. */
+	VMWATCH_EVENT events[VMWATCH_RING_SIZE];
+	ULONG head;
+	ULONG count;
+	ULONG dropped;
+} VMWATCH_CPU, *PVMWATCH_CPU;
+
+/* Output of a drain, filled by each processor from VMX root. */
+typedef struct _VMWATCH_DRAIN
+{
+	PVMWATCH_EVENT events;
+	ULONG capacity;
+	volatile LONG written;
+	volatile LONG dropped;
+
+	/* Page table base of the caller, the events are written through it. */
+	CR3 guestCR3;
+} VMWATCH_DRAIN, *PVMWATCH_DRAIN;
+
+/******************** Module Constants ********************/
+
+
+/******************** Module Variables ********************/
+
+static VMWATCH watches[VMWATCH_MAX_WATCHES] = { 0 };
+static VMWATCH_CPU cpuState[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/******************** Module Prototypes ********************/
+static BOOLEAN handleWatchViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation, PVOID userBuffer);
+static BOOLEAN handleWatchStep(PMTF_CONFIG mtfConfig, PVOID userBuffer);
+static void completeSteps(PVMM_DATA lpData, PVMWATCH_CPU cpu);
+static void recordEvent(PVMM_DATA lpData, PVMWATCH_CPU cpu, PVMWATCH_STEP step);
+static EPT_PML1_ENTRY armedEntry(EPT_PML1_ENTRY savedPML1E, UINT32 triggers);
+static ULONG getPageCount(PVMWATCH watch);
+static NTSTATUS syncArmWatch(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS syncDisarmWatch(PVMM_DATA lpData, PVOID parameter);
+static NTSTATUS syncDrainEvents(PVMM_DATA lpData, PVOID parameter);
+static BOOLEAN isSharingPage(PVMWATCH newWatch);
+
+/******************** Public Code ********************/
+
+NTSTATUS VMWatch_init(PVMM_DATA lpData)
+{
+	/* Called once per logical processor before launch. Watchpoints re-arm once the
+	 * faulting instruction has been single stepped, the MTF handler covers every RIP
+	 * and declines traps it was not expecting. */
+	NTSTATUS status;
+
+	if (lpData->processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		RtlZeroMemory(&cpuState[lpData->processorIndex], sizeof(VMWATCH_CPU));
+		status = MTF_addHandler(&lpData->mtfConfig, (PUINT8)0, (PUINT8)MAXULONG_PTR, handleWatchStep, NULL);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS VMWatch_add(
+	PHYSICAL_ADDRESS start,
+	SIZE_T size,
+	UINT32 triggers,
+	UINT64 filterMask,
+	UINT64 filterValue,
+	PUINT32 watchId
+)
+{
+	/* Called from the guest at PASSIVE_LEVEL, the watch is armed on every processor using VMSync. */
+	NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+	const UINT32 VALID_TRIGGERS = VMWATCH_TRIGGER_READ | VMWATCH_TRIGGER_WRITE | VMWATCH_TRIGGER_EXECUTE;
+	if ((0 == size) || (0 == triggers) || (0 != (triggers & ~VALID_TRIGGERS)) || (NULL == watchId) ||
+		((((ULONG_PTR)PAGE_ALIGN(start.QuadPart + size - 1) - (ULONG_PTR)PAGE_ALIGN(start.QuadPart)) / PAGE_SIZE) >= VMWATCH_MAX_PAGES))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (UINT32 i = 0; i < VMWATCH_MAX_WATCHES; i++)
+	{
+		PVMWATCH watch = &watches[i];
+
+		/* Claim the first free slot. */
+		if (0 == InterlockedCompareExchange(&watch->inUse, 1, 0))
+		{
+			watch->id = i;
+			watch->start = start;
+			watch->size = size;
+			watch->triggers = triggers;
+			watch->filterMask = filterMask;
+			watch->filterValue = filterValue;
+
+			/* Only one handler is called per violation, so watches cannot share a page. */
+			if (FALSE == isSharingPage(watch))
+			{
+				/* VMX root cannot allocate, so each processor must be able to split every page and add the handler. */
+				status = EPT_reserve(getPageCount(watch), 1);
+
+				if (NT_SUCCESS(status))
+				{
+					status = VMSync_broadcastEdit(syncArmWatch, watch, 0, NULL);
+				}
+
+				if (NT_SUCCESS(status))
+				{
+					*watchId = i;
+				}
+				else
+				{
+					/* Undo anything that was armed before the failure. */
+					VMSync_broadcastEdit(syncDisarmWatch, watch, 0, NULL);
+					InterlockedExchange(&watch->inUse, 0);
+				}
+			}
+			else
+			{
+				InterlockedExchange(&watch->inUse, 0);
+				status = STATUS_CONFLICTING_ADDRESSES;
+			}
+
+			break;
+		}
+	}
+
+	return status;
+}
+
+NTSTATUS VMWatch_remove(UINT32 watchId)
+{
+	NTSTATUS status;
+
+	if ((watchId < VMWATCH_MAX_WATCHES) && (0 != watches[watchId].inUse))
+	{
+		PVMWATCH watch = &watches[watchId];
+
+		status = VMSync_broadcastEdit(syncDisarmWatch, watch, 0, NULL);
+		InterlockedExchange(&watch->inUse, 0);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS VMWatch_drain(
+	PVMWATCH_EVENT events,
+	ULONG capacity,
+	PULONG eventCount,
+	PULONG droppedCount
+)
+{
+	/* Called from the guest, each processor copies out its own ring from VMX root
+	 * so the rings never need to be shared with the guest while being written. */
+	NTSTATUS status;
+
+	if ((NULL != events) && (0 != capacity) && (NULL != eventCount))
+	{
+		VMWATCH_DRAIN drain = { 0 };
+		drain.events = events;
+		drain.capacity = capacity;
+		drain.guestCR3.Flags = __readcr3();
+
+		status = VMSync_broadcastQuery(syncDrainEvents, &drain, sizeof(drain));
+
+		*eventCount = (ULONG)min(drain.written, (LONG)capacity);
+		if (NULL != droppedCount)
+		{
+			*droppedCount = (ULONG)drain.dropped;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static BOOLEAN handleWatchViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PEPT_VIOLATION violation, PVOID userBuffer)
+{
+	UNREFERENCED_PARAMETER(guestContext);
+
+	BOOLEAN result = FALSE;
+
+	PVMWATCH watch = (PVMWATCH)userBuffer;
+	PVMM_DATA lpData = CONTAINING_RECORD(eptConfig, VMM_DATA, eptConfig);
+	PVMWATCH_CPU cpu = &cpuState[lpData->processorIndex];
+
+	PEPT_PML1_ENTRY pml1e = EPT_getPML1EFromAddress(eptConfig, violation->guestPA);
+	if ((NULL != watch) && (NULL != pml1e))
+	{
+		ULONG page = (ULONG)(((ULONG_PTR)PAGE_ALIGN(violation->guestPA.QuadPart) - (ULONG_PTR)PAGE_ALIGN(watch->start.QuadPart)) / PAGE_SIZE);
+
+		/* Pages already opened for this instruction stay open, re-arming them here would
+		 * fault on them again and never let the instruction complete. Running out of
+		 * steps means the trap was missed, so finish those before starting again. */
+		if (VMWATCH_MAX_STEPS == cpu->stepCount)
+		{
+			completeSteps(lpData, cpu);
+		}
+
+		/* Open the page for a single instruction with the permissions it had before
+		 * arming, the MTF trap afterwards records the access and re-arms the page. */
+		pml1e->Flags = cpu->savedPML1E[watch->id][page].Flags;
+
+		PVMWATCH_STEP step = &cpu->steps[cpu->stepCount++];
+		step->watch = watch;
+		step->pml1e = pml1e;
+		step->page = page;
+		step->violation = *violation;
+		__vmx_vmread(VMCS_GUEST_RIP, &cpu->steppingRIP);
+
+		MTF_setTracingEnabled(TRUE);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static BOOLEAN handleWatchStep(PMTF_CONFIG mtfConfig, PVOID userBuffer)
+{
+	UNREFERENCED_PARAMETER(userBuffer);
+
+	BOOLEAN result = FALSE;
+
+	PVMM_DATA lpData = CONTAINING_RECORD(mtfConfig, VMM_DATA, mtfConfig);
+	PVMWATCH_CPU cpu = &cpuState[lpData->processorIndex];
+
+	/* Only handle the trap if this processor was stepping a watched access. */
+	if (0 != cpu->stepCount)
+	{
+		MTF_setTracingEnabled(FALSE);
+		completeSteps(lpData, cpu);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static void completeSteps(PVMM_DATA lpData, PVMWATCH_CPU cpu)
+{
+	/* Re-arm every page opened for the instruction and record each access, permissions
+	 * are being removed so cached translations need to be invalidated. */
+	for (ULONG i = 0; i < cpu->stepCount; i++)
+	{
+		PVMWATCH_STEP step = &cpu->steps[i];
+		step->pml1e->Flags = armedEntry(cpu->savedPML1E[step->watch->id][step->page], step->watch->triggers).Flags;
+	}
+
+	EPT_invalidateAndFlush(&lpData->eptConfig);
+
+	for (ULONG i = 0; i < cpu->stepCount; i++)
+	{
+		recordEvent(lpData, cpu, &cpu->steps[i]);
+	}
+
+	cpu->stepCount = 0;
+}
+
+static void recordEvent(PVMM_DATA lpData, PVMWATCH_CPU cpu, PVMWATCH_STEP step)
+{
+	PVMWATCH watch = step->watch;
+	PEPT_VIOLATION violation = &step->violation;
+
+	/* Permissions are per page, ignore accesses to the rest of the page. */
+	UINT64 watchStart = (UINT64)watch->start.QuadPart;
+	UINT64 accessPA = (UINT64)violation->guestPA.QuadPart;
+	if ((accessPA < watchStart) || (accessPA >= (watchStart + watch->size)))
+	{
+		return;
+	}
+
+	/* Determine which of the watched accesses took place. */
+	UINT32 accessType = 0;
+	if (violation->qualification.ReadAccess)
+	{
+		accessType |= VMWATCH_TRIGGER_READ;
+	}
+	if (violation->qualification.WriteAccess)
+	{
+		accessType |= VMWATCH_TRIGGER_WRITE;
+	}
+	if (violation->qualification.ExecuteAccess)
+	{
+		accessType |= VMWATCH_TRIGGER_EXECUTE;
+	}
+
+	accessType &= watch->triggers;
+	if (0 == accessType)
+	{
+		return;
+	}
+
+	/* The write has completed, so read the value that was written (without crossing the page). */
+	UINT64 value = 0;
+	if (accessType & VMWATCH_TRIGGER_WRITE)
+	{
+		SIZE_T readSize = min(sizeof(value), PAGE_SIZE - (accessPA & (PAGE_SIZE - 1)));
+		MemManage_readPhysicalAddress(&lpData->mmContext, accessPA, &value, readSize);
+
+		if ((value & watch->filterMask) != watch->filterValue)
+		{
+			/* Only a write, and the value does not match the filter. */
+			if (VMWATCH_TRIGGER_WRITE == accessType)
+			{
+				return;
+			}
+		}
+	}
+
+	UINT64 currentTSC = __rdtsc();
+
+	/* Coalesce with the latest record if it is the same instruction and access. */
+	if (0 != cpu->count)
+	{
+		PVMWATCH_EVENT latest = &cpu->events[(cpu->head + VMWATCH_RING_SIZE - 1) % VMWATCH_RING_SIZE];
+
+		if ((latest->guestRIP == cpu->steppingRIP) &&
+			(latest->watchId == watch->id) &&
+			(latest->accessType == accessType))
+		{
+			latest->hitCount++;
+			latest->guestPA = accessPA;
+			latest->guestLA = violation->guestLA;
+			latest->value = value;
+			latest->lastTSC = currentTSC;
+			return;
+		}
+	}
+
+	/* New record, the oldest is overwritten if the ring is full. */
+	PVMWATCH_EVENT newEvent = &cpu->events[cpu->head];
+	newEvent->watchId = watch->id;
+	newEvent->processorIndex = lpData->processorIndex;
+	newEvent->guestRIP = cpu->steppingRIP;
+	newEvent->accessType = accessType;
+	newEvent->hitCount = 1;
+	newEvent->guestPA = accessPA;
+	newEvent->guestLA = violation->guestLA;
+	newEvent->value = value;
+	newEvent->firstTSC = currentTSC;
+	newEvent->lastTSC = currentTSC;
+
+	cpu->head = (cpu->head + 1) % VMWATCH_RING_SIZE;
+	if (cpu->count < VMWATCH_RING_SIZE)
+	{
+		cpu->count++;
+	}
+	else
+	{
+		cpu->dropped++;
+	}
+}
+
+static EPT_PML1_ENTRY armedEntry(EPT_PML1_ENTRY savedPML1E, UINT32 triggers)
+{
+	/* The armed entry only differs from the one saved before arming by the
+	 * permissions the watch traps, anything else on the page is kept. */
+	EPT_PML1_ENTRY result = savedPML1E;
+
+	/* EPT does not allow a page to be writable but not readable,
+	 * so trapping reads also has to remove write access. */
+	if (triggers & VMWATCH_TRIGGER_READ)
+	{
+		result.ReadAccess = FALSE;
+		result.WriteAccess = FALSE;
+	}
+
+	if (triggers & VMWATCH_TRIGGER_WRITE)
+	{
+		result.WriteAccess = FALSE;
+	}
+
+	if (triggers & VMWATCH_TRIGGER_EXECUTE)
+	{
+		result.ExecuteAccess = FALSE;
+	}
+
+	return result;
+}
+
+static ULONG getPageCount(PVMWATCH watch)
+{
+	return (ULONG)(((ULONG_PTR)PAGE_ALIGN(watch->start.QuadPart + watch->size - 1) - (ULONG_PTR)PAGE_ALIGN(watch->start.QuadPart)) / PAGE_SIZE) + 1;
+}
+
+static NTSTATUS syncArmWatch(PVMM_DATA lpData, PVOID parameter)
+{
+	/* Applied in VMX root on each processor, VMSync invalidates EPT after the batch. */
+	PVMWATCH watch = (PVMWATCH)parameter;
+	PVMWATCH_CPU cpu = &cpuState[lpData->processorIndex];
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PHYSICAL_RANGE handlerRange;
+	handlerRange.start.QuadPart = (LONGLONG)PAGE_ALIGN(watch->start.QuadPart);
+	handlerRange.end.QuadPart = (LONGLONG)PAGE_ALIGN(watch->start.QuadPart + watch->size - 1) + PAGE_SIZE - 1;
+
+	/* Nothing is restored on disarm for pages that were never armed. */
+	__stosb((PUCHAR)cpu->savedPML1E[watch->id], 0, sizeof(cpu->savedPML1E[watch->id]));
+
+	/* Permissions can only be removed at 4KB granularity. */
+	ULONG pageCount = getPageCount(watch);
+	for (ULONG page = 0; (page < pageCount) && NT_SUCCESS(status); page++)
+	{
+		PHYSICAL_ADDRESS pagePA;
+		pagePA.QuadPart = handlerRange.start.QuadPart + ((LONGLONG)page * PAGE_SIZE);
+
+		status = EPT_splitLargePage(&lpData->eptConfig, pagePA);
+		if (NT_SUCCESS(status) || (STATUS_ALREADY_COMPLETE == status))
+		{
+			PEPT_PML1_ENTRY pml1e = EPT_getPML1EFromAddress(&lpData->eptConfig, pagePA);
+			if (NULL != pml1e)
+			{
+				cpu->savedPML1E[watch->id][page] = *pml1e;
+				pml1e->Flags = armedEntry(*pml1e, watch->triggers).Flags;
+				status = STATUS_SUCCESS;
+			}
+			else
+			{
+				status = STATUS_NO_SUCH_MEMBER;
+			}
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		status = EPT_addViolationHandler(&lpData->eptConfig, handlerRange, handleWatchViolation, watch);
+	}
+
+	return status;
+}
+
+static NTSTATUS syncDisarmWatch(PVMM_DATA lpData, PVOID parameter)
+{
+	PVMWATCH watch = (PVMWATCH)parameter;
+	PVMWATCH_CPU cpu = &cpuState[lpData->processorIndex];
+
+	LONGLONG pageStart = (LONGLONG)PAGE_ALIGN(watch->start.QuadPart);
+	ULONG pageCount = getPageCount(watch);
+
+	for (ULONG page = 0; page < pageCount; page++)
+	{
+		/* Pages that were never armed have no saved entry. */
+		if (0 != cpu->savedPML1E[watch->id][page].Flags)
+		{
+			PHYSICAL_ADDRESS pagePA;
+			pagePA.QuadPart = pageStart + ((LONGLONG)page * PAGE_SIZE);
+
+			PEPT_PML1_ENTRY pml1e = EPT_getPML1EFromAddress(&lpData->eptConfig, pagePA);
+			if (NULL != pml1e)
+			{
+				/* Restore the permissions the page had before it was armed. */
+				pml1e->Flags = cpu->savedPML1E[watch->id][page].Flags;
+			}
+
+			cpu->savedPML1E[watch->id][page].Flags = 0;
+		}
+	}
+
+	/* A page of the watch opened for a step is restored above, it must not be re-armed by the trap. */
+	ULONG kept = 0;
+	for (ULONG i = 0; i < cpu->stepCount; i++)
+	{
+		if (watch != cpu->steps[i].watch)
+		{
+			cpu->steps[kept++] = cpu->steps[i];
+		}
+	}
+	cpu->stepCount = kept;
+
+	/* May not exist if arming failed part way through. */
+	EPT_removeViolationHandler(&lpData->eptConfig, handleWatchViolation, watch);
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS syncDrainEvents(PVMM_DATA lpData, PVOID parameter)
+{
+	PVMWATCH_DRAIN drain = (PVMWATCH_DRAIN)parameter;
+	PVMWATCH_CPU cpu = &cpuState[lpData->processorIndex];
+
+	/* Reserve space in the output for this processor's events. */
+	LONG offset = InterlockedExchangeAdd(&drain->written, (LONG)cpu->count);
+	ULONG available = (offset < (LONG)drain->capacity) ? (drain->capacity - (ULONG)offset) : 0;
+	ULONG toCopy = min(cpu->count, available);
+
+	/* Copy out the oldest events first, anything that does not fit (or could not
+	 * be written to the caller's buffer) stays in the ring. The buffer belongs to the
+	 * guest, so it is written through the page tables of the caller. */
+	ULONG tail = (cpu->head + VMWATCH_RING_SIZE - cpu->count) % VMWATCH_RING_SIZE;
+	ULONG copied = 0;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	while ((copied < toCopy) && NT_SUCCESS(status))
+	{
+		status = MemManage_writeVirtualAddress(&lpData->mmContext, drain->guestCR3,
+											   (GUEST_VIRTUAL_ADDRESS)&drain->events[offset + copied],
+											   &cpu->events[(tail + copied) % VMWATCH_RING_SIZE], sizeof(VMWATCH_EVENT));
+		if (NT_SUCCESS(status))
+		{
+			copied++;
+		}
+	}
+
+	cpu->count -= copied;
+
+	InterlockedExchangeAdd(&drain->dropped, (LONG)cpu->dropped);
+	cpu->dropped = 0;
+
+	return status;
+}
+
+static BOOLEAN isSharingPage(PVMWATCH newWatch)
+{
+	BOOLEAN result = FALSE;
+
+	LONGLONG newStart = (LONGLONG)PAGE_ALIGN(newWatch->start.QuadPart);
+	LONGLONG newEnd = (LONGLONG)PAGE_ALIGN(newWatch->start.QuadPart + newWatch->size - 1);
+
+	for (UINT32 i = 0; i < VMWATCH_MAX_WATCHES; i++)
+	{
+		PVMWATCH watch = &watches[i];
+
+		if ((watch != newWatch) && (0 != watch->inUse))
+		{
+			LONGLONG start = (LONGLONG)PAGE_ALIGN(watch->start.QuadPart);
+			LONGLONG end = (LONGLONG)PAGE_ALIGN(watch->start.QuadPart + watch->size - 1);
+
+			if ((newStart <= end) && (start <= newEnd))
+			{
+				result = TRUE;
+				break;
+			}
+		}
+	}
+
+	return result;
+}
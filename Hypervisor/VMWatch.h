@@ -0,0 +1,75 @@
+#pragma once
+#include <wdm.h>
+#include "VMM.h"
+
+/******************** Public Defines ********************/
+
+/* Accesses that trigger a watchpoint. */
+#define VMWATCH_TRIGGER_READ		0x1
+#define VMWATCH_TRIGGER_WRITE		0x2
+#define VMWATCH_TRIGGER_EXECUTE		0x4
+
+/* Maximum amount of watchpoints active at once, and of pages each can span. */
+#define VMWATCH_MAX_WATCHES			16
+#define VMWATCH_MAX_PAGES			16
+
+/* Amount of events buffered per logical processor before the oldest are overwritten. */
+#define VMWATCH_RING_SIZE			256
+
+/* Most watched pages a single instruction can touch, its code and both operands
+ * of a string instruction, each of them crossing a page boundary. */
+#define VMWATCH_MAX_STEPS			8
+
+/******************** Public Typedefs ********************/
+
+/* Record of accesses to a watched range, consecutive hits from the
+ * same instruction are coalesced into a single record. */
+typedef struct _VMWATCH_EVENT
+{
+	UINT32 watchId;
+	UINT32 processorIndex;
+
+	/* Instruction that caused the access, and the access type (VMWATCH_TRIGGER_*). */
+	UINT64 guestRIP;
+	UINT32 accessType;
+
+	/* Amount of times the access was coalesced into this record. */
+	UINT32 hitCount;
+
+	/* Addresses of the latest access. */
+	UINT64 guestPA;
+	UINT64 guestLA;
+
+	/* Value at the address after the latest write (up to 8 bytes). */
+	UINT64 value;
+
+	/* TSC of the first and latest access. */
+	UINT64 firstTSC;
+	UINT64 lastTSC;
+} VMWATCH_EVENT, *PVMWATCH_EVENT;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS VMWatch_init(PVMM_DATA lpData);
+
+NTSTATUS VMWatch_add(
+	PHYSICAL_ADDRESS start,
+	SIZE_T size,
+	UINT32 triggers,
+	UINT64 filterMask,
+	UINT64 filterValue,
+	PUINT32 watchId
+);
+
+NTSTATUS VMWatch_remove(UINT32 watchId);
+
+NTSTATUS VMWatch_drain(
+	PVMWATCH_EVENT events,
+	ULONG capacity,
+	PULONG eventCount,
+	PULONG droppedCount
+);
\ No newline at end of file
@@ -0,0 +1,588 @@
+/*
+ * Differential fuzzer and benchmark for the instruction length decoder (Decoder.c).
+ *
+ * Random instructions are built from legacy prefixes, REX, VEX and every opcode map,
+ * then decoded both by Decoder_decode and by a reference disassembler (GNU objdump, with
+ * Intel 64 semantics). The decoder must agree on the length of every instruction the
+ * reference accepts, any mismatch fails the run. Either side may reject more encodings
+ * than the other (objdump accepts VEX after REX or a 66/F0/F2/F3 prefix, which raises #UD,
+ * and the decoder accepts any opcode of the 0F 38/0F 3A maps), these are listed with -v.
+ *
+ * The benchmark decodes the given raw code (e.g. an extracted .text section) linearly,
+ * or generated instructions when no file is given.
+ *
+ * Portable C99, build with:
+ *		cc -std=c99 -O2 -o decoderfuzz DecoderFuzz.c ../../Hypervisor/Decoder.c
+ *
+ * Usage:
+ *		decoderfuzz [-n count] [-s seed] [-x objdump] [-v]
+ *		decoderfuzz -b [-n count] [-s seed] [file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "../../Hypervisor/Decoder.h"
+
+/******************** Module Typedefs ********************/
+
+typedef struct _REFERENCE_RESULT
+{
+	int length;
+	int valid;
+} REFERENCE_RESULT, *PREFERENCE_RESULT;
+
+typedef struct _FUZZ_SUMMARY
+{
+	uint64_t agreed;
+	uint64_t lengthMismatches;
+	uint64_t rejectedByDecoder;
+	uint64_t rejectedByReference;
+	uint64_t rejectedByBoth;
+} FUZZ_SUMMARY, *PFUZZ_SUMMARY;
+
+/******************** Module Constants ********************/
+
+/* Each candidate sits in its own slot, padded with NOPs so the reference disassembler
+ * is back in step at the start of the next slot whatever it made of the candidate. */
+#define SLOT_SIZE			32
+
+#define DEFAULT_COUNT		200000
+#define DEFAULT_BENCH_COUNT	2000000
+#define MAX_LISTED			20
+
+#define INPUT_FILE			"decoderfuzz.bin"
+#define OUTPUT_FILE			"decoderfuzz.txt"
+
+static const uint8_t LEGACY_PREFIXES[] = { 0x66, 0x67, 0xF0, 0xF2, 0xF3, 0x2E, 0x36, 0x3E, 0x26, 0x64, 0x65 };
+
+/******************** Module Variables ********************/
+
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+
+/******************** Module Prototypes ********************/
+static int runFuzz(uint32_t count, const char* objdump, int verbose);
+static int runBenchmark(uint32_t count, const char* path);
+static void generateInstruction(uint8_t* slot);
+static int compareDecoder(const uint8_t* slots, const REFERENCE_RESULT* references, uint32_t count, int verbose);
+static int runReference(const char* objdump, const uint8_t* slots, uint32_t count, PREFERENCE_RESULT results);
+static int parseReference(uint32_t count, PREFERENCE_RESULT results);
+static int isPrefixOrWait(uint8_t value);
+static int isPrefixOnly(const char* mnemonic);
+static void printBytes(const char* label, const uint8_t* bytes, int length);
+static uint32_t nextRandom(void);
+static double getSeconds(void);
+
+/******************** Public Code ********************/
+
+int main(int argc, char* argv[])
+{
+	uint32_t count = 0;
+	const char* objdump = "objdump";
+	const char* path = NULL;
+	int benchmark = 0;
+	int verbose = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((0 == strcmp(argv[i], "-n")) && ((i + 1) < argc))
+		{
+			count = (uint32_t)strtoul(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-s")) && ((i + 1) < argc))
+		{
+			randomState = strtoull(argv[++i], NULL, 0) | 1;
+		}
+		else if ((0 == strcmp(argv[i], "-x")) && ((i + 1) < argc))
+		{
+			objdump = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "-b"))
+		{
+			benchmark = 1;
+		}
+		else if (0 == strcmp(argv[i], "-v"))
+		{
+			verbose = 1;
+		}
+		else if ((1 == benchmark) && ('-' != argv[i][0]))
+		{
+			path = argv[i];
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-n count] [-s seed] [-x objdump] [-v]\n", argv[0]);
+			fprintf(stderr, "       %s -b [-n count] [-s seed] [file]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (1 == benchmark)
+	{
+		return runBenchmark((0 != count) ? count : DEFAULT_BENCH_COUNT, path);
+	}
+
+	return runFuzz((0 != count) ? count : DEFAULT_COUNT, objdump, verbose);
+}
+
+/******************** Module Code ********************/
+
+static int runFuzz(uint32_t count, const char* objdump, int verbose)
+{
+	int result = 1;
+
+	uint8_t* slots = malloc((size_t)count * SLOT_SIZE);
+	PREFERENCE_RESULT references = calloc(count, sizeof(REFERENCE_RESULT));
+
+	if ((NULL == slots) || (NULL == references))
+	{
+		fprintf(stderr, "out of memory\n");
+	}
+	else
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			generateInstruction(&slots[(size_t)i * SLOT_SIZE]);
+		}
+
+		if (0 == runReference(objdump, slots, count, references))
+		{
+			result = compareDecoder(slots, references, count, verbose);
+		}
+	}
+
+	free(references);
+	free(slots);
+
+	return result;
+}
+
+static int compareDecoder(const uint8_t* slots, const REFERENCE_RESULT* references, uint32_t count, int verbose)
+{
+	/* Returns 0 when the decoder and the reference agree on the length of every valid instruction. */
+	FUZZ_SUMMARY summary = { 0 };
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint8_t* candidate = &slots[(size_t)i * SLOT_SIZE];
+		const REFERENCE_RESULT* reference = &references[i];
+
+		INSTRUCTION_LAYOUT layout;
+		int valid = NT_SUCCESS(Decoder_decode(candidate, DECODER_MAX_INSTRUCTION_LENGTH, &layout));
+
+		if ((0 == valid) && (0 == reference->valid))
+		{
+			summary.rejectedByBoth++;
+		}
+		else if (0 == valid)
+		{
+			summary.rejectedByDecoder++;
+
+			if (0 != verbose)
+			{
+				printBytes("rejected by decoder:  ", candidate, reference->length);
+			}
+		}
+		else if (0 == reference->valid)
+		{
+			summary.rejectedByReference++;
+
+			if (0 != verbose)
+			{
+				printBytes("rejected by reference:", candidate, (int)layout.length);
+			}
+		}
+		else if ((int)layout.length != reference->length)
+		{
+			if (summary.lengthMismatches < MAX_LISTED)
+			{
+				printf("length %2" PRIu32 ", reference %2d: ", layout.length, reference->length);
+				printBytes("", candidate, DECODER_MAX_INSTRUCTION_LENGTH);
+			}
+
+			summary.lengthMismatches++;
+		}
+		else
+		{
+			summary.agreed++;
+		}
+	}
+
+	printf("\n%" PRIu32 " instructions\n", count);
+	printf("  Same length:            %" PRIu64 "\n", summary.agreed);
+	printf("  Length mismatches:      %" PRIu64 "\n", summary.lengthMismatches);
+	printf("  Rejected by both:       %" PRIu64 "\n", summary.rejectedByBoth);
+	printf("  Rejected by decoder:    %" PRIu64 "\n", summary.rejectedByDecoder);
+	printf("  Rejected by reference:  %" PRIu64 "\n", summary.rejectedByReference);
+
+	return (0 == summary.lengthMismatches) ? 0 : 1;
+}
+
+static int runBenchmark(uint32_t count, const char* path)
+{
+	/* Decodes either the given raw code linearly, or the first instruction of each generated slot. */
+	uint8_t* code = NULL;
+	size_t codeSize = 0;
+	size_t slotSize = 0;
+
+	if (NULL != path)
+	{
+		FILE* file = fopen(path, "rb");
+		if (NULL == file)
+		{
+			perror(path);
+			return 1;
+		}
+
+		fseek(file, 0, SEEK_END);
+		long fileSize = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		code = (fileSize > 0) ? malloc((size_t)fileSize + DECODER_MAX_INSTRUCTION_LENGTH) : NULL;
+		if ((NULL == code) || ((size_t)fileSize != fread(code, 1, (size_t)fileSize, file)))
+		{
+			fprintf(stderr, "%s: cannot read\n", path);
+			fclose(file);
+			free(code);
+			return 1;
+		}
+
+		fclose(file);
+		codeSize = (size_t)fileSize;
+	}
+	else
+	{
+		code = malloc((size_t)count * SLOT_SIZE);
+		if (NULL == code)
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			generateInstruction(&code[(size_t)i * SLOT_SIZE]);
+		}
+
+		codeSize = (size_t)count * SLOT_SIZE;
+		slotSize = SLOT_SIZE;
+	}
+
+	/* Undecodable bytes are stepped over one at a time, as a scan for branches would. */
+	uint64_t decoded = 0;
+	uint64_t totalLength = 0;
+	size_t offset = 0;
+
+	double start = getSeconds();
+
+	while (offset < codeSize)
+	{
+		size_t available = codeSize - offset;
+
+		INSTRUCTION_LAYOUT layout;
+		if (NT_SUCCESS(Decoder_decode(&code[offset], (ULONG)min(available, (size_t)DECODER_MAX_INSTRUCTION_LENGTH), &layout)))
+		{
+			offset += (0 != slotSize) ? slotSize : layout.length;
+			totalLength += layout.length;
+		}
+		else
+		{
+			offset += (0 != slotSize) ? slotSize : 1;
+		}
+
+		decoded++;
+	}
+
+	double elapsed = getSeconds() - start;
+
+	printf("%" PRIu64 " instructions in %.3f ms\n", decoded, elapsed * 1e3);
+	printf("  %.2f ns per instruction, %.1f MB/s decoded, average length %.2f\n",
+		(elapsed * 1e9) / (double)decoded, ((double)totalLength / (1 << 20)) / elapsed,
+		(double)totalLength / (double)decoded);
+
+	free(code);
+	return 0;
+}
+
+static void generateInstruction(uint8_t* slot)
+{
+	/* Builds a random instruction at the start of the slot, followed by random bytes for the
+	 * operands (at most 15 bytes in total) and NOPs to the end of the slot. */
+	int offset = 0;
+
+	memset(slot, 0x90, SLOT_SIZE);
+
+	uint32_t prefixCount = nextRandom() % 3;
+	for (uint32_t i = 0; i < prefixCount; i++)
+	{
+		slot[offset++] = LEGACY_PREFIXES[nextRandom() % sizeof(LEGACY_PREFIXES)];
+	}
+
+	if (0 == (nextRandom() % 2))
+	{
+		slot[offset++] = 0x40 | (nextRandom() & 0x0F);
+	}
+
+	/* Map of the opcode, as in Decoder.h. */
+	int opcodeMap = OPCODE_MAP_ONE_BYTE;
+
+	switch (nextRandom() % 8)
+	{
+	case 0:
+		slot[offset++] = 0x0F;
+		slot[offset++] = 0x38;
+		opcodeMap = OPCODE_MAP_0F38;
+		break;
+
+	case 1:
+		slot[offset++] = 0x0F;
+		slot[offset++] = 0x3A;
+		opcodeMap = OPCODE_MAP_0F3A;
+		break;
+
+	case 2:
+	case 3:
+		slot[offset++] = 0x0F;
+		opcodeMap = OPCODE_MAP_0F;
+		break;
+
+	case 4:
+		/* Two or three byte VEX, with the inverted register fields set as valid
+		 * encodings usually have them. */
+		if (0 == (nextRandom() % 2))
+		{
+			slot[offset++] = 0xC5;
+			slot[offset++] = 0xF8 | (nextRandom() & 0x87);
+		}
+		else
+		{
+			slot[offset++] = 0xC4;
+			slot[offset++] = 0xE0 | (1 + (nextRandom() % 3));
+			slot[offset++] = 0x78 | (nextRandom() & 0x87);
+		}
+		opcodeMap = -1;
+		break;
+
+	default:
+		break;
+	}
+
+	int opcodeOffset = offset;
+
+	while (offset < DECODER_MAX_INSTRUCTION_LENGTH)
+	{
+		slot[offset++] = (uint8_t)nextRandom();
+	}
+
+	/* objdump ends an instruction at a prefix that follows REX and drops the prefixes before it,
+	 * and joins FWAIT to the x87 instruction after it, the processor does neither. 0F 78/79 are
+	 * VMREAD/VMWRITE on Intel but objdump decodes them as AMD's SSE4a after a 66 or F2 prefix. */
+	while (((OPCODE_MAP_ONE_BYTE == opcodeMap) && (0 != isPrefixOrWait(slot[opcodeOffset]))) ||
+		   ((OPCODE_MAP_0F == opcodeMap) && (0x78 == (slot[opcodeOffset] & 0xFE))))
+	{
+		slot[opcodeOffset] = (uint8_t)nextRandom();
+	}
+}
+
+static int runReference(const char* objdump, const uint8_t* slots, uint32_t count, PREFERENCE_RESULT results)
+{
+	/* Disassembles the slots with objdump, keeping what it made of the first instruction of each. */
+	int result = -1;
+
+	FILE* input = fopen(INPUT_FILE, "wb");
+	if (NULL == input)
+	{
+		perror(INPUT_FILE);
+	}
+	else
+	{
+		size_t written = fwrite(slots, SLOT_SIZE, count, input);
+		fclose(input);
+
+		char command[512];
+		snprintf(command, sizeof(command), "%s -D -b binary -m i386:x86-64 -M intel64 --insn-width=16 %s > %s",
+			objdump, INPUT_FILE, OUTPUT_FILE);
+
+		if (count != written)
+		{
+			perror(INPUT_FILE);
+		}
+		else if (0 != system(command))
+		{
+			fprintf(stderr, "reference disassembler failed: %s\n", command);
+		}
+		else
+		{
+			result = parseReference(count, results);
+		}
+	}
+
+	remove(INPUT_FILE);
+	remove(OUTPUT_FILE);
+
+	return result;
+}
+
+static int parseReference(uint32_t count, PREFERENCE_RESULT results)
+{
+	FILE* output = fopen(OUTPUT_FILE, "r");
+	if (NULL == output)
+	{
+		perror(OUTPUT_FILE);
+		return -1;
+	}
+
+	char line[512];
+	uint32_t found = 0;
+
+	/* Prefixes that have no effect on the instruction are listed on their own line
+	 * ("rex.W", "fs", "data16"...), the lines are joined until the instruction itself. */
+	PREFERENCE_RESULT pending = NULL;
+	unsigned long nextAddress = 0;
+
+	while (NULL != fgets(line, sizeof(line), output))
+	{
+		/* "   40:\t48 89 c8 <padding>\tmov    %rcx,%rax" */
+		char* cursor;
+		unsigned long address = strtoul(line, &cursor, 16);
+
+		if ((cursor == line) || (':' != cursor[0]) || ('\t' != cursor[1]))
+		{
+			continue;
+		}
+
+		if ((0 == (address % SLOT_SIZE)) && ((address / SLOT_SIZE) < count))
+		{
+			pending = &results[address / SLOT_SIZE];
+			found++;
+		}
+		else if (address != nextAddress)
+		{
+			pending = NULL;
+		}
+
+		if (NULL == pending)
+		{
+			continue;
+		}
+
+		cursor += 2;
+
+		char* mnemonic = strchr(cursor, '\t');
+		int length = 0;
+
+		while ((NULL != mnemonic) && (cursor < mnemonic))
+		{
+			char* next;
+			strtoul(cursor, &next, 16);
+
+			if (next == cursor)
+			{
+				break;
+			}
+
+			length++;
+			cursor = next;
+			while (' ' == *cursor)
+			{
+				cursor++;
+			}
+		}
+
+		pending->length += length;
+		pending->valid = (NULL != mnemonic) && (NULL == strstr(mnemonic, "(bad)"));
+		nextAddress = address + length;
+
+		if ((NULL == mnemonic) || (0 == isPrefixOnly(mnemonic + 1)))
+		{
+			pending = NULL;
+		}
+	}
+
+	fclose(output);
+
+	if (found != count)
+	{
+		fprintf(stderr, "reference disassembler lost step, %" PRIu32 " of %" PRIu32 " slots\n", found, count);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int isPrefixOrWait(uint8_t value)
+{
+	int result = (0x40 == (value & 0xF0)) || (0x9B == value);
+
+	for (size_t i = 0; i < sizeof(LEGACY_PREFIXES); i++)
+	{
+		result |= (LEGACY_PREFIXES[i] == value);
+	}
+
+	return result;
+}
+
+static int isPrefixOnly(const char* mnemonic)
+{
+	/* A line such as "repnz gs rex.WRXB", only made of prefix names. */
+	static const char* PREFIX_NAMES[] = { "rex", "data16", "addr32", "lock", "repz", "repnz", "cs", "ss", "ds", "es", "fs", "gs" };
+
+	int result = 0;
+
+	while (('\0' != *mnemonic) && ('\n' != *mnemonic))
+	{
+		size_t tokenLength = strcspn(mnemonic, " \n");
+		size_t nameLength = strcspn(mnemonic, ". \n");
+		int known = 0;
+
+		for (size_t i = 0; i < (sizeof(PREFIX_NAMES) / sizeof(PREFIX_NAMES[0])); i++)
+		{
+			if ((nameLength == strlen(PREFIX_NAMES[i])) && (0 == strncmp(mnemonic, PREFIX_NAMES[i], nameLength)))
+			{
+				known = 1;
+			}
+		}
+
+		if (0 == known)
+		{
+			return 0;
+		}
+
+		result = 1;
+		mnemonic += tokenLength;
+		while (' ' == *mnemonic)
+		{
+			mnemonic++;
+		}
+	}
+
+	return result;
+}
+
+static void printBytes(const char* label, const uint8_t* bytes, int length)
+{
+	printf("%s", label);
+
+	for (int i = 0; i < length; i++)
+	{
+		printf(" %02X", bytes[i]);
+	}
+
+	printf("\n");
+}
+
+static uint32_t nextRandom(void)
+{
+	/* xorshift64*, the same seed always gives the same instructions. */
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	return (uint32_t)((randomState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static double getSeconds(void)
+{
+	/* Processor time, precise enough for the millions of instructions decoded per run. */
+	return (double)clock() / (double)CLOCKS_PER_SEC;
+}
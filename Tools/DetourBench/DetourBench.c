@@ -0,0 +1,283 @@
+/*
+ * Microbenchmark of the detours a hook can place on a function, measured per hooked call.
+ *
+ * Each variant is a caller that CALLs the detour, which reaches a handler returning 1,
+ * so the cost of the handler's and the caller's returns is included. The PUSH/RET form
+ * is the one VMHook used before Relocate_writeJump, its RET has no matching CALL and
+ * leaves the return stack buffer out of step with every return that follows.
+ *
+ * Portable C99 (x64 only), build with:
+ *		cc -std=c99 -O2 -o detourbench DetourBench.c
+ *
+ * Usage:
+ *		detourbench [-n iterations] [-r rounds]
+ */
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+/******************** Module Typedefs ********************/
+
+typedef int (*GENERATED_CALLER)(void);
+
+typedef struct _DETOUR_VARIANT
+{
+	const char* name;
+	size_t (*writeDetour)(uint8_t* buffer, uint8_t* handler);
+} DETOUR_VARIANT, *PDETOUR_VARIANT;
+
+/******************** Module Constants ********************/
+
+#define VARIANT_PAGE_SIZE	0x1000
+
+/* Offsets of the caller, the detour and the handler within the page of a variant. */
+#define CALLER_OFFSET		0x00
+#define DETOUR_OFFSET		0x40
+#define HANDLER_OFFSET		0x80
+
+#define DEFAULT_ITERATIONS	50000000ULL
+#define DEFAULT_ROUNDS		5
+
+/******************** Module Prototypes ********************/
+static size_t writeDirect(uint8_t* buffer, uint8_t* handler);
+static size_t writePushRet(uint8_t* buffer, uint8_t* handler);
+static size_t writeJumpRel32(uint8_t* buffer, uint8_t* handler);
+static size_t writeJumpRIP(uint8_t* buffer, uint8_t* handler);
+static uint8_t* allocateExecutable(size_t size);
+static void buildVariant(uint8_t* page, const DETOUR_VARIANT* variant);
+static double measure(GENERATED_CALLER caller, uint64_t iterations, int rounds);
+static double getSeconds(void);
+
+/******************** Module Variables ********************/
+
+static const DETOUR_VARIANT VARIANTS[] =
+{
+	{ "direct call (no detour)",	writeDirect },
+	{ "push/mov/xchg/ret",		writePushRet },
+	{ "jmp rel32",				writeJumpRel32 },
+	{ "jmp [rip+0]",				writeJumpRIP },
+};
+
+#define VARIANT_COUNT (sizeof(VARIANTS) / sizeof(VARIANTS[0]))
+
+/******************** Public Code ********************/
+
+int main(int argc, char* argv[])
+{
+	uint64_t iterations = DEFAULT_ITERATIONS;
+	int rounds = DEFAULT_ROUNDS;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((0 == strcmp(argv[i], "-n")) && ((i + 1) < argc))
+		{
+			iterations = strtoull(argv[++i], NULL, 0);
+		}
+		else if ((0 == strcmp(argv[i], "-r")) && ((i + 1) < argc))
+		{
+			rounds = atoi(argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-n iterations] [-r rounds]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if ((0 == iterations) || (rounds <= 0))
+	{
+		fprintf(stderr, "iterations and rounds must be positive\n");
+		return 2;
+	}
+
+	uint8_t* pages = allocateExecutable(VARIANT_COUNT * VARIANT_PAGE_SIZE);
+	if (NULL == pages)
+	{
+		fprintf(stderr, "cannot allocate executable memory\n");
+		return 1;
+	}
+
+	printf("%" PRIu64 " calls per round, best of %d rounds\n\n", iterations, rounds);
+	printf("  %-26s %10s %12s\n", "Detour", "ns/call", "vs direct");
+
+	double baseline = 0.0;
+
+	for (size_t i = 0; i < VARIANT_COUNT; i++)
+	{
+		uint8_t* page = pages + (i * VARIANT_PAGE_SIZE);
+		buildVariant(page, &VARIANTS[i]);
+
+		/* Object to function pointer conversion, fine on every x64 ABI. */
+		GENERATED_CALLER caller;
+		uint8_t* entry = page + CALLER_OFFSET;
+		memcpy(&caller, &entry, sizeof(caller));
+
+		if (1 != caller())
+		{
+			fprintf(stderr, "%s: handler not reached\n", VARIANTS[i].name);
+			return 1;
+		}
+
+		double nsPerCall = measure(caller, iterations, rounds);
+		if (0 == i)
+		{
+			baseline = nsPerCall;
+		}
+
+		printf("  %-26s %10.2f %+11.2f\n", VARIANTS[i].name, nsPerCall, nsPerCall - baseline);
+	}
+
+	return 0;
+}
+
+/******************** Module Code ********************/
+
+static size_t writeDirect(uint8_t* buffer, uint8_t* handler)
+{
+	/* No detour, the caller is pointed straight at the handler. */
+	(void)buffer;
+	(void)handler;
+	return 0;
+}
+
+static size_t writePushRet(uint8_t* buffer, uint8_t* handler)
+{
+	/* PUSH RAX; MOV RAX, imm64; XCHG [RSP], RAX; RET */
+	uint64_t target = (uint64_t)(uintptr_t)handler;
+
+	buffer[0] = 0x50;
+	buffer[1] = 0x48;
+	buffer[2] = 0xB8;
+	memcpy(&buffer[3], &target, sizeof(target));
+	buffer[11] = 0x48;
+	buffer[12] = 0x87;
+	buffer[13] = 0x04;
+	buffer[14] = 0x24;
+	buffer[15] = 0xC3;
+
+	return 16;
+}
+
+static size_t writeJumpRel32(uint8_t* buffer, uint8_t* handler)
+{
+	/* JMP rel32, as written by Relocate_writeJump when the handler is within 2GB. */
+	int32_t displacement = (int32_t)(handler - (buffer + 5));
+
+	buffer[0] = 0xE9;
+	memcpy(&buffer[1], &displacement, sizeof(displacement));
+
+	return 5;
+}
+
+static size_t writeJumpRIP(uint8_t* buffer, uint8_t* handler)
+{
+	/* JMP QWORD PTR [RIP+0]; DQ handler, as written by Relocate_writeJump otherwise. */
+	uint64_t target = (uint64_t)(uintptr_t)handler;
+	int32_t displacement = 0;
+
+	buffer[0] = 0xFF;
+	buffer[1] = 0x25;
+	memcpy(&buffer[2], &displacement, sizeof(displacement));
+	memcpy(&buffer[6], &target, sizeof(target));
+
+	return 14;
+}
+
+static uint8_t* allocateExecutable(size_t size)
+{
+	uint8_t* memory;
+
+#if defined(_WIN32)
+	memory = (uint8_t*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	memory = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void*)memory)
+	{
+		memory = NULL;
+	}
+#endif
+
+	return memory;
+}
+
+static void buildVariant(uint8_t* page, const DETOUR_VARIANT* variant)
+{
+	uint8_t* caller = page + CALLER_OFFSET;
+	uint8_t* detour = page + DETOUR_OFFSET;
+	uint8_t* handler = page + HANDLER_OFFSET;
+
+	memset(page, 0xCC, VARIANT_PAGE_SIZE);
+
+	/* Handler: MOV EAX, 1; RET */
+	handler[0] = 0xB8;
+	handler[1] = 0x01;
+	handler[2] = 0x00;
+	handler[3] = 0x00;
+	handler[4] = 0x00;
+	handler[5] = 0xC3;
+
+	/* Caller: CALL detour (or the handler when there is none); RET */
+	uint8_t* callTarget = (0 != variant->writeDetour(detour, handler)) ? detour : handler;
+	int32_t displacement = (int32_t)(callTarget - (caller + 5));
+
+	caller[0] = 0xE8;
+	memcpy(&caller[1], &displacement, sizeof(displacement));
+	caller[5] = 0xC3;
+}
+
+static double measure(GENERATED_CALLER caller, uint64_t iterations, int rounds)
+{
+	/* Returns the best time of a call across the rounds, in nanoseconds. */
+	double best = 0.0;
+
+	for (int round = 0; round < rounds; round++)
+	{
+		uint64_t reached = 0;
+		double start = getSeconds();
+
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			reached += (uint64_t)caller();
+		}
+
+		double elapsed = getSeconds() - start;
+
+		if (reached != iterations)
+		{
+			fprintf(stderr, "handler reached %" PRIu64 " of %" PRIu64 " times\n", reached, iterations);
+			exit(1);
+		}
+
+		double nsPerCall = (elapsed * 1e9) / (double)iterations;
+		if ((0 == round) || (nsPerCall < best))
+		{
+			best = nsPerCall;
+		}
+	}
+
+	return best;
+}
+
+static double getSeconds(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + ((double)now.tv_nsec / 1e9);
+#endif
+}
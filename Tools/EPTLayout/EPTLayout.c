@@ -0,0 +1,232 @@
+/*
+ * Offline analyzer for EPT layouts exported with VMCALL_ACTION_EXPORT_EPT.
+ *
+ * Portable C99, build with:
+ *		cc -std=c99 -O2 -o eptlayout EPTLayout.c
+ *
+ * Usage:
+ *		eptlayout [-v] <layout file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "../../Hypervisor/EPTLayout_Common.h"
+
+/******************** Module Typedefs ********************/
+
+typedef struct _LAYOUT_SUMMARY
+{
+	UINT64 bytes2MB;
+	UINT64 bytes4KB;
+	UINT64 splitRegions;
+	UINT64 uncachedBytes;
+	UINT64 uncachedRuns;
+	UINT64 shadowedPages;
+	UINT64 overriddenPages;
+	UINT64 veEnabledPages;
+} LAYOUT_SUMMARY, *PLAYOUT_SUMMARY;
+
+/******************** Module Constants ********************/
+
+#define SIZE_4KB	0x1000ULL
+#define SIZE_2MB	0x200000ULL
+
+#define MEMORY_TYPE_UNCACHEABLE		0
+
+static const char* MEMORY_TYPE_NAMES[8] = { "UC", "WC", "??", "??", "WT", "WP", "WB", "UC-" };
+
+/******************** Module Prototypes ********************/
+static int readLayout(const char* path, PEPT_LAYOUT_HEADER header, PEPT_LAYOUT_RECORD* records);
+static void summarise(const EPT_LAYOUT_RECORD* records, UINT32 recordCount, PLAYOUT_SUMMARY summary, int verbose);
+static void printPermissions(UINT8 permissions, char* out);
+
+/******************** Public Code ********************/
+
+int main(int argc, char* argv[])
+{
+	int verbose = 0;
+	const char* path = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (0 == strcmp(argv[i], "-v"))
+		{
+			verbose = 1;
+		}
+		else
+		{
+			path = argv[i];
+		}
+	}
+
+	if (NULL == path)
+	{
+		fprintf(stderr, "usage: %s [-v] <layout file>\n", argv[0]);
+		return 2;
+	}
+
+	EPT_LAYOUT_HEADER header;
+	PEPT_LAYOUT_RECORD records = NULL;
+	if (0 != readLayout(path, &header, &records))
+	{
+		return 1;
+	}
+
+	printf("EPT layout of processor %" PRIu32 " (EPTP 0x%016" PRIX64 "), %" PRIu32 " records\n\n",
+		header.processorIndex, header.eptPointer, header.recordCount);
+
+	LAYOUT_SUMMARY summary = { 0 };
+	summarise(records, header.recordCount, &summary, verbose);
+
+	UINT64 totalBytes = summary.bytes2MB + summary.bytes4KB;
+	double coverage = (0 != totalBytes) ? (100.0 * (double)summary.bytes2MB / (double)totalBytes) : 0.0;
+
+	printf("\nSummary\n");
+	printf("  Mapped:               %" PRIu64 " MB\n", totalBytes >> 20);
+	printf("  Large page coverage:  %.2f%% (%" PRIu64 " MB in 2MB pages, %" PRIu64 " MB in 4KB pages)\n",
+		coverage, summary.bytes2MB >> 20, summary.bytes4KB >> 20);
+	printf("  Split 2MB regions:    %" PRIu64 "\n", summary.splitRegions);
+	printf("  UC regions:           %" PRIu64 " (%" PRIu64 " MB)\n", summary.uncachedRuns, summary.uncachedBytes >> 20);
+	printf("  Shadowed pages:       %" PRIu64 "\n", summary.shadowedPages);
+	printf("  Permission overrides: %" PRIu64 " pages\n", summary.overriddenPages);
+	printf("  #VE enabled pages:    %" PRIu64 "\n", summary.veEnabledPages);
+
+	free(records);
+	return 0;
+}
+
+/******************** Module Code ********************/
+
+static int readLayout(const char* path, PEPT_LAYOUT_HEADER header, PEPT_LAYOUT_RECORD* records)
+{
+	FILE* file = fopen(path, "rb");
+	if (NULL == file)
+	{
+		perror(path);
+		return -1;
+	}
+
+	int result = -1;
+
+	if (1 != fread(header, sizeof(*header), 1, file))
+	{
+		fprintf(stderr, "%s: truncated header\n", path);
+	}
+	else if ((EPT_LAYOUT_MAGIC != header->magic) || (EPT_LAYOUT_VERSION != header->version))
+	{
+		fprintf(stderr, "%s: not an EPT layout (magic 0x%08" PRIX32 ", version %" PRIu32 ")\n",
+			path, header->magic, header->version);
+	}
+	else
+	{
+		*records = calloc((header->recordCount != 0) ? header->recordCount : 1, sizeof(EPT_LAYOUT_RECORD));
+		if (NULL == *records)
+		{
+			fprintf(stderr, "%s: out of memory\n", path);
+		}
+		else if (header->recordCount != fread(*records, sizeof(EPT_LAYOUT_RECORD), header->recordCount, file))
+		{
+			fprintf(stderr, "%s: truncated records\n", path);
+			free(*records);
+			*records = NULL;
+		}
+		else
+		{
+			result = 0;
+		}
+	}
+
+	fclose(file);
+	return result;
+}
+
+static void summarise(const EPT_LAYOUT_RECORD* records, UINT32 recordCount, PLAYOUT_SUMMARY summary, int verbose)
+{
+	/* End of the previous UC run, so adjacent UC runs of different sizes count as one region. */
+	UINT64 uncachedEnd = UINT64_MAX;
+
+	for (UINT32 i = 0; i < recordCount; i++)
+	{
+		const EPT_LAYOUT_RECORD* record = &records[i];
+
+		if (EPT_LAYOUT_SPLIT_2MB == record->pageSize)
+		{
+			summary->splitRegions += record->pageCount;
+
+			if (verbose)
+			{
+				printf("  %016" PRIX64 " split   x%-6" PRIu32 "\n", record->guestPA, record->pageCount);
+			}
+			continue;
+		}
+
+		UINT64 pageSize = (EPT_LAYOUT_PAGE_2MB == record->pageSize) ? SIZE_2MB : SIZE_4KB;
+		UINT64 runBytes = pageSize * record->pageCount;
+
+		if (EPT_LAYOUT_PAGE_2MB == record->pageSize)
+		{
+			summary->bytes2MB += runBytes;
+		}
+		else
+		{
+			summary->bytes4KB += runBytes;
+		}
+
+		if (MEMORY_TYPE_UNCACHEABLE == record->memoryType)
+		{
+			if (uncachedEnd != record->guestPA)
+			{
+				summary->uncachedRuns++;
+			}
+			summary->uncachedBytes += runBytes;
+			uncachedEnd = record->guestPA + runBytes;
+		}
+
+		/* Only 4KB entries are remapped or have their permissions changed at runtime. */
+		UINT64 pages = (EPT_LAYOUT_PAGE_2MB == record->pageSize) ? (runBytes / SIZE_4KB) : record->pageCount;
+
+		if (record->hostPA != record->guestPA)
+		{
+			summary->shadowedPages += pages;
+		}
+
+		if ((EPT_LAYOUT_READ | EPT_LAYOUT_WRITE | EPT_LAYOUT_EXECUTE) != record->permissions)
+		{
+			summary->overriddenPages += pages;
+		}
+
+		if (0 == (record->flags & EPT_LAYOUT_FLAG_SUPPRESS_VE))
+		{
+			summary->veEnabledPages += pages;
+		}
+
+		if (verbose)
+		{
+			char permissions[4];
+			printPermissions(record->permissions, permissions);
+
+			printf("  %016" PRIX64 " %s x%-6" PRIu32 " %s %-3s%s",
+				record->guestPA,
+				(EPT_LAYOUT_PAGE_2MB == record->pageSize) ? "2MB   " : "4KB   ",
+				record->pageCount,
+				permissions,
+				MEMORY_TYPE_NAMES[record->memoryType & 7],
+				(record->flags & EPT_LAYOUT_FLAG_SUPPRESS_VE) ? "" : " #VE");
+
+			if (record->hostPA != record->guestPA)
+			{
+				printf(" -> %016" PRIX64, record->hostPA);
+			}
+			printf("\n");
+		}
+	}
+}
+
+static void printPermissions(UINT8 permissions, char* out)
+{
+	out[0] = (permissions & EPT_LAYOUT_READ) ? 'R' : '-';
+	out[1] = (permissions & EPT_LAYOUT_WRITE) ? 'W' : '-';
+	out[2] = (permissions & EPT_LAYOUT_EXECUTE) ? 'X' : '-';
+	out[3] = '\0';
+}
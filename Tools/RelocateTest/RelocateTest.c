@@ -0,0 +1,372 @@
+/*
+ * Executes code relocated by the hook relocation engine (Relocate.c) in user mode.
+ *
+ * Every case is a small function whose first instructions are copied by Relocate_copyInstructions,
+ * followed by a jump back to the rest of the function as a hook trampoline is. The copy is made
+ * both within 2GB of the original (displacements adjusted) and further away (RIP-relative loads
+ * and branches rewritten to absolute forms), then called and its result checked. The branch
+ * target scan of Relocate_checkBranchTargets is checked on functions that loop into their prologue.
+ *
+ * Portable C99 (x64 only), build with:
+ *		cc -std=c99 -O2 -o relocatetest RelocateTest.c ../../Hypervisor/Relocate.c ../../Hypervisor/Decoder.c
+ *
+ * Usage:
+ *		relocatetest [-v]
+ */
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#else
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "../../Hypervisor/Relocate.h"
+
+/******************** Module Typedefs ********************/
+
+typedef uint64_t (*TEST_FUNCTION)(void);
+
+typedef enum _EXPECTATION
+{
+	EXPECT_VALUE = 0,		/* The constant in the test. */
+	EXPECT_DATA,			/* The qword at DATA_OFFSET. */
+	EXPECT_DATA32,			/* The low dword of the qword at DATA_OFFSET. */
+	EXPECT_DATA_ADDRESS,	/* The address of DATA_OFFSET. */
+	EXPECT_DATA_ADDRESS32	/* The low dword of the address of DATA_OFFSET. */
+} EXPECTATION;
+
+typedef struct _RELOCATE_TEST
+{
+	const char* name;
+	uint8_t code[40];
+	size_t minimumSize;
+	EXPECTATION expectation;
+	uint64_t value;
+
+	/* Cannot be rewritten without a scratch register once out of reach. */
+	int nearOnly;
+} RELOCATE_TEST, *PRELOCATE_TEST;
+
+typedef struct _SCAN_TEST
+{
+	const char* name;
+	uint8_t code[16];
+	size_t overwrittenSize;
+	size_t scanSize;
+	NTSTATUS expected;
+} SCAN_TEST, *PSCAN_TEST;
+
+/******************** Module Constants ********************/
+
+/* Each case sits in its own slot of the source pages, its data at a fixed offset in the slot. */
+#define SLOT_SIZE			0x100
+#define DATA_OFFSET			0xF0
+#define DATA_VALUE			0x1122334455667788ULL
+
+#define REGION_SIZE			0x10000
+#define TRAMPOLINE_SIZE		0x80
+
+/* Far enough that no rel32 reaches, the far copy is skipped if no such memory can be had. */
+#define FAR_DISTANCE		(16ULL << 30)
+
+static const RELOCATE_TEST RELOCATE_TESTS[] =
+{
+	/* LEA RAX, [RIP+data]; RET */
+	{ "lea r64, [rip]",			{ 0x48, 0x8D, 0x05, 0xE9, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_DATA_ADDRESS, 0, 0 },
+
+	/* LEA EAX, [RIP+data]; RET */
+	{ "lea r32, [rip]",			{ 0x8D, 0x05, 0xEA, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_DATA_ADDRESS32, 0, 0 },
+
+	/* LEA R9D, [RIP+data]; MOV EAX, R9D; RET */
+	{ "lea r9d, [rip]",			{ 0x44, 0x8D, 0x0D, 0xE9, 0x00, 0x00, 0x00, 0x44, 0x89, 0xC8, 0xC3 }, 5, EXPECT_DATA_ADDRESS32, 0, 0 },
+
+	/* LEA R10, [RIP+data]; MOV RAX, R10; RET */
+	{ "lea r10, [rip]",			{ 0x4C, 0x8D, 0x15, 0xE9, 0x00, 0x00, 0x00, 0x4C, 0x89, 0xD0, 0xC3 }, 5, EXPECT_DATA_ADDRESS, 0, 0 },
+
+	/* MOV RAX, [RIP+data]; RET */
+	{ "mov r64, [rip]",			{ 0x48, 0x8B, 0x05, 0xE9, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_DATA, 0, 0 },
+
+	/* MOV EAX, [RIP+data]; RET */
+	{ "mov r32, [rip]",			{ 0x8B, 0x05, 0xEA, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_DATA32, 0, 0 },
+
+	/* MOV R11, [RIP+data]; MOV RAX, R11; RET */
+	{ "mov r11, [rip]",			{ 0x4C, 0x8B, 0x1D, 0xE9, 0x00, 0x00, 0x00, 0x4C, 0x89, 0xD8, 0xC3 }, 5, EXPECT_DATA, 0, 0 },
+
+	/* PUSH R12; MOV R12, [RIP+data]; MOV RAX, R12; POP R12; RET (SIB for the R12 base) */
+	{ "mov r12, [rip]",			{ 0x41, 0x54, 0x4C, 0x8B, 0x25, 0xE7, 0x00, 0x00, 0x00, 0x4C, 0x89, 0xE0, 0x41, 0x5C, 0xC3 }, 5, EXPECT_DATA, 0, 0 },
+
+	/* PUSH RBP; MOV RBP, [RIP+data]; MOV RAX, RBP; POP RBP; RET (disp8 for the RBP base) */
+	{ "mov rbp, [rip]",			{ 0x55, 0x48, 0x8B, 0x2D, 0xE8, 0x00, 0x00, 0x00, 0x48, 0x89, 0xE8, 0x5D, 0xC3 }, 5, EXPECT_DATA, 0, 0 },
+
+	/* PUSH R13; MOV R13, [RIP+data]; MOV RAX, R13; POP R13; RET (disp8 for the R13 base) */
+	{ "mov r13, [rip]",			{ 0x41, 0x55, 0x4C, 0x8B, 0x2D, 0xE7, 0x00, 0x00, 0x00, 0x4C, 0x89, 0xE8, 0x41, 0x5D, 0xC3 }, 5, EXPECT_DATA, 0, 0 },
+
+	/* XOR EAX, EAX; ADD RAX, [RIP+data]; RET */
+	{ "add r64, [rip]",			{ 0x31, 0xC0, 0x48, 0x03, 0x05, 0xE7, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_DATA, 0, 1 },
+
+	/* XOR EAX, EAX; CMP QWORD PTR [RIP+data], 0; SETNE AL; RET (immediate after the displacement) */
+	{ "cmp [rip], imm8",		{ 0x31, 0xC0, 0x48, 0x83, 0x3D, 0xE6, 0x00, 0x00, 0x00, 0x00, 0x0F, 0x95, 0xC0, 0xC3 }, 5, EXPECT_VALUE, 1, 1 },
+
+	/* XOR EAX, EAX; JZ +6; MOV EAX, 2; RET; MOV EAX, 1; RET */
+	{ "jcc rel8 taken",			{ 0x31, 0xC0, 0x74, 0x06, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_VALUE, 1, 0 },
+
+	/* XOR EAX, EAX; JNZ +6; MOV EAX, 2; RET; MOV EAX, 1; RET */
+	{ "jcc rel8 not taken",		{ 0x31, 0xC0, 0x75, 0x06, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_VALUE, 2, 0 },
+
+	/* XOR EAX, EAX; JZ rel32 +6; MOV EAX, 2; RET; MOV EAX, 1; RET */
+	{ "jcc rel32 taken",		{ 0x31, 0xC0, 0x0F, 0x84, 0x06, 0x00, 0x00, 0x00, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_VALUE, 1, 0 },
+
+	/* MOV ECX, 2; LOOP +6; MOV EAX, 2; RET; MOV EAX, 1; RET */
+	{ "loop taken",				{ 0xB9, 0x02, 0x00, 0x00, 0x00, 0xE2, 0x06, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 7, EXPECT_VALUE, 1, 0 },
+
+	/* MOV ECX, 1; LOOP +6; MOV EAX, 2; RET; MOV EAX, 1; RET */
+	{ "loop not taken",			{ 0xB9, 0x01, 0x00, 0x00, 0x00, 0xE2, 0x06, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 7, EXPECT_VALUE, 2, 0 },
+
+	/* XOR ECX, ECX; JRCXZ +6; MOV EAX, 2; RET; MOV EAX, 1; RET */
+	{ "jrcxz taken",			{ 0x31, 0xC9, 0xE3, 0x06, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 4, EXPECT_VALUE, 1, 0 },
+
+	/* MOV RCX, 1 << 32; JECXZ +6; MOV EAX, 2; RET; MOV EAX, 1; RET (the address size prefix is kept) */
+	{ "jecxz taken",			{ 0x48, 0xB9, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x67, 0xE3, 0x06, 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }, 13, EXPECT_VALUE, 1, 0 },
+
+	/* CALL +11; RET; INT3 x10; MOV EAX, 7; RET */
+	{ "call rel32",				{ 0xE8, 0x0B, 0x00, 0x00, 0x00, 0xC3, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xB8, 0x07, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_VALUE, 7, 0 },
+
+	/* JMP +11; INT3 x11; MOV EAX, 3; RET */
+	{ "jmp rel32",				{ 0xE9, 0x0B, 0x00, 0x00, 0x00, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xB8, 0x03, 0x00, 0x00, 0x00, 0xC3 }, 5, EXPECT_VALUE, 3, 0 },
+};
+
+#define RELOCATE_TEST_COUNT (sizeof(RELOCATE_TESTS) / sizeof(RELOCATE_TESTS[0]))
+
+static const SCAN_TEST SCAN_TESTS[] =
+{
+	/* XOR EAX, EAX; INC EAX; CMP EAX, 3; JNE -7 (into the INC); RET */
+	{ "branch into prologue",	{ 0x31, 0xC0, 0xFF, 0xC0, 0x83, 0xF8, 0x03, 0x75, 0xF9, 0xC3, 0xCC, 0xCC }, 5, 12, STATUS_NOT_CAPABLE },
+
+	/* The same, with the scan ending before the branch. */
+	{ "branch past scan size",	{ 0x31, 0xC0, 0xFF, 0xC0, 0x83, 0xF8, 0x03, 0x75, 0xF9, 0xC3, 0xCC, 0xCC }, 5, 7, STATUS_SUCCESS },
+
+	/* XOR EAX, EAX; INC EAX; CMP EAX, 3; JNE -9 (the first byte); RET */
+	{ "branch to function",		{ 0x31, 0xC0, 0xFF, 0xC0, 0x83, 0xF8, 0x03, 0x75, 0xF7, 0xC3, 0xCC, 0xCC }, 5, 12, STATUS_SUCCESS },
+
+	/* XOR EAX, EAX; JMP +0 (after the prologue); RET */
+	{ "branch after prologue",	{ 0x31, 0xC0, 0xEB, 0x03, 0x90, 0x90, 0x90, 0xC3, 0xCC, 0xCC }, 2, 10, STATUS_SUCCESS },
+};
+
+#define SCAN_TEST_COUNT (sizeof(SCAN_TESTS) / sizeof(SCAN_TESTS[0]))
+
+/******************** Module Prototypes ********************/
+static int runRelocateTest(const RELOCATE_TEST* test, uint8_t* source, uint8_t* destination, int verbose);
+static int runScanTest(const SCAN_TEST* test, uint8_t* source);
+static uint64_t getExpected(const RELOCATE_TEST* test, uint8_t* source);
+static uint64_t callCode(uint8_t* code);
+static uint8_t* allocateExecutable(uint8_t* hint, size_t size);
+
+/******************** Public Code ********************/
+
+int main(int argc, char* argv[])
+{
+	int verbose = ((2 == argc) && (0 == strcmp(argv[1], "-v")));
+	int failures = 0;
+
+	if ((1 != argc) && (0 == verbose))
+	{
+		fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+		return 2;
+	}
+
+	/* Sources in the first half of the region, near copies in the second. */
+	uint8_t* region = allocateExecutable(NULL, REGION_SIZE);
+	uint8_t* farRegion = NULL;
+
+	if (NULL == region)
+	{
+		fprintf(stderr, "cannot allocate executable memory\n");
+		return 1;
+	}
+
+	for (uint64_t distance = FAR_DISTANCE; (NULL == farRegion) && (distance <= (FAR_DISTANCE << 4)); distance <<= 1)
+	{
+		farRegion = allocateExecutable(region + distance, REGION_SIZE);
+
+		if ((NULL != farRegion) && ((uint64_t)(farRegion - region) < (4ULL << 30)) && ((uint64_t)(region - farRegion) < (4ULL << 30)))
+		{
+			/* The hint was not honoured, the copies would be within reach. */
+			farRegion = NULL;
+		}
+	}
+
+	printf("  %-24s %-6s %-6s\n", "Relocation", "near", "far");
+
+	for (size_t i = 0; i < RELOCATE_TEST_COUNT; i++)
+	{
+		const RELOCATE_TEST* test = &RELOCATE_TESTS[i];
+		uint8_t* source = region + (i * SLOT_SIZE);
+
+		int nearResult = runRelocateTest(test, source, region + (REGION_SIZE / 2) + (i * TRAMPOLINE_SIZE), verbose);
+		int farResult = (NULL != farRegion) ? runRelocateTest(test, source, farRegion + (i * TRAMPOLINE_SIZE), verbose) : -1;
+
+		failures += (0 < nearResult) + (0 < farResult);
+
+		printf("  %-24s %-6s %-6s\n", test->name,
+			(0 == nearResult) ? "ok" : "FAIL",
+			(0 == farResult) ? "ok" : ((0 > farResult) ? "skip" : "FAIL"));
+	}
+
+	printf("\n  %-24s %-6s\n", "Branch scan", "");
+
+	for (size_t i = 0; i < SCAN_TEST_COUNT; i++)
+	{
+		int result = runScanTest(&SCAN_TESTS[i], region);
+		failures += result;
+
+		printf("  %-24s %-6s\n", SCAN_TESTS[i].name, (0 == result) ? "ok" : "FAIL");
+	}
+
+	if (NULL == farRegion)
+	{
+		printf("\nNo memory beyond 2GB of the sources, far relocations were not tested.\n");
+	}
+
+	printf("\n%d failure(s)\n", failures);
+
+	return (0 == failures) ? 0 : 1;
+}
+
+/******************** Module Code ********************/
+
+static int runRelocateTest(const RELOCATE_TEST* test, uint8_t* source, uint8_t* destination, int verbose)
+{
+	/* Returns 0 when the relocated copy behaves as the original, 1 otherwise. */
+	int result = 1;
+
+	memset(source, 0xCC, SLOT_SIZE);
+	memcpy(source, test->code, sizeof(test->code));
+	*((uint64_t*)&source[DATA_OFFSET]) = DATA_VALUE;
+	memset(destination, 0xCC, TRAMPOLINE_SIZE);
+
+	uint64_t expected = getExpected(test, source);
+
+	SIZE_T measuredSource = 0;
+	SIZE_T measuredSize = 0;
+	SIZE_T sourceSize = 0;
+	SIZE_T destinationSize = 0;
+
+	NTSTATUS measureStatus = Relocate_copyInstructions(source, test->minimumSize, NULL, 0, &measuredSource, &measuredSize);
+	NTSTATUS status = Relocate_copyInstructions(source, test->minimumSize, destination, (SIZE_T)destination, &sourceSize, &destinationSize);
+
+	int reachable = (RELOCATE_REL32_JUMP_SIZE == Relocate_getJumpSize((SIZE_T)destination, (SIZE_T)source));
+
+	if ((1 == test->nearOnly) && (0 == reachable))
+	{
+		/* Refused rather than rewritten incorrectly. */
+		result = (STATUS_NOT_CAPABLE == status) ? 0 : 1;
+	}
+	else if ((!NT_SUCCESS(measureStatus)) || (!NT_SUCCESS(status)))
+	{
+		fprintf(stderr, "%s: relocation failed (0x%08" PRIX32 ", 0x%08" PRIX32 ")\n", test->name, (uint32_t)measureStatus, (uint32_t)status);
+	}
+	else if ((measuredSource != sourceSize) || (measuredSize < destinationSize) || ((destinationSize + RELOCATE_ABSOLUTE_JUMP_SIZE) > TRAMPOLINE_SIZE))
+	{
+		fprintf(stderr, "%s: measured %zu/%zu bytes, copied %zu/%zu\n", test->name,
+			(size_t)measuredSource, (size_t)measuredSize, (size_t)sourceSize, (size_t)destinationSize);
+	}
+	else
+	{
+		/* Back to the rest of the original function, as a hook trampoline does. */
+		Relocate_writeJump(&destination[destinationSize], (SIZE_T)&destination[destinationSize], (SIZE_T)source + sourceSize);
+
+		if (0 != verbose)
+		{
+			printf("  %s (%s):", test->name, (0 != reachable) ? "near" : "far");
+			for (SIZE_T i = 0; i < destinationSize; i++)
+			{
+				printf(" %02X", destination[i]);
+			}
+			printf("\n");
+		}
+
+		fflush(stdout);
+
+		uint64_t actual = callCode(destination);
+		if (actual == expected)
+		{
+			result = 0;
+		}
+		else
+		{
+			fprintf(stderr, "%s: returned 0x%016" PRIX64 ", expected 0x%016" PRIX64 "\n", test->name, actual, expected);
+		}
+	}
+
+	return result;
+}
+
+static int runScanTest(const SCAN_TEST* test, uint8_t* source)
+{
+	memset(source, 0xCC, SLOT_SIZE);
+	memcpy(source, test->code, sizeof(test->code));
+
+	NTSTATUS status = Relocate_checkBranchTargets(source, test->overwrittenSize, test->scanSize);
+
+	return (test->expected == status) ? 0 : 1;
+}
+
+static uint64_t getExpected(const RELOCATE_TEST* test, uint8_t* source)
+{
+	uint64_t result;
+
+	switch (test->expectation)
+	{
+	case EXPECT_DATA:
+		result = DATA_VALUE;
+		break;
+
+	case EXPECT_DATA32:
+		result = (uint32_t)DATA_VALUE;
+		break;
+
+	case EXPECT_DATA_ADDRESS:
+		result = (uint64_t)(uintptr_t)&source[DATA_OFFSET];
+		break;
+
+	case EXPECT_DATA_ADDRESS32:
+		result = (uint32_t)(uintptr_t)&source[DATA_OFFSET];
+		break;
+
+	default:
+		result = test->value;
+		break;
+	}
+
+	return result;
+}
+
+static uint64_t callCode(uint8_t* code)
+{
+	/* Object to function pointer conversion, fine on every x64 ABI. */
+	TEST_FUNCTION function;
+	memcpy(&function, &code, sizeof(function));
+
+	return function();
+}
+
+static uint8_t* allocateExecutable(uint8_t* hint, size_t size)
+{
+	uint8_t* memory;
+
+#if defined(_WIN32)
+	memory = (uint8_t*)VirtualAlloc(hint, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	memory = (uint8_t*)mmap(hint, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void*)memory)
+	{
+		memory = NULL;
+	}
+#endif
+
+	return memory;
+}